@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "seal.h"
+
+// Benchmark of function calls. The script nests `depth` functions, each one
+// declares the next and calls it twice, so running it makes 2^(depth+1) - 1
+// calls of local functions.
+// Usage: bench_calls [depth] [opt-level] [runs]
+
+#define _maxDepth 24
+
+static char g_script[64 * 1024];
+
+// Write the script into `g_script`
+static void genScript(int depth);
+
+int main(int argc, char **argv) {
+    int depth = argc > 1 ? atoi(argv[1]) : 18;
+    SlOptLevel level = argc > 2 ? atoi(argv[2]) : SlOpt_None;
+    int runs = argc > 3 ? atoi(argv[3]) : 5;
+    if (depth < 0 || depth > _maxDepth || runs <= 0) {
+        printf("USAGE: bench_calls [depth] [opt-level] [runs]\n");
+        return 1;
+    }
+    genScript(depth);
+
+    SlVM vm = { 0 };
+    SlSource src = slSourceFromCStr(g_script);
+    src.path = "<bench>";
+    SlObj main = slGenCode(&vm, &src, level);
+    if (vm.error.occurred) {
+        printf("%s\n", vm.error.msg);
+        return 1;
+    }
+
+    double best = 0;
+    for (int i = 0; i < runs; i++) {
+        clock_t start = clock();
+        SlObj result = slRun(&vm, main);
+        double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+        if (vm.error.occurred) {
+            printf("%s\n", vm.error.msg);
+            return 1;
+        }
+        slDelRef(result);
+        best = i == 0 || secs < best ? secs : best;
+    }
+    slDelRef(main);
+
+    double calls = (double)((2u << depth) - 1);
+    printf(
+        "depth %d, level %d: %.0f calls in %.3f s (%.1f ns/call)\n",
+        depth,
+        (int)level,
+        calls,
+        best,
+        best * 1e9 / calls
+    );
+    return 0;
+}
+
+static void genScript(int depth) {
+    size_t len = 0;
+    // f0(x) { return x + 1; }, fn(x) { func fn-1(x) {...} ... }
+    for (int i = depth; i > 0; i--) {
+        len += (size_t)snprintf(
+            g_script + len,
+            sizeof(g_script) - len,
+            "func f%d(x) {\n",
+            i
+        );
+    }
+    len += (size_t)snprintf(
+        g_script + len,
+        sizeof(g_script) - len,
+        "func f0(x) { return x + 1; }\n"
+    );
+    for (int i = 1; i <= depth; i++) {
+        len += (size_t)snprintf(
+            g_script + len,
+            sizeof(g_script) - len,
+            "return f%d(x) + f%d(x * 2);\n}\n",
+            i - 1,
+            i - 1
+        );
+    }
+    snprintf(
+        g_script + len,
+        sizeof(g_script) - len,
+        "return f%d(1);\n",
+        depth
+    );
+}
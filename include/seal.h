@@ -7,8 +7,15 @@
 
 #include "sl_array.h"
 #include "sl_vm.h"
+#include "sl_str.h"
+#include "sl_list.h"
+#include "sl_map.h"
+#include "sl_ordmap.h"
+#include "sl_persist.h"
 #include "sl_lexer.h"
 #include "sl_parser.h"
+#include "sl_optimizer.h"
+#include "sl_ir.h"
 #include "sl_codegen.h"
 #include "sl_exec.h"
 #include "sl_builtin.h"
@@ -1,5 +1,62 @@
 #include "sl_vm.h"
 
+// Arithmetic on Ints wraps around on overflow. Division of Ints gives an Int
+// when it is exact and a Float otherwise, the remainder has the sign of `a`
+// and both give a Float when `b` is zero.
+// If an error occurs return null.
 SlObj slAdd(SlVM *vm, SlObj a, SlObj b);
+SlObj slSub(SlVM *vm, SlObj a, SlObj b);
 SlObj slMul(SlVM *vm, SlObj a, SlObj b);
+SlObj slDiv(SlVM *vm, SlObj a, SlObj b);
+SlObj slMod(SlVM *vm, SlObj a, SlObj b);
+SlObj slPow(SlVM *vm, SlObj a, SlObj b);
 SlObj slToStr(SlVM *vm, SlObj obj);
+// Convert each part to a string and concatenate them, the length of the result
+// is computed first so that it is allocated only once.
+SlObj slInterpolate(SlVM *vm, const SlObj *parts, size_t count);
+// Get a new reference to `container[key]`.
+// If an error occurs return null.
+SlObj slGetItem(SlVM *vm, SlObj container, SlObj key);
+// Set `(*container)[key]` to `value`, the container takes a new reference.
+// Frozen containers are replaced with a modified version holding a frozen
+// `value`, unless they are unique and can be modified in place.
+// If an error occurs return false.
+bool slSetItem(SlVM *vm, SlObj *container, SlObj key, SlObj value);
+// Get the part of a string or list from `start` up to `end` excluded. Negative
+// bounds count from the end and bounds out of range are clamped. Slices of
+// frozen objects may be views of them, see `slStrSlice` and `slListSlice`.
+// If an error occurs return null.
+SlObj slSlice(SlVM *vm, SlObj container, SlObj start, SlObj end);
+// Split a string at each occurrence of the non-empty string `sep` into a
+// frozen list of frozen strings. The parts are views of the string when
+// possible, a mutable string is copied once and its copy is sliced.
+// If an error occurs return null.
+SlObj slSplit(SlVM *vm, SlObj str, SlObj sep);
+// Same as `slSplit` with `"\n"` as the separator, but a line may end with
+// `"\r\n"` and a newline at the end does not give an empty last line.
+// If an error occurs return null.
+SlObj slLines(SlVM *vm, SlObj str);
+// Add `value` at the end or at the start of a mutable list, which takes a new
+// reference to it. Both ends take amortized constant time.
+// If an error occurs return false.
+bool slPushBack(SlVM *vm, SlObj list, SlObj value);
+bool slPushFront(SlVM *vm, SlObj list, SlObj value);
+// Remove the last or the first item of a non-empty mutable list and return
+// the reference to it.
+// If an error occurs return null.
+SlObj slPopBack(SlVM *vm, SlObj list);
+SlObj slPopFront(SlVM *vm, SlObj list);
+// Get the keys of an ordered map between `lo` and `hi` included as a frozen
+// list in increasing order. A null bound leaves that side of the range open.
+// If an error occurs return null.
+SlObj slRange(SlVM *vm, SlObj map, SlObj lo, SlObj hi);
+// Get the greatest key of an ordered map that is less than or equal to `key`,
+// or the least key that is greater than or equal to it. Return null if there
+// is no such key.
+// If an error occurs return null.
+SlObj slFloor(SlVM *vm, SlObj map, SlObj key);
+SlObj slCeil(SlVM *vm, SlObj map, SlObj key);
+// Create an ordered map with the entries of a map. If the keys are already in
+// increasing order the tree is built in bulk.
+// If an error occurs return null.
+SlObj slToOrdMap(SlVM *vm, SlObj map);
@@ -1,6 +1,8 @@
 #ifndef SL_CODEGEN_H_
 #define SL_CODEGEN_H_
 
+#include "sl_array.h"
+#include "sl_optimizer.h"
 #include "sl_vm.h"
 
 // Argument list:
@@ -22,10 +24,12 @@ typedef enum SlOpCode {
     SlOp_lks, // dst.r src.s; load constant by short: stack[dst] = constants[src]
     SlOp_lki, // dst.r src.i; load constant by short: stack[dst] = constants[src]
     SlOp_cpy, // dst.r src.r; copy: stack[dst] = stack[src]
+    SlOp_mov, // dst.r src.r; move, src is not read again and its reference is
+              // taken: stack[dst] = stack[src]; stack[src] = empty
     SlOp_ls,  // dst.r src.r; load shared: stack[dst] = shared[src].value
     SlOp_sts, // dst.r src.r; store shared: shared[dst].value = stack[src]
-    SlOp_mks, // dst.r src.r; make shared: stack[dst] = sharedSlot(src)
-    SlOp_dts, // from.r to.r; detach shared: for i in from..=to { detach(stack[i]); }
+    SlOp_dts, // from.r to.r; detach shared: close the open shared slots of
+              // stack[from..=to], see slCloseSharedSlots
 
     SlOp_add,  // dst.r lhs.r rhs.r; dst = lhs + rhs
     SlOp_sub,  // dst.r lhs.r rhs.r; dst = lhs - rhs
@@ -33,15 +37,27 @@ typedef enum SlOpCode {
     SlOp_div,  // dst.r lhs.r rhs.r; dst = lhs / rhs
     SlOp_mod,  // dst.r lhs.r rhs.r; dst = lhs % rhs
     SlOp_pow,  // dst.r lhs.r rhs.r; dst = lhs ^ rhs
+    // The compiler proved that lhs and rhs are Int, their types are not
+    // checked
+    SlOp_addi, // dst.r lhs.r rhs.r; dst = lhs + rhs
+    SlOp_subi, // dst.r lhs.r rhs.r; dst = lhs - rhs
+    SlOp_muli, // dst.r lhs.r rhs.r; dst = lhs * rhs
 
     SlOp_print,// src.r; print(str(stack[src]) + '\n')
+    // The shared slots of a closure are opened on the registers of the
+    // function or taken from its own shared slots, see SlSharedInfo
     SlOp_mkfb, // dst.r func.b; make function: stack[dst] = closure(constants[func])
     SlOp_mkfs, // dst.r func.s; make function: stack[dst] = closure(constants[func])
     SlOp_mkfi, // dst.r func.i; make function: stack[dst] = closure(constants[func])
     SlOp_call, // func.r last.r;
                // stack[func] = stack[func](stack[func + 1], ..., stack[last])
+               // the arguments are moved to the frame of the callee
+    SlOp_callk,// func.r last.r size.s; call a function known to take
+               // last - func arguments and to need `size` registers, args
+               // are the same as SlOp_call but the callee is not checked
     SlOp_tcall,// func.r last.r; perform a tail call, args are the same as SlOp_call
-    SlOp_ret,  // src.r; return src
+    SlOp_ret,  // src.r; close the open shared slots of the frame and move src
+               // to the return address
 
     SlOp_jmp, // diff.I; jump: pc += diff
     SlOp_jtr, // val.r diff.I; jump if true: if (stack[val]) pc += diff
@@ -52,6 +68,20 @@ typedef enum SlOpCode {
     SlOp_jne, // lhs.r rhs.r diff.I; jump if lhs != rhs: if (stack[lhs] != stack[rhs]) pc += diff
 } SlOpCode;
 
-SlObj slGenCode(SlVM *vm, const SlSource *source);
+// Compile a source file to the prototype of its main function.
+// How many arithmetic instructions use the Int variants is printed if
+// SL_PRINT_TYPES is set to `true`.
+// If an error occurs return null.
+SlObj slGenCode(SlVM *vm, const SlSource *source, SlOptLevel optLevel);
+// Run the peephole optimizer that slGenCode uses from SlOpt_Fold on the
+// bytecode of a function, the ranges in `lineInfo` are moved with the
+// instructions they cover.
+// If an error occurs return false.
+bool slOptimizeBytecode(
+    SlVM *vm,
+    SlU8Arr *bytecode,
+    SlLineInfo *lineInfo,
+    uint32_t lineInfoCount
+);
 
 #endif // !SL_CODEGEN_H_
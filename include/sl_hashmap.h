@@ -38,16 +38,26 @@
         if (!newBuckets) {                                                     \
             return false;                                                      \
         }                                                                      \
-        for (uint32_t i = 0; i < map->cap; i++) {                              \
+        /* Buckets are moved in insertion order to keep the links */         \
+        uint32_t prev = newCap;                                                \
+        for (                                                                  \
+            uint32_t i = map->len ? map->first : map->cap;                     \
+            i < map->cap;                                                      \
+            i = map->buckets[i].next                                           \
+        ) {                                                                    \
             Name##Bucket *bucket = &map->buckets[i];                           \
-            if (bucket->hash == 0) {                                           \
-                continue;                                                      \
-            }                                                                  \
             uint32_t idx = bucket->hash & mask;                                \
             while (newBuckets[idx].hash != 0) {                                \
                 idx = (idx + 1) & mask;                                        \
             }                                                                  \
             newBuckets[idx] = *bucket;                                         \
+            newBuckets[idx].next = newCap;                                     \
+            if (prev == newCap) {                                              \
+                map->first = idx;                                              \
+            } else {                                                           \
+                newBuckets[prev].next = idx;                                   \
+            }                                                                  \
+            map->last = prev = idx;                                            \
         }                                                                      \
         memFree(map->buckets);                                                 \
         map->buckets = newBuckets;                                             \
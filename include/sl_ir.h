@@ -0,0 +1,102 @@
+#ifndef SL_IR_H_
+#define SL_IR_H_
+
+#include "sl_array.h"
+#include "sl_parser.h"
+
+// SSA form of a function. Each instruction defines at most one value that is
+// identified by the index of the instruction, values are never reassigned.
+// Variables are not part of the IR: the builder maps each variable to the
+// value it holds at each point.
+
+// A value, -1 for no value
+typedef int32_t SlIrValue;
+
+typedef enum SlIrOp {
+    SlIr_Nop,        // instruction removed by a pass
+    SlIr_Null,       // null
+    SlIr_Int,        // Int constant `as.numInt`
+    SlIr_Param,      // parameter `as.idx`
+    SlIr_External,   // shared slot `as.idx` of the function, only used as an
+                     // argument of SlIr_Closure
+    SlIr_LoadShared, // value of the shared slot `as.idx` of the function
+    SlIr_MakeShared, // shared slot holding args[0], opened by the closures
+                     // that capture it
+    SlIr_StoreShared,// store args[1] in the shared slot args[0]
+    SlIr_Detach,     // close the shared slots in args
+    SlIr_Closure,    // closure of `children[as.idx]` capturing the slots in
+                     // args, a slot of the function itself is SlIr_External
+                     // and variables captured by value are the value itself
+    SlIr_Copy,       // args[0]
+    SlIr_Add,        // args[0] + args[1]
+    SlIr_Sub,        // args[0] - args[1]
+    SlIr_Mul,        // args[0] * args[1]
+    SlIr_Div,        // args[0] / args[1]
+    SlIr_Mod,        // args[0] % args[1]
+    SlIr_Pow,        // args[0] ^ args[1]
+    SlIr_Call,       // call args[0] with the arguments args[1..]
+    SlIr_Print,      // print args[0]
+    SlIr_Ret,        // return args[0]
+    SlIr_Phi         // args[i] if control comes from `preds[i]` of the block
+} SlIrOp;
+
+// What is known about a value, Numeric and Int values never cause errors in
+// arithmetic with each other
+typedef enum SlIrType {
+    SlIrType_Any,
+    SlIrType_Numeric, // either an Int or a Float
+    SlIrType_Int,
+    SlIrType_Null,
+    SlIrType_Func,
+    SlIrType_Slot
+} SlIrType;
+
+typedef struct SlIrInst {
+    SlIrOp op;
+    SlIrType type;
+    SlNodeIdx node; // node the instruction comes from, used for errors
+    uint32_t block;
+    uint32_t firstArg; // index in `args` of the function
+    uint32_t argCount;
+    union {
+        int64_t numInt;
+        uint32_t idx;
+    } as;
+} SlIrInst;
+
+typedef struct SlIrBlock {
+    SlI32Arr insts; // instructions in execution order
+    SlI32Arr preds;
+} SlIrBlock;
+
+typedef struct SlIrFunc SlIrFunc;
+
+slArrayType(SlIrInst, SlIrInsts, slIrInsts)
+slArrayType(SlIrBlock, SlIrBlocks, slIrBlocks)
+slArrayType(SlIrFunc *, SlIrFuncs, slIrFuncs)
+
+struct SlIrFunc {
+    SlIrInsts insts;
+    SlI32Arr args;
+    SlIrBlocks blocks; // the first block is the entry
+    SlIrFuncs children;
+    uint16_t paramCount;
+    uint16_t sharedCount;
+};
+
+// Build the IR of the function `lambda` of a resolved AST and of the
+// functions nested in it.
+// If an error occurs return NULL.
+SlIrFunc *slIrBuild(SlVM *vm, const SlAst *ast, SlNodeIdx lambda);
+void slIrDestroy(SlIrFunc *func);
+// Run inlining, copy propagation, type inference, global value numbering and
+// dead code and store elimination on a function and the functions nested in
+// it.
+// Inlining decisions are printed if SL_PRINT_INLINING is set to `true`.
+// If an error occurs return false, the IR is still valid.
+bool slIrOptimize(SlVM *vm, const SlAst *ast, SlIrFunc *func);
+void slIrPrint(const SlIrFunc *func);
+
+#define slIrArgs(func, inst) (&(func)->args.data[(inst)->firstArg])
+
+#endif // !SL_IR_H_
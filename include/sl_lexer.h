@@ -28,6 +28,7 @@ typedef enum SlTokenKind {
     SlToken_KwVar,
     SlToken_KwFunc,
     SlToken_KwPrint,
+    SlToken_KwReturn,
 
     SlToken_Eof
 } SlTokenKind;
@@ -0,0 +1,71 @@
+#ifndef SL_LIST_H_
+#define SL_LIST_H_
+
+#include "sl_vm.h"
+
+// A list starts with unboxed storage and switches to `SlList_Objs` the first
+// time it stores an item of a different type. Empty lists take the kind of the
+// first item stored in them. Ints are never stored in a list of floats or the
+// other way round since the type of the items must be preserved.
+
+// Items of small lists are stored in the same allocation as the header, see
+// `slListNewInline`. A list moves them to a separate buffer the first time it
+// needs more room.
+#define slListInlineCap 8
+
+// Slices of frozen lists at least this long are views that point into the
+// items of the list they come from, unless it is more than
+// `slListViewMaxRatio` times longer. Slices of mutable lists and of lists
+// stored in tries are always copied.
+#define slListViewMinLen 16
+#define slListViewMaxRatio 8
+
+// Get the position in the storage of the item at `idx`.
+#define slListPos(list, idx)                                                   \
+    ((list)->head + (idx) < (list)->cap                                        \
+        ? (list)->head + (idx)                                                 \
+        : (list)->head + (idx) - (list)->cap)
+
+// Create a new mutable list with room for `cap` items. The items are stored
+// inline if `cap` is at most `slListInlineCap`.
+// If an error occurs return null.
+SlObj slListNew(SlVM *vm, size_t cap);
+// Create a new mutable list with room for `cap` items of kind `kind` in the
+// same allocation as the header.
+// If an error occurs return null.
+SlObj slListNewInline(SlVM *vm, SlListKind kind, size_t cap);
+// Free a list whose last reference was deleted.
+void slListDestroy(SlList *list);
+
+// Make room for `cap` items without further allocations.
+// If an error occurs return false.
+bool slListReserve(SlVM *vm, SlList *list, size_t cap);
+// Get a new reference to the item at `idx`, which must be in bounds.
+SlObj slListGet(const SlList *list, size_t idx);
+// Replace the item at `idx`, which must be in bounds. The list takes a new
+// reference to `value`.
+// If an error occurs return false.
+bool slListSet(SlVM *vm, SlList *list, size_t idx, SlObj value);
+// Add `value` at the end of the list, the list takes a new reference to it.
+// If an error occurs return false.
+bool slListAppend(SlVM *vm, SlList *list, SlObj value);
+// Add `value` at the start of the list, the list takes a new reference to it.
+// If an error occurs return false.
+bool slListPrepend(SlVM *vm, SlList *list, SlObj value);
+// Remove the last item of a non-empty list and return the reference to it.
+SlObj slListPop(SlList *list);
+// Remove the first item of a non-empty list and return the reference to it.
+SlObj slListPopFront(SlList *list);
+// Move the items to the start of the storage so that they are in order in
+// `objs`, `ints` or `floats`. No allocation is done.
+void slListLinearize(SlList *list);
+// Get the `len` items of `list` starting from `start` as a new list of the
+// same mutability, the range must be in bounds.
+// If an error occurs return null.
+SlObj slListSlice(SlVM *vm, SlObj list, size_t start, size_t len);
+// Convert an index object to a position in the list, negative indices count
+// from the end.
+// If the index is not valid set an error and return false.
+bool slListIndex(SlVM *vm, const SlList *list, SlObj idx, size_t *outIdx);
+
+#endif // !SL_LIST_H_
@@ -0,0 +1,87 @@
+#ifndef SL_MAP_H_
+#define SL_MAP_H_
+
+#include "sl_vm.h"
+
+// The index table of a map is an array of control bytes with a parallel array
+// of indices into `entries`. A control byte is either `slMapCtrlEmpty`,
+// `slMapCtrlDeleted` or the lowest 7 bits of the hash of the entry, the
+// remaining bits select the group where probing starts.
+// Control bytes are scanned one group at a time, comparing all the bytes of
+// a group with a few word-wide operations.
+#define slMapGroupSize 8
+#define slMapCtrlEmpty 0x80
+#define slMapCtrlDeleted 0xfe
+// Maps stay in shape mode while they have at most this many keys, all of
+// them strings, and no key was ever removed. In shape mode there is no index
+// table, keys are found by scanning `entries` and field accesses can use
+// inline caches.
+#define slShapeMaxKeys 32
+
+// Entries of small maps are stored in the same allocation as the header, see
+// `slMapNewInline`. Such maps have no index table and keys are found by
+// scanning `entries`, the table is built when the entries move to a separate
+// buffer.
+#define slMapInlineCap 8
+// Int keys added in the order `0, 1, 2...` to an empty map are stored in an
+// array of values, their lookup is a bounds check and a load. Once any other
+// key is added further keys go in `entries` so that the array part, which
+// is iterated first, keeps the insertion order. Removing a key of the array
+// part other than the last moves the whole array part to `entries`.
+
+// Get the number of keys in a map.
+#define slMapCount(map) ((map)->count + (map)->arrayLen)
+
+// Create a new mutable map with room for `slMapInlineCap` inline entries.
+// If an error occurs return null.
+SlObj slMapNew(SlVM *vm);
+// Create a new mutable map with room for `cap` entries in the same allocation
+// as the header.
+// If an error occurs return null.
+SlObj slMapNewInline(SlVM *vm, size_t cap);
+// Free a map whose last reference was deleted.
+void slMapDestroy(SlMap *map);
+
+// Make room for `count` entries without further allocations.
+// If an error occurs return false.
+bool slMapReserve(SlVM *vm, SlMap *map, size_t count);
+// Get the value associated with `key`.
+// Return NULL if the key is not found or if an error occurs.
+SlObj *slMapGet(SlVM *vm, SlMap *map, SlObj key);
+// Associate `value` with `key`, the map takes new references to both. The key
+// is stored as returned by `slMapStoredKey`.
+// If an error occurs return false.
+bool slMapSet(SlVM *vm, SlMap *map, SlObj key, SlObj value);
+// Remove `key` from the map.
+// Return false if the key is not found or if an error occurs.
+bool slMapDel(SlVM *vm, SlMap *map, SlObj key);
+// Get the next entry in insertion order, `*iter` must be initialized to zero.
+// The key is written to `outKey` without a new reference and `outValue`
+// points to the stored value.
+// Return false when there are no more entries.
+bool slMapNext(SlMap *map, size_t *iter, SlObj *outKey, SlObj **outValue);
+
+// Get the value of the key `cache->key`, the cache is updated on a miss.
+// Return NULL if the key is not found or if an error occurs.
+SlObj *slMapGetField(SlVM *vm, SlMap *map, SlFieldCache *cache);
+// Set the value of the key `cache->key`, the cache is updated on a miss.
+// If an error occurs return false.
+bool slMapSetField(SlVM *vm, SlMap *map, SlFieldCache *cache, SlObj value);
+// Switch a map to dictionary mode, its shape is released.
+// If an error occurs return false.
+bool slMapDropShape(SlVM *vm, SlMap *map);
+// Release the references held by an inline cache.
+void slFieldCacheClear(SlFieldCache *cache);
+// Free a shape whose last reference was deleted.
+void slShapeDestroy(SlShape *shape);
+
+// Hash an object that is used as a key.
+// If the object cannot be hashed set an error and return false.
+bool slMapKeyHash(SlVM *vm, SlObj key, uint32_t *outHash);
+bool slMapKeyEq(SlObj a, SlObj b);
+// Get the object stored in a map for `key`: strings are interned and mutable
+// lists are frozen.
+// If an error occurs return null.
+SlObj slMapStoredKey(SlVM *vm, SlObj key);
+
+#endif // !SL_MAP_H_
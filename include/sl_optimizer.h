@@ -0,0 +1,28 @@
+#ifndef SL_OPTIMIZER_H_
+#define SL_OPTIMIZER_H_
+
+#include "sl_parser.h"
+
+// Optimization levels accepted by `slGenCode`
+typedef enum SlOptLevel {
+    // Compile the program as it is written
+    SlOpt_None,
+    // Fold constant arithmetic, simplify algebraic identities, drop
+    // unreachable statements and use the Int variants of arithmetic
+    // instructions when the operands are known to be Ints
+    SlOpt_Fold,
+    // Also replace variables declared once with a constant value with the
+    // value itself and drop their declarations
+    SlOpt_Propagate,
+    // Also translate functions to SSA form and run global optimizations on
+    // it, see sl_ir.h
+    SlOpt_Ssa
+} SlOptLevel;
+
+// Rewrite the nodes of an AST whose variables have not been resolved yet.
+// Nodes are changed in place and the ones that are no longer referenced are
+// left in `ast->nodes`.
+// If an error occurs return false.
+bool slOptimizeAst(SlVM *vm, SlAst *ast, SlOptLevel level);
+
+#endif // !SL_OPTIMIZER_H_
@@ -0,0 +1,101 @@
+#ifndef SL_ORDMAP_H_
+#define SL_ORDMAP_H_
+
+#include "sl_vm.h"
+
+// Ordered maps keep their keys sorted in a B-tree. All the keys of a map must
+// be of the same type: Ints and Floats are ordered by value and strings byte
+// by byte.
+// Nodes hold up to `slOrdMapNodeCap` keys, the header and the keys of a node
+// fill four 64-byte cache lines. Values are stored after the keys so that
+// searching a node does not load them.
+#define slOrdMapNodeCap 15
+#define slOrdMapMaxHeight 24
+
+struct SlOrdMapNode {
+    uint16_t count;
+    bool leaf;
+    SlObj keys[slOrdMapNodeCap];
+    SlObj values[slOrdMapNodeCap];
+    SlOrdMapNode *children[]; // `count + 1` children, only in internal nodes
+};
+
+// Iterator over a range of keys of an ordered map, it is invalidated when the
+// map is modified.
+typedef struct SlOrdMapIter {
+    SlOrdMapNode *nodes[slOrdMapMaxHeight];
+    uint16_t idx[slOrdMapMaxHeight]; // next key of each node
+    uint32_t depth;
+    SlObj hi;
+} SlOrdMapIter;
+
+// Create a new empty ordered map.
+// If an error occurs return null.
+SlObj slOrdMapNew(SlVM *vm);
+// Create an ordered map from `count` keys in increasing order and their
+// values. The tree is built bottom-up with full nodes.
+// If the keys are not sorted or an error occurs return null.
+SlObj slOrdMapFromSorted(
+    SlVM *vm,
+    const SlObj *keys,
+    const SlObj *values,
+    size_t count
+);
+// Free an ordered map whose last reference was deleted.
+void slOrdMapDestroy(SlOrdMap *map);
+
+// Get the value associated with `key`.
+// Return NULL if the key is not found or if an error occurs.
+SlObj *slOrdMapGet(SlVM *vm, SlOrdMap *map, SlObj key);
+// Associate `value` with `key`, the map takes new references to both. Strings
+// are stored interned.
+// If an error occurs return false.
+bool slOrdMapSet(SlVM *vm, SlOrdMap *map, SlObj key, SlObj value);
+// Remove `key` from the map.
+// Return false if the key is not found or if an error occurs.
+bool slOrdMapDel(SlVM *vm, SlOrdMap *map, SlObj key);
+// Find the entry with the greatest key that is less than or equal to `key`.
+// Return false if there is none or if an error occurs.
+bool slOrdMapFloor(
+    SlVM *vm,
+    SlOrdMap *map,
+    SlObj key,
+    SlObj *outKey,
+    SlObj **outValue
+);
+// Find the entry with the least key that is greater than or equal to `key`.
+// Return false if there is none or if an error occurs.
+bool slOrdMapCeil(
+    SlVM *vm,
+    SlOrdMap *map,
+    SlObj key,
+    SlObj *outKey,
+    SlObj **outValue
+);
+
+// Start iterating over the keys between `lo` and `hi` included in increasing
+// order. A bound of type SlObj_Empty leaves that side of the range open.
+// If an error occurs return false.
+bool slOrdMapIterInit(
+    SlVM *vm,
+    SlOrdMap *map,
+    SlObj lo,
+    SlObj hi,
+    SlOrdMapIter *iter
+);
+// Get the next entry of the range, the key is written to `outKey` without a
+// new reference and `outValue` points to the stored value.
+// Return false at the end of the range or if an error occurs.
+bool slOrdMapIterNext(
+    SlVM *vm,
+    SlOrdMapIter *iter,
+    SlObj *outKey,
+    SlObj **outValue
+);
+
+// Compare two keys, `*outCmp` is negative, zero or positive if `a` is less
+// than, equal to or greater than `b`.
+// If the keys cannot be compared set an error and return false.
+bool slOrdMapKeyCmp(SlVM *vm, SlObj a, SlObj b, int *outCmp);
+
+#endif // !SL_ORDMAP_H_
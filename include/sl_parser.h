@@ -16,7 +16,8 @@ typedef enum SlNodeKind {
     SlNode_Access,
     SlNode_Print,
     SlNode_Lambda,
-    SlNode_RetStmnt
+    SlNode_RetStmnt,
+    SlNode_Call // also used as a statement
 } SlNodeKind;
 
 typedef enum SlBinOp {
@@ -30,6 +31,15 @@ typedef enum SlBinOp {
 
 typedef int32_t SlNodeIdx;
 
+// The value of a variable in the `vars` of a block is [byValue:1|shr:15|idx:16]
+// - idx: index of the variable in the block
+// - shr: index of its shared slot plus one, 0 if closures do not share it
+// - byValue: closures capture a copy of the variable, it is never changed
+//   after they are created
+#define slVarIdx(info) ((uint16_t)((info) & 0xffff))
+#define slVarShrIdx(info) ((int32_t)(((info) >> 16) & 0x7fff) - 1)
+#define slVarByValue(info) (((info) >> 31) != 0)
+
 typedef struct SlNode {
     SlNodeKind kind;
     uint32_t line;
@@ -42,6 +52,9 @@ typedef struct SlNode {
         struct {
             SlNodeIdx *nodes;
             SlStrMap *vars;
+            // number of accesses to each variable from the function that
+            // declares it, set when the variables are resolved
+            int32_t *uses;
             uint16_t funcCount;
             uint16_t sharedCount;
             uint32_t nodeCount;
@@ -58,7 +71,12 @@ typedef struct SlNode {
             uint16_t paramCount;
             SlNodeIdx body;
         } lambda;
-        SlNodeIdx retStmnt;
+        struct {
+            SlNodeIdx callee;
+            SlNodeIdx *args;
+            uint16_t argCount;
+        } call;
+        SlNodeIdx retStmnt; // -1 if no value is returned
         SlNodeIdx print;
         int64_t numInt;
     } as;
@@ -71,7 +89,11 @@ typedef struct SlAst {
     SlNodeIdx root;
 } SlAst;
 
+// Parse a source file, the names of the variables are not resolved.
 SlAst slParse(SlVM *vm, const SlSource *source);
+// Assign registers and shared slots to the variables of an AST.
+// If an error occurs return false, the AST must still be destroyed.
+bool slResolveAst(SlVM *vm, SlAst *ast, const char *path);
 void slDestroyAst(SlAst *ast);
 void slPrintAst(const SlAst *ast);
 
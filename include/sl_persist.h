@@ -0,0 +1,65 @@
+#ifndef SL_PERSIST_H_
+#define SL_PERSIST_H_
+
+#include "sl_vm.h"
+
+// Frozen lists and maps with at least `slPersistMinLen` items are stored in
+// tries. Modifying one creates a new version that copies only the nodes on
+// the path to the change and shares all the others with the original.
+// Lists use a vector trie indexed by 5 bits of the index per level. Maps use
+// a hash array mapped trie (HAMT) from keys to positions plus a vector trie of
+// entries that keeps insertion order.
+#define slPersistMinLen 32
+#define slPNodeBits 5
+#define slPNodeWidth (1 << slPNodeBits)
+
+typedef enum SlPNodeKind {
+    SlPNode_Vec,      // items, children of the node or values at the bottom
+    SlPNode_Entries,  // entries, bottom of the vector trie of a map
+    SlPNode_Hamt,     // entries, with an empty key if the value is a child
+    SlPNode_Collision // entries with the same hash
+} SlPNodeKind;
+
+#define slPNodeItems(node) ((SlObj *)((node) + 1))
+#define slPNodeEntries(node) ((SlMapEntry *)((node) + 1))
+
+// Free a node whose last reference was deleted.
+void slPNodeDestroy(SlPNode *node);
+
+// Get a frozen version of `obj` taking over the reference to it. Mutable
+// objects are frozen in place if they are unique and deeply copied otherwise,
+// the objects they contain are frozen as well.
+// If an error occurs return null.
+SlObj slFreeze(SlVM *vm, SlObj obj);
+
+// Create a frozen list with the contents of `items`.
+// If an error occurs return null.
+SlObj slFrozenListNew(SlVM *vm, const SlObj *items, size_t len);
+// Get the item at `idx` of a list of kind `SlList_Trie`, it must be in bounds.
+const SlObj *slFrozenListItem(const SlList *list, size_t idx);
+// Create a new version of a frozen list with `value` at `idx`, which must be
+// in bounds.
+// If an error occurs return null.
+SlObj slFrozenListSet(SlVM *vm, SlObj list, size_t idx, SlObj value);
+// Create a new version of a frozen list with `value` added at the end.
+// If an error occurs return null.
+SlObj slFrozenListAppend(SlVM *vm, SlObj list, SlObj value);
+
+// Create a frozen map with the contents of `map`.
+// If an error occurs return null.
+SlObj slFrozenMapNew(SlVM *vm, SlMap *map);
+// Find the entry of `key` in a map stored in tries, `key` must be flat.
+// Return NULL if the key is not found.
+SlMapEntry *slFrozenMapFind(const SlMap *map, SlObj key, uint32_t hash);
+// Get the next entry in insertion order of a map stored in tries, `*iter`
+// must be initialized to zero. Return NULL when there are no more entries.
+SlMapEntry *slFrozenMapNext(const SlMap *map, size_t *iter);
+// Create a new version of a frozen map with `key` associated with `value`.
+// If an error occurs return null.
+SlObj slFrozenMapSet(SlVM *vm, SlObj map, SlObj key, SlObj value);
+// Create a new version of a frozen map without `key`. If the key is not found
+// a new reference to `map` is returned.
+// If an error occurs return null.
+SlObj slFrozenMapDel(SlVM *vm, SlObj map, SlObj key);
+
+#endif // !SL_PERSIST_H_
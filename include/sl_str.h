@@ -0,0 +1,80 @@
+#ifndef SL_STR_H_
+#define SL_STR_H_
+
+#include "sl_vm.h"
+
+// Small strings are stored inside the object itself, starting from `reserved`
+// and continuing into `as`. The last byte holds the unused capacity so that it
+// doubles as the NUL terminator when the string is full.
+#define slSmallStrCap 11
+
+// Concatenations at least this long produce a rope instead of a copy.
+#define slRopeMinLen 64
+
+// Slices at least this long are views that point into the bytes of the
+// string they come from, unless it is more than `slStrViewMaxRatio` times
+// longer. A short view would keep a much longer string alive, such slices
+// are copied instead.
+#define slStrViewMinLen 64
+#define slStrViewMaxRatio 8
+
+#define slObjIsStr(obj)                                                        \
+    (((obj).type & 0xff) == SlObj_Str || (obj).type == SlObj_SmallStr)
+
+// Create a small string, `len` must be at most `slSmallStrCap`.
+SlObj slSmallStrNew(const uint8_t *bytes, size_t len);
+// Allocate a flat heap string with room for `len` bytes stored after the
+// struct. The bytes are not initialized.
+// If an error occurs return NULL.
+SlStr *slStrAlloc(SlVM *vm, size_t len);
+// Free a heap string whose last reference was deleted.
+void slStrDestroy(SlStr *str);
+
+// Get the length of a string of either representation.
+size_t slStrLen(const SlObj *str);
+// Get the bytes of a string of either representation. The pointer is valid as
+// long as `str` is, for small strings this is the object pointed to by `str`.
+// The string must be flat.
+const uint8_t *slStrBytes(const SlObj *str);
+// Copy the contents of a rope into a single buffer, the parts are released.
+// Do nothing if the string is already flat.
+// If an error occurs return false.
+bool slStrFlatten(SlVM *vm, SlObj str);
+
+// Compare two flat strings. Strings interned in the same table are compared
+// by pointer.
+bool slStrEq(SlObj a, SlObj b);
+// Hash a flat string, the hash of heap strings is cached.
+uint32_t slStrHash(SlObj str);
+// Create a new frozen string with the contents of `a` followed by `b`. Long
+// results are ropes that reference `a` and `b` until they are flattened,
+// mutable parts are copied first.
+// If an error occurs return null.
+SlObj slStrConcat(SlVM *vm, SlObj a, SlObj b);
+// Same as `slStrConcat` but the reference to `str` is taken over. If `str` is
+// unique it is extended in place, growing its buffer geometrically.
+// If an error occurs return null.
+SlObj slStrAppend(SlVM *vm, SlObj str, SlObj tail);
+// Get the `len` bytes of `str` starting from `start` as a new frozen string,
+// the range must be in bounds. Views reference the flat string that owns the
+// bytes and never another view.
+// If an error occurs return null.
+SlObj slStrSlice(SlVM *vm, SlObj str, size_t start, size_t len);
+// Concatenate `count` flat strings into a new frozen string with a single
+// allocation.
+// If an error occurs return null.
+SlObj slStrJoin(SlVM *vm, const SlObj *strs, size_t count);
+
+// Get the canonical string with the given contents from the intern table of
+// the VM, creating it if needed.
+// If an error occurs return null.
+SlObj slStrInternBytes(SlVM *vm, const uint8_t *bytes, size_t len);
+// Get a new reference to the canonical string equal to `str`. If there is none
+// `str` itself is flattened and added to the intern table of the VM, unless it
+// is mutable or shared between threads: a frozen copy is added instead.
+// If an error occurs return null.
+SlObj slStrIntern(SlVM *vm, SlObj str);
+// Remove an interned string that is being destroyed from its table.
+void slStrTableRemove(SlStrTable *table, SlStr *str);
+
+#endif // !SL_STR_H_
@@ -6,7 +6,7 @@
 #include <stdbool.h>
 #include <stdarg.h>
 
-#define slObjIsSmall(obj) ((obj).type <= SlObj_Float)
+#define slObjIsSmall(obj) ((obj).type <= SlObj_SmallStr)
 #define slObjIsNumeric(obj)                                                    \
     ((obj).type == SlObj_Int || (obj).type == SlObj_Float)
 
@@ -19,19 +19,23 @@ typedef enum SlObjType {
     SlObj_Bool,
     SlObj_Int,
     SlObj_Float,
+    SlObj_SmallStr, // frozen string stored inline, see sl_str.h
 
     // Acyclic objects (tracked by the gc but cannot contain themselves)
 
     SlObj_Str,
     SlObj_Prototype, // internal (function prototype)
+    SlObj_Shape, // internal (key layout shared by record-like maps)
 
     // Cyclic objects (objects that can contain themselves)
 
     SlObj_List,
     SlObj_Map,
+    SlObj_OrdMap, // map with sorted keys, see sl_ordmap.h
     SlObj_Func,
     SlObj_Struct,
     SlObj_SharedSlot, // internal (value captured by closures)
+    SlObj_PNode, // internal (node of a large frozen list or map)
 
     // Frozen types
 
@@ -46,13 +50,26 @@ typedef double SlFloat;
 typedef struct SlList SlList;
 typedef struct SlStr SlStr;
 typedef struct SlMap SlMap;
+typedef struct SlOrdMap SlOrdMap;
+typedef struct SlOrdMapNode SlOrdMapNode;
 typedef struct SlFunc SlFunc;
 typedef struct SlStruct SlStruct;
 typedef struct SlPrototype SlPrototype;
 typedef struct SlSharedSlot SlSharedSlot;
-
+typedef struct SlShape SlShape;
+typedef struct SlPNode SlPNode;
+
+// Reference counts are biased towards the thread that owns the object.
+// Objects start unshared (`owner == NULL`) and only `refCount` is used. After
+// `slShare` the owner keeps updating `refCount` without atomic operations
+// while any other thread uses `sharedRefCount`. When the count of the owner
+// reaches zero it is merged into `sharedRefCount` and the object is destroyed
+// when the shared count reaches zero as well.
 typedef struct SlGCObj {
     size_t refCount;
+    // [count:63|merged:1], updated atomically, `count` may be negative
+    volatile int64_t sharedRefCount;
+    const void *owner;
 } SlGCObj;
 
 typedef struct SlObj {
@@ -65,37 +82,141 @@ typedef struct SlObj {
         SlList *list;
         SlStr *str;
         SlMap *map;
+        SlOrdMap *ordMap;
         SlFunc *func;
         SlStruct *structure;
         SlPrototype *proto;
         SlSharedSlot *sharedSlot;
+        SlShape *shape;
+        SlPNode *pnode;
         uint16_t stackIdx;
         SlGCObj *gcObj;
     } as;
 } SlObj;
 
+// Storage used by a list, lists where all items are of the same numeric type
+// store them unboxed. See sl_list.h.
+typedef enum SlListKind {
+    SlList_Ints,   // every item is an Int, stored in `ints`
+    SlList_Floats, // every item is a Float, stored in `floats`
+    SlList_Objs,   // any item, stored in `objs`
+    SlList_Trie    // frozen lists that are not small, stored in `trie`
+} SlListKind;
+
 struct SlList {
     SlGCObj asGCObj;
-    SlObj *objs;
+    union {
+        SlObj *objs;
+        int64_t *ints;
+        SlFloat *floats;
+        SlPNode *trie;
+    };
     size_t len, cap;
+    // Position in the storage of the first item, the items continue from the
+    // start of the storage after reaching `cap`. Always 0 for frozen lists.
+    size_t head;
+    SlListKind kind;
+    uint32_t trieShift;
+    // Frozen list whose items are used by a view, NULL for other lists
+    SlList *parent;
 };
 
+// A string allocated as a rope is followed by its two parts and has
+// `bytes == NULL` until it is flattened, see sl_str.h.
 struct SlStr {
     SlGCObj asGCObj;
     uint8_t *bytes;
-    size_t len, cap;
+    size_t len;
+    size_t cap; // 0 if `bytes` is stored after the struct
+    uint32_t hash; // 0 if not computed yet
+    bool rope;
+    struct SlStrTable *internedIn; // table holding the string, if any
+    // String whose bytes are used by a view, NULL for other strings
+    SlStr *parent;
 };
 
+// Set of interned strings. Entries are weak: a string removes itself from the
+// table when it is destroyed.
+// A table is not synchronized and is only used by the thread of the VMs that
+// own it. It only holds frozen strings and `slShare` removes a string
+// from its table, so other threads never reach it.
+typedef struct SlStrTable {
+    SlStr **strs;
+    uint32_t len, tombstones;
+    uint32_t cap; // Power of two
+} SlStrTable;
+
 typedef struct SlMapEntry {
     SlObj key, value;
+    uint32_t hash;
 } SlMapEntry;
 
+// Entries are stored in insertion order, removed entries have a key of type
+// SlObj_Empty until they are compacted. The index table (`ctrl` and
+// `indices`) maps hashes to positions in `entries`, see sl_map.h.
+// Maps with only string keys that are never removed have a shape instead of
+// an index table, maps with inline entries have neither and are scanned.
 struct SlMap {
     SlGCObj asGCObj;
     SlMapEntry *entries;
-    size_t len, cap;
+    size_t len, cap; // `len` includes removed entries
+    size_t count; // number of entries that are not removed
+    SlShape *shape; // NULL in dictionary mode
+    uint8_t *ctrl; // `indices` is allocated in the same block
+    uint32_t *indices;
+    uint32_t indexCap; // power of two, at least slMapGroupSize, or zero
+    uint32_t growthLeft; // free control bytes before the index must grow
+    // Values of the Int keys `0` to `arrayLen - 1`, see sl_map.h
+    SlObj *array;
+    size_t arrayLen, arrayCap;
+    // Frozen maps that are not small have no entries or index table, `hamt`
+    // maps keys to entries and `order` holds the keys in insertion order
+    SlPNode *hamt;
+    SlPNode *order;
+    uint32_t orderShift;
+};
+
+struct SlOrdMap {
+    SlGCObj asGCObj;
+    SlOrdMapNode *root; // NULL if the map is empty
+    size_t count;
+};
+
+// A shape maps the keys of a map to their index in `entries`. Maps that add
+// the same keys in the same order share their shape.
+struct SlShape {
+    SlGCObj asGCObj;
+    SlShape *parent; // NULL for the root
+    SlShape **rootRef; // cleared when the root is destroyed
+    SlObj key; // key added by the transition from `parent`
+    uint32_t keyCount;
+    // Children are weak references, they remove themselves when destroyed
+    uint32_t childCount, childCap;
+    SlShape **children;
+};
+
+// Nodes are immutable once built and are shared between the versions of a
+// frozen container. They are followed by `count` items (SlObj) or entries
+// (SlMapEntry) depending on `kind`, see sl_persist.h.
+struct SlPNode {
+    SlGCObj asGCObj;
+    uint32_t bitmap; // used slots of SlPNode_Hamt nodes
+    uint32_t count;
+    uint8_t kind;
 };
 
+// Inline cache of a field access, one is kept for each place in the code
+// that accesses the field `key`.
+// If a map has shape `shape` the field is at `entries[idx]`, if the field is
+// missing and `transition` is not NULL it is added at `entries[idx]` and the
+// shape of the map becomes `transition`.
+typedef struct SlFieldCache {
+    SlObj key;
+    SlShape *shape;
+    SlShape *transition;
+    uint32_t idx;
+} SlFieldCache;
+
 struct SlFunc {
     SlGCObj asGCObj;
     SlPrototype *proto;
@@ -136,8 +257,14 @@ typedef struct SlDebugInfo {
     uint16_t slotInfoCount;
 } SlDebugInfo;
 
+// Where a closure gets each of its shared slots when it is created:
+// - fromShared: shared[idx] of the enclosing function
+// - byValue: a new closed slot holding a copy of stack[idx], used for
+//   variables that never change after the closure is created
+// - otherwise the slot opened on stack[idx], see slOpenSharedSlot
 typedef struct SlSharedInfo {
     bool fromShared;
+    bool byValue;
     uint16_t idx;
 } SlSharedInfo;
 
@@ -149,12 +276,19 @@ struct SlPrototype {
     SlObj *constants;
     SlDebugInfo *debugInfo;
     uint16_t frameSize;
+    uint16_t paramCount;
     uint16_t sharedCount;
     SlSharedInfo *sharedInfo;
 };
 
+// A slot is open while the variable it holds is in a live stack frame:
+// `location` points to the register of the variable and the VM keeps a
+// reference in its list of open slots. Closing it copies the value to `value`
+// and points `location` there.
 struct SlSharedSlot {
     SlGCObj asGCObj;
+    SlObj *location;
+    SlSharedSlot *nextOpen;
     SlObj value;
 };
 
@@ -172,7 +306,8 @@ typedef struct SlStackBlock {
 
 typedef struct SlCallFrame {
     SlFunc *func;
-    uint64_t pc;
+    SlObj *stackPtr; // first register of the function
+    uint64_t pc; // where the caller continues after the function returns
     SlObj *retAddress;
 } SlCallFrame;
 
@@ -201,6 +336,14 @@ typedef struct SlVM {
     uint64_t pc;
     SlPrototype *bytecode;
     SlObj *stackPtr;
+    SlStrTable ownStrTable;
+    // Table used for interning, if NULL `ownStrTable` is used. Can be set to
+    // share the table with other VMs running on the same thread.
+    SlStrTable *strTable;
+    SlShape *rootShape; // shape of empty maps, owned by the maps using it
+    // Open shared slots, the ones of the running frame come first by
+    // decreasing register
+    SlSharedSlot *openSlots;
 } SlVM;
 
 // Create a source from a C string. No memory is allocated.
@@ -228,8 +371,8 @@ SlObj slObjInt(int64_t value);
 SlObj slObjFloat(double value);
 
 // Create a new string object.
-// The contents of bytes are copied.
-// If an error occurs return NULL.
+// The contents of bytes are copied, short strings are stored inline.
+// If an error occurs return null.
 SlObj slFrozenStrNew(
     SlVM *vm,
     const uint8_t *bytes,
@@ -251,13 +394,44 @@ SlObj slPrototypeNew(
     SlSharedInfo *sharedInfo,
     uint16_t sharedCount,
     uint16_t frameSize,
+    uint16_t paramCount,
     SlDebugInfo *debugInfo
 );
 
+// Create a function of a prototype, the function takes its own reference to
+// `proto`. Its shared slots are NULL and must be set before it is called.
+// If an error occurs return null.
+SlObj slFuncNew(SlVM *vm, SlObj proto);
+// Get a new reference to the shared slot of register `reg` of the running
+// function, the slot is created and opened if no closure captured the
+// register yet.
+// If an error occurs return NULL.
+SlSharedSlot *slOpenSharedSlot(SlVM *vm, uint16_t reg);
+// Close the open shared slots of the registers from..=to of the running
+// function, called when the variables go out of scope.
+void slCloseSharedSlots(SlVM *vm, uint16_t from, uint16_t to);
+
+// Initialize the header of a newly allocated object with one reference.
+void slGCObjInit(SlGCObj *obj);
 // Get a new reference to an object.
 SlObj slNewRef(SlObj o);
 // Delete a reference of an object.
 void slDelRef(SlObj o);
+// Make an object and every object it references usable by multiple threads,
+// the calling thread becomes the owner of any object that was not already
+// shared. Only frozen data should be shared: the objects are not modified
+// after this call.
+// A thread receiving a shared object must take its own reference with
+// `slNewRef` and the sending thread must release the one it passed.
+// If an error occurs return false, objects shared until then stay shared.
+bool slShare(SlVM *vm, SlObj o);
+// Check if an object was passed to `slShare`, a shared object must not be
+// modified, not even to cache data.
+bool slIsShared(SlObj o);
+// Check if `o` has a single reference and is not shared with other threads.
+// Whoever holds that reference can modify the object in place without the
+// change being observed.
+bool slIsUnique(SlObj o);
 
 // Get the name of a type.
 const char *slTypeName(SlObj o);
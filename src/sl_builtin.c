@@ -1,51 +1,141 @@
 #include <assert.h>
 #include <inttypes.h>
+#include <math.h>
+#include <string.h>
 
 #include "sl_builtin.h"
+#include "clib_mem.h"
+#include "sl_list.h"
+#include "sl_map.h"
+#include "sl_ordmap.h"
+#include "sl_persist.h"
+#include "sl_str.h"
 #include "sl_vm.h"
 
+#define toFloat(obj)                                                           \
+    ((obj).type == SlObj_Int ? (SlFloat)(obj).as.numInt : (obj).as.numFloat)
+
+// Set an error for an operator that does not support its operands.
+static SlObj unsupported(SlVM *vm, const char *op, SlObj a, SlObj b);
+// Convert a slice bound to a position in a sequence of length `len`.
+// If the bound is not an Int set an error and return false.
+static bool sliceBound(SlVM *vm, SlObj bound, size_t len, size_t *outPos);
+// Check that `list` is a mutable list that has items if `popping`, `action`
+// describes the operation in the error message.
+// If it is not set an error and return false.
+static bool checkDeque(SlVM *vm, SlObj list, const char *action, bool popping);
+// Check that `map` is an ordered map.
+// If it is not set an error and return false.
+static bool checkOrdMap(SlVM *vm, SlObj map);
+// Find the first occurrence of `sub` in `bytes`, `subLen` must not be zero.
+// Return NULL if it is not found.
+static const uint8_t *findBytes(
+    const uint8_t *bytes,
+    size_t len,
+    const uint8_t *sub,
+    size_t subLen
+);
+// Split a flat string at each occurrence of `sep`. When splitting `lines` a
+// carriage return before the separator is removed from each part and there
+// is no empty part after a final separator.
+// If an error occurs return null.
+static SlObj splitStr(
+    SlVM *vm,
+    SlObj str,
+    const uint8_t *sep,
+    size_t sepLen,
+    bool lines
+);
+
 SlObj slAdd(SlVM *vm, SlObj a, SlObj b){
     if (slObjIsNumeric(a) && slObjIsNumeric(b)) {
         if (a.type == SlObj_Int && b.type == SlObj_Int) {
-            return slObjInt(a.as.numInt + b.as.numInt);
-        }
-        SlFloat valA = a.type == SlObj_Int
-            ? (SlFloat)a.as.numInt
-            : a.as.numFloat;
-        SlFloat valB = b.type == SlObj_Int
-            ? (SlFloat)b.as.numInt
-            : b.as.numFloat;
-        return slObjFloat(valA + valB);
+            return slObjInt(
+                (SlInt)((uint64_t)a.as.numInt + (uint64_t)b.as.numInt)
+            );
+        }
+        return slObjFloat(toFloat(a) + toFloat(b));
+    } else if (slObjIsStr(a) && slObjIsStr(b)) {
+        return slStrConcat(vm, a, b);
     } else {
-        slSetError(
-            vm,
-            "%s + %s not supported",
-            slTypeName(a), slTypeName(b)
+        return unsupported(vm, "+", a, b);
+    }
+}
+
+SlObj slSub(SlVM *vm, SlObj a, SlObj b) {
+    if (!slObjIsNumeric(a) || !slObjIsNumeric(b)) {
+        return unsupported(vm, "-", a, b);
+    }
+    if (a.type == SlObj_Int && b.type == SlObj_Int) {
+        return slObjInt(
+            (SlInt)((uint64_t)a.as.numInt - (uint64_t)b.as.numInt)
         );
-        return slNull;
     }
+    return slObjFloat(toFloat(a) - toFloat(b));
 }
 
 SlObj slMul(SlVM *vm, SlObj a, SlObj b) {
-    if (slObjIsNumeric(a) && slObjIsNumeric(b)) {
-        if (a.type == SlObj_Int && b.type == SlObj_Int) {
-            return slObjInt(a.as.numInt * b.as.numInt);
-        }
-        SlFloat valA = a.type == SlObj_Int
-            ? (SlFloat)a.as.numInt
-            : a.as.numFloat;
-        SlFloat valB = b.type == SlObj_Int
-            ? (SlFloat)b.as.numInt
-            : b.as.numFloat;
-        return slObjFloat(valA * valB);
-    } else {
-        slSetError(
-            vm,
-            "%s + %s not supported",
-            slTypeName(a), slTypeName(b)
+    if (!slObjIsNumeric(a) || !slObjIsNumeric(b)) {
+        return unsupported(vm, "*", a, b);
+    }
+    if (a.type == SlObj_Int && b.type == SlObj_Int) {
+        return slObjInt(
+            (SlInt)((uint64_t)a.as.numInt * (uint64_t)b.as.numInt)
         );
-        return slNull;
     }
+    return slObjFloat(toFloat(a) * toFloat(b));
+}
+
+SlObj slDiv(SlVM *vm, SlObj a, SlObj b) {
+    if (!slObjIsNumeric(a) || !slObjIsNumeric(b)) {
+        return unsupported(vm, "/", a, b);
+    }
+    if (a.type == SlObj_Int && b.type == SlObj_Int && b.as.numInt != 0) {
+        SlInt lhs = a.as.numInt, rhs = b.as.numInt;
+        // INT64_MIN / -1 overflows
+        if (rhs == -1) {
+            return slObjInt((SlInt)(0 - (uint64_t)lhs));
+        }
+        if (lhs % rhs == 0) {
+            return slObjInt(lhs / rhs);
+        }
+    }
+    return slObjFloat(toFloat(a) / toFloat(b));
+}
+
+SlObj slMod(SlVM *vm, SlObj a, SlObj b) {
+    if (!slObjIsNumeric(a) || !slObjIsNumeric(b)) {
+        return unsupported(vm, "%", a, b);
+    }
+    if (a.type == SlObj_Int && b.type == SlObj_Int && b.as.numInt != 0) {
+        if (b.as.numInt == -1) {
+            return slObjInt(0);
+        }
+        return slObjInt(a.as.numInt % b.as.numInt);
+    }
+    return slObjFloat(fmod(toFloat(a), toFloat(b)));
+}
+
+SlObj slPow(SlVM *vm, SlObj a, SlObj b) {
+    if (!slObjIsNumeric(a) || !slObjIsNumeric(b)) {
+        return unsupported(vm, "^", a, b);
+    }
+    if (a.type == SlObj_Int && b.type == SlObj_Int && b.as.numInt >= 0) {
+        uint64_t base = (uint64_t)a.as.numInt, result = 1;
+        for (SlInt exp = b.as.numInt; exp != 0; exp >>= 1) {
+            if (exp & 1) {
+                result *= base;
+            }
+            base *= base;
+        }
+        return slObjInt((SlInt)result);
+    }
+    return slObjFloat(pow(toFloat(a), toFloat(b)));
+}
+
+static SlObj unsupported(SlVM *vm, const char *op, SlObj a, SlObj b) {
+    slSetError(vm, "%s %s %s not supported", slTypeName(a), op, slTypeName(b));
+    return slNull;
 }
 
 SlObj slToStr(SlVM *vm, SlObj o) {
@@ -66,13 +156,434 @@ SlObj slToStr(SlVM *vm, SlObj o) {
         return slFrozenStrFmt(vm, "%"PRIi64, o.as.numInt);
     case SlObj_Float:
         return slFrozenStrFmt(vm, "%.15g", o.as.numFloat);
+    case SlObj_SmallStr:
     case SlObj_Str:
         return slNewRef(o);
     case SlObj_Prototype:
         return slFrozenStrNew(vm, SlU8("<internal:prototype>"));
+    case SlObj_Func:
+        return slFrozenStrNew(vm, SlU8("<func>"));
     default:
         assert(false && "TODO slToStr");
         return slFrozenStrNew(vm, SlU8("TODO"));
     }
 #undef SlU8
 }
+
+SlObj slInterpolate(SlVM *vm, const SlObj *parts, size_t count) {
+    SlObj stackStrs[16] = { 0 };
+    SlObj *strs = stackStrs;
+    if (count > sizeof(stackStrs) / sizeof(*stackStrs)) {
+        strs = memAlloc(count, sizeof(*strs));
+        if (strs == NULL) {
+            slSetOutOfMemoryError(vm);
+            return slNull;
+        }
+    }
+
+    SlObj result = slNull;
+    size_t converted = 0;
+    for (; converted < count; converted++) {
+        SlObj str = slToStr(vm, parts[converted]);
+        if (vm->error.occurred) {
+            goto cleanup;
+        }
+        strs[converted] = str;
+        if (!slStrFlatten(vm, str)) {
+            converted++;
+            goto cleanup;
+        }
+    }
+    result = slStrJoin(vm, strs, count);
+
+cleanup:
+    for (size_t i = 0; i < converted; i++) {
+        slDelRef(strs[i]);
+    }
+    if (strs != stackStrs) {
+        memFree(strs);
+    }
+    return result;
+}
+
+SlObj slGetItem(SlVM *vm, SlObj container, SlObj key) {
+    switch (container.type & 0xff) {
+    case SlObj_List: {
+        size_t idx;
+        if (!slListIndex(vm, container.as.list, key, &idx)) {
+            return slNull;
+        }
+        return slListGet(container.as.list, idx);
+    }
+    case SlObj_Map: {
+        SlObj *value = slMapGet(vm, container.as.map, key);
+        if (value == NULL) {
+            if (!vm->error.occurred) {
+                slSetError(vm, "key not found");
+            }
+            return slNull;
+        }
+        return slNewRef(*value);
+    }
+    case SlObj_OrdMap: {
+        SlObj *value = slOrdMapGet(vm, container.as.ordMap, key);
+        if (value == NULL) {
+            if (!vm->error.occurred) {
+                slSetError(vm, "key not found");
+            }
+            return slNull;
+        }
+        return slNewRef(*value);
+    }
+    default:
+        slSetError(vm, "%s cannot be indexed", slTypeName(container));
+        return slNull;
+    }
+}
+
+static bool setFrozenItem(SlVM *vm, SlObj *container, SlObj key, SlObj value) {
+    SlObj frozenValue = slFreeze(vm, slNewRef(value));
+    if (vm->error.occurred) {
+        return false;
+    }
+
+    // Trie-backed containers are never modified in place, their nodes may be
+    // shared with other versions. Views share their items with another list.
+    bool inPlace = slIsUnique(*container);
+    SlObj result = slNull;
+    if (container->type == SlObj_FrozenList) {
+        SlList *list = container->as.list;
+        size_t idx;
+        if (!slListIndex(vm, list, key, &idx)) {
+            slDelRef(frozenValue);
+            return false;
+        }
+        if (inPlace && list->kind != SlList_Trie && list->parent == NULL) {
+            bool success = slListSet(vm, list, idx, frozenValue);
+            slDelRef(frozenValue);
+            return success;
+        }
+        result = slFrozenListSet(vm, *container, idx, frozenValue);
+    } else {
+        if (inPlace && container->as.map->hamt == NULL) {
+            bool success = slMapSet(vm, container->as.map, key, frozenValue);
+            slDelRef(frozenValue);
+            return success;
+        }
+        result = slFrozenMapSet(vm, *container, key, frozenValue);
+    }
+    slDelRef(frozenValue);
+    if (vm->error.occurred) {
+        return false;
+    }
+    slDelRef(*container);
+    *container = result;
+    return true;
+}
+
+bool slSetItem(SlVM *vm, SlObj *container, SlObj key, SlObj value) {
+    switch (container->type) {
+    case SlObj_List: {
+        size_t idx;
+        if (!slListIndex(vm, container->as.list, key, &idx)) {
+            return false;
+        }
+        return slListSet(vm, container->as.list, idx, value);
+    }
+    case SlObj_Map:
+        return slMapSet(vm, container->as.map, key, value);
+    case SlObj_OrdMap:
+        return slOrdMapSet(vm, container->as.ordMap, key, value);
+    case SlObj_FrozenList:
+    case SlObj_FrozenMap:
+        return setFrozenItem(vm, container, key, value);
+    default:
+        slSetError(vm, "items of %s cannot be set", slTypeName(*container));
+        return false;
+    }
+}
+
+SlObj slSlice(SlVM *vm, SlObj container, SlObj start, SlObj end) {
+    size_t len;
+    if (slObjIsStr(container)) {
+        len = slStrLen(&container);
+    } else if ((container.type & 0xff) == SlObj_List) {
+        len = container.as.list->len;
+    } else {
+        slSetError(vm, "%s cannot be sliced", slTypeName(container));
+        return slNull;
+    }
+    size_t from, to;
+    if (!sliceBound(vm, start, len, &from) || !sliceBound(vm, end, len, &to)) {
+        return slNull;
+    }
+    if (to < from) {
+        to = from;
+    }
+    if (slObjIsStr(container)) {
+        return slStrSlice(vm, container, from, to - from);
+    }
+    return slListSlice(vm, container, from, to - from);
+}
+
+SlObj slSplit(SlVM *vm, SlObj str, SlObj sep) {
+    if (!slObjIsStr(str) || !slObjIsStr(sep)) {
+        slSetError(
+            vm,
+            "cannot split %s with %s",
+            slTypeName(str), slTypeName(sep)
+        );
+        return slNull;
+    }
+    if (slStrLen(&sep) == 0) {
+        slSetError(vm, "the separator is empty");
+        return slNull;
+    }
+    if (!slStrFlatten(vm, sep)) {
+        return slNull;
+    }
+    return splitStr(vm, str, slStrBytes(&sep), slStrLen(&sep), false);
+}
+
+SlObj slLines(SlVM *vm, SlObj str) {
+    if (!slObjIsStr(str)) {
+        slSetError(vm, "cannot split %s into lines", slTypeName(str));
+        return slNull;
+    }
+    return splitStr(vm, str, (const uint8_t *)"\n", 1, true);
+}
+
+bool slPushBack(SlVM *vm, SlObj list, SlObj value) {
+    if (!checkDeque(vm, list, "push to", false)) {
+        return false;
+    }
+    return slListAppend(vm, list.as.list, value);
+}
+
+bool slPushFront(SlVM *vm, SlObj list, SlObj value) {
+    if (!checkDeque(vm, list, "push to", false)) {
+        return false;
+    }
+    return slListPrepend(vm, list.as.list, value);
+}
+
+SlObj slPopBack(SlVM *vm, SlObj list) {
+    if (!checkDeque(vm, list, "pop from", true)) {
+        return slNull;
+    }
+    return slListPop(list.as.list);
+}
+
+SlObj slPopFront(SlVM *vm, SlObj list) {
+    if (!checkDeque(vm, list, "pop from", true)) {
+        return slNull;
+    }
+    return slListPopFront(list.as.list);
+}
+
+SlObj slRange(SlVM *vm, SlObj map, SlObj lo, SlObj hi) {
+    if (!checkOrdMap(vm, map)) {
+        return slNull;
+    }
+    SlOrdMapIter iter;
+    if (!slOrdMapIterInit(
+        vm,
+        map.as.ordMap,
+        lo.type == SlObj_Null ? (SlObj){ .type = SlObj_Empty } : lo,
+        hi.type == SlObj_Null ? (SlObj){ .type = SlObj_Empty } : hi,
+        &iter
+    )) {
+        return slNull;
+    }
+    SlObj keys = slListNew(vm, 0);
+    if (vm->error.occurred) {
+        return slNull;
+    }
+    SlObj key;
+    SlObj *value;
+    while (slOrdMapIterNext(vm, &iter, &key, &value)) {
+        if (!slListAppend(vm, keys.as.list, key)) {
+            slDelRef(keys);
+            return slNull;
+        }
+    }
+    if (vm->error.occurred) {
+        slDelRef(keys);
+        return slNull;
+    }
+    return slFreeze(vm, keys);
+}
+
+SlObj slFloor(SlVM *vm, SlObj map, SlObj key) {
+    if (!checkOrdMap(vm, map)) {
+        return slNull;
+    }
+    SlObj floorKey;
+    SlObj *value;
+    if (!slOrdMapFloor(vm, map.as.ordMap, key, &floorKey, &value)) {
+        return slNull;
+    }
+    return slNewRef(floorKey);
+}
+
+SlObj slCeil(SlVM *vm, SlObj map, SlObj key) {
+    if (!checkOrdMap(vm, map)) {
+        return slNull;
+    }
+    SlObj ceilKey;
+    SlObj *value;
+    if (!slOrdMapCeil(vm, map.as.ordMap, key, &ceilKey, &value)) {
+        return slNull;
+    }
+    return slNewRef(ceilKey);
+}
+
+SlObj slToOrdMap(SlVM *vm, SlObj map) {
+    if ((map.type & 0xff) != SlObj_Map) {
+        slSetError(vm, "cannot create an OrdMap from %s", slTypeName(map));
+        return slNull;
+    }
+    size_t count = slMapCount(map.as.map);
+    SlObj *keys = memAlloc(count * 2, sizeof(*keys));
+    if (keys == NULL && count != 0) {
+        slSetOutOfMemoryError(vm);
+        return slNull;
+    }
+    SlObj *values = keys + count;
+
+    // The keys and values are borrowed from the map
+    bool sorted = true;
+    size_t iter = 0;
+    SlObj *value;
+    for (size_t i = 0; slMapNext(map.as.map, &iter, &keys[i], &value); i++) {
+        values[i] = *value;
+        int cmp = -1;
+        if (i != 0 && sorted
+            && !slOrdMapKeyCmp(vm, keys[i - 1], keys[i], &cmp))
+        {
+            memFree(keys);
+            return slNull;
+        }
+        sorted = sorted && cmp < 0;
+    }
+
+    SlObj result = slNull;
+    if (sorted) {
+        result = slOrdMapFromSorted(vm, keys, values, count);
+    } else {
+        result = slOrdMapNew(vm);
+        for (size_t i = 0; !vm->error.occurred && i < count; i++) {
+            slOrdMapSet(vm, result.as.ordMap, keys[i], values[i]);
+        }
+        if (vm->error.occurred) {
+            slDelRef(result);
+            result = slNull;
+        }
+    }
+    memFree(keys);
+    return result;
+}
+
+static bool sliceBound(SlVM *vm, SlObj bound, size_t len, size_t *outPos) {
+    if (bound.type != SlObj_Int) {
+        slSetError(vm, "slice bounds must be Int, not %s", slTypeName(bound));
+        return false;
+    }
+    int64_t pos = bound.as.numInt;
+    if (pos < 0) {
+        pos += (int64_t)len;
+    }
+    *outPos = pos < 0 ? 0 : (uint64_t)pos > len ? len : (size_t)pos;
+    return true;
+}
+
+static bool checkDeque(SlVM *vm, SlObj list, const char *action, bool popping) {
+    if (list.type != SlObj_List) {
+        slSetError(vm, "cannot %s %s", action, slTypeName(list));
+        return false;
+    }
+    if (popping && list.as.list->len == 0) {
+        slSetError(vm, "cannot %s an empty List", action);
+        return false;
+    }
+    return true;
+}
+
+static bool checkOrdMap(SlVM *vm, SlObj map) {
+    if (map.type != SlObj_OrdMap) {
+        slSetError(vm, "expected OrdMap, got %s", slTypeName(map));
+        return false;
+    }
+    return true;
+}
+
+static const uint8_t *findBytes(
+    const uint8_t *bytes,
+    size_t len,
+    const uint8_t *sub,
+    size_t subLen
+) {
+    const uint8_t *end = bytes + len;
+    while ((size_t)(end - bytes) >= subLen) {
+        const uint8_t *first = memchr(bytes, sub[0], end - bytes - subLen + 1);
+        if (first == NULL) {
+            return NULL;
+        }
+        if (memcmp(first, sub, subLen) == 0) {
+            return first;
+        }
+        bytes = first + 1;
+    }
+    return NULL;
+}
+
+static SlObj splitStr(
+    SlVM *vm,
+    SlObj str,
+    const uint8_t *sep,
+    size_t sepLen,
+    bool lines
+) {
+    if (!slStrFlatten(vm, str)) {
+        return slNull;
+    }
+    // Slices of a mutable string are copies, a frozen copy of the whole
+    // string is sliced instead so that the parts can be views of it
+    SlObj src = str.type == SlObj_Str
+        ? slFrozenStrNew(vm, slStrBytes(&str), slStrLen(&str))
+        : slNewRef(str);
+    if (vm->error.occurred) {
+        return slNull;
+    }
+    SlObj parts = slListNew(vm, 0);
+    if (vm->error.occurred) {
+        slDelRef(src);
+        return slNull;
+    }
+
+    const uint8_t *bytes = slStrBytes(&src);
+    size_t len = slStrLen(&src);
+    for (size_t start = 0; !lines || start < len;) {
+        const uint8_t *found =
+            findBytes(bytes + start, len - start, sep, sepLen);
+        size_t end = found == NULL ? len : (size_t)(found - bytes);
+        size_t partLen = end - start;
+        if (lines && partLen != 0 && bytes[end - 1] == '\r') {
+            partLen--;
+        }
+        SlObj part = slStrSlice(vm, src, start, partLen);
+        if (vm->error.occurred || !slListAppend(vm, parts.as.list, part)) {
+            slDelRef(part);
+            slDelRef(parts);
+            slDelRef(src);
+            return slNull;
+        }
+        slDelRef(part);
+        if (found == NULL) {
+            break;
+        }
+        start = end + sepLen;
+    }
+    slDelRef(src);
+    return slFreeze(vm, parts);
+}
@@ -2,6 +2,8 @@
 
 #include "sl_array.h"
 #include "sl_codegen.h"
+#include "sl_ir.h"
+#include "sl_optimizer.h"
 #include "sl_parser.h"
 
 // There are 0x7fff + 0x80 available registers but the top 128 are reserved
@@ -13,43 +15,152 @@
 slArrayType(SlObj, Constants, consts)
 slArrayImpl(SlObj, Constants, consts)
 
+/*
+Registers are allocated per function from a pool, every register is either
+free or holds one value.
+
+A variable gets a register when it is declared and gives it back after the
+last access from its function, the resolver counts the accesses. Values of
+expressions are computed in free registers that are either released by the
+instruction that reads them or taken by the variable being declared, so that
+no copy is needed.
+
+Functions declared in a block and parameters use runs of consecutive
+registers that are allocated when the block starts. Closures refer to the
+registers of the variables they capture, so functions and captured variables
+keep their registers until the block ends, the other parameters are released
+after their last access.
+*/
+
+// A function known at compile time, calls to it use SlOp_callk
+typedef struct KnownFunc {
+    int32_t frameSize; // -1 if the function is not known
+    uint16_t paramCount;
+} KnownFunc;
+
+typedef struct VarState {
+    int16_t reg; // -1 if the variable is not in a register
+    int32_t usesLeft;
+    bool declared;
+    bool pinned; // the register is kept until the block ends
+    KnownFunc func; // function the variable holds since its last declaration
+    bool isInt; // the variable holds an Int since its last declaration
+} VarState;
+
 // The program tracked as a stack of functions, stored in FuncState
 // Each function has inside its own vars table that is a stack of blocks
 
 typedef struct BlockState {
     struct BlockState *parent;
     SlStrMap *vars;
-    uint16_t baseReg, baseShr;
+    VarState *varStates; // indexed like `vars`
 } BlockState;
 
 typedef struct FuncState {
     struct FuncState *parent;
     SlU8Arr bytecode;
     Constants consts;
-    SlStrMap externalVars; // value: [fromShared?:1|src:15|0|dst:15]
-    uint16_t usedStack;
+    SlStrMap externalVars; // value: [fromShared?:1|src:15|byValue?:1|dst:15]
+    SlU8Arr regs; // 1 for each register that is in use
+    uint16_t paramCount;
     uint16_t maxStackSize;
     BlockState *block;
 } FuncState;
 
+// State of a value of the IR while it is lowered
+typedef struct IrValueState {
+    int16_t reg; // -1 if the value is not in a register
+    int16_t backing; // register a shared slot refers to
+    int32_t lastUse; // position of the last instruction that reads the value
+    bool stored; // a shared slot that is stored to
+    KnownFunc func; // the function made by a closure
+} IrValueState;
+
 typedef struct GenState {
     SlVM *vm;
     const char *path;
     SlAst ast;
     FuncState *func;
     int16_t outReg; // always absolute
+    // set by expressions when the register in `outReg` must be released or
+    // taken by the instruction that reads it
+    bool outOwned;
+    SlOptLevel optLevel;
+    // arithmetic instructions emitted and how many of them use the Int
+    // variants
+    uint32_t arithCount;
+    uint32_t intArithCount;
 } GenState;
 
+// Instruction decoded by the peephole optimizer
+typedef struct PeepInst {
+    uint32_t offset; // offset in the bytecode before it is rewritten
+    uint8_t op;
+    bool removed;
+    bool isTarget; // a jump goes to the instruction
+    int32_t operands[3]; // the last operand of a jump is the target index
+} PeepInst;
+
+// Name and operand format of each instruction, see sl_codegen.h
+static const struct {
+    const char *name;
+    const char *fmt;
+} opInfos[] = {
+    [SlOp_nop] = { "nop", "" },
+    [SlOp_ln] = { "ln", "rr" },
+    [SlOp_li8] = { "li8", "rB" },
+    [SlOp_lkb] = { "lkb", "rb" },
+    [SlOp_lks] = { "lks", "rs" },
+    [SlOp_lki] = { "lki", "ri" },
+    [SlOp_cpy] = { "cpy", "rr" },
+    [SlOp_mov] = { "mov", "rr" },
+    [SlOp_ls] = { "ls", "rr" },
+    [SlOp_sts] = { "sts", "rr" },
+    [SlOp_dts] = { "dts", "rr" },
+    [SlOp_add] = { "add", "rrr" },
+    [SlOp_sub] = { "sub", "rrr" },
+    [SlOp_mul] = { "mul", "rrr" },
+    [SlOp_div] = { "div", "rrr" },
+    [SlOp_mod] = { "mod", "rrr" },
+    [SlOp_pow] = { "pow", "rrr" },
+    [SlOp_addi] = { "addi", "rrr" },
+    [SlOp_subi] = { "subi", "rrr" },
+    [SlOp_muli] = { "muli", "rrr" },
+    [SlOp_print] = { "print", "r" },
+    [SlOp_mkfb] = { "mkfb", "rb" },
+    [SlOp_mkfs] = { "mkfs", "rs" },
+    [SlOp_mkfi] = { "mkfi", "ri" },
+    [SlOp_call] = { "call", "rr" },
+    [SlOp_callk] = { "callk", "rrs" },
+    [SlOp_tcall] = { "tcall", "rr" },
+    [SlOp_ret] = { "ret", "r" },
+    [SlOp_jmp] = { "jmp", "I" },
+    [SlOp_jtr] = { "jtr", "rI" },
+    [SlOp_jfl] = { "jfl", "rI" },
+    [SlOp_jlt] = { "jlt", "rrI" },
+    [SlOp_jle] = { "jle", "rrI" },
+    [SlOp_jeq] = { "jeq", "rrI" },
+    [SlOp_jne] = { "jne", "rrI" }
+};
+
 static void emitU8(const GenState *g, uint8_t n);
 static void emitI8(const GenState *g, int8_t n);
 static void emitU16(const GenState *g, uint16_t n);
 // static void emitI24(const GenState *g, int32_t n);
 static void emitU24(const GenState *g, int32_t n);
 static void emitOp(const GenState *g, SlOpCode opCode);
-// Use absolute register
-static void emitRegAbs(const GenState *g, int16_t reg);
-// Use reg + g->func->block->baseReg
-static void emitRegRel(const GenState *g, uint16_t reg);
+static void emitReg(const GenState *g, int16_t reg);
+// Copy stack[src] to stack[dst], the value is moved if `src` is not read
+// afterwards. Nothing is emitted if the registers are the same.
+static void emitCopy(const GenState *g, int16_t dst, int16_t src, bool move);
+// Emit a call of stack[first] with the `argCount` arguments that follow it,
+// the call is direct if `callee` is known and takes these arguments
+static void emitCall(
+    const GenState *g,
+    int16_t first,
+    uint16_t argCount,
+    KnownFunc callee
+);
 // Emit appropriate op, that loads from the constants with an appropriate
 // integer
 // op - the byte version of the opcode (e.g. SlOp_lkb)
@@ -59,20 +170,80 @@ static void emitKOp(const GenState *g, SlOpCode op, int32_t src);
 
 static void setError(const GenState *g, SlNodeIdx node, const char *fmt, ...);
 
-static uint16_t getSlot(const GenState *g);
-static bool useSlots(const GenState *g, SlNodeIdx node, size_t count);
-static void releaseSlots(const GenState *g, uint16_t first);
+// Rewrite the bytecode of the current function removing redundant
+// instructions and threading jumps, the ranges in `lineInfo` are moved with
+// the instructions they cover.
+static void optimizeBytecode(
+    GenState *g,
+    SlLineInfo *lineInfo,
+    uint32_t lineInfoCount
+);
+// Apply the rewrite rules once, return true if something changed
+static bool rewriteInsts(PeepInst *insts, uint32_t count);
+static bool isJump(uint8_t op);
+// Decode the operand of format `fmt` at `bytecode[*i]` and move `*i` past it
+static int32_t decodeOperand(const uint8_t *bytecode, uint32_t *i, char fmt);
+static void emitOperand(const GenState *g, char fmt, int32_t value);
+static uint32_t instSize(const PeepInst *inst);
+// Index of the first instruction from `i` that is not removed
+static uint32_t nextLive(const PeepInst *insts, uint32_t count, uint32_t i);
+// Check if `inst` writes `reg` without reading it first
+static bool overwrites(const PeepInst *inst, int32_t reg);
+// Check if the first operand of `op` is a register that is only written
+static bool writesFirstOperand(uint8_t op);
+
+// Get the first of `count` consecutive free registers and mark them as used.
+// If the frame becomes too big return -1.
+static int16_t allocRegs(const GenState *g, SlNodeIdx node, uint16_t count);
+static void freeRegs(const GenState *g, int16_t first, uint16_t count);
 
-static int16_t setOutRegRel(GenState *g, int16_t reg);
 static int16_t setOutRegAbs(GenState *g, int16_t reg);
-// If g->outReg is not set, use a new slot and set outReg to point to it
+// If g->outReg is not set, allocate a register and set outReg to point to it
 static bool useOutRegNew(GenState *g, SlNodeIdx idx);
+// Release g->outReg if the expression that produced it gave it away
+static void releaseOutReg(GenState *g);
 
 static int32_t addConst(const GenState *g, SlNodeIdx node, SlObj obj);
+// Add the function of a prototype to the constants, the reference to `proto`
+// is taken even if an error occurs. A prototype that captures nothing gets a
+// single function that lives as long as the constants and `*outOp` is
+// SlOp_lkb, otherwise it is SlOp_mkfb and a closure is made each time.
+static int32_t addFuncConst(
+    const GenState *g,
+    SlNodeIdx node,
+    SlObj proto,
+    SlOpCode *outOp
+);
 
 static SlNode *getNode(const GenState *g, SlNodeIdx idx);
 
 static SlObj genProtoObj(GenState *g, SlNodeIdx idx, SlStrIdx name);
+// Lower the IR of a function, see `slIrBuild`. Each value gets a register
+// from its definition to its last use.
+static SlObj genProtoFromIr(GenState *g, const SlIrFunc *ir);
+// Emit the instruction `value` of `ir` at position `pos` of its block
+static void genIrInst(
+    GenState *g,
+    const SlIrFunc *ir,
+    SlIrValue value,
+    uint32_t pos,
+    IrValueState *values
+);
+static void genIrCall(
+    GenState *g,
+    const SlIrFunc *ir,
+    SlIrValue value,
+    uint32_t pos,
+    IrValueState *values
+);
+// Release the registers of the operands of `inst` that are last used by it
+static void freeIrOperands(
+    const GenState *g,
+    const SlIrFunc *ir,
+    const SlIrInst *inst,
+    uint32_t pos,
+    const IrValueState *values
+);
 
 static bool genStmnt(GenState *g, SlNodeIdx idx);
 static void genBlock(GenState *g, SlNodeIdx idx);
@@ -83,29 +254,80 @@ static void genRetStmnt(GenState *g, SlNodeIdx idx);
 // g->outReg contains the register where the value of the expression is stored
 
 static bool genExpr(GenState *g, SlNodeIdx idx);
-static void genLambda(GenState *g, SlNodeIdx idx, SlStrIdx name);
+// Return the prototype of the function or NULL if an error occurs
+static const SlPrototype *genLambda(
+    GenState *g,
+    SlNodeIdx idx,
+    SlStrIdx name
+);
 static void genBinOp(GenState *g, SlNodeIdx idx);
+static void genCall(GenState *g, SlNodeIdx idx);
 static void genNumInt(GenState *g, SlNodeIdx idx);
 static void genAccess(GenState *g, SlNodeIdx idx);
+// Find a declared variable of the current function, NULL if `name` is not
+// one of them
+static VarState *findLocalVar(const GenState *g, SlStrIdx name);
+// Get the function held by the local variable read by an expression
+static KnownFunc knownFunc(const GenState *g, SlNodeIdx idx);
+// Tell if the value of an expression is known to be an Int
+static bool knownInt(const GenState *g, SlNodeIdx idx);
+// Emit `op` or its Int variant if `intOperands` is true and it has one.
+static void emitArith(
+    GenState *g,
+    SlOpCode op,
+    bool intOperands,
+    int16_t dst,
+    int16_t lhs,
+    int16_t rhs
+);
 
 void printPrototype(SlObj main);
 
-SlObj slGenCode(SlVM *vm, const SlSource *source) {
+SlObj slGenCode(SlVM *vm, const SlSource *source, SlOptLevel optLevel) {
     SlAst ast = slParse(vm, source);
     if (vm->error.occurred) {
         return slNull;
     }
+    if (!slOptimizeAst(vm, &ast, optLevel)
+        || !slResolveAst(vm, &ast, source->path))
+    {
+        slDestroyAst(&ast);
+        return slNull;
+    }
     assert(ast.nodes[ast.root].kind == SlNode_Lambda);
 
     GenState g = {
         .vm = vm,
         .ast = ast,
         .path = source->path,
-        .func = NULL
+        .func = NULL,
+        .optLevel = optLevel
     };
 
-    SlObj main = genProtoObj(&g, ast.root, (SlStrIdx){ .idx = 0, .len = 0 });
+    SlObj main = slNull;
+    if (optLevel >= SlOpt_Ssa) {
+        SlIrFunc *ir = slIrBuild(vm, &ast, ast.root);
+        if (ir != NULL && slIrOptimize(vm, &ast, ir)) {
+            char *printIr = getenv("SL_PRINT_IR");
+            if (printIr && strcmp(printIr, "true") == 0) {
+                slIrPrint(ir);
+            }
+            main = genProtoFromIr(&g, ir);
+        }
+        slIrDestroy(ir);
+    } else {
+        main = genProtoObj(&g, ast.root, (SlStrIdx){ .idx = 0, .len = 0 });
+    }
     slDestroyAst(&ast);
+    char *printTypes = getenv("SL_PRINT_TYPES");
+    if (printTypes && strcmp(printTypes, "true") == 0 && g.arithCount != 0) {
+        printf(
+            "Int arithmetic: %"PRIu32" of %"PRIu32" instructions (%.1f%%)\n",
+            g.intArithCount,
+            g.arithCount,
+            100.0 * g.intArithCount / g.arithCount
+        );
+    }
     if (main.type == SlObj_Prototype && main.as.proto->debugInfo != NULL) {
         main.as.proto->debugInfo->name = (uint8_t *)".main";
     }
@@ -145,17 +367,9 @@ static void emitOp(const GenState *g, SlOpCode opCode) {
     emitU8(g, (uint8_t)opCode);
 }
 
-static void emitRegRel(const GenState *g, uint16_t reg) {
-    assert(g->func != NULL);
-    assert(g->func->block != NULL);
-    uint16_t baseReg = g->func->block->baseReg;
-
-    assert((uint32_t)reg + (uint32_t)baseReg < 0xffff);
-    emitRegAbs(g, (int16_t)(reg + baseReg));
-}
-
-static void emitRegAbs(const GenState *g, int16_t reg) {
-    assert(reg >= 0 && reg <= _maxReg);
+static void emitReg(const GenState *g, int16_t reg) {
+    // _maxReg is the largest int16_t
+    assert(reg >= 0);
     if (reg < 0x80) {
         emitU8(g, (uint8_t)reg);
     } else {
@@ -168,19 +382,39 @@ static void emitKOp(const GenState *g, SlOpCode op, int32_t src) {
     assert(g->outReg >= 0);
     if (src <= 0xff) {
         emitOp(g, op);
-        emitRegAbs(g, g->outReg);
+        emitReg(g, g->outReg);
         emitU8(g, (uint8_t)src);
     } else if (src <= 0xffff) {
         emitOp(g, op + 1);
-        emitRegAbs(g, g->outReg);
+        emitReg(g, g->outReg);
         emitU16(g, (uint16_t)src);
     } else {
         emitOp(g, op + 2);
-        emitRegAbs(g, g->outReg);
+        emitReg(g, g->outReg);
         emitU24(g, src);
     }
 }
 
+static void emitCopy(const GenState *g, int16_t dst, int16_t src, bool move) {
+    if (dst == src) return;
+    emitOp(g, move ? SlOp_mov : SlOp_cpy);
+    emitReg(g, dst);
+    emitReg(g, src);
+}
+
+static void emitCall(
+    const GenState *g,
+    int16_t first,
+    uint16_t argCount,
+    KnownFunc callee
+) {
+    bool direct = callee.frameSize >= 0 && callee.paramCount == argCount;
+    emitOp(g, direct ? SlOp_callk : SlOp_call);
+    emitReg(g, first);
+    emitReg(g, (int16_t)(first + argCount));
+    if (direct) emitU16(g, (uint16_t)callee.frameSize);
+}
+
 static void setError(const GenState *g, SlNodeIdx node, const char *fmt, ...) {
     if (g->vm->error.occurred) return;
     va_list args;
@@ -193,44 +427,44 @@ static void setError(const GenState *g, SlNodeIdx node, const char *fmt, ...) {
     slSetError(g->vm, "%s:%"PRIu32": %s", g->path, line, buf);
 }
 
-static uint16_t getSlot(const GenState *g) {
-    assert(g->func != NULL);
-    return g->func->usedStack;
-}
-
-static bool useSlots(const GenState *g, SlNodeIdx node, size_t count) {
+static int16_t allocRegs(const GenState *g, SlNodeIdx node, uint16_t count) {
     assert(g->func != NULL);
-    if (g->func->usedStack > _maxReg - count) {
+    assert(count != 0);
+    SlU8Arr *regs = &g->func->regs;
+
+    uint32_t first = 0;
+    while (first < regs->len) {
+        uint32_t end = first;
+        while (end < regs->len && end - first < count && !regs->data[end]) {
+            end++;
+        }
+        if (end - first == count || end == regs->len) break;
+        first = end + 1;
+    }
+    if (first + count > _maxReg) {
         setError(
             g,
             node,
             "maximum function frame size exceeded (max is %d)",
             _maxReg
         );
-        return false;
+        return -1;
     }
 
-    g->func->usedStack += count;
-    if (g->func->usedStack > g->func->maxStackSize) {
-        g->func->maxStackSize = g->func->usedStack;
+    while (regs->len < first + count) {
+        if (!slU8Push(g->vm, regs, 0)) return -1;
     }
-    return true;
-}
-
-static void releaseSlots(const GenState *g, uint16_t first) {
-    assert(g->func != NULL);
-    assert(first <= g->func->usedStack);
-    g->func->usedStack = first;
+    memset(regs->data + first, 1, count);
+    if (regs->len > g->func->maxStackSize) {
+        g->func->maxStackSize = (uint16_t)regs->len;
+    }
+    return (int16_t)first;
 }
 
-static int16_t setOutRegRel(GenState *g, int16_t reg) {
+static void freeRegs(const GenState *g, int16_t first, uint16_t count) {
     assert(g->func != NULL);
-    assert(g->func->block != NULL);
-    uint16_t baseReg = g->func->block->baseReg;
-
-    if (reg < 0) return setOutRegAbs(g, -1);
-    assert((uint32_t)reg + (uint32_t)baseReg <= _maxReg);
-    return setOutRegAbs(g, (int16_t)(reg + baseReg));
+    assert(first >= 0 && (uint32_t)first + count <= g->func->regs.len);
+    memset(g->func->regs.data + first, 0, count);
 }
 
 static int16_t setOutRegAbs(GenState *g, int16_t reg) {
@@ -238,13 +472,20 @@ static int16_t setOutRegAbs(GenState *g, int16_t reg) {
     assert(reg < _maxReg);
     int16_t old = g->outReg;
     g->outReg = reg;
+    g->outOwned = false;
     return old;
 }
 
 static bool useOutRegNew(GenState *g, SlNodeIdx idx) {
     if (g->outReg >= 0) return true;
-    g->outReg = (int16_t)getSlot(g);
-    return useSlots(g, idx, 1);
+    g->outReg = allocRegs(g, idx, 1);
+    g->outOwned = true;
+    return g->outReg >= 0;
+}
+
+static void releaseOutReg(GenState *g) {
+    if (g->outOwned) freeRegs(g, g->outReg, 1);
+    g->outOwned = false;
 }
 
 static int32_t addConst(const GenState *g, SlNodeIdx node, SlObj obj) {
@@ -262,6 +503,25 @@ static int32_t addConst(const GenState *g, SlNodeIdx node, SlObj obj) {
     return (int32_t)(g->func->consts.len - 1);
 }
 
+static int32_t addFuncConst(
+    const GenState *g,
+    SlNodeIdx node,
+    SlObj proto,
+    SlOpCode *outOp
+) {
+    SlObj obj = proto;
+    *outOp = SlOp_mkfb;
+    if (proto.as.proto->sharedCount == 0) {
+        obj = slFuncNew(g->vm, proto);
+        slDelRef(proto);
+        if (obj.type == SlObj_Null) return -1;
+        *outOp = SlOp_lkb;
+    }
+    int32_t constIdx = addConst(g, node, obj);
+    if (constIdx < 0) slDelRef(obj);
+    return constIdx;
+}
+
 static SlNode *getNode(const GenState *g, SlNodeIdx idx) {
     assert(idx >= 0 && (uint32_t)idx < g->ast.nodeCount);
     return &g->ast.nodes[idx];
@@ -269,10 +529,9 @@ static SlNode *getNode(const GenState *g, SlNodeIdx idx) {
 
 static bool genStmnt(GenState *g, SlNodeIdx idx) {
     if (g->vm->error.occurred) return false;
-    g->outReg = -1;
+    setOutRegAbs(g, -1);
 
     SlNode *node = getNode(g, idx);
-    uint16_t firstSlot = getSlot(g);
     switch (node->kind) {
     case SlNode_INVALID:
     case SlNode_BinOp:
@@ -293,10 +552,11 @@ static bool genStmnt(GenState *g, SlNodeIdx idx) {
     case SlNode_RetStmnt:
         genRetStmnt(g, idx);
         break;
+    case SlNode_Call:
+        genCall(g, idx);
+        releaseOutReg(g);
+        break;
     }
-    // When a statement ends, the number of slots used after is the same as the
-    // number of slots used before (since variables are pre-allocated)
-    releaseSlots(g, firstSlot);
     return !g->vm->error.occurred;
 }
 
@@ -307,87 +567,172 @@ static void genBlock(GenState *g, SlNodeIdx idx) {
     SlNode *node = getNode(g, idx);
     uint16_t varCount = node->as.block.vars->len;
     uint16_t funcCount = node->as.block.funcCount;
-    uint16_t sharedCount = node->as.block.sharedCount;
-    uint16_t baseReg = getSlot(g);
+    // The parameters are the variables of the outermost block of a function
+    uint16_t paramCount = g->func->block == NULL ? g->func->paramCount : 0;
 
     BlockState newBlockState = {
         .parent = g->func->block,
-        .vars = getNode(g, idx)->as.block.vars,
-        .baseReg = baseReg,
-        .baseShr = baseReg + varCount
+        .vars = node->as.block.vars,
+        .varStates = NULL
     };
-    if (!useSlots(g, idx, varCount + sharedCount)) return;
+    if (varCount != 0) {
+        newBlockState.varStates = memAlloc(
+            varCount,
+            sizeof(*newBlockState.varStates)
+        );
+        if (newBlockState.varStates == NULL) {
+            slSetOutOfMemoryError(g->vm);
+            return;
+        }
+    }
+    VarState *varStates = newBlockState.varStates;
+    for (uint16_t i = 0; i < varCount; i++) {
+        varStates[i] = (VarState){
+            .reg = -1,
+            .usesLeft = node->as.block.uses[i],
+            .declared = false,
+            .pinned = false,
+            .func = { .frameSize = -1 }
+        };
+    }
 
-    // ReSharper disable once CppDFALocalValueEscapesFunction
     g->func->block = &newBlockState;
 
+    // The arguments are stored in the first registers of the frame
+    if (paramCount != 0) {
+        int16_t first = allocRegs(g, idx, paramCount);
+        if (first < 0) goto cleanup;
+        assert(first == 0);
+        for (uint16_t i = 0; i < paramCount; i++) {
+            varStates[i].reg = (int16_t)i;
+            varStates[i].declared = true;
+        }
+    }
     if (funcCount != 0) {
+        int16_t first = allocRegs(g, idx, funcCount);
+        if (first < 0) goto cleanup;
+        for (uint16_t i = 0; i < funcCount; i++) {
+            varStates[i].reg = (int16_t)(first + i);
+            varStates[i].declared = true;
+            varStates[i].pinned = true;
+        }
         emitOp(g, SlOp_ln);
-        emitRegRel(g, 0);
-        emitRegRel(g, funcCount - 1);
+        emitReg(g, first);
+        emitReg(g, (int16_t)(first + funcCount - 1));
     }
     slMapForeach(node->as.block.vars, SlStrMapBucket, var, i) {
-        if (i >= funcCount) goto break_foreach;
-        int32_t shrIdx = ((int32_t)var->value >> 16) - 1;
-        if (shrIdx == -1) continue;
-        emitOp(g, SlOp_mks);
-        emitRegRel(g, (uint16_t)shrIdx + varCount);
-        emitRegRel(g, (uint16_t)i);
+        if (!varStates[i].declared) continue;
+        if (slVarByValue(var->value) || slVarShrIdx(var->value) >= 0) {
+            varStates[i].pinned = true;
+        }
+    }
+    for (uint16_t i = 0; i < paramCount; i++) {
+        if (varStates[i].usesLeft != 0 || varStates[i].pinned) continue;
+        freeRegs(g, varStates[i].reg, 1);
+        varStates[i].reg = -1;
     }
-break_foreach:
 
     for (uint32_t i = 0; i < node->as.block.nodeCount; i++) {
-        if (!genStmnt(g, node->as.block.nodes[i])) return;
+        if (!genStmnt(g, node->as.block.nodes[i])) goto cleanup;
     }
 
-    if (sharedCount != 0) {
+    // Close the slots that closures opened on the registers of the variables
+    slMapForeach(node->as.block.vars, SlStrMapBucket, var, i) {
+        if (varStates[i].reg < 0 || slVarShrIdx(var->value) < 0) continue;
         emitOp(g, SlOp_dts);
-        emitRegRel(g, varCount);
-        emitRegRel(g, varCount + sharedCount - 1);
+        emitReg(g, varStates[i].reg);
+        emitReg(g, varStates[i].reg);
+    }
+
+cleanup:
+    for (uint16_t i = 0; i < varCount; i++) {
+        if (varStates[i].reg >= 0) freeRegs(g, varStates[i].reg, 1);
     }
-    releaseSlots(g, baseReg);
+    memFree(varStates);
     g->func->block = newBlockState.parent;
 }
 
 static void genVarDeclr(GenState *g, SlNodeIdx idx) {
     SlNode *node = getNode(g, idx);
-    uint32_t *varInfo = slStrMapGet(
-        g->func->block->vars,
-        node->as.varDeclr.name
-    );
+    BlockState *block = g->func->block;
+    uint32_t *varInfo = slStrMapGet(block->vars, node->as.varDeclr.name);
     assert(varInfo != NULL);
 
-    uint16_t slotIdx = *varInfo & 0xff;
-    int16_t shrIdx = (int16_t)((*varInfo >> 16) - 1);
+    uint16_t varIdx = slVarIdx(*varInfo);
+    VarState *var = &block->varStates[varIdx];
 
-    int16_t oldOutReg = setOutRegRel(g, (int16_t)slotIdx);
+    // Functions and captured variables that are declared again keep their
+    // register, other variables take the register of their value
+    setOutRegAbs(g, var->pinned ? var->reg : -1);
 
+    KnownFunc func = { .frameSize = -1 };
+    bool isInt = knownInt(g, node->as.varDeclr.value);
     SlNode *value = getNode(g, node->as.varDeclr.value);
     if (value->kind == SlNode_Lambda) {
-        genLambda(g, node->as.varDeclr.value, node->as.varDeclr.name);
-        if (g->vm->error.occurred) return;
+        const SlPrototype *proto = genLambda(
+            g,
+            node->as.varDeclr.value,
+            node->as.varDeclr.name
+        );
+        if (proto == NULL) return;
+        func.frameSize = proto->frameSize;
+        func.paramCount = value->as.lambda.paramCount;
     } else {
+        func = knownFunc(g, node->as.varDeclr.value);
         if (!genExpr(g, node->as.varDeclr.value)) return;
     }
-
-    g->outReg = oldOutReg;
-    if (shrIdx >= 0) {
-        emitOp(g, SlOp_mks);
-        emitRegRel(g, g->func->block->baseShr + shrIdx);
-        emitRegRel(g, slotIdx);
+    // There are no branches, the variable holds the function until it is
+    // declared again
+    var->func = func;
+    var->isInt = isInt;
+
+    if (var->pinned) {
+        assert(g->outReg == var->reg);
+    } else if (g->outOwned) {
+        if (var->reg >= 0) freeRegs(g, var->reg, 1);
+        var->reg = g->outReg;
+    } else {
+        // The value is in the register of a variable that is still used
+        if (var->reg < 0) {
+            var->reg = allocRegs(g, idx, 1);
+            if (var->reg < 0) return;
+        }
+        emitOp(g, SlOp_cpy);
+        emitReg(g, var->reg);
+        emitReg(g, g->outReg);
+    }
+    setOutRegAbs(g, -1);
+    // Closures capture the register of the variable
+    if (slVarByValue(*varInfo) || slVarShrIdx(*varInfo) >= 0) {
+        var->pinned = true;
+    }
+    var->declared = true;
+    if (!var->pinned && var->usesLeft == 0) {
+        freeRegs(g, var->reg, 1);
+        var->reg = -1;
     }
 }
 
 static void genPrint(GenState *g, SlNodeIdx idx) {
     if (!genExpr(g, getNode(g, idx)->as.print)) return;
     emitOp(g, SlOp_print);
-    emitRegAbs(g, g->outReg);
+    emitReg(g, g->outReg);
+    releaseOutReg(g);
 }
 
 static void genRetStmnt(GenState *g, SlNodeIdx idx) {
-    if (!genExpr(g, getNode(g, idx)->as.print)) return;
+    SlNodeIdx value = getNode(g, idx)->as.retStmnt;
+    if (value == -1) {
+        if (!useOutRegNew(g, idx)) return;
+        emitOp(g, SlOp_ln);
+        emitReg(g, g->outReg);
+        emitReg(g, g->outReg);
+    } else if (!genExpr(g, value)) {
+        return;
+    }
     emitOp(g, SlOp_ret);
-    emitRegAbs(g, g->outReg);
+    emitReg(g, g->outReg);
+    releaseOutReg(g);
 }
 
 static SlObj genProtoObj(GenState *g, SlNodeIdx idx, SlStrIdx name) {
@@ -395,16 +740,23 @@ static SlObj genProtoObj(GenState *g, SlNodeIdx idx, SlStrIdx name) {
 
     FuncState newTop = {
         .parent = g->func,
-        .externalVars = { .userData = g->ast.strs }
+        .externalVars = { .userData = g->ast.strs },
+        .paramCount = g->ast.nodes[idx].as.lambda.paramCount
     };
 
-    // ReSharper disable once CppDFALocalValueEscapesFunction
     g->func = &newTop;
 
     SlNodeIdx body = g->ast.nodes[idx].as.lambda.body;
     assert(g->ast.nodes[body].kind == SlNode_Block);
 
-    if (!genStmnt(g, body)) return slNull;
+    bool ok = genStmnt(g, body);
+    if (ok && g->optLevel >= SlOpt_Fold) {
+        optimizeBytecode(g, NULL, 0);
+        ok = !g->vm->error.occurred;
+    }
+    slU8Clear(&newTop.regs);
+    g->func = newTop.parent;
+    if (!ok) return slNull;
 
     SlSharedInfo *sharedInfo = memAllocZeroed(
         newTop.externalVars.len,
@@ -419,11 +771,11 @@ static SlObj genProtoObj(GenState *g, SlNodeIdx idx, SlStrIdx name) {
         uint16_t i = var->value & 0x7fff;
         sharedInfo[i] = (SlSharedInfo){
             .fromShared = var->value >> 31,
+            .byValue = (var->value >> 15) & 1,
             .idx = (var->value >> 16) & 0x7fff
         };
     }
 
-    g->func = newTop.parent;
     return slPrototypeNew(
         g->vm,
         newTop.bytecode.data,
@@ -433,10 +785,346 @@ static SlObj genProtoObj(GenState *g, SlNodeIdx idx, SlStrIdx name) {
         sharedInfo,
         newTop.externalVars.len,
         newTop.maxStackSize,
+        newTop.paramCount,
+        NULL
+    );
+}
+
+static SlObj genProtoFromIr(GenState *g, const SlIrFunc *ir) {
+    // Functions have no branches yet
+    assert(ir->blocks.len == 1);
+    const SlI32Arr *insts = &ir->blocks.data[0].insts;
+
+    FuncState newTop = {
+        .parent = g->func,
+        .externalVars = { .userData = g->ast.strs },
+        .paramCount = ir->paramCount
+    };
+    IrValueState *values = memAlloc(ir->insts.len + 1, sizeof(*values));
+    if (values == NULL) {
+        slSetOutOfMemoryError(g->vm);
+        return slNull;
+    }
+    for (uint32_t i = 0; i < ir->insts.len; i++) {
+        values[i] = (IrValueState){
+            .reg = -1,
+            .backing = -1,
+            .lastUse = -1,
+            .stored = false,
+            .func = { .frameSize = -1 }
+        };
+    }
+    for (uint32_t pos = 0; pos < insts->len; pos++) {
+        const SlIrInst *inst = &ir->insts.data[insts->data[pos]];
+        const SlIrValue *args = slIrArgs(ir, inst);
+        for (uint32_t k = 0; k < inst->argCount; k++) {
+            values[args[k]].lastUse = (int32_t)pos;
+        }
+        if (inst->op == SlIr_StoreShared) values[args[0]].stored = true;
+    }
+    // A slot that is never stored to refers to the register of its value,
+    // which then lives until the slot is detached
+    for (uint32_t pos = 0; pos < insts->len; pos++) {
+        const SlIrInst *inst = &ir->insts.data[insts->data[pos]];
+        if (inst->op != SlIr_Detach) continue;
+        const SlIrValue *args = slIrArgs(ir, inst);
+        for (uint32_t k = 0; k < inst->argCount; k++) {
+            if (values[args[k]].stored) continue;
+            const SlIrInst *makeShared = &ir->insts.data[args[k]];
+            values[slIrArgs(ir, makeShared)[0]].lastUse = (int32_t)pos;
+        }
+    }
+
+    g->func = &newTop;
+    int16_t outReg = g->outReg;
+    if (ir->paramCount != 0 && allocRegs(g, 0, ir->paramCount) < 0) {
+        goto cleanup;
+    }
+    for (uint32_t pos = 0; pos < insts->len; pos++) {
+        const SlIrInst *inst = &ir->insts.data[insts->data[pos]];
+        if (inst->op != SlIr_Param) continue;
+        IrValueState *param = &values[insts->data[pos]];
+        param->reg = (int16_t)inst->as.idx;
+        if (param->lastUse < 0) freeRegs(g, param->reg, 1);
+    }
+    for (uint32_t pos = 0; pos < insts->len; pos++) {
+        genIrInst(g, ir, insts->data[pos], pos, values);
+        if (g->vm->error.occurred) break;
+    }
+    if (!g->vm->error.occurred) optimizeBytecode(g, NULL, 0);
+
+cleanup:
+    memFree(values);
+    slU8Clear(&newTop.regs);
+    g->func = newTop.parent;
+    setOutRegAbs(g, outReg);
+
+    SlSharedInfo *sharedInfo = NULL;
+    if (!g->vm->error.occurred && ir->sharedCount != 0) {
+        // Filled by the closure instruction of the enclosing function
+        sharedInfo = memAllocZeroed(ir->sharedCount, sizeof(*sharedInfo));
+        if (sharedInfo == NULL) slSetOutOfMemoryError(g->vm);
+    }
+    if (g->vm->error.occurred) {
+        for (uint32_t i = 0; i < newTop.consts.len; i++) {
+            slDelRef(newTop.consts.data[i]);
+        }
+        constsClear(&newTop.consts);
+        slU8Clear(&newTop.bytecode);
+        return slNull;
+    }
+
+    return slPrototypeNew(
+        g->vm,
+        newTop.bytecode.data,
+        newTop.bytecode.len,
+        newTop.consts.data,
+        newTop.consts.len,
+        sharedInfo,
+        ir->sharedCount,
+        newTop.maxStackSize,
+        ir->paramCount,
         NULL
     );
 }
 
+static void genIrInst(
+    GenState *g,
+    const SlIrFunc *ir,
+    SlIrValue value,
+    uint32_t pos,
+    IrValueState *values
+) {
+    const SlIrInst *inst = &ir->insts.data[value];
+    const SlIrValue *args = slIrArgs(ir, inst);
+    IrValueState *dst = &values[value];
+    IrValueState *src = inst->argCount != 0 ? &values[args[0]] : NULL;
+
+    if (inst->op == SlIr_Call) {
+        genIrCall(g, ir, value, pos, values);
+        return;
+    }
+
+    // A slot is opened on the register it refers to by the closures that
+    // capture it. If it is stored to nothing else may write the register, the
+    // value is copied unless the slot is its last use.
+    if (inst->op == SlIr_MakeShared) {
+        if (!dst->stored) {
+            dst->backing = src->reg;
+        } else if (src->lastUse == (int32_t)pos) {
+            dst->backing = src->reg;
+            src->reg = -1;
+        } else {
+            dst->backing = allocRegs(g, inst->node, 1);
+            if (dst->backing < 0) return;
+            emitOp(g, SlOp_cpy);
+            emitReg(g, dst->backing);
+            emitReg(g, src->reg);
+        }
+    }
+
+    // The operands are read before the result is written so the result can
+    // be stored in the register of one of them, except for closures that
+    // read the slots when they are made
+    bool hasResult = inst->op != SlIr_Param
+                  && inst->op != SlIr_External
+                  && inst->op != SlIr_MakeShared
+                  && inst->op != SlIr_StoreShared
+                  && inst->op != SlIr_Detach
+                  && inst->op != SlIr_Print
+                  && inst->op != SlIr_Ret;
+    if (hasResult && inst->op == SlIr_Closure) {
+        dst->reg = allocRegs(g, inst->node, 1);
+        if (dst->reg < 0) return;
+    }
+    freeIrOperands(g, ir, inst, pos, values);
+    if (hasResult && dst->reg < 0) {
+        dst->reg = allocRegs(g, inst->node, 1);
+        if (dst->reg < 0) return;
+    }
+    setOutRegAbs(g, dst->reg);
+
+    switch (inst->op) {
+    case SlIr_Nop:
+    case SlIr_Param:
+    case SlIr_External:
+    case SlIr_MakeShared:
+        break;
+    case SlIr_Null:
+        emitOp(g, SlOp_ln);
+        emitReg(g, g->outReg);
+        emitReg(g, g->outReg);
+        break;
+    case SlIr_Int:
+        if (inst->as.numInt > -128 && inst->as.numInt < 127) {
+            emitOp(g, SlOp_li8);
+            emitReg(g, g->outReg);
+            emitI8(g, (int8_t)inst->as.numInt);
+        } else {
+            int32_t constIdx = addConst(
+                g,
+                inst->node,
+                slObjInt(inst->as.numInt)
+            );
+            if (constIdx < 0) return;
+            emitKOp(g, SlOp_lkb, constIdx);
+        }
+        break;
+    case SlIr_LoadShared:
+        emitOp(g, SlOp_ls);
+        emitReg(g, g->outReg);
+        emitReg(g, (int16_t)inst->as.idx);
+        break;
+    case SlIr_StoreShared:
+        emitCopy(
+            g,
+            src->backing,
+            values[args[1]].reg,
+            values[args[1]].lastUse == (int32_t)pos
+        );
+        break;
+    case SlIr_Detach:
+        for (uint32_t k = 0; k < inst->argCount; k++) {
+            IrValueState *slot = &values[args[k]];
+            emitOp(g, SlOp_dts);
+            emitReg(g, slot->backing);
+            emitReg(g, slot->backing);
+            if (slot->stored) {
+                freeRegs(g, slot->backing, 1);
+                continue;
+            }
+            // Several slots can refer to the same value
+            const SlIrInst *makeShared = &ir->insts.data[args[k]];
+            IrValueState *slotSrc = &values[slIrArgs(ir, makeShared)[0]];
+            if (slotSrc->lastUse == (int32_t)pos && slotSrc->reg >= 0) {
+                freeRegs(g, slotSrc->reg, 1);
+                slotSrc->reg = -1;
+            }
+        }
+        break;
+    case SlIr_Closure: {
+        const SlIrFunc *child = ir->children.data[inst->as.idx];
+        SlObj proto = genProtoFromIr(g, child);
+        if (proto.type == SlObj_Null) return;
+        for (uint32_t k = 0; k < inst->argCount; k++) {
+            const SlIrInst *arg = &ir->insts.data[args[k]];
+            SlSharedInfo *info = &proto.as.proto->sharedInfo[k];
+            if (arg->op == SlIr_External) {
+                *info = (SlSharedInfo){
+                    .fromShared = true,
+                    .idx = (uint16_t)arg->as.idx
+                };
+            } else if (arg->op == SlIr_MakeShared) {
+                *info = (SlSharedInfo){
+                    .idx = (uint16_t)values[args[k]].backing
+                };
+            } else {
+                *info = (SlSharedInfo){
+                    .byValue = true,
+                    .idx = (uint16_t)values[args[k]].reg
+                };
+            }
+        }
+        dst->func = (KnownFunc){
+            .frameSize = proto.as.proto->frameSize,
+            .paramCount = child->paramCount
+        };
+        SlOpCode op;
+        int32_t constIdx = addFuncConst(g, inst->node, proto, &op);
+        if (constIdx < 0) return;
+        emitKOp(g, op, constIdx);
+        break;
+    }
+    case SlIr_Copy:
+        emitCopy(g, g->outReg, src->reg, src->lastUse == (int32_t)pos);
+        break;
+    case SlIr_Add:
+    case SlIr_Sub:
+    case SlIr_Mul:
+    case SlIr_Div:
+    case SlIr_Mod:
+    case SlIr_Pow:
+        emitArith(
+            g,
+            SlOp_add + (inst->op - SlIr_Add),
+            ir->insts.data[args[0]].type == SlIrType_Int
+                && ir->insts.data[args[1]].type == SlIrType_Int,
+            g->outReg,
+            values[args[0]].reg,
+            values[args[1]].reg
+        );
+        break;
+    case SlIr_Call:
+        assert(false && "unreachable");
+        break;
+    case SlIr_Print:
+        emitOp(g, SlOp_print);
+        emitReg(g, src->reg);
+        break;
+    case SlIr_Ret:
+        emitOp(g, SlOp_ret);
+        emitReg(g, src->reg);
+        break;
+    case SlIr_Phi:
+        assert(false && "unreachable");
+        break;
+    }
+
+    if (hasResult && dst->lastUse < 0) freeRegs(g, dst->reg, 1);
+}
+
+static void genIrCall(
+    GenState *g,
+    const SlIrFunc *ir,
+    SlIrValue value,
+    uint32_t pos,
+    IrValueState *values
+) {
+    const SlIrInst *inst = &ir->insts.data[value];
+    const SlIrValue *args = slIrArgs(ir, inst);
+    uint16_t count = (uint16_t)inst->argCount;
+
+    // The function and the arguments must be in consecutive registers, the
+    // result is written to the first one
+    int16_t first = allocRegs(g, inst->node, count);
+    if (first < 0) return;
+    for (uint16_t k = 0; k < count; k++) {
+        // The last copy of an operand that dies here moves it
+        bool move = values[args[k]].lastUse == (int32_t)pos;
+        for (uint16_t j = k + 1; j < count; j++) {
+            move = move && args[j] != args[k];
+        }
+        emitCopy(g, (int16_t)(first + k), values[args[k]].reg, move);
+    }
+    KnownFunc callee = values[args[0]].func;
+    freeIrOperands(g, ir, inst, pos, values);
+    emitCall(g, first, count - 1, callee);
+
+    if (count > 1) freeRegs(g, (int16_t)(first + 1), count - 1);
+    values[value].reg = first;
+    if (values[value].lastUse < 0) freeRegs(g, first, 1);
+}
+
+static void freeIrOperands(
+    const GenState *g,
+    const SlIrFunc *ir,
+    const SlIrInst *inst,
+    uint32_t pos,
+    const IrValueState *values
+) {
+    const SlIrValue *args = slIrArgs(ir, inst);
+    for (uint32_t k = 0; k < inst->argCount; k++) {
+        const IrValueState *arg = &values[args[k]];
+        if (arg->lastUse != (int32_t)pos || arg->reg < 0) continue;
+        // Operands can appear more than once
+        bool seen = false;
+        for (uint32_t j = 0; j < k; j++) {
+            seen = seen || args[j] == args[k];
+        }
+        if (!seen) freeRegs(g, arg->reg, 1);
+    }
+}
+
 static bool genExpr(GenState *g, SlNodeIdx idx) {
     if (g->vm->error.occurred) return false;
     SlNode *node = getNode(g, idx);
@@ -453,6 +1141,9 @@ static bool genExpr(GenState *g, SlNodeIdx idx) {
     case SlNode_Lambda:
         genLambda(g, idx, (SlStrIdx){ 0 });
         break;
+    case SlNode_Call:
+        genCall(g, idx);
+        break;
     case SlNode_INVALID:
     case SlNode_Block:
     case SlNode_VarDeclr:
@@ -464,54 +1155,113 @@ static bool genExpr(GenState *g, SlNodeIdx idx) {
     return !g->vm->error.occurred;
 }
 
-static void genLambda(GenState *g, SlNodeIdx idx, SlStrIdx name) {
+static const SlPrototype *genLambda(
+    GenState *g,
+    SlNodeIdx idx,
+    SlStrIdx name
+) {
+    // The statements of the function change the output register
+    int16_t outReg = g->outReg;
     SlObj lambda = genProtoObj(g, idx, name);
-    if (lambda.type == SlObj_Null) return;
-    int32_t constIdx = addConst(g, idx, lambda);
-    if (constIdx < 0) {
-        slDelRef(lambda);
-        return;
-    }
-    if (!useOutRegNew(g, idx)) return;
-    emitKOp(g, SlOp_mkfb, constIdx);
+    setOutRegAbs(g, outReg);
+    if (lambda.type == SlObj_Null) return NULL;
+    // The constants keep the prototype alive
+    const SlPrototype *proto = lambda.as.proto;
+    SlOpCode op;
+    int32_t constIdx = addFuncConst(g, idx, lambda, &op);
+    if (constIdx < 0) return NULL;
+    if (!useOutRegNew(g, idx)) return NULL;
+    emitKOp(g, op, constIdx);
+    return proto;
 }
 
 static void genBinOp(GenState *g, SlNodeIdx idx) {
-    uint16_t top = getSlot(g);
     int16_t dst = setOutRegAbs(g, -1);
     SlNode *node = getNode(g, idx);
+    // Like the peephole pass the Int instructions are not used by SlOpt_None
+    bool intOperands = g->optLevel >= SlOpt_Fold
+        && knownInt(g, node->as.binOp.lhs)
+        && knownInt(g, node->as.binOp.rhs);
     if (!genExpr(g, node->as.binOp.lhs)) return;
-    int16_t lhs = setOutRegAbs(g, -1);
+    int16_t lhs = g->outReg;
+    bool lhsOwned = g->outOwned;
+
+    // A variable read by the lhs from its own register is still read after
+    // the rhs, so the rhs cannot release it: its last access becomes the
+    // instruction that reads both operands
+    VarState *lhsVar = NULL;
+    SlNode *lhsNode = getNode(g, node->as.binOp.lhs);
+    if (!lhsOwned && lhsNode->kind == SlNode_Access) {
+        lhsVar = findLocalVar(g, lhsNode->as.access);
+    }
+    if (lhsVar != NULL) lhsVar->usesLeft++;
+    setOutRegAbs(g, -1);
     if (!genExpr(g, node->as.binOp.rhs)) return;
-    int16_t rhs = setOutRegAbs(g, dst);
+    int16_t rhs = g->outReg;
+    bool rhsOwned = g->outOwned;
+    if (lhsVar != NULL && --lhsVar->usesLeft == 0 && !lhsVar->pinned) {
+        lhsVar->reg = -1;
+        lhsOwned = true;
+    }
 
+    // The operands are read before the result is written so the result can
+    // be stored in the register of one of them
+    if (lhsOwned) freeRegs(g, lhs, 1);
+    if (rhsOwned) freeRegs(g, rhs, 1);
+    setOutRegAbs(g, dst);
+    if (!useOutRegNew(g, idx)) return;
+
+    SlOpCode op = SlOp_add;
     switch (node->as.binOp.op) {
     case SlBinOp_Add:
-        emitOp(g, SlOp_add);
+        op = SlOp_add;
         break;
     case SlBinOp_Sub:
-        emitOp(g, SlOp_sub);
+        op = SlOp_sub;
         break;
     case SlBinOp_Mul:
-        emitOp(g, SlOp_mul);
+        op = SlOp_mul;
         break;
     case SlBinOp_Div:
-        emitOp(g, SlOp_div);
+        op = SlOp_div;
         break;
     case SlBinOp_Mod:
-        emitOp(g, SlOp_mod);
+        op = SlOp_mod;
         break;
     case SlBinOp_Pow:
-        emitOp(g, SlOp_pow);
+        op = SlOp_pow;
         break;
     }
-    releaseSlots(g, top);
-    g->outReg = dst;
-    if (!useOutRegNew(g, idx)) return;
+    emitArith(g, op, intOperands, g->outReg, lhs, rhs);
+}
 
-    emitRegAbs(g, g->outReg);
-    emitRegAbs(g, lhs);
-    emitRegAbs(g, rhs);
+static void genCall(GenState *g, SlNodeIdx idx) {
+    int16_t dst = setOutRegAbs(g, -1);
+    SlNode *node = getNode(g, idx);
+    uint16_t argCount = node->as.call.argCount;
+
+    // The function and the arguments are evaluated directly into the
+    // registers the call reads
+    KnownFunc callee = knownFunc(g, node->as.call.callee);
+    int16_t first = allocRegs(g, idx, argCount + 1);
+    if (first < 0) return;
+    setOutRegAbs(g, first);
+    if (!genExpr(g, node->as.call.callee)) return;
+    for (uint16_t i = 0; i < argCount; i++) {
+        setOutRegAbs(g, (int16_t)(first + 1 + i));
+        if (!genExpr(g, getNode(g, idx)->as.call.args[i])) return;
+    }
+    emitCall(g, first, argCount, callee);
+    if (argCount != 0) freeRegs(g, (int16_t)(first + 1), argCount);
+
+    if (dst < 0) {
+        setOutRegAbs(g, first);
+        g->outOwned = true;
+        return;
+    }
+    emitCopy(g, dst, first, true);
+    freeRegs(g, first, 1);
+    setOutRegAbs(g, dst);
 }
 
 static void genNumInt(GenState *g, SlNodeIdx idx) {
@@ -519,7 +1269,7 @@ static void genNumInt(GenState *g, SlNodeIdx idx) {
     if (!useOutRegNew(g, idx)) return;
     if (num > -128 && num < 127) {
         emitOp(g, SlOp_li8);
-        emitRegAbs(g, g->outReg);
+        emitReg(g, g->outReg);
         emitI8(g, (int8_t)num);
     } else {
         int32_t constIdx = addConst(g, idx, slObjInt(num));
@@ -528,23 +1278,104 @@ static void genNumInt(GenState *g, SlNodeIdx idx) {
     }
 }
 
+static VarState *findLocalVar(const GenState *g, SlStrIdx name) {
+    // Same lookup as findVar, variables of other functions are not included
+    for (BlockState *block = g->func->block; block; block = block->parent) {
+        uint32_t *info = slStrMapGet(block->vars, name);
+        if (info == NULL) continue;
+        VarState *var = &block->varStates[slVarIdx(*info)];
+        if (var->declared) return var;
+    }
+    return NULL;
+}
+
+static KnownFunc knownFunc(const GenState *g, SlNodeIdx idx) {
+    const SlNode *node = getNode(g, idx);
+    if (node->kind != SlNode_Access) return (KnownFunc){ .frameSize = -1 };
+    // Variables of other functions are not known
+    const VarState *var = findLocalVar(g, node->as.access);
+    if (var == NULL) return (KnownFunc){ .frameSize = -1 };
+    return var->func;
+}
+
+static bool knownInt(const GenState *g, SlNodeIdx idx) {
+    const SlNode *node = getNode(g, idx);
+    switch (node->kind) {
+    case SlNode_NumInt:
+        return true;
+    case SlNode_BinOp:
+        // Int division can give a Float and the other operations are not
+        // specialized
+        return (node->as.binOp.op == SlBinOp_Add
+                || node->as.binOp.op == SlBinOp_Sub
+                || node->as.binOp.op == SlBinOp_Mul)
+            && knownInt(g, node->as.binOp.lhs)
+            && knownInt(g, node->as.binOp.rhs);
+    case SlNode_Access: {
+        // Variables of other functions are not known
+        const VarState *var = findLocalVar(g, node->as.access);
+        return var != NULL && var->isInt;
+    }
+    default:
+        return false;
+    }
+}
+
+static void emitArith(
+    GenState *g,
+    SlOpCode op,
+    bool intOperands,
+    int16_t dst,
+    int16_t lhs,
+    int16_t rhs
+) {
+    g->arithCount++;
+    if (intOperands && op >= SlOp_add && op <= SlOp_mul) {
+        op = SlOp_addi + (op - SlOp_add);
+        g->intArithCount++;
+    }
+    emitOp(g, op);
+    emitReg(g, dst);
+    emitReg(g, lhs);
+    emitReg(g, rhs);
+}
+
+// Find the register of a variable. Variables of other functions are added to
+// the shared values of `f`, `*outIdx` is then an index in them.
+// If `capture` is true the variable is captured by a closure and
+// `*outByValue` tells if the closure gets a copy of it.
+// `*outVar` is set for local variables that are not captured and is NULL
+// otherwise.
 static bool findVar(
     SlVM *vm,
     FuncState *f,
     SlStrIdx name,
+    bool capture,
     int16_t *outIdx,
-    bool *outFromShared
+    bool *outFromShared,
+    bool *outByValue,
+    VarState **outVar
 ) {
     assert(f != NULL);
     uint32_t *info = NULL;
+    *outVar = NULL;
+    *outByValue = false;
 
-    // First check the local variables
+    // First check the local variables, a variable declared with `var` is
+    // visible only after its declaration
     BlockState *block = f->block;
     while (block != NULL) {
         info = slStrMapGet(block->vars, name);
-        if (info != NULL) {
-            *outIdx = (int16_t)((*info & 0xff) + block->baseReg);
+        VarState *var = info ? &block->varStates[slVarIdx(*info)] : NULL;
+        if (var != NULL && var->declared) {
             *outFromShared = false;
+            *outIdx = var->reg;
+            if (capture) {
+                assert(slVarByValue(*info) || slVarShrIdx(*info) >= 0);
+                *outByValue = slVarByValue(*info);
+            } else {
+                *outVar = var;
+            }
             return true;
         }
         block = block->parent;
@@ -555,40 +1386,409 @@ static bool findVar(
     // Then check the shared values
     info = slStrMapGet(&f->externalVars, name);
     if (info != NULL) {
-        *outIdx = (int16_t)(*info & 0xff);
+        *outIdx = (int16_t)(*info & 0x7fff);
         return true;
     }
 
     // Otherwise get the variable from the parent function and add it to the
     // shared values
     int16_t idx;
-    bool fromShared;
-    if (!findVar(vm, f->parent, name, &idx, &fromShared)) return false;
+    bool fromShared, byValue;
+    VarState *var;
+    if (!findVar(
+        vm,
+        f->parent,
+        name,
+        true,
+        &idx,
+        &fromShared,
+        &byValue,
+        &var
+    )) {
+        return false;
+    }
 
     *outIdx = (int16_t)f->externalVars.len;
-    uint32_t externalValue = (fromShared << 31) | (idx << 16) | (*outIdx);
+    uint32_t externalValue = (uint32_t)fromShared << 31
+                           | (uint32_t)idx << 16
+                           | (uint32_t)byValue << 15
+                           | (uint32_t)*outIdx;
     return slStrMapSet(vm, &f->externalVars, name, externalValue);
 }
 
 static void genAccess(GenState *g, SlNodeIdx idx) {
-    bool fromShared;
+    bool fromShared, byValue;
     int16_t varSlot;
+    VarState *var;
 
     SlStrIdx name = getNode(g, idx)->as.access;
-    if (!findVar(g->vm, g->func, name, &varSlot, &fromShared)) return;
+    if (!findVar(
+        g->vm,
+        g->func,
+        name,
+        false,
+        &varSlot,
+        &fromShared,
+        &byValue,
+        &var
+    )) {
+        return;
+    }
 
     if (fromShared) {
         if (!useOutRegNew(g, idx)) return;
         emitOp(g, SlOp_ls);
-        emitRegAbs(g, g->outReg);
-        emitRegAbs(g, varSlot);
-    } else if (g->outReg >= 0) {
-        emitOp(g, SlOp_cpy);
-        emitRegAbs(g, g->outReg);
-        emitRegAbs(g, varSlot);
+        emitReg(g, g->outReg);
+        emitReg(g, varSlot);
+        return;
+    }
+
+    assert(varSlot >= 0);
+    // After the last access the register of the variable is given to the
+    // instruction that reads it, no other read of it is pending then (see
+    // genBinOp) so a copy can move the value
+    bool lastUse = --var->usesLeft == 0 && !var->pinned;
+    if (lastUse) var->reg = -1;
+
+    if (g->outReg >= 0) {
+        emitCopy(g, g->outReg, varSlot, lastUse);
+        if (lastUse && g->outReg != varSlot) freeRegs(g, varSlot, 1);
     } else {
         g->outReg = varSlot;
+        g->outOwned = lastUse;
+    }
+}
+
+// PEEPHOLE OPTIMIZATION
+
+/*
+The bytecode of a function is decoded into a list of instructions that is
+rewritten until no rule applies and then encoded again. Jump displacements are
+relative to the end of the jump instruction, while the list is rewritten they
+are replaced by the index of the target so that instructions can be removed or
+change size. No rule makes the code longer, so a displacement that fits before
+the rewrite still fits after it.
+*/
+
+static bool isJump(uint8_t op) {
+    return op >= SlOp_jmp && op <= SlOp_jne;
+}
+
+static int32_t decodeOperand(const uint8_t *bytecode, uint32_t *i, char fmt) {
+    int32_t value;
+    switch (fmt) {
+    case 'r':
+        value = bytecode[(*i)++];
+        if (value < 0x80) return value;
+        return (((value & 0x7f) << 8) | bytecode[(*i)++]) + 0x80;
+    case 'b':
+        return bytecode[(*i)++];
+    case 'B':
+        return (int8_t)bytecode[(*i)++];
+    case 's':
+    case 'S':
+        value = (bytecode[*i] << 8) | bytecode[*i + 1];
+        *i += 2;
+        return fmt == 'S' ? (int16_t)value : value;
+    case 'i':
+    case 'I':
+        value = (bytecode[*i] << 16) | (bytecode[*i + 1] << 8)
+              | bytecode[*i + 2];
+        *i += 3;
+        // Sign extend the 24-bit value
+        if (fmt == 'I' && value >= 0x800000) value -= 0x1000000;
+        return value;
+    default:
+        assert(false && "unknown operand format");
+        return 0;
+    }
+}
+
+static void emitOperand(const GenState *g, char fmt, int32_t value) {
+    switch (fmt) {
+    case 'r':
+        emitReg(g, (int16_t)value);
+        break;
+    case 'b':
+    case 'B':
+        emitU8(g, (uint8_t)value);
+        break;
+    case 's':
+    case 'S':
+        emitU16(g, (uint16_t)value);
+        break;
+    case 'i':
+    case 'I':
+        emitU24(g, value & 0xffffff);
+        break;
+    default:
+        assert(false && "unknown operand format");
+    }
+}
+
+static uint32_t instSize(const PeepInst *inst) {
+    uint32_t size = 1;
+    const char *fmt = opInfos[inst->op].fmt;
+    for (uint32_t k = 0; fmt[k] != '\0'; k++) {
+        if (fmt[k] == 'r') {
+            size += inst->operands[k] < 0x80 ? 1 : 2;
+        } else if (fmt[k] == 's' || fmt[k] == 'S') {
+            size += 2;
+        } else if (fmt[k] == 'i' || fmt[k] == 'I') {
+            size += 3;
+        } else {
+            size += 1;
+        }
+    }
+    return size;
+}
+
+static uint32_t nextLive(const PeepInst *insts, uint32_t count, uint32_t i) {
+    while (i < count && insts[i].removed) i++;
+    return i;
+}
+
+static bool overwrites(const PeepInst *inst, int32_t reg) {
+    const int32_t *o = inst->operands;
+    switch (inst->op) {
+    case SlOp_ln:
+        return reg >= o[0] && reg <= o[1];
+    case SlOp_li8:
+    case SlOp_lkb:
+    case SlOp_lks:
+    case SlOp_lki:
+    case SlOp_ls:
+        return o[0] == reg;
+    case SlOp_cpy:
+    case SlOp_mov:
+        return o[0] == reg && o[1] != reg;
+    case SlOp_add:
+    case SlOp_sub:
+    case SlOp_mul:
+    case SlOp_div:
+    case SlOp_mod:
+    case SlOp_pow:
+    case SlOp_addi:
+    case SlOp_subi:
+    case SlOp_muli:
+        return o[0] == reg && o[1] != reg && o[2] != reg;
+    default:
+        return false;
+    }
+}
+
+static bool writesFirstOperand(uint8_t op) {
+    switch (op) {
+    case SlOp_li8:
+    case SlOp_lkb:
+    case SlOp_lks:
+    case SlOp_lki:
+    case SlOp_cpy:
+    case SlOp_mov:
+    case SlOp_ls:
+    case SlOp_add:
+    case SlOp_sub:
+    case SlOp_mul:
+    case SlOp_div:
+    case SlOp_mod:
+    case SlOp_pow:
+    case SlOp_addi:
+    case SlOp_subi:
+    case SlOp_muli:
+    case SlOp_mkfb:
+    case SlOp_mkfs:
+    case SlOp_mkfi:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool rewriteInsts(PeepInst *insts, uint32_t count) {
+    bool changed = false;
+
+    for (uint32_t i = 0; i < count; i++) insts[i].isTarget = false;
+    for (uint32_t i = 0; i < count; i++) {
+        PeepInst *inst = &insts[i];
+        if (inst->removed || !isJump(inst->op)) continue;
+        uint32_t last = (uint32_t)strlen(opInfos[inst->op].fmt) - 1;
+        uint32_t target = nextLive(insts, count, inst->operands[last]);
+        // Jumps to jumps go to the final target
+        for (uint32_t hops = 0; hops < count; hops++) {
+            if (target == count || insts[target].op != SlOp_jmp) break;
+            uint32_t next = nextLive(insts, count, insts[target].operands[0]);
+            uint32_t from = inst->offset;
+            uint32_t to = next < count ? insts[next].offset : UINT32_MAX;
+            if (next == count || next == target) break;
+            if ((from > to ? from - to : to - from) >= 0x800000) break;
+            target = next;
+        }
+        if ((uint32_t)inst->operands[last] != target) {
+            inst->operands[last] = (int32_t)target;
+            changed = true;
+        }
+        if (target < count) insts[target].isTarget = true;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        PeepInst *inst = &insts[i];
+        if (inst->removed) continue;
+        uint32_t nextIdx = nextLive(insts, count, i + 1);
+        PeepInst *next = nextIdx < count ? &insts[nextIdx] : NULL;
+        int32_t *o = inst->operands;
+
+        bool remove = inst->op == SlOp_nop
+            || ((inst->op == SlOp_cpy || inst->op == SlOp_mov) && o[0] == o[1])
+            || (inst->op == SlOp_jmp && (uint32_t)o[0] == nextIdx)
+            // The copy or null is overwritten before it is read
+            || (inst->op == SlOp_cpy && next != NULL && overwrites(next, o[0]))
+            || (inst->op == SlOp_ln
+                && o[0] == o[1]
+                && next != NULL
+                && overwrites(next, o[0]));
+        if (remove) {
+            inst->removed = true;
+            changed = true;
+            continue;
+        }
+        if (next == NULL || next->isTarget) continue;
+
+        if (inst->op == SlOp_ln
+            && next->op == SlOp_ln
+            && next->operands[0] <= o[1] + 1
+            && o[0] <= next->operands[1] + 1)
+        {
+            // Adjacent or overlapping ranges of nulls
+            if (next->operands[0] < o[0]) o[0] = next->operands[0];
+            if (next->operands[1] > o[1]) o[1] = next->operands[1];
+            next->removed = true;
+            changed = true;
+        } else if (inst->op == SlOp_cpy
+                   && next->op == SlOp_cpy
+                   && next->operands[0] == o[1]
+                   && next->operands[1] == o[0])
+        {
+            // Copy back of a value that was just copied
+            next->removed = true;
+            changed = true;
+        } else if (writesFirstOperand(inst->op)
+                   && next->op == SlOp_mov
+                   && next->operands[1] == o[0]
+                   && next->operands[0] != o[0])
+        {
+            // A value computed only to be moved is computed in place
+            o[0] = next->operands[0];
+            next->removed = true;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+bool slOptimizeBytecode(
+    SlVM *vm,
+    SlU8Arr *bytecode,
+    SlLineInfo *lineInfo,
+    uint32_t lineInfoCount
+) {
+    FuncState func = { .bytecode = *bytecode };
+    GenState g = { .vm = vm, .func = &func };
+    optimizeBytecode(&g, lineInfo, lineInfoCount);
+    *bytecode = func.bytecode;
+    return !vm->error.occurred;
+}
+
+static void optimizeBytecode(
+    GenState *g,
+    SlLineInfo *lineInfo,
+    uint32_t lineInfoCount
+) {
+    SlU8Arr *bytecode = &g->func->bytecode;
+    if (bytecode->len == 0) return;
+    // Each instruction takes at least a byte
+    PeepInst *insts = memAlloc(bytecode->len, sizeof(*insts));
+    uint32_t *newOffsets = memAlloc(bytecode->len + 1, sizeof(*newOffsets));
+    if (insts == NULL || newOffsets == NULL) {
+        slSetOutOfMemoryError(g->vm);
+        goto cleanup;
+    }
+
+    uint32_t count = 0;
+    uint32_t i = 0;
+    while (i < bytecode->len) {
+        PeepInst *inst = &insts[count++];
+        inst->offset = i;
+        inst->op = bytecode->data[i++];
+        inst->removed = false;
+        assert(opInfos[inst->op].name != NULL);
+        const char *fmt = opInfos[inst->op].fmt;
+        for (uint32_t k = 0; fmt[k] != '\0'; k++) {
+            inst->operands[k] = decodeOperand(bytecode->data, &i, fmt[k]);
+        }
+        if (isJump(inst->op)) {
+            // Stored as the offset of the target until every instruction is
+            // decoded
+            uint32_t last = (uint32_t)strlen(fmt) - 1;
+            inst->operands[last] += (int32_t)i;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        PeepInst *inst = &insts[i];
+        if (!isJump(inst->op)) continue;
+        uint32_t last = (uint32_t)strlen(opInfos[inst->op].fmt) - 1;
+        uint32_t target = 0;
+        while (target < count
+               && insts[target].offset < (uint32_t)inst->operands[last])
+        {
+            target++;
+        }
+        assert(target == count
+               || insts[target].offset == (uint32_t)inst->operands[last]);
+        inst->operands[last] = (int32_t)target;
+    }
+
+    while (rewriteInsts(insts, count)) { }
+
+    uint32_t offset = 0;
+    for (i = 0; i < count; i++) {
+        newOffsets[i] = offset;
+        if (!insts[i].removed) offset += instSize(&insts[i]);
+    }
+    newOffsets[count] = offset;
+
+    // Ranges of lines start and end at instructions
+    for (uint32_t k = 0; k < lineInfoCount; k++) {
+        size_t start = lineInfo[k].start;
+        size_t end = start + lineInfo[k].len;
+        uint32_t first = 0;
+        while (first < count && insts[first].offset < start) first++;
+        uint32_t last = first;
+        while (last < count && insts[last].offset < end) last++;
+        lineInfo[k].start = newOffsets[first];
+        lineInfo[k].len = newOffsets[last] - newOffsets[first];
+    }
+
+    SlU8Arr old = *bytecode;
+    *bytecode = (SlU8Arr){ 0 };
+    for (i = 0; i < count; i++) {
+        const PeepInst *inst = &insts[i];
+        if (inst->removed) continue;
+        const char *fmt = opInfos[inst->op].fmt;
+        emitOp(g, inst->op);
+        for (uint32_t k = 0; fmt[k] != '\0'; k++) {
+            int32_t value = inst->operands[k];
+            if (isJump(inst->op) && fmt[k + 1] == '\0') {
+                int32_t end = (int32_t)(newOffsets[i] + instSize(inst));
+                value = (int32_t)newOffsets[value] - end;
+            }
+            emitOperand(g, fmt[k], value);
+        }
     }
+    slU8Clear(&old);
+
+cleanup:
+    memFree(insts);
+    memFree(newOffsets);
 }
 
 // BYTECODE PRINTING
@@ -597,182 +1797,15 @@ static void printBytecode(const uint8_t *bytecode, uint32_t len) {
     uint32_t i = 0;
     while (i < len) {
         uint8_t op = bytecode[i++];
-        const char *fmt;
-        switch (op) {
-        case SlOp_nop:
-            printf("\tnop");
-            fmt = "";
-            break;
-        case SlOp_ln:
-            printf("\tln");
-            fmt = "rr";
-            break;
-        case SlOp_li8:
-            printf("\tli8");
-            fmt = "rB";
-            break;
-        case SlOp_lkb:
-            printf("\tlkb");
-            fmt = "rb";
-            break;
-        case SlOp_lks:
-            printf("\tlks");
-            fmt = "rs";
-            break;
-        case SlOp_lki:
-            printf("\tlki");
-            fmt = "ri";
-            break;
-        case SlOp_cpy:
-            printf("\tcpy");
-            fmt = "rr";
-            break;
-        case SlOp_ls:
-            printf("\tls");
-            fmt = "rr";
-            break;
-        case SlOp_sts:
-            printf("\tsts");
-            fmt = "rr";
-            break;
-        case SlOp_mks:
-            printf("\tmks");
-            fmt = "rr";
-            break;
-        case SlOp_dts:
-            printf("\tdts");
-            fmt = "rr";
-            break;
-        case SlOp_add:
-            printf("\tadd");
-            fmt = "rrr";
-            break;
-        case SlOp_sub:
-            printf("\tsub");
-            fmt = "rrr";
-            break;
-        case SlOp_mul:
-            printf("\tmul");
-            fmt = "rrr";
-            break;
-        case SlOp_div:
-            printf("\tdiv");
-            fmt = "rrr";
-            break;
-        case SlOp_mod:
-            printf("\tmod");
-            fmt = "rrr";
-            break;
-        case SlOp_pow:
-            printf("\tpow");
-            fmt = "rrr";
-            break;
-        case SlOp_print:
-            printf("\tprint");
-            fmt = "r";
-            break;
-        case SlOp_mkfb:
-            printf("\tmkfb");
-            fmt = "rb";
-            break;
-        case SlOp_mkfs:
-            printf("\tmkfs");
-            fmt = "rs";
-            break;
-        case SlOp_mkfi:
-            printf("\tmkfi");
-            fmt = "ri";
-            break;
-        case SlOp_call:
-            printf("\tcall");
-            fmt = "rr";
-            break;
-        case SlOp_tcall:
-            printf("\ttcall");
-            fmt = "rr";
-            break;
-        case SlOp_ret:
-            printf("\tret");
-            fmt = "r";
-            break;
-        case SlOp_jmp:
-            printf("\tjmp");
-            fmt = "I";
-            break;
-        case SlOp_jtr:
-            printf("\tjtr");
-            fmt = "rI";
-            break;
-        case SlOp_jfl:
-            printf("\tjfl");
-            fmt = "rI";
-            break;
-        case SlOp_jlt:
-            printf("\tjlt");
-            fmt = "rrI";
-            break;
-        case SlOp_jle:
-            printf("\tjle");
-            fmt = "rrI";
-            break;
-        case SlOp_jeq:
-            printf("\tjeq");
-            fmt = "rrI";
-            break;
-        case SlOp_jne:
-            printf("\tjne");
-            fmt = "rrI";
-            break;
-        default:
-            printf("ERROR unknown op %d", op);
+        if (op >= sizeof(opInfos) / sizeof(*opInfos)
+            || opInfos[op].name == NULL)
+        {
+            printf("ERROR unknown op %d\n", op);
             return;
         }
-
-        while (*fmt) {
-            switch (*fmt) {
-            case 'r': {
-                uint8_t b0 = bytecode[i++];
-                if (b0 < 0x80) {
-                    printf("\t%u", b0);
-                    break;
-                }
-                uint8_t b1 = bytecode[i++];
-                printf("\t%u", ((b0 & 0x7f) << 8) + b1 + 0x80);
-                break;
-            }
-            case 'b':
-                printf("\t%u", bytecode[i++]);
-                break;
-            case 'B':
-                printf("\t%i", bytecode[i++]);
-                break;
-            case 's':
-                printf("\t%u", (bytecode[i] << 8) + bytecode[i + 1]);
-                i += 2;
-                break;
-            case 'S':
-                printf("\t%d", (bytecode[i] << 8) + bytecode[i + 1]);
-                i += 2;
-                break;
-            case 'i':
-                printf(
-                    "\t%u",
-                    (bytecode[i] << 16) + (bytecode[i + 1] << 8) + bytecode[i + 2]
-                );
-                i += 3;
-                break;
-            case 'I':
-                printf(
-                   "\t%d",
-                   (bytecode[i] << 16) + (bytecode[i + 1] << 8) + bytecode[i + 2]
-                );
-                i += 3;
-                break;
-            default:
-                printf("Bad format: '%s'", fmt);
-                return;
-            }
-            fmt++;
+        printf("\t%s", opInfos[op].name);
+        for (const char *fmt = opInfos[op].fmt; *fmt; fmt++) {
+            printf("\t%d", decodeOperand(bytecode, &i, *fmt));
         }
         printf("\n");
     }
@@ -786,8 +1819,22 @@ void printPrototype(SlObj main) {
     for (uint32_t i = 0; i < toPrint.len; i++) {
         assert(toPrint.data[i].type == SlObj_Prototype);
         SlPrototype *proto = toPrint.data[i].as.proto;
-        printf("<%p> bytecode:\n", (void *)proto);
+        printf(
+            "<%p> bytecode (frame size %"PRIu16"):\n",
+            (void *)proto,
+            proto->frameSize
+        );
         printBytecode(proto->bytes, proto->size);
+        if (proto->sharedCount != 0) printf("----shared:\n");
+        for (uint16_t j = 0; j < proto->sharedCount; j++) {
+            SlSharedInfo info = proto->sharedInfo[j];
+            printf(
+                "\t[%"PRIu16"] %s %"PRIu16"\n",
+                j,
+                info.fromShared ? "shared" : info.byValue ? "copy" : "slot",
+                info.idx
+            );
+        }
         if (proto->constCount == 0) continue;
         printf("----constants:\n");
         for (uint32_t j = 0; j < proto->constCount; j++) {
@@ -801,6 +1848,14 @@ void printPrototype(SlObj main) {
                 printf(" <%p>", (void *)obj.as.proto);
                 if (!constsPush(&dummy, &toPrint, obj)) return;
                 break;
+            case SlObj_Func:
+                printf(" <%p>", (void *)obj.as.func->proto);
+                obj = (SlObj){
+                    .type = SlObj_Prototype,
+                    .as.proto = obj.as.func->proto
+                };
+                if (!constsPush(&dummy, &toPrint, obj)) return;
+                break;
             default:
                 break;
             }
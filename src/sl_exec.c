@@ -1,14 +1,20 @@
+#include <stdio.h>
+#include <assert.h>
+
 #include "sl_builtin.h"
 #include "sl_codegen.h"
 #include "sl_exec.h"
+#include "sl_str.h"
 #include "clib_mem.h"
 
 #define _blockMinCapacity 512 // 8 KiB blocks
+#define _maxCallDepth 100000
 
-// Add `count` slots to the stack and return a pointer to the first.
+// Add `count` slots to the stack and return a pointer to the first, the slots
+// are empty.
 static SlObj *pushSlots(SlVM *vm, uint16_t count);
 // Remove `count` slots from the stack. Each call must undo a previous
-// `slPushSlots` call with the same number of slots.
+// `slPushSlots` call with the same number of slots. The slots must be empty.
 static void popSlots(SlVM *vm, uint16_t count);
 
 // Add a stack frame to the call stack.
@@ -18,19 +24,61 @@ static SlCallFrame *topFrame(SlVM *vm);
 // Remove a frame from the call stack.
 static void popFrame(SlVM *vm);
 
-static bool callFunc(SlVM *vm, SlObj func, SlObj *retAddress);
+// Start running `func`, its result is stored in `*retAddress` when it returns.
+// The arguments are moved from `args` to the first registers of the function.
+// If an error occurs return false.
+static bool callFunc(
+    SlVM *vm,
+    SlObj func,
+    SlObj *args,
+    uint16_t argCount,
+    SlObj *retAddress
+);
+// Same as callFunc but `func` is not checked, it must be a function that
+// takes `argCount` arguments and needs `frameSize` registers.
+static bool enterFunc(
+    SlVM *vm,
+    SlFunc *func,
+    uint16_t frameSize,
+    SlObj *args,
+    uint16_t argCount,
+    SlObj *retAddress
+);
+// Close the shared slots opened on the registers of the running function,
+// release the registers and move `retVal` to its return address.
+static void retFunc(SlVM *vm, SlObj retVal);
 static bool exeFunc(SlVM *vm);
+// Set the shared slots of a new closure of the running function.
+// If an error occurs return false.
+static bool captureSlots(SlVM *vm, SlFunc *func);
+// Make a closed shared slot holding a new reference to `value`.
+// If an error occurs return NULL.
+static SlSharedSlot *newSlot(SlVM *vm, SlObj value);
+
 static inline uint16_t decodeReg(SlVM *vm);
-static inline uint32_t decodeU32(SlVM *vm);
+static inline uint16_t decodeU16(SlVM *vm);
+static inline uint32_t decodeU24(SlVM *vm);
 // Set the value of a stack slot, a reference is taken from obj
 static inline void setSlot(SlVM *vm, uint16_t reg, SlObj obj);
 
 SlObj slRun(SlVM *vm, SlObj mainFunc) {
     SlObj res = slNull;
-    callFunc(vm, mainFunc, &res);
-
-    exeFunc(vm);
+    SlObj func = mainFunc.type == SlObj_Prototype
+        ? slFuncNew(vm, mainFunc)
+        : slNewRef(mainFunc);
+    if (vm->error.occurred) {
+        return slNull;
+    }
 
+    uint64_t initialSize = vm->callStack.totalUsed;
+    if (callFunc(vm, func, NULL, 0, &res)) {
+        exeFunc(vm);
+    }
+    slDelRef(func);
+    // Unwind the frames left by an error
+    while (vm->callStack.totalUsed > initialSize) {
+        retFunc(vm, slNull);
+    }
     return res;
 }
 
@@ -40,14 +88,12 @@ static SlObj *pushSlots(SlVM *vm, uint16_t count) {
     SlStackBlock *top = vm->stackTop;
     if (top == NULL || top->cap - top->used < count) {
         uint16_t newCap = count > _blockMinCapacity ? count : _blockMinCapacity;
-        top = memAllocZeroedBytes(
-            sizeof(*top) + (newCap - 1) * sizeof(*top->slots)
-        );
+        top = memAllocBytes(sizeof(*top) + newCap * sizeof(*top->slots));
         if (top == NULL) {
             slSetOutOfMemoryError(vm);
             return NULL;
         }
-        top->prev = top;
+        top->prev = vm->stackTop;
         top->cap = newCap;
         top->used = 0;
         vm->stackTop = top;
@@ -64,41 +110,36 @@ static SlObj *pushSlots(SlVM *vm, uint16_t count) {
 static void popSlots(SlVM *vm, uint16_t count) {
     assert(count != 0);
     assert(vm->stackTop != NULL);
-    if (vm->stackTop->used == 0) {
-        SlStackBlock *block = vm->stackTop;
-        vm->stackTop = block->prev;
-        memFree(block);
+    SlStackBlock *top = vm->stackTop;
+    assert(top->used >= count);
+    top->used -= count;
+    if (top->used == 0) {
+        vm->stackTop = top->prev;
+        memFree(top);
     }
-    assert(vm->stackTop->used >= count);
-    vm->stackTop->used -= count;
 }
 
 static SlCallFrame *pushFrame(SlVM *vm) {
-    vm->callStack.totalUsed++;
     SlCallStackBlock *top = vm->callStack.top;
-    if (top != NULL && top->used < slCallStackCap) {
-        return &top->frames[top->used++];
-    }
-    SlCallStackBlock *block = memAlloc(1, sizeof(*block));
-    if (block == NULL) {
-        slSetOutOfMemoryError(vm);
-        return NULL;
+    if (top == NULL || top->used == slCallStackCap) {
+        SlCallStackBlock *block = memAlloc(1, sizeof(*block));
+        if (block == NULL) {
+            slSetOutOfMemoryError(vm);
+            return NULL;
+        }
+        block->prev = top;
+        block->used = 0;
+        vm->callStack.top = top = block;
     }
-    block->prev = top;
-    vm->callStack.top = block;
-    block->used = 1;
-    return &block->frames[0];
+    vm->callStack.totalUsed++;
+    return &top->frames[top->used++];
 }
 
 static SlCallFrame *topFrame(SlVM *vm) {
     assert(vm->callStack.top != NULL);
     assert(vm->callStack.totalUsed > 0);
     SlCallStackBlock *top = vm->callStack.top;
-    if (top->used > 0) {
-        return &top->frames[top->used - 1];
-    } else {
-        return &top->prev->frames[top->prev->used - 1];
-    }
+    return &top->frames[top->used - 1];
 }
 
 static void popFrame(SlVM *vm) {
@@ -106,104 +147,299 @@ static void popFrame(SlVM *vm) {
     assert(vm->callStack.totalUsed > 0);
     vm->callStack.totalUsed--;
     SlCallStackBlock *top = vm->callStack.top;
-    if (top->used > 0) {
-        top->used--;
-    } else {
+    if (--top->used == 0) {
         vm->callStack.top = top->prev;
-        vm->callStack.top->used--;
         memFree(top);
     }
 }
 
-static bool callFunc(SlVM *vm, SlObj func, SlObj *retAddress) {
-    SlCallFrame *frame = pushFrame(vm);
-    if (frame == NULL) {
+static bool callFunc(
+    SlVM *vm,
+    SlObj func,
+    SlObj *args,
+    uint16_t argCount,
+    SlObj *retAddress
+) {
+    if ((func.type & 0xff) != SlObj_Func) {
+        slSetError(vm, "%s cannot be called", slTypeName(func));
         return false;
     }
+    SlPrototype *proto = func.as.func->proto;
+    if (argCount != proto->paramCount) {
+        slSetError(
+            vm,
+            "expected %u arguments, got %u",
+            (unsigned)proto->paramCount,
+            (unsigned)argCount
+        );
+        return false;
+    }
+    return enterFunc(
+        vm,
+        func.as.func,
+        proto->frameSize,
+        args,
+        argCount,
+        retAddress
+    );
+}
 
-    if ((func.type & 0xff) != SlObj_Func) {
-        slSetError(vm, "only functions can be called");
+static bool enterFunc(
+    SlVM *vm,
+    SlFunc *func,
+    uint16_t frameSize,
+    SlObj *args,
+    uint16_t argCount,
+    SlObj *retAddress
+) {
+    assert(func->proto->paramCount == argCount);
+    assert(func->proto->frameSize == frameSize);
+    if (vm->callStack.totalUsed >= _maxCallDepth) {
+        slSetError(vm, "stack overflow");
+        return false;
+    }
+
+    SlObj *stackPtr = NULL;
+    if (frameSize != 0) {
+        stackPtr = pushSlots(vm, frameSize);
+        if (stackPtr == NULL) {
+            return false;
+        }
+    }
+    SlCallFrame *frame = pushFrame(vm);
+    if (frame == NULL) {
+        if (stackPtr != NULL) {
+            popSlots(vm, frameSize);
+        }
         return false;
     }
 
+    for (uint16_t i = 0; i < argCount; i++) {
+        stackPtr[i] = args[i];
+        args[i].type = SlObj_Empty;
+    }
     frame->pc = vm->pc;
-    frame->func = func.as.func;
+    frame->func = slNewRef(
+        (SlObj){ .type = SlObj_Func, .as.func = func }
+    ).as.func;
+    frame->stackPtr = stackPtr;
     frame->retAddress = retAddress;
-    vm->bytecode = func.as.func->bytecode;
-    vm->sharedSlots = func.as.func->sharedSlots;
+    vm->bytecode = func->proto;
+    vm->stackPtr = stackPtr;
     vm->pc = 0;
-    vm->stackPtr = pushSlots(vm, vm->bytecode->frameSize);
     return true;
 }
 
+static void retFunc(SlVM *vm, SlObj retVal) {
+    SlCallFrame *frame = topFrame(vm);
+    uint16_t frameSize = vm->bytecode->frameSize;
+    if (frameSize != 0) {
+        slCloseSharedSlots(vm, 0, frameSize - 1);
+        for (uint16_t i = 0; i < frameSize; i++) {
+            slDelRef(vm->stackPtr[i]);
+            vm->stackPtr[i].type = SlObj_Empty;
+        }
+        popSlots(vm, frameSize);
+    }
+
+    SlObj *retAddress = frame->retAddress;
+    SlFunc *func = frame->func;
+    vm->pc = frame->pc;
+    popFrame(vm);
+    if (vm->callStack.totalUsed != 0) {
+        frame = topFrame(vm);
+        vm->bytecode = frame->func->proto;
+        vm->stackPtr = frame->stackPtr;
+    } else {
+        vm->bytecode = NULL;
+        vm->stackPtr = NULL;
+    }
+
+    // The return address can hold the function itself
+    slDelRef(*retAddress);
+    *retAddress = retVal;
+    slDelRef((SlObj){ .type = SlObj_Func, .as.func = func });
+}
+
 static bool exeFunc(SlVM *vm) {
     assert(vm->callStack.totalUsed > 0);
     uint64_t initialSize = vm->callStack.totalUsed;
 
     while (vm->callStack.totalUsed >= initialSize) {
-        assert(vm->pc < vm->bytecode->size);
+        // Functions that reach the end return null
+        if (vm->pc == vm->bytecode->size) {
+            retFunc(vm, slNull);
+            continue;
+        }
         uint8_t op = vm->bytecode->bytes[vm->pc++];
         switch (op) {
         case SlOp_nop:
             break;
-        case SlOp_ldnull:
-            setSlot(vm, decodeReg(vm), slNull);
+        case SlOp_ln: {
+            uint16_t from = decodeReg(vm);
+            uint16_t to = decodeReg(vm);
+            for (uint32_t i = from; i <= to; i++) {
+                setSlot(vm, (uint16_t)i, slNull);
+            }
             break;
-        case SlOp_ldi8: {
-            uint16_t dest = decodeReg(vm);
+        }
+        case SlOp_li8: {
+            uint16_t dst = decodeReg(vm);
             SlObj num = slObjInt((int8_t)vm->bytecode->bytes[vm->pc++]);
-            setSlot(vm, dest, num);
+            setSlot(vm, dst, num);
+            break;
+        }
+        case SlOp_lkb:
+        case SlOp_lks:
+        case SlOp_lki: {
+            uint16_t dst = decodeReg(vm);
+            uint32_t idx = op == SlOp_lkb ? vm->bytecode->bytes[vm->pc++]
+                : op == SlOp_lks ? decodeU16(vm)
+                : decodeU24(vm);
+            setSlot(vm, dst, slNewRef(vm->bytecode->constants[idx]));
             break;
         }
         case SlOp_cpy: {
-            uint16_t dest, src;
-            dest = decodeReg(vm);
-            src = decodeReg(vm);
-            setSlot(vm, dest, slNewRef(vm->stackPtr[src]));
-        }
-        case SlOp_add: {
-            uint16_t dest, lhs, rhs;
-            dest = decodeReg(vm);
-            lhs = decodeReg(vm);
-            rhs = decodeReg(vm);
-            setSlot(vm, dest, slAdd(vm, vm->stackPtr[lhs], vm->stackPtr[rhs]));
-            goto maybeError;
+            uint16_t dst = decodeReg(vm);
+            uint16_t src = decodeReg(vm);
+            setSlot(vm, dst, slNewRef(vm->stackPtr[src]));
+            break;
         }
-        case SlOp_mul: {
-            uint16_t dest, lhs, rhs;
-            dest = decodeReg(vm);
-            lhs = decodeReg(vm);
-            rhs = decodeReg(vm);
-            setSlot(vm, dest, slMul(vm, vm->stackPtr[lhs], vm->stackPtr[rhs]));
-            goto maybeError;
+        case SlOp_mov: {
+            uint16_t dst = decodeReg(vm);
+            uint16_t src = decodeReg(vm);
+            // The reference of the source is taken
+            SlObj obj = vm->stackPtr[src];
+            vm->stackPtr[src].type = SlObj_Empty;
+            setSlot(vm, dst, obj);
+            break;
+        }
+        case SlOp_ls: {
+            uint16_t dst = decodeReg(vm);
+            SlSharedSlot *slot = topFrame(vm)->func->sharedSlots[decodeReg(vm)];
+            setSlot(vm, dst, slNewRef(*slot->location));
+            break;
+        }
+        case SlOp_sts: {
+            SlSharedSlot *slot = topFrame(vm)->func->sharedSlots[decodeReg(vm)];
+            SlObj value = slNewRef(vm->stackPtr[decodeReg(vm)]);
+            SlObj prev = *slot->location;
+            *slot->location = value;
+            slDelRef(prev);
+            break;
+        }
+        case SlOp_dts: {
+            uint16_t from = decodeReg(vm);
+            uint16_t to = decodeReg(vm);
+            slCloseSharedSlots(vm, from, to);
+            break;
         }
+        case SlOp_add:
         case SlOp_sub:
+        case SlOp_mul:
         case SlOp_div:
         case SlOp_mod:
         case SlOp_pow: {
-            slSetError(vm, "TODO: implement opcode");
+            static SlObj (*const funcs[])(SlVM *, SlObj, SlObj) = {
+                slAdd, slSub, slMul, slDiv, slMod, slPow
+            };
+            uint16_t dst = decodeReg(vm);
+            SlObj lhs = vm->stackPtr[decodeReg(vm)];
+            SlObj rhs = vm->stackPtr[decodeReg(vm)];
+            setSlot(vm, dst, funcs[op - SlOp_add](vm, lhs, rhs));
             goto maybeError;
         }
+        // The operands are Ints, the result wraps around like in slAdd
+        case SlOp_addi: {
+            uint16_t dst = decodeReg(vm);
+            uint64_t lhs = (uint64_t)vm->stackPtr[decodeReg(vm)].as.numInt;
+            uint64_t rhs = (uint64_t)vm->stackPtr[decodeReg(vm)].as.numInt;
+            setSlot(vm, dst, slObjInt((SlInt)(lhs + rhs)));
+            break;
+        }
+        case SlOp_subi: {
+            uint16_t dst = decodeReg(vm);
+            uint64_t lhs = (uint64_t)vm->stackPtr[decodeReg(vm)].as.numInt;
+            uint64_t rhs = (uint64_t)vm->stackPtr[decodeReg(vm)].as.numInt;
+            setSlot(vm, dst, slObjInt((SlInt)(lhs - rhs)));
+            break;
+        }
+        case SlOp_muli: {
+            uint16_t dst = decodeReg(vm);
+            uint64_t lhs = (uint64_t)vm->stackPtr[decodeReg(vm)].as.numInt;
+            uint64_t rhs = (uint64_t)vm->stackPtr[decodeReg(vm)].as.numInt;
+            setSlot(vm, dst, slObjInt((SlInt)(lhs * rhs)));
+            break;
+        }
         case SlOp_print: {
             SlObj str = slToStr(vm, vm->stackPtr[decodeReg(vm)]);
-            if ((str.type & 0xff) != SlObj_Str) {
+            if (!slObjIsStr(str)) {
+                goto maybeError;
+            }
+            if (!slStrFlatten(vm, str)) {
+                slDelRef(str);
                 goto maybeError;
             }
-            printf("%.*s\n", (int)str.as.str->len, (char *)str.as.str->bytes);
+            printf("%.*s\n", (int)slStrLen(&str), (char *)slStrBytes(&str));
             slDelRef(str);
             break;
         }
+        case SlOp_mkfb:
+        case SlOp_mkfs:
+        case SlOp_mkfi: {
+            uint16_t dst = decodeReg(vm);
+            uint32_t idx = op == SlOp_mkfb ? vm->bytecode->bytes[vm->pc++]
+                : op == SlOp_mkfs ? decodeU16(vm)
+                : decodeU24(vm);
+            SlObj func = slFuncNew(vm, vm->bytecode->constants[idx]);
+            if (func.type == SlObj_Null) {
+                goto maybeError;
+            }
+            if (!captureSlots(vm, func.as.func)) {
+                slDelRef(func);
+                goto maybeError;
+            }
+            setSlot(vm, dst, func);
+            break;
+        }
+        case SlOp_call: {
+            uint16_t func = decodeReg(vm);
+            uint16_t last = decodeReg(vm);
+            // The result replaces the function, the callee keeps its own
+            // reference to it while it runs
+            callFunc(
+                vm,
+                vm->stackPtr[func],
+                &vm->stackPtr[func + 1],
+                last - func,
+                &vm->stackPtr[func]
+            );
+            goto maybeError;
+        }
+        case SlOp_callk: {
+            uint16_t func = decodeReg(vm);
+            uint16_t last = decodeReg(vm);
+            uint16_t frameSize = decodeU16(vm);
+            // The code generator checked the function and its arguments
+            enterFunc(
+                vm,
+                vm->stackPtr[func].as.func,
+                frameSize,
+                &vm->stackPtr[func + 1],
+                last - func,
+                &vm->stackPtr[func]
+            );
+            goto maybeError;
+        }
         case SlOp_ret: {
-            SlObj retVal = slNewRef(vm->stackPtr[decodeReg(vm)]);
-            SlCallFrame *frame = topFrame(vm);
-            slDelRef(*frame->retAddress);
-            *frame->retAddress = retVal;
-            vm->pc = frame->pc;
-            popFrame(vm);
+            uint16_t src = decodeReg(vm);
+            SlObj retVal = vm->stackPtr[src];
+            vm->stackPtr[src].type = SlObj_Empty;
+            retFunc(vm, retVal);
             break;
         }
         default:
-            assert(false && "unreachable opcode");
+            slSetError(vm, "unsupported opcode %u", (unsigned)op);
             return false;
         }
 
@@ -216,6 +452,46 @@ static bool exeFunc(SlVM *vm) {
     return !vm->error.occurred;
 }
 
+static bool captureSlots(SlVM *vm, SlFunc *func) {
+    SlPrototype *proto = func->proto;
+    for (uint16_t i = 0; i < proto->sharedCount; i++) {
+        SlSharedInfo info = proto->sharedInfo[i];
+        if (info.byValue) {
+            func->sharedSlots[i] = newSlot(vm, vm->stackPtr[info.idx]);
+            if (func->sharedSlots[i] == NULL) {
+                return false;
+            }
+            continue;
+        }
+        if (info.fromShared) {
+            SlObj slot = {
+                .type = SlObj_SharedSlot,
+                .as.sharedSlot = topFrame(vm)->func->sharedSlots[info.idx]
+            };
+            func->sharedSlots[i] = slNewRef(slot).as.sharedSlot;
+            continue;
+        }
+        func->sharedSlots[i] = slOpenSharedSlot(vm, info.idx);
+        if (func->sharedSlots[i] == NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static SlSharedSlot *newSlot(SlVM *vm, SlObj value) {
+    SlSharedSlot *slot = memAllocBytes(sizeof(*slot));
+    if (slot == NULL) {
+        slSetOutOfMemoryError(vm);
+        return NULL;
+    }
+    slGCObjInit(&slot->asGCObj);
+    slot->value = slNewRef(value);
+    slot->location = &slot->value;
+    slot->nextOpen = NULL;
+    return slot;
+}
+
 static inline uint16_t decodeReg(SlVM *vm) {
     assert(vm->pc < vm->bytecode->size);
     uint8_t byte0 = vm->bytecode->bytes[vm->pc++];
@@ -224,19 +500,26 @@ static inline uint16_t decodeReg(SlVM *vm) {
     }
     assert(vm->pc < vm->bytecode->size);
     uint8_t byte1 = vm->bytecode->bytes[vm->pc++];
-    return (((byte0 & 0x7f) << 8) | byte1) + 0x7f;
+    return (uint16_t)((((byte0 & 0x7f) << 8) | byte1) + 0x80);
+}
+
+static inline uint16_t decodeU16(SlVM *vm) {
+    uint16_t val = (uint16_t)((vm->bytecode->bytes[vm->pc + 0] << 8)
+                 | (vm->bytecode->bytes[vm->pc + 1]));
+    vm->pc += 2;
+    return val;
 }
 
-static inline uint32_t decodeU32(SlVM *vm) {
-    uint32_t val = (vm->bytecode->bytes[vm->pc + 0] << 24)
-                 | (vm->bytecode->bytes[vm->pc + 1] << 16)
-                 | (vm->bytecode->bytes[vm->pc + 2] << 8)
-                 | (vm->bytecode->bytes[vm->pc + 3]);
-    vm->pc += 4;
+static inline uint32_t decodeU24(SlVM *vm) {
+    uint32_t val = ((uint32_t)vm->bytecode->bytes[vm->pc + 0] << 16)
+                 | ((uint32_t)vm->bytecode->bytes[vm->pc + 1] << 8)
+                 | ((uint32_t)vm->bytecode->bytes[vm->pc + 2]);
+    vm->pc += 3;
     return val;
 }
 
 static inline void setSlot(SlVM *vm, uint16_t reg, SlObj obj) {
-    slDelRef(vm->stackPtr[reg]);
+    SlObj prev = vm->stackPtr[reg];
     vm->stackPtr[reg] = obj;
+    slDelRef(prev);
 }
@@ -0,0 +1,1198 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sl_hashmap.h"
+#include "sl_ir.h"
+
+// Functions with at most this many instructions are inlined
+#define _maxInlineInsts 16
+
+slArrayImpl(SlIrInst, SlIrInsts, slIrInsts)
+slArrayImpl(SlIrBlock, SlIrBlocks, slIrBlocks)
+slArrayImpl(SlIrFunc *, SlIrFuncs, slIrFuncs)
+
+/*
+The builder keeps, for each variable of the blocks that are open, the value
+the variable holds and the shared slot it was last stored in. Declaring a
+variable again only changes the value it maps to.
+
+The language has no branches yet so every function is a single block and no
+phi nodes are built, the passes and the printer already handle them. There
+are no loops either, so there is nothing for loop-invariant code motion to
+move and the pass is not implemented.
+*/
+
+typedef struct BuildBlock {
+    struct BuildBlock *parent;
+    SlStrMap *vars;
+    SlIrValue *values; // value of each variable, -1 before its declaration
+    SlIrValue *slots; // shared slot of each variable, -1 if it has none
+} BuildBlock;
+
+typedef struct BuildFunc {
+    struct BuildFunc *parent;
+    SlIrFunc *ir;
+    BuildBlock *block;
+    SlStrMap externals; // value: index of the shared slot of the function
+    SlI32Arr captures; // slot of the parent function for each shared slot
+} BuildFunc;
+
+typedef struct BuildState {
+    SlVM *vm;
+    const SlAst *ast;
+    BuildFunc *func;
+} BuildState;
+
+// Add an instruction at the end of the last block of `f`.
+// If an error occurs return -1.
+static SlIrValue emit(
+    const BuildState *b,
+    BuildFunc *f,
+    SlIrOp op,
+    SlIrType type,
+    SlNodeIdx node,
+    const SlIrValue *args,
+    uint32_t argCount
+);
+static SlIrInst *instAt(const BuildFunc *f, SlIrValue value);
+// Add an instruction to `func` without adding it to a block, `inst.firstArg`
+// is ignored.
+// If an error occurs return -1.
+static SlIrValue appendInst(
+    SlVM *vm,
+    SlIrFunc *func,
+    SlIrInst inst,
+    const SlIrValue *args
+);
+
+// Build a function, `*outCaptures` is set to the slots of the enclosing
+// function that it captures.
+static SlIrFunc *buildFunc(
+    BuildState *b,
+    SlNodeIdx idx,
+    SlI32Arr *outCaptures
+);
+static bool buildStmnt(BuildState *b, SlNodeIdx idx);
+static bool buildBlock(BuildState *b, SlNodeIdx idx);
+static bool buildVarDeclr(BuildState *b, SlNodeIdx idx);
+static SlIrValue buildExpr(BuildState *b, SlNodeIdx idx);
+static SlIrValue buildAccess(BuildState *b, SlNodeIdx idx);
+static SlIrValue buildClosure(BuildState *b, SlNodeIdx idx);
+static SlIrValue buildCall(BuildState *b, SlNodeIdx idx);
+// Add a shared slot to `f` that captures the variable `name` of an enclosing
+// function.
+// If an error occurs return false.
+static bool addCapture(
+    BuildState *b,
+    BuildFunc *f,
+    SlStrIdx name,
+    SlNodeIdx node,
+    uint32_t *outIdx
+);
+// Get the value of `f` that holds the shared slot of the variable `name`.
+// If an error occurs return -1.
+static SlIrValue captureFrom(
+    BuildState *b,
+    BuildFunc *f,
+    SlStrIdx name,
+    SlNodeIdx node
+);
+
+static bool isNumeric(SlIrType type);
+static SlIrType binOpType(SlIrOp op, SlIrType lhs, SlIrType rhs);
+// Type of a value that has either type `t1` or type `t2`.
+static SlIrType joinTypes(SlIrType t1, SlIrType t2);
+static bool isBinOp(SlIrOp op);
+static bool definesValue(SlIrOp op);
+
+static void propagateCopies(SlIrFunc *func);
+// Replace calls of small functions created in `func` with their body.
+static bool inlineCalls(SlVM *vm, const SlAst *ast, SlIrFunc *func);
+// Get the function called by `call` if it can be inlined.
+// Return NULL if it cannot, `*outReason` is set if the function is known.
+static const SlIrFunc *inlineCandidate(
+    const SlIrFunc *func,
+    const SlIrInst *call,
+    const char **outReason
+);
+// Add the body of the function called by `call` to `insts`, `*outResult` is
+// set to the value it returns.
+static bool inlineCall(
+    SlVM *vm,
+    SlIrFunc *func,
+    SlIrValue call,
+    const SlIrFunc *callee,
+    SlI32Arr *insts,
+    SlIrValue *outResult
+);
+// Refine the types given by the builder now that the arguments of inlined
+// code and the results of calls of known functions are known.
+static void inferTypes(SlIrFunc *func);
+// Type of the values returned by `func`.
+static SlIrType returnType(const SlIrFunc *func);
+static bool numberValues(SlVM *vm, SlIrFunc *func);
+static bool removeDeadCode(SlVM *vm, SlIrFunc *func);
+// Replace each argument `a` with `repl[a]`.
+static void replaceArgs(SlIrFunc *func, const SlIrValue *repl);
+static bool sameInst(const SlIrFunc *func, SlIrValue v1, SlIrValue v2);
+static uint32_t hashInst(const SlIrFunc *func, SlIrValue value);
+
+static const char *opName(SlIrOp op);
+static const char *typeName(SlIrType type);
+
+SlIrFunc *slIrBuild(SlVM *vm, const SlAst *ast, SlNodeIdx lambda) {
+    BuildState b = {
+        .vm = vm,
+        .ast = ast,
+        .func = NULL
+    };
+    SlI32Arr captures = { 0 };
+    SlIrFunc *func = buildFunc(&b, lambda, &captures);
+    assert(captures.len == 0);
+    slI32Clear(&captures);
+    return func;
+}
+
+void slIrDestroy(SlIrFunc *func) {
+    if (func == NULL) return;
+    for (uint32_t i = 0; i < func->blocks.len; i++) {
+        slI32Clear(&func->blocks.data[i].insts);
+        slI32Clear(&func->blocks.data[i].preds);
+    }
+    for (uint32_t i = 0; i < func->children.len; i++) {
+        slIrDestroy(func->children.data[i]);
+    }
+    slIrInstsClear(&func->insts);
+    slI32Clear(&func->args);
+    slIrBlocksClear(&func->blocks);
+    slIrFuncsClear(&func->children);
+    memFree(func);
+}
+
+bool slIrOptimize(SlVM *vm, const SlAst *ast, SlIrFunc *func) {
+    // Nested functions are optimized first so that they are inlined in
+    // their final form
+    for (uint32_t i = 0; i < func->children.len; i++) {
+        if (!slIrOptimize(vm, ast, func->children.data[i])) return false;
+    }
+    propagateCopies(func);
+    if (!inlineCalls(vm, ast, func)) return false;
+    propagateCopies(func);
+    inferTypes(func);
+    if (!numberValues(vm, func)) return false;
+    return removeDeadCode(vm, func);
+}
+
+void slIrPrint(const SlIrFunc *func) {
+    printf(
+        "<%p> ir (params %"PRIu16", shared %"PRIu16"):\n",
+        (void *)func,
+        func->paramCount,
+        func->sharedCount
+    );
+    for (uint32_t i = 0; i < func->blocks.len; i++) {
+        const SlIrBlock *block = &func->blocks.data[i];
+        printf("block%"PRIu32":", i);
+        for (uint32_t j = 0; j < block->preds.len; j++) {
+            printf(" <- block%"PRIi32, block->preds.data[j]);
+        }
+        printf("\n");
+        for (uint32_t j = 0; j < block->insts.len; j++) {
+            SlIrValue value = block->insts.data[j];
+            const SlIrInst *inst = &func->insts.data[value];
+            printf("\t");
+            if (definesValue(inst->op)) {
+                printf("%%%"PRIi32" = ", value);
+            }
+            printf("%s", opName(inst->op));
+            switch (inst->op) {
+            case SlIr_Int:
+                printf(" %"PRIi64, inst->as.numInt);
+                break;
+            case SlIr_Param:
+            case SlIr_External:
+            case SlIr_LoadShared:
+                printf(" %"PRIu32, inst->as.idx);
+                break;
+            case SlIr_Closure:
+                printf(" <%p>", (void *)func->children.data[inst->as.idx]);
+                break;
+            default:
+                break;
+            }
+            const SlIrValue *args = slIrArgs(func, inst);
+            for (uint32_t k = 0; k < inst->argCount; k++) {
+                printf(" %%%"PRIi32, args[k]);
+            }
+            if (definesValue(inst->op)) {
+                printf(" : %s", typeName(inst->type));
+            }
+            printf("\n");
+        }
+    }
+    for (uint32_t i = 0; i < func->children.len; i++) {
+        slIrPrint(func->children.data[i]);
+    }
+}
+
+static SlIrValue emit(
+    const BuildState *b,
+    BuildFunc *f,
+    SlIrOp op,
+    SlIrType type,
+    SlNodeIdx node,
+    const SlIrValue *args,
+    uint32_t argCount
+) {
+    SlIrFunc *ir = f->ir;
+    SlIrInst inst = {
+        .op = op,
+        .type = type,
+        .node = node,
+        .block = ir->blocks.len - 1,
+        .argCount = argCount,
+        .as.numInt = 0
+    };
+    SlIrValue value = appendInst(b->vm, ir, inst, args);
+    if (value < 0) return -1;
+    SlIrBlock *block = &ir->blocks.data[inst.block];
+    if (!slI32Push(b->vm, &block->insts, value)) return -1;
+    return value;
+}
+
+static SlIrValue appendInst(
+    SlVM *vm,
+    SlIrFunc *func,
+    SlIrInst inst,
+    const SlIrValue *args
+) {
+    inst.firstArg = func->args.len;
+    for (uint32_t i = 0; i < inst.argCount; i++) {
+        assert(args[i] >= 0);
+        if (!slI32Push(vm, &func->args, args[i])) return -1;
+    }
+    if (!slIrInstsPush(vm, &func->insts, inst)) return -1;
+    return (SlIrValue)func->insts.len - 1;
+}
+
+static SlIrInst *instAt(const BuildFunc *f, SlIrValue value) {
+    assert(value >= 0 && (uint32_t)value < f->ir->insts.len);
+    return &f->ir->insts.data[value];
+}
+
+static SlIrFunc *buildFunc(
+    BuildState *b,
+    SlNodeIdx idx,
+    SlI32Arr *outCaptures
+) {
+    const SlNode *node = &b->ast->nodes[idx];
+    assert(node->kind == SlNode_Lambda);
+
+    SlIrFunc *ir = memAllocZeroed(1, sizeof(*ir));
+    if (ir == NULL) {
+        slSetOutOfMemoryError(b->vm);
+        return NULL;
+    }
+    ir->paramCount = node->as.lambda.paramCount;
+    if (!slIrBlocksPush(b->vm, &ir->blocks, (SlIrBlock){ 0 })) {
+        slIrDestroy(ir);
+        return NULL;
+    }
+
+    BuildFunc f = {
+        .parent = b->func,
+        .ir = ir,
+        .block = NULL,
+        .externals = { .userData = b->ast->strs },
+        .captures = { 0 }
+    };
+    b->func = &f;
+    bool ok = buildStmnt(b, node->as.lambda.body);
+    b->func = f.parent;
+    slStrMapClear(&f.externals);
+
+    if (!ok) {
+        slI32Clear(&f.captures);
+        slIrDestroy(ir);
+        return NULL;
+    }
+    ir->sharedCount = (uint16_t)f.captures.len;
+    *outCaptures = f.captures;
+    return ir;
+}
+
+static bool buildStmnt(BuildState *b, SlNodeIdx idx) {
+    const SlNode *node = &b->ast->nodes[idx];
+    SlIrValue value;
+    switch (node->kind) {
+    case SlNode_Block:
+        return buildBlock(b, idx);
+    case SlNode_VarDeclr:
+        return buildVarDeclr(b, idx);
+    case SlNode_Print:
+        value = buildExpr(b, node->as.print);
+        if (value < 0) return false;
+        return emit(b, b->func, SlIr_Print, SlIrType_Any, idx, &value, 1) >= 0;
+    case SlNode_RetStmnt:
+        if (node->as.retStmnt == -1) {
+            value = emit(b, b->func, SlIr_Null, SlIrType_Null, idx, NULL, 0);
+        } else {
+            value = buildExpr(b, node->as.retStmnt);
+        }
+        if (value < 0) return false;
+        return emit(b, b->func, SlIr_Ret, SlIrType_Any, idx, &value, 1) >= 0;
+    case SlNode_Call:
+        return buildExpr(b, idx) >= 0;
+    case SlNode_BinOp:
+    case SlNode_NumInt:
+    case SlNode_Access:
+    case SlNode_Lambda:
+    case SlNode_INVALID:
+        assert(false && "unreachable");
+        return false;
+    }
+    return false;
+}
+
+static bool buildBlock(BuildState *b, SlNodeIdx idx) {
+    const SlNode *node = &b->ast->nodes[idx];
+    BuildFunc *f = b->func;
+    uint32_t varCount = node->as.block.vars->len;
+    uint16_t funcCount = node->as.block.funcCount;
+    // The parameters are the variables of the outermost block of a function
+    uint16_t paramCount = f->block == NULL ? f->ir->paramCount : 0;
+
+    BuildBlock block = {
+        .parent = f->block,
+        .vars = node->as.block.vars,
+        .values = NULL,
+        .slots = NULL
+    };
+    if (varCount != 0) {
+        block.values = memAlloc(varCount * 2, sizeof(*block.values));
+        if (block.values == NULL) {
+            slSetOutOfMemoryError(b->vm);
+            return false;
+        }
+        block.slots = block.values + varCount;
+        for (uint32_t i = 0; i < varCount * 2; i++) {
+            block.values[i] = -1;
+        }
+    }
+    f->block = &block;
+    bool ok = false;
+    SlI32Arr slots = { 0 };
+
+    for (uint16_t i = 0; i < paramCount; i++) {
+        block.values[i] = emit(b, f, SlIr_Param, SlIrType_Any, idx, NULL, 0);
+        if (block.values[i] < 0) goto cleanup;
+        instAt(f, block.values[i])->as.idx = i;
+    }
+    for (uint16_t i = 0; i < funcCount; i++) {
+        block.values[i] = emit(b, f, SlIr_Null, SlIrType_Null, idx, NULL, 0);
+        if (block.values[i] < 0) goto cleanup;
+    }
+    slMapForeach(node->as.block.vars, SlStrMapBucket, var, i) {
+        if (block.values[i] < 0 || slVarShrIdx(var->value) < 0) continue;
+        block.slots[i] = emit(
+            b, f,
+            SlIr_MakeShared,
+            SlIrType_Slot,
+            idx,
+            &block.values[i],
+            1
+        );
+        if (block.slots[i] < 0) goto cleanup;
+    }
+
+    for (uint32_t i = 0; i < node->as.block.nodeCount; i++) {
+        if (!buildStmnt(b, node->as.block.nodes[i])) goto cleanup;
+    }
+
+    for (uint32_t i = 0; i < varCount; i++) {
+        if (block.slots[i] < 0) continue;
+        if (!slI32Push(b->vm, &slots, block.slots[i])) goto cleanup;
+    }
+    if (slots.len != 0) {
+        SlIrValue detach = emit(
+            b, f,
+            SlIr_Detach,
+            SlIrType_Any,
+            idx,
+            slots.data,
+            slots.len
+        );
+        if (detach < 0) goto cleanup;
+    }
+    ok = true;
+
+cleanup:
+    slI32Clear(&slots);
+    f->block = block.parent;
+    memFree(block.values);
+    return ok;
+}
+
+static bool buildVarDeclr(BuildState *b, SlNodeIdx idx) {
+    const SlNode *node = &b->ast->nodes[idx];
+    BuildFunc *f = b->func;
+    uint32_t *info = slStrMapGet(f->block->vars, node->as.varDeclr.name);
+    assert(info != NULL);
+    uint32_t varIdx = slVarIdx(*info);
+
+    SlIrValue value = buildExpr(b, node->as.varDeclr.value);
+    if (value < 0) return false;
+    // The variable gets a copy of the value of the other variable, copy
+    // propagation removes it
+    if (b->ast->nodes[node->as.varDeclr.value].kind == SlNode_Access) {
+        SlIrType type = instAt(f, value)->type;
+        value = emit(b, f, SlIr_Copy, type, idx, &value, 1);
+        if (value < 0) return false;
+    }
+    f->block->values[varIdx] = value;
+
+    // Functions and variables declared again already have a slot, closures
+    // that captured it must see the new value
+    if (f->block->slots[varIdx] >= 0) {
+        SlIrValue args[2] = { f->block->slots[varIdx], value };
+        return emit(b, f, SlIr_StoreShared, SlIrType_Any, idx, args, 2) >= 0;
+    }
+    if (slVarShrIdx(*info) >= 0) {
+        SlIrValue slot = emit(
+            b, f,
+            SlIr_MakeShared,
+            SlIrType_Slot,
+            idx,
+            &value,
+            1
+        );
+        if (slot < 0) return false;
+        f->block->slots[varIdx] = slot;
+    }
+    return true;
+}
+
+static SlIrValue buildExpr(BuildState *b, SlNodeIdx idx) {
+    const SlNode *node = &b->ast->nodes[idx];
+    BuildFunc *f = b->func;
+    switch (node->kind) {
+    case SlNode_NumInt: {
+        SlIrValue value = emit(b, f, SlIr_Int, SlIrType_Int, idx, NULL, 0);
+        if (value < 0) return -1;
+        instAt(f, value)->as.numInt = node->as.numInt;
+        return value;
+    }
+    case SlNode_Access:
+        return buildAccess(b, idx);
+    case SlNode_BinOp: {
+        SlIrValue args[2];
+        args[0] = buildExpr(b, node->as.binOp.lhs);
+        if (args[0] < 0) return -1;
+        args[1] = buildExpr(b, node->as.binOp.rhs);
+        if (args[1] < 0) return -1;
+
+        SlIrOp op = SlIr_Add + (node->as.binOp.op - SlBinOp_Add);
+        SlIrType type = binOpType(
+            op,
+            instAt(f, args[0])->type,
+            instAt(f, args[1])->type
+        );
+        return emit(b, f, op, type, idx, args, 2);
+    }
+    case SlNode_Lambda:
+        return buildClosure(b, idx);
+    case SlNode_Call:
+        return buildCall(b, idx);
+    case SlNode_Block:
+    case SlNode_VarDeclr:
+    case SlNode_Print:
+    case SlNode_RetStmnt:
+    case SlNode_INVALID:
+        assert(false && "unreachable");
+        return -1;
+    }
+    return -1;
+}
+
+static SlIrValue buildAccess(BuildState *b, SlNodeIdx idx) {
+    BuildFunc *f = b->func;
+    SlStrIdx name = b->ast->nodes[idx].as.access;
+
+    for (BuildBlock *block = f->block; block != NULL; block = block->parent) {
+        uint32_t *info = slStrMapGet(block->vars, name);
+        if (info != NULL && block->values[*info & 0xffff] >= 0) {
+            return block->values[*info & 0xffff];
+        }
+    }
+
+    uint32_t extIdx;
+    uint32_t *ext = slStrMapGet(&f->externals, name);
+    if (ext != NULL) {
+        extIdx = *ext;
+    } else if (!addCapture(b, f, name, idx, &extIdx)) {
+        return -1;
+    }
+    SlIrValue value = emit(b, f, SlIr_LoadShared, SlIrType_Any, idx, NULL, 0);
+    if (value < 0) return -1;
+    instAt(f, value)->as.idx = extIdx;
+    return value;
+}
+
+static SlIrValue buildClosure(BuildState *b, SlNodeIdx idx) {
+    BuildFunc *f = b->func;
+    SlI32Arr captures = { 0 };
+    SlIrFunc *child = buildFunc(b, idx, &captures);
+    if (child == NULL) return -1;
+    if (!slIrFuncsPush(b->vm, &f->ir->children, child)) {
+        slIrDestroy(child);
+        slI32Clear(&captures);
+        return -1;
+    }
+    SlIrValue value = emit(
+        b, f,
+        SlIr_Closure,
+        SlIrType_Func,
+        idx,
+        captures.data,
+        captures.len
+    );
+    slI32Clear(&captures);
+    if (value < 0) return -1;
+    instAt(f, value)->as.idx = f->ir->children.len - 1;
+    return value;
+}
+
+static SlIrValue buildCall(BuildState *b, SlNodeIdx idx) {
+    const SlNode *node = &b->ast->nodes[idx];
+    SlI32Arr args = { 0 };
+    SlIrValue value = buildExpr(b, node->as.call.callee);
+    if (value < 0 || !slI32Push(b->vm, &args, value)) goto error;
+    for (uint16_t i = 0; i < node->as.call.argCount; i++) {
+        value = buildExpr(b, node->as.call.args[i]);
+        if (value < 0 || !slI32Push(b->vm, &args, value)) goto error;
+    }
+    value = emit(
+        b, b->func,
+        SlIr_Call,
+        SlIrType_Any,
+        idx,
+        args.data,
+        args.len
+    );
+    slI32Clear(&args);
+    return value;
+error:
+    slI32Clear(&args);
+    return -1;
+}
+
+static bool addCapture(
+    BuildState *b,
+    BuildFunc *f,
+    SlStrIdx name,
+    SlNodeIdx node,
+    uint32_t *outIdx
+) {
+    assert(f->parent != NULL);
+    SlIrValue slot = captureFrom(b, f->parent, name, node);
+    if (slot < 0) return false;
+    *outIdx = f->captures.len;
+    if (!slI32Push(b->vm, &f->captures, slot)) return false;
+    return slStrMapSet(b->vm, &f->externals, name, *outIdx);
+}
+
+static SlIrValue captureFrom(
+    BuildState *b,
+    BuildFunc *f,
+    SlStrIdx name,
+    SlNodeIdx node
+) {
+    for (BuildBlock *block = f->block; block != NULL; block = block->parent) {
+        uint32_t *info = slStrMapGet(block->vars, name);
+        if (info == NULL || block->values[slVarIdx(*info)] < 0) continue;
+        // Variables that are never set again are captured by value, the
+        // resolver gives a shared slot to the others
+        if (slVarByValue(*info)) return block->values[slVarIdx(*info)];
+        assert(block->slots[slVarIdx(*info)] >= 0);
+        return block->slots[slVarIdx(*info)];
+    }
+
+    uint32_t extIdx;
+    uint32_t *ext = slStrMapGet(&f->externals, name);
+    if (ext != NULL) {
+        extIdx = *ext;
+    } else if (!addCapture(b, f, name, node, &extIdx)) {
+        return -1;
+    }
+    SlIrValue value = emit(b, f, SlIr_External, SlIrType_Slot, node, NULL, 0);
+    if (value < 0) return -1;
+    instAt(f, value)->as.idx = extIdx;
+    return value;
+}
+
+static bool isNumeric(SlIrType type) {
+    return type == SlIrType_Numeric || type == SlIrType_Int;
+}
+
+static SlIrType binOpType(SlIrOp op, SlIrType lhs, SlIrType rhs) {
+    if (lhs == SlIrType_Int
+        && rhs == SlIrType_Int
+        && (op == SlIr_Add || op == SlIr_Sub || op == SlIr_Mul))
+    {
+        return SlIrType_Int;
+    }
+    if (isNumeric(lhs) && isNumeric(rhs)) return SlIrType_Numeric;
+    return SlIrType_Any;
+}
+
+static SlIrType joinTypes(SlIrType t1, SlIrType t2) {
+    if (t1 == t2) return t1;
+    if (isNumeric(t1) && isNumeric(t2)) return SlIrType_Numeric;
+    return SlIrType_Any;
+}
+
+static bool isBinOp(SlIrOp op) {
+    return op >= SlIr_Add && op <= SlIr_Pow;
+}
+
+static bool definesValue(SlIrOp op) {
+    return op != SlIr_Nop
+        && op != SlIr_StoreShared
+        && op != SlIr_Detach
+        && op != SlIr_Print
+        && op != SlIr_Ret;
+}
+
+static void propagateCopies(SlIrFunc *func) {
+    for (uint32_t i = 0; i < func->args.len; i++) {
+        SlIrValue arg = func->args.data[i];
+        while (func->insts.data[arg].op == SlIr_Copy) {
+            arg = slIrArgs(func, &func->insts.data[arg])[0];
+        }
+        func->args.data[i] = arg;
+    }
+}
+
+static bool inlineCalls(SlVM *vm, const SlAst *ast, SlIrFunc *func) {
+    // Functions have no branches yet
+    if (func->blocks.len != 1) return true;
+    char *printInlining = getenv("SL_PRINT_INLINING");
+    bool log = printInlining && strcmp(printInlining, "true") == 0;
+
+    SlI32Arr *block = &func->blocks.data[0].insts;
+    SlI32Arr insts = { 0 };
+    for (uint32_t i = 0; i < block->len; i++) {
+        SlIrValue value = block->data[i];
+        SlIrInst *inst = &func->insts.data[value];
+        const char *reason = NULL;
+        const SlIrFunc *callee = inst->op == SlIr_Call
+            ? inlineCandidate(func, inst, &reason)
+            : NULL;
+        uint32_t line = ast->nodes[inst->node].line;
+
+        if (callee == NULL) {
+            if (log && reason != NULL) {
+                printf("line %"PRIu32": call not inlined, %s\n", line, reason);
+            }
+            if (!slI32Push(vm, &insts, value)) goto error;
+            continue;
+        }
+        if (log) {
+            printf(
+                "line %"PRIu32": inlined call of <%p> (%"PRIu32" insts)\n",
+                line,
+                (void *)callee,
+                callee->blocks.data[0].insts.len
+            );
+        }
+
+        SlIrValue result;
+        if (!inlineCall(vm, func, value, callee, &insts, &result)) goto error;
+        // The call becomes a copy of the result, copy propagation removes it
+        inst = &func->insts.data[value];
+        inst->op = SlIr_Copy;
+        inst->type = func->insts.data[result].type;
+        inst->argCount = 1;
+        slIrArgs(func, inst)[0] = result;
+        if (!slI32Push(vm, &insts, value)) goto error;
+    }
+
+    slI32Clear(block);
+    *block = insts;
+    return true;
+error:
+    slI32Clear(&insts);
+    return false;
+}
+
+static const SlIrFunc *inlineCandidate(
+    const SlIrFunc *func,
+    const SlIrInst *call,
+    const char **outReason
+) {
+    const SlIrInst *closure = &func->insts.data[slIrArgs(func, call)[0]];
+    // Only functions created in this function are known
+    if (closure->op != SlIr_Closure) return NULL;
+
+    const SlIrFunc *callee = func->children.data[closure->as.idx];
+    if (callee->blocks.len != 1) {
+        *outReason = "the function has branches";
+        return NULL;
+    }
+    if (callee->paramCount != call->argCount - 1) {
+        *outReason = "the number of arguments does not match";
+        return NULL;
+    }
+    const SlI32Arr *insts = &callee->blocks.data[0].insts;
+    if (insts->len > _maxInlineInsts) {
+        *outReason = "the function is too big";
+        return NULL;
+    }
+    for (uint32_t i = 0; i < insts->len; i++) {
+        const SlIrInst *inst = &callee->insts.data[insts->data[i]];
+        switch (inst->op) {
+        case SlIr_Closure:
+        case SlIr_MakeShared:
+        case SlIr_StoreShared:
+        case SlIr_Detach:
+        case SlIr_External:
+            *outReason = "the function creates closures";
+            return NULL;
+        case SlIr_Ret:
+            if (i + 1 == insts->len) break;
+            *outReason = "the function returns early";
+            return NULL;
+        default:
+            break;
+        }
+    }
+    return callee;
+}
+
+static bool inlineCall(
+    SlVM *vm,
+    SlIrFunc *func,
+    SlIrValue call,
+    const SlIrFunc *callee,
+    SlI32Arr *insts,
+    SlIrValue *outResult
+) {
+    const SlI32Arr *body = &callee->blocks.data[0].insts;
+    SlIrValue *map = memAlloc(callee->insts.len, sizeof(*map));
+    SlI32Arr args = { 0 };
+    if (map == NULL) {
+        slSetOutOfMemoryError(vm);
+        return false;
+    }
+    *outResult = -1;
+
+    for (uint32_t i = 0; i < body->len; i++) {
+        SlIrValue value = body->data[i];
+        SlIrInst inst = callee->insts.data[value];
+        const SlIrValue *callArgs = slIrArgs(func, &func->insts.data[call]);
+        const SlIrInst *closure = &func->insts.data[callArgs[0]];
+
+        switch (inst.op) {
+        case SlIr_Param:
+            map[value] = callArgs[1 + inst.as.idx];
+            continue;
+        case SlIr_Ret:
+            *outResult = map[slIrArgs(callee, &inst)[0]];
+            continue;
+        case SlIr_LoadShared: {
+            // A slot of this function holds the value that was stored last,
+            // the slots of enclosing functions are still loaded
+            SlIrValue slot = slIrArgs(func, closure)[inst.as.idx];
+            const SlIrInst *slotInst = &func->insts.data[slot];
+            if (slotInst->op == SlIr_External) {
+                inst.as.idx = slotInst->as.idx;
+                break;
+            }
+            if (slotInst->op != SlIr_MakeShared) {
+                // Captured by value
+                map[value] = slot;
+                continue;
+            }
+            map[value] = slIrArgs(func, slotInst)[0];
+            for (uint32_t j = insts->len; j-- > 0;) {
+                const SlIrInst *store = &func->insts.data[insts->data[j]];
+                if (store->op == SlIr_StoreShared
+                    && slIrArgs(func, store)[0] == slot)
+                {
+                    map[value] = slIrArgs(func, store)[1];
+                    break;
+                }
+            }
+            continue;
+        }
+        default:
+            break;
+        }
+
+        slI32Clear(&args);
+        const SlIrValue *instArgs = slIrArgs(callee, &inst);
+        for (uint32_t k = 0; k < inst.argCount; k++) {
+            if (!slI32Push(vm, &args, map[instArgs[k]])) goto error;
+        }
+        inst.block = 0;
+        map[value] = appendInst(vm, func, inst, args.data);
+        if (map[value] < 0) goto error;
+        if (!slI32Push(vm, insts, map[value])) goto error;
+    }
+
+    // A function without return statements returns null
+    if (*outResult < 0) {
+        SlIrInst null = {
+            .op = SlIr_Null,
+            .type = SlIrType_Null,
+            .node = func->insts.data[call].node,
+            .block = 0,
+            .argCount = 0,
+            .as.numInt = 0
+        };
+        *outResult = appendInst(vm, func, null, NULL);
+        if (*outResult < 0) goto error;
+        if (!slI32Push(vm, insts, *outResult)) goto error;
+    }
+
+    slI32Clear(&args);
+    memFree(map);
+    return true;
+error:
+    slI32Clear(&args);
+    memFree(map);
+    return false;
+}
+
+static void inferTypes(SlIrFunc *func) {
+    // Phi instructions can use values defined after them, the types are
+    // computed again until none of them changes
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (uint32_t i = 0; i < func->blocks.len; i++) {
+            const SlI32Arr *block = &func->blocks.data[i].insts;
+            for (uint32_t j = 0; j < block->len; j++) {
+                SlIrInst *inst = &func->insts.data[block->data[j]];
+                const SlIrValue *args = slIrArgs(func, inst);
+                SlIrType type = inst->type;
+                if (inst->op == SlIr_Copy) {
+                    type = func->insts.data[args[0]].type;
+                } else if (isBinOp(inst->op)) {
+                    type = binOpType(
+                        inst->op,
+                        func->insts.data[args[0]].type,
+                        func->insts.data[args[1]].type
+                    );
+                } else if (inst->op == SlIr_Phi && inst->argCount != 0) {
+                    type = func->insts.data[args[0]].type;
+                    for (uint32_t k = 1; k < inst->argCount; k++) {
+                        type = joinTypes(type, func->insts.data[args[k]].type);
+                    }
+                } else if (inst->op == SlIr_Call) {
+                    // Only functions created in this function are known,
+                    // their types were inferred before this one
+                    const SlIrInst *closure = &func->insts.data[args[0]];
+                    if (closure->op == SlIr_Closure) {
+                        type = returnType(
+                            func->children.data[closure->as.idx]
+                        );
+                    }
+                }
+                if (type != inst->type) {
+                    inst->type = type;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+static SlIrType returnType(const SlIrFunc *func) {
+    bool found = false;
+    SlIrType type = SlIrType_Null;
+    for (uint32_t i = 0; i < func->blocks.len; i++) {
+        const SlI32Arr *block = &func->blocks.data[i].insts;
+        for (uint32_t j = 0; j < block->len; j++) {
+            const SlIrInst *inst = &func->insts.data[block->data[j]];
+            if (inst->op != SlIr_Ret) continue;
+            SlIrType retType = func->insts.data[slIrArgs(func, inst)[0]].type;
+            type = found ? joinTypes(type, retType) : retType;
+            found = true;
+        }
+    }
+
+    // A function that reaches the end of its last block returns null
+    const SlI32Arr *last = &func->blocks.data[func->blocks.len - 1].insts;
+    if (last->len == 0
+        || func->insts.data[last->data[last->len - 1]].op != SlIr_Ret)
+    {
+        type = found ? joinTypes(type, SlIrType_Null) : SlIrType_Null;
+    }
+    return type;
+}
+
+static bool numberValues(SlVM *vm, SlIrFunc *func) {
+    uint32_t count = func->insts.len;
+    if (count == 0) return true;
+
+    uint32_t cap = 16;
+    while (cap < count * 2) cap *= 2;
+    SlIrValue *table = memAlloc(cap + count, sizeof(*table));
+    if (table == NULL) {
+        slSetOutOfMemoryError(vm);
+        return false;
+    }
+    SlIrValue *repl = table + cap;
+    memset(table, 0xff, cap * sizeof(*table));
+    for (uint32_t i = 0; i < count; i++) {
+        repl[i] = (SlIrValue)i;
+    }
+
+    for (uint32_t i = 0; i < func->blocks.len; i++) {
+        SlIrBlock *block = &func->blocks.data[i];
+        for (uint32_t j = 0; j < block->insts.len; j++) {
+            SlIrValue value = block->insts.data[j];
+            SlIrInst *inst = &func->insts.data[value];
+            SlIrValue *args = slIrArgs(func, inst);
+            for (uint32_t k = 0; k < inst->argCount; k++) {
+                args[k] = repl[args[k]];
+            }
+
+            switch (inst->op) {
+            case SlIr_Null:
+            case SlIr_Int:
+            case SlIr_External:
+                break;
+            case SlIr_Add:
+            case SlIr_Mul:
+                // Commutative only for numbers, strings are concatenated
+                if (isNumeric(func->insts.data[args[0]].type)
+                    && isNumeric(func->insts.data[args[1]].type)
+                    && args[0] > args[1])
+                {
+                    SlIrValue tmp = args[0];
+                    args[0] = args[1];
+                    args[1] = tmp;
+                }
+                break;
+            case SlIr_Sub:
+            case SlIr_Div:
+            case SlIr_Mod:
+            case SlIr_Pow:
+                break;
+            default:
+                // Instructions with effects, values that must be distinct
+                // objects and loads of slots other closures can store to are
+                // not numbered
+                continue;
+            }
+
+            uint32_t mask = cap - 1;
+            uint32_t h = hashInst(func, value) & mask;
+            for (;; h = (h + 1) & mask) {
+                SlIrValue other = table[h];
+                if (other < 0) {
+                    table[h] = value;
+                    break;
+                }
+                // A value of the entry block dominates every other block
+                uint32_t otherBlock = func->insts.data[other].block;
+                if ((otherBlock == 0 || otherBlock == inst->block)
+                    && sameInst(func, other, value))
+                {
+                    repl[value] = other;
+                    inst->op = SlIr_Nop;
+                    break;
+                }
+            }
+        }
+    }
+    // Phi nodes can reference values defined after them
+    replaceArgs(func, repl);
+    memFree(table);
+    return true;
+}
+
+static bool removeDeadCode(SlVM *vm, SlIrFunc *func) {
+    uint32_t count = func->insts.len;
+    if (count == 0) return true;
+
+    bool *live = memAllocZeroed(count, sizeof(*live));
+    // Stores to each slot, linked through the entries of the stores
+    SlIrValue *stores = memAlloc(count, sizeof(*stores));
+    SlI32Arr work = { 0 };
+    if (live == NULL || stores == NULL) {
+        slSetOutOfMemoryError(vm);
+        goto error;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        stores[i] = -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        const SlIrInst *inst = &func->insts.data[i];
+        if (inst->op != SlIr_StoreShared) continue;
+        SlIrValue slot = slIrArgs(func, inst)[0];
+        stores[i] = stores[slot];
+        stores[slot] = (SlIrValue)i;
+    }
+
+    // Instructions with effects are always live, arithmetic can fail unless
+    // the operands are numbers
+    for (uint32_t i = 0; i < count; i++) {
+        const SlIrInst *inst = &func->insts.data[i];
+        bool root = inst->op == SlIr_Print
+                 || inst->op == SlIr_Call
+                 || inst->op == SlIr_Ret
+                 || inst->op == SlIr_Detach
+                 || inst->op == SlIr_Phi;
+        if (isBinOp(inst->op)) {
+            const SlIrValue *args = slIrArgs(func, inst);
+            root = !isNumeric(func->insts.data[args[0]].type)
+                || !isNumeric(func->insts.data[args[1]].type);
+        }
+        if (!root) continue;
+        live[i] = true;
+        if (!slI32Push(vm, &work, (SlIrValue)i)) goto error;
+    }
+    while (work.len != 0) {
+        SlIrValue value = work.data[--work.len];
+        const SlIrInst *inst = &func->insts.data[value];
+        // Detaching a slot or storing to it does not keep it alive, the
+        // stores to a slot that is alive are
+        if (inst->op == SlIr_Detach) continue;
+        if (inst->op == SlIr_MakeShared) {
+            for (SlIrValue st = stores[value]; st >= 0; st = stores[st]) {
+                if (live[st]) continue;
+                live[st] = true;
+                if (!slI32Push(vm, &work, st)) goto error;
+            }
+        }
+        const SlIrValue *args = slIrArgs(func, inst);
+        // The slot a value is stored to does not make it live
+        uint32_t k = inst->op == SlIr_StoreShared;
+        for (; k < inst->argCount; k++) {
+            if (live[args[k]]) continue;
+            live[args[k]] = true;
+            if (!slI32Push(vm, &work, args[k])) goto error;
+        }
+    }
+
+    // Slots that no closure captures are dead stores, they are removed from
+    // the instructions that detach them
+    for (uint32_t i = 0; i < count; i++) {
+        SlIrInst *inst = &func->insts.data[i];
+        if (inst->op != SlIr_Detach) continue;
+        SlIrValue *args = slIrArgs(func, inst);
+        uint32_t kept = 0;
+        for (uint32_t k = 0; k < inst->argCount; k++) {
+            if (live[args[k]]) args[kept++] = args[k];
+        }
+        inst->argCount = kept;
+        if (kept == 0) live[i] = false;
+    }
+
+    for (uint32_t i = 0; i < func->blocks.len; i++) {
+        SlI32Arr *insts = &func->blocks.data[i].insts;
+        uint32_t kept = 0;
+        for (uint32_t j = 0; j < insts->len; j++) {
+            SlIrValue value = insts->data[j];
+            if (live[value]) {
+                insts->data[kept++] = value;
+            } else {
+                func->insts.data[value].op = SlIr_Nop;
+            }
+        }
+        insts->len = kept;
+    }
+
+    slI32Clear(&work);
+    memFree(stores);
+    memFree(live);
+    return true;
+error:
+    slI32Clear(&work);
+    memFree(stores);
+    memFree(live);
+    return false;
+}
+
+static void replaceArgs(SlIrFunc *func, const SlIrValue *repl) {
+    for (uint32_t i = 0; i < func->args.len; i++) {
+        func->args.data[i] = repl[func->args.data[i]];
+    }
+}
+
+static bool sameInst(const SlIrFunc *func, SlIrValue v1, SlIrValue v2) {
+    const SlIrInst *inst1 = &func->insts.data[v1];
+    const SlIrInst *inst2 = &func->insts.data[v2];
+    if (inst1->op != inst2->op
+        || inst1->as.numInt != inst2->as.numInt
+        || inst1->argCount != inst2->argCount)
+    {
+        return false;
+    }
+    // The args of a function without any are NULL
+    return inst1->argCount == 0 || memcmp(
+        slIrArgs(func, inst1),
+        slIrArgs(func, inst2),
+        inst1->argCount * sizeof(SlIrValue)
+    ) == 0;
+}
+
+static uint32_t hashInst(const SlIrFunc *func, SlIrValue value) {
+    const SlIrInst *inst = &func->insts.data[value];
+    const SlIrValue *args = slIrArgs(func, inst);
+    // An array, a struct could have padding bytes
+    int32_t key[5] = {
+        (int32_t)inst->op,
+        (int32_t)(inst->as.numInt & 0xffffffff),
+        (int32_t)(inst->as.numInt >> 32),
+        -1,
+        -1
+    };
+    assert(inst->argCount <= 2);
+    for (uint32_t i = 0; i < inst->argCount; i++) {
+        key[3 + i] = args[i];
+    }
+    return slMemHash(key, sizeof(key));
+}
+
+static const char *opName(SlIrOp op) {
+    switch (op) {
+    case SlIr_Nop: return "nop";
+    case SlIr_Null: return "null";
+    case SlIr_Int: return "int";
+    case SlIr_Param: return "param";
+    case SlIr_External: return "external";
+    case SlIr_LoadShared: return "loadshared";
+    case SlIr_MakeShared: return "makeshared";
+    case SlIr_StoreShared: return "storeshared";
+    case SlIr_Detach: return "detach";
+    case SlIr_Closure: return "closure";
+    case SlIr_Copy: return "copy";
+    case SlIr_Add: return "add";
+    case SlIr_Sub: return "sub";
+    case SlIr_Mul: return "mul";
+    case SlIr_Div: return "div";
+    case SlIr_Mod: return "mod";
+    case SlIr_Pow: return "pow";
+    case SlIr_Call: return "call";
+    case SlIr_Print: return "print";
+    case SlIr_Ret: return "ret";
+    case SlIr_Phi: return "phi";
+    }
+    return "?";
+}
+
+static const char *typeName(SlIrType type) {
+    switch (type) {
+    case SlIrType_Any: return "Any";
+    case SlIrType_Numeric: return "Numeric";
+    case SlIrType_Int: return "Int";
+    case SlIrType_Null: return "Null";
+    case SlIrType_Func: return "Func";
+    case SlIrType_Slot: return "Slot";
+    }
+    return "?";
+}
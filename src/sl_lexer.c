@@ -33,7 +33,8 @@ static const struct {
 } keywords[] = {
     { "var", SlToken_KwVar },
     { "func", SlToken_KwFunc },
-    { "print", SlToken_KwPrint }
+    { "print", SlToken_KwPrint },
+    { "return", SlToken_KwReturn }
 };
 static const size_t keywordsLen = sizeof(keywords) / sizeof(*keywords);
 
@@ -86,10 +87,13 @@ const char *slTokenKindToStr(SlTokenKind kind) {
         return "the keyword 'func'";
     case SlToken_KwPrint:
         return "the keyword 'print'";
+    case SlToken_KwReturn:
+        return "the keyword 'return'";
     case SlToken_Eof:
         return "the end of the file";
     }
     assert(false && "unreachable");
+    return NULL;
 }
 
 SlTokens slTokenize(SlVM *vm, const SlSource *source) {
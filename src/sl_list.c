@@ -0,0 +1,414 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "clib_mem.h"
+#include "sl_list.h"
+#include "sl_persist.h"
+
+#define _minCap 4
+
+#define isInline(list) ((void *)(list)->objs == (void *)((list) + 1))
+#define listObj(l) ((SlObj){ .type = SlObj_FrozenList, .as.list = (l) })
+
+static size_t itemSize(SlListKind kind);
+// Make sure that the storage of the list can hold `value`.
+// If an error occurs return false.
+static bool prepareStore(SlVM *vm, SlList *list, SlObj value);
+// Box all the items, changing the storage to `SlList_Objs`.
+// If an error occurs return false.
+static bool generalize(SlVM *vm, SlList *list);
+// Write `value` at `idx` without releasing the previous item.
+static void writeItem(SlList *list, size_t idx, SlObj value);
+// Get the item at position `pos` of the storage without a new reference, the
+// caller takes over the one held by the list.
+static SlObj takeItem(SlList *list, size_t pos);
+// Reverse the items between the positions `start` and `end` of the storage.
+static void reverseItems(SlList *list, size_t start, size_t end);
+// Create a view of the items of a flat frozen list.
+// If an error occurs return null.
+static SlObj newView(SlVM *vm, SlList *src, size_t start, size_t len);
+// Copy items of `src` into a new list.
+// If an error occurs return null.
+static SlObj copySlice(SlVM *vm, SlObj src, size_t start, size_t len);
+
+SlObj slListNew(SlVM *vm, size_t cap) {
+    // The inline room is sized for boxed items so that a list can change kind
+    // without moving them
+    if (cap <= slListInlineCap) {
+        SlObj list = slListNewInline(vm, SlList_Objs, slListInlineCap);
+        if (!vm->error.occurred) {
+            list.as.list->kind = SlList_Ints;
+            list.as.list->cap = slListInlineCap * 2;
+        }
+        return list;
+    }
+    SlList *list = memAllocZeroed(1, sizeof(*list));
+    if (list == NULL) {
+        slSetOutOfMemoryError(vm);
+        return slNull;
+    }
+    slGCObjInit(&list->asGCObj);
+    list->kind = SlList_Ints;
+    if (!slListReserve(vm, list, cap)) {
+        memFree(list);
+        return slNull;
+    }
+    return (SlObj){ .type = SlObj_List, .as.list = list };
+}
+
+SlObj slListNewInline(SlVM *vm, SlListKind kind, size_t cap) {
+    size_t bytes = cap * itemSize(kind);
+    SlList *list = memAllocBytes(sizeof(*list) + bytes);
+    if (list == NULL) {
+        slSetOutOfMemoryError(vm);
+        return slNull;
+    }
+    memset(list, 0, sizeof(*list));
+    slGCObjInit(&list->asGCObj);
+    list->objs = (SlObj *)(list + 1);
+    list->kind = kind;
+    list->cap = cap;
+    return (SlObj){ .type = SlObj_List, .as.list = list };
+}
+
+void slListDestroy(SlList *list) {
+    // The items of a view belong to its parent
+    if (list->parent != NULL) {
+        slDelRef(listObj(list->parent));
+        memFree(list);
+        return;
+    }
+    if (list->kind == SlList_Trie) {
+        slDelRef((SlObj){ .type = SlObj_PNode, .as.pnode = list->trie });
+        memFree(list);
+        return;
+    }
+    if (list->kind == SlList_Objs) {
+        for (size_t i = 0; i < list->len; i++) {
+            slDelRef(list->objs[slListPos(list, i)]);
+        }
+    }
+    if (!isInline(list)) {
+        memFree(list->objs);
+    }
+    memFree(list);
+}
+
+bool slListReserve(SlVM *vm, SlList *list, size_t cap) {
+    if (cap <= list->cap) {
+        return true;
+    }
+    size_t size = itemSize(list->kind);
+    if (isInline(list)) {
+        slListLinearize(list);
+    }
+    uint8_t *items = isInline(list)
+        ? memAlloc(cap, size)
+        : memChange(list->objs, cap, size);
+    if (items == NULL) {
+        slSetOutOfMemoryError(vm);
+        return false;
+    }
+    if (isInline(list)) {
+        memcpy(items, list->objs, list->len * size);
+    } else if (list->head + list->len > list->cap) {
+        // The items before the wrap-around move to the end of the new storage
+        size_t newHead = list->head + cap - list->cap;
+        memmove(
+            items + newHead * size,
+            items + list->head * size,
+            (list->cap - list->head) * size
+        );
+        list->head = newHead;
+    }
+    list->objs = (SlObj *)items;
+    list->cap = cap;
+    return true;
+}
+
+SlObj slListGet(const SlList *list, size_t idx) {
+    assert(idx < list->len);
+    switch (list->kind) {
+    case SlList_Ints:
+        return slObjInt(list->ints[slListPos(list, idx)]);
+    case SlList_Floats:
+        return slObjFloat(list->floats[slListPos(list, idx)]);
+    case SlList_Trie:
+        return slNewRef(*slFrozenListItem(list, idx));
+    default:
+        return slNewRef(list->objs[slListPos(list, idx)]);
+    }
+}
+
+bool slListSet(SlVM *vm, SlList *list, size_t idx, SlObj value) {
+    assert(idx < list->len);
+    if (!prepareStore(vm, list, value)) {
+        return false;
+    }
+    // The previous item is released last, its destructor may access the list
+    SlObj prevItem = list->kind == SlList_Objs
+        ? list->objs[slListPos(list, idx)]
+        : slNull;
+    writeItem(list, idx, value);
+    slDelRef(prevItem);
+    return true;
+}
+
+bool slListAppend(SlVM *vm, SlList *list, SlObj value) {
+    if (!prepareStore(vm, list, value)) {
+        return false;
+    }
+    if (list->len == list->cap) {
+        size_t newCap = list->cap < _minCap ? _minCap : list->cap * 2;
+        if (!slListReserve(vm, list, newCap)) {
+            return false;
+        }
+    }
+    writeItem(list, list->len++, value);
+    return true;
+}
+
+bool slListPrepend(SlVM *vm, SlList *list, SlObj value) {
+    if (!prepareStore(vm, list, value)) {
+        return false;
+    }
+    if (list->len == list->cap) {
+        size_t newCap = list->cap < _minCap ? _minCap : list->cap * 2;
+        if (!slListReserve(vm, list, newCap)) {
+            return false;
+        }
+    }
+    list->head = list->head == 0 ? list->cap - 1 : list->head - 1;
+    list->len++;
+    writeItem(list, 0, value);
+    return true;
+}
+
+SlObj slListPop(SlList *list) {
+    assert(list->len != 0);
+    list->len--;
+    SlObj item = takeItem(list, slListPos(list, list->len));
+    if (list->len == 0) {
+        list->head = 0;
+    }
+    return item;
+}
+
+SlObj slListPopFront(SlList *list) {
+    assert(list->len != 0);
+    SlObj item = takeItem(list, list->head);
+    list->len--;
+    list->head = list->len == 0 || list->head + 1 == list->cap
+        ? 0
+        : list->head + 1;
+    return item;
+}
+
+void slListLinearize(SlList *list) {
+    if (list->head == 0) {
+        return;
+    }
+    if (list->head + list->len <= list->cap) {
+        size_t size = itemSize(list->kind);
+        memmove(
+            list->objs,
+            (uint8_t *)list->objs + list->head * size,
+            list->len * size
+        );
+    } else {
+        // Rotating the whole storage by reversing it in three steps needs no
+        // additional memory
+        reverseItems(list, 0, list->head);
+        reverseItems(list, list->head, list->cap);
+        reverseItems(list, 0, list->cap);
+    }
+    list->head = 0;
+}
+
+SlObj slListSlice(SlVM *vm, SlObj list, size_t start, size_t len) {
+    SlList *src = list.as.list;
+    assert(start + len <= src->len);
+    if (list.type != SlObj_FrozenList || src->kind == SlList_Trie) {
+        return copySlice(vm, list, start, len);
+    }
+    if (start == 0 && len == src->len) {
+        return slNewRef(list);
+    }
+    SlList *parent = src->parent != NULL ? src->parent : src;
+    if (len < slListViewMinLen || len * slListViewMaxRatio < parent->len) {
+        return copySlice(vm, list, start, len);
+    }
+    return newView(vm, src, start, len);
+}
+
+bool slListIndex(SlVM *vm, const SlList *list, SlObj idx, size_t *outIdx) {
+    if (idx.type != SlObj_Int) {
+        slSetError(vm, "list indices must be Int, not %s", slTypeName(idx));
+        return false;
+    }
+    int64_t pos = idx.as.numInt;
+    if (pos < 0) {
+        pos += (int64_t)list->len;
+    }
+    if (pos < 0 || (uint64_t)pos >= list->len) {
+        slSetError(vm, "list index %"PRIi64" out of range", idx.as.numInt);
+        return false;
+    }
+    *outIdx = (size_t)pos;
+    return true;
+}
+
+static size_t itemSize(SlListKind kind) {
+    switch (kind) {
+    case SlList_Ints:
+        return sizeof(int64_t);
+    case SlList_Floats:
+        return sizeof(SlFloat);
+    default:
+        return sizeof(SlObj);
+    }
+}
+
+static bool prepareStore(SlVM *vm, SlList *list, SlObj value) {
+    switch (list->kind) {
+    case SlList_Ints:
+        if (value.type == SlObj_Int) {
+            return true;
+        }
+        break;
+    case SlList_Floats:
+        if (value.type == SlObj_Float) {
+            return true;
+        }
+        break;
+    default:
+        return true;
+    }
+
+    // Ints and floats have the same size, an empty list can switch between
+    // them without touching its storage
+    if (list->len == 0 && slObjIsNumeric(value)) {
+        list->kind = value.type == SlObj_Int ? SlList_Ints : SlList_Floats;
+        return true;
+    }
+    return generalize(vm, list);
+}
+
+static bool generalize(SlVM *vm, SlList *list) {
+    slListLinearize(list);
+    size_t cap = list->cap;
+    SlObj *objs = list->objs;
+    if (isInline(list)) {
+        // The inline room holds half as many boxed items
+        cap = list->cap * itemSize(list->kind) / sizeof(SlObj);
+        if (list->len > cap) {
+            cap = list->len * 2;
+            objs = memAlloc(cap, sizeof(*objs));
+        }
+    } else if (cap != 0) {
+        objs = memChange(list->objs, cap, sizeof(*objs));
+    }
+    if (objs == NULL && cap != 0) {
+        slSetOutOfMemoryError(vm);
+        return false;
+    }
+
+    // Boxed items are larger than unboxed ones, when converting in place
+    // going from the end never overwrites an item that was not read yet
+    const void *src = isInline(list) ? (void *)list->objs : (void *)objs;
+    const int64_t *ints = src;
+    const SlFloat *floats = src;
+    for (size_t i = list->len; i-- > 0;) {
+        objs[i] = list->kind == SlList_Ints
+            ? slObjInt(ints[i])
+            : slObjFloat(floats[i]);
+    }
+    list->objs = objs;
+    list->cap = cap;
+    list->kind = SlList_Objs;
+    return true;
+}
+
+static void writeItem(SlList *list, size_t idx, SlObj value) {
+    size_t pos = slListPos(list, idx);
+    switch (list->kind) {
+    case SlList_Ints:
+        list->ints[pos] = value.as.numInt;
+        break;
+    case SlList_Floats:
+        list->floats[pos] = value.as.numFloat;
+        break;
+    default:
+        list->objs[pos] = slNewRef(value);
+        break;
+    }
+}
+
+static SlObj takeItem(SlList *list, size_t pos) {
+    switch (list->kind) {
+    case SlList_Ints:
+        return slObjInt(list->ints[pos]);
+    case SlList_Floats:
+        return slObjFloat(list->floats[pos]);
+    default:
+        return list->objs[pos];
+    }
+}
+
+static void reverseItems(SlList *list, size_t start, size_t end) {
+    size_t size = itemSize(list->kind);
+    uint8_t *items = (uint8_t *)list->objs;
+    uint8_t tmp[sizeof(SlObj)];
+    for (; end - start > 1; start++, end--) {
+        memcpy(tmp, items + start * size, size);
+        memcpy(items + start * size, items + (end - 1) * size, size);
+        memcpy(items + (end - 1) * size, tmp, size);
+    }
+}
+
+static SlObj newView(SlVM *vm, SlList *src, size_t start, size_t len) {
+    SlList *view = memAllocZeroed(1, sizeof(*view));
+    if (view == NULL) {
+        slSetOutOfMemoryError(vm);
+        return slNull;
+    }
+    slGCObjInit(&view->asGCObj);
+    view->objs = (SlObj *)((uint8_t *)src->objs + start * itemSize(src->kind));
+    view->len = len;
+    view->cap = len;
+    view->kind = src->kind;
+    view->parent = src->parent != NULL ? src->parent : src;
+    slNewRef(listObj(view->parent));
+    return listObj(view);
+}
+
+static SlObj copySlice(SlVM *vm, SlObj src, size_t start, size_t len) {
+    SlObj *items = memAlloc(len, sizeof(*items));
+    if (items == NULL && len != 0) {
+        slSetOutOfMemoryError(vm);
+        return slNull;
+    }
+    for (size_t i = 0; i < len; i++) {
+        items[i] = slListGet(src.as.list, start + i);
+    }
+
+    SlObj result = slNull;
+    if (src.type == SlObj_FrozenList) {
+        result = slFrozenListNew(vm, items, len);
+    } else {
+        result = slListNew(vm, len);
+        for (size_t i = 0; !vm->error.occurred && i < len; i++) {
+            slListAppend(vm, result.as.list, items[i]);
+        }
+        if (vm->error.occurred) {
+            slDelRef(result);
+            result = slNull;
+        }
+    }
+    for (size_t i = 0; i < len; i++) {
+        slDelRef(items[i]);
+    }
+    memFree(items);
+    return result;
+}
@@ -0,0 +1,868 @@
+#include <assert.h>
+#include <string.h>
+
+#include "clib_mem.h"
+#include "sl_list.h"
+#include "sl_map.h"
+#include "sl_persist.h"
+#include "sl_str.h"
+
+#define _minEntryCap 4
+#define _lsbs 0x0101010101010101ull
+#define _msbs 0x8080808080808080ull
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif // !_MSC_VER
+
+// Check if `key` is a key of the array part of `map`.
+#define inArray(map, key) \
+    ((key).type == SlObj_Int && (uint64_t)(key).as.numInt < (map)->arrayLen)
+#define entriesInline(map) ((void *)(map)->entries == (void *)((map) + 1))
+
+#define h1(hash) ((hash) >> 7)
+#define h2(hash) ((uint8_t)((hash) & 0x7f))
+
+// Load the control bytes of a group, byte `i` is stored in bits `8i..8i+7`.
+static uint64_t loadGroup(const uint8_t *ctrl);
+// Mark with the highest bit the bytes equal to `h2`. May report false
+// positives next to a real match, entries must be compared anyway.
+static uint64_t matchByte(uint64_t group, uint8_t h2);
+static uint64_t matchEmpty(uint64_t group);
+static uint64_t matchEmptyOrDeleted(uint64_t group);
+// Get the index of the lowest byte marked in `mask`.
+static uint32_t lowestByte(uint64_t mask);
+
+// Get the position in the index table of `key`, return `map->indexCap` if it
+// is not found.
+static uint32_t findPos(const SlMap *map, SlObj key, uint32_t hash);
+// Get the first free position in the probe sequence of `hash`.
+static uint32_t findFreePos(const SlMap *map, uint32_t hash);
+static bool rebuildIndex(SlVM *vm, SlMap *map, uint32_t indexCap);
+static bool growIndex(SlVM *vm, SlMap *map, size_t count);
+static bool growEntries(SlVM *vm, SlMap *map, size_t cap);
+// Remove all the deleted entries, the index table must be rebuilt after this.
+static void compactEntries(SlMap *map);
+// Get the index in `entries` of `key`, return SIZE_MAX if it is not found.
+static size_t findEntry(const SlMap *map, SlObj key, uint32_t hash);
+static bool appendArray(SlVM *vm, SlMap *map, SlObj value);
+// Move the array part to the start of `entries`.
+static bool spillArray(SlVM *vm, SlMap *map);
+
+#define shapeObj(s) ((SlObj){ .type = SlObj_Shape, .as.shape = (s) })
+
+// Get a new reference to the shape of empty maps.
+static SlShape *rootShape(SlVM *vm);
+// Get a new reference to the shape reached by adding `key` to `shape`.
+static SlShape *shapeTransition(SlVM *vm, SlShape *shape, SlObj key);
+static void setShape(SlMap *map, SlShape *shape);
+static void updateCache(
+    SlFieldCache *cache,
+    SlShape *shape,
+    SlShape *transition,
+    size_t idx
+);
+
+SlObj slMapNew(SlVM *vm) {
+    return slMapNewInline(vm, slMapInlineCap);
+}
+
+SlObj slMapNewInline(SlVM *vm, size_t cap) {
+    SlMap *map = memAllocBytes(sizeof(*map) + cap * sizeof(SlMapEntry));
+    if (map == NULL) {
+        slSetOutOfMemoryError(vm);
+        return slNull;
+    }
+    memset(map, 0, sizeof(*map));
+    slGCObjInit(&map->asGCObj);
+    map->entries = (SlMapEntry *)(map + 1);
+    map->cap = cap;
+    map->shape = rootShape(vm);
+    if (map->shape == NULL) {
+        memFree(map);
+        return slNull;
+    }
+    return (SlObj){ .type = SlObj_Map, .as.map = map };
+}
+
+void slMapDestroy(SlMap *map) {
+    if (map->hamt != NULL) {
+        slDelRef((SlObj){ .type = SlObj_PNode, .as.pnode = map->hamt });
+        slDelRef((SlObj){ .type = SlObj_PNode, .as.pnode = map->order });
+        memFree(map);
+        return;
+    }
+    for (size_t i = 0; i < map->arrayLen; i++) {
+        slDelRef(map->array[i]);
+    }
+    memFree(map->array);
+    for (size_t i = 0; i < map->len; i++) {
+        slDelRef(map->entries[i].key);
+        slDelRef(map->entries[i].value);
+    }
+    if (!entriesInline(map)) {
+        memFree(map->entries);
+    }
+    memFree(map->ctrl);
+    if (map->shape != NULL) {
+        slDelRef(shapeObj(map->shape));
+    }
+    memFree(map);
+}
+
+bool slMapReserve(SlVM *vm, SlMap *map, size_t count) {
+    // A shape has at most slShapeMaxKeys keys, larger maps are dictionaries
+    if (count > slShapeMaxKeys && !slMapDropShape(vm, map)) {
+        return false;
+    }
+    if (map->shape != NULL) {
+        return count <= map->cap || growEntries(vm, map, count);
+    }
+    if (map->len != map->count) {
+        compactEntries(map);
+        if (!rebuildIndex(vm, map, map->indexCap)) {
+            return false;
+        }
+    }
+    if (count > map->cap && !growEntries(vm, map, count)) {
+        return false;
+    }
+    if (!entriesInline(map) && count > map->count + map->growthLeft) {
+        return growIndex(vm, map, count);
+    }
+    return true;
+}
+
+SlObj *slMapGet(SlVM *vm, SlMap *map, SlObj key) {
+    if (inArray(map, key)) {
+        return &map->array[key.as.numInt];
+    }
+    uint32_t hash;
+    if (!slMapKeyHash(vm, key, &hash)) {
+        return NULL;
+    }
+    if (map->hamt != NULL) {
+        SlMapEntry *entry = slFrozenMapFind(map, key, hash);
+        return entry == NULL ? NULL : &entry->value;
+    }
+    size_t idx = findEntry(map, key, hash);
+    if (idx == SIZE_MAX) {
+        return NULL;
+    }
+    return &map->entries[idx].value;
+}
+
+bool slMapSet(SlVM *vm, SlMap *map, SlObj key, SlObj value) {
+    if (inArray(map, key)) {
+        SlObj *slot = &map->array[key.as.numInt];
+        slDelRef(*slot);
+        *slot = slNewRef(value);
+        return true;
+    }
+    if (key.type == SlObj_Int
+        && key.as.numInt == (int64_t)map->arrayLen
+        && map->len == 0)
+    {
+        return appendArray(vm, map, value);
+    }
+
+    uint32_t hash;
+    if (!slMapKeyHash(vm, key, &hash)) {
+        return false;
+    }
+
+    size_t idx = findEntry(map, key, hash);
+    if (idx != SIZE_MAX) {
+        SlMapEntry *entry = &map->entries[idx];
+        slDelRef(entry->value);
+        entry->value = slNewRef(value);
+        return true;
+    }
+
+    if (map->shape != NULL
+        && (!slObjIsStr(key) || map->shape->keyCount == slShapeMaxKeys)
+        && !slMapDropShape(vm, map))
+    {
+        return false;
+    }
+
+    if (map->len == map->cap) {
+        if (map->len - map->count > map->len / 2) {
+            compactEntries(map);
+            if (!rebuildIndex(vm, map, map->indexCap)) {
+                return false;
+            }
+        } else {
+            size_t newCap =
+                map->cap < _minEntryCap ? _minEntryCap : map->cap * 2;
+            if (!growEntries(vm, map, newCap)) {
+                return false;
+            }
+        }
+    }
+    // Once the entries leave the inline storage the index table is built
+    if (map->shape == NULL
+        && !entriesInline(map)
+        && map->growthLeft == 0
+        && !growIndex(vm, map, map->count + 1))
+    {
+        return false;
+    }
+
+    SlObj storedKey = slMapStoredKey(vm, key);
+    if (vm->error.occurred) {
+        return false;
+    }
+
+    if (map->shape != NULL) {
+        SlShape *shape = shapeTransition(vm, map->shape, storedKey);
+        if (shape == NULL) {
+            slDelRef(storedKey);
+            return false;
+        }
+        setShape(map, shape);
+        map->entries[map->len++] = (SlMapEntry){
+            .key = storedKey,
+            .value = slNewRef(value),
+            .hash = hash
+        };
+        map->count++;
+        return true;
+    }
+
+    if (map->ctrl != NULL) {
+        uint32_t pos = findFreePos(map, hash);
+        if (map->ctrl[pos] == slMapCtrlEmpty) {
+            map->growthLeft--;
+        }
+        map->ctrl[pos] = h2(hash);
+        map->indices[pos] = (uint32_t)map->len;
+    }
+    map->entries[map->len++] = (SlMapEntry){
+        .key = storedKey,
+        .value = slNewRef(value),
+        .hash = hash
+    };
+    map->count++;
+    return true;
+}
+
+bool slMapDel(SlVM *vm, SlMap *map, SlObj key) {
+    if (inArray(map, key)) {
+        if ((size_t)key.as.numInt == map->arrayLen - 1) {
+            slDelRef(map->array[--map->arrayLen]);
+            return true;
+        }
+        if (!spillArray(vm, map)) {
+            return false;
+        }
+    }
+    uint32_t hash;
+    if (!slMapKeyHash(vm, key, &hash)) {
+        return false;
+    }
+    if (map->shape != NULL) {
+        // Shapes only describe maps that grow, removing a key would leave a
+        // hole in the layout
+        if (findEntry(map, key, hash) == SIZE_MAX) {
+            return false;
+        }
+        if (!slMapDropShape(vm, map)) {
+            return false;
+        }
+    }
+    size_t entryIdx;
+    if (map->ctrl == NULL) {
+        entryIdx = findEntry(map, key, hash);
+        if (entryIdx == SIZE_MAX) {
+            return false;
+        }
+    } else {
+        uint32_t pos = findPos(map, key, hash);
+        if (pos == map->indexCap) {
+            return false;
+        }
+        entryIdx = map->indices[pos];
+        map->ctrl[pos] = slMapCtrlDeleted;
+    }
+    SlMapEntry removed = map->entries[entryIdx];
+    map->entries[entryIdx] = (SlMapEntry){
+        .key = { .type = SlObj_Empty },
+        .value = slNull
+    };
+    map->count--;
+    if (entryIdx == map->len - 1) {
+        map->len--;
+    }
+
+    // Once most entries are removed they are compacted so that iteration does
+    // not skip over long runs of removed entries
+    if (map->len > slMapGroupSize && map->len - map->count > map->len / 2) {
+        compactEntries(map);
+        if (!rebuildIndex(vm, map, map->indexCap)) {
+            slDelRef(removed.key);
+            slDelRef(removed.value);
+            return false;
+        }
+    }
+
+    slDelRef(removed.key);
+    slDelRef(removed.value);
+    return true;
+}
+
+bool slMapNext(SlMap *map, size_t *iter, SlObj *outKey, SlObj **outValue) {
+    if (*iter < map->arrayLen) {
+        *outKey = slObjInt((int64_t)*iter);
+        *outValue = &map->array[(*iter)++];
+        return true;
+    }
+    SlMapEntry *entry = NULL;
+    if (map->hamt != NULL) {
+        entry = slFrozenMapNext(map, iter);
+    } else {
+        while (entry == NULL && *iter - map->arrayLen < map->len) {
+            entry = &map->entries[(*iter)++ - map->arrayLen];
+            if (entry->key.type == SlObj_Empty) {
+                entry = NULL;
+            }
+        }
+    }
+    if (entry == NULL) {
+        return false;
+    }
+    *outKey = entry->key;
+    *outValue = &entry->value;
+    return true;
+}
+
+SlObj *slMapGetField(SlVM *vm, SlMap *map, SlFieldCache *cache) {
+    if (map->shape != NULL
+        && map->shape == cache->shape
+        && cache->transition == NULL)
+    {
+        return &map->entries[cache->idx].value;
+    }
+    if (map->hamt != NULL) {
+        return slMapGet(vm, map, cache->key);
+    }
+
+    uint32_t hash;
+    if (!slMapKeyHash(vm, cache->key, &hash)) {
+        return NULL;
+    }
+    size_t idx = findEntry(map, cache->key, hash);
+    if (idx == SIZE_MAX) {
+        return NULL;
+    }
+    if (map->shape != NULL) {
+        updateCache(cache, map->shape, NULL, idx);
+    }
+    return &map->entries[idx].value;
+}
+
+bool slMapSetField(SlVM *vm, SlMap *map, SlFieldCache *cache, SlObj value) {
+    if (map->shape != NULL && map->shape == cache->shape) {
+        if (cache->transition == NULL) {
+            SlMapEntry *entry = &map->entries[cache->idx];
+            slDelRef(entry->value);
+            entry->value = slNewRef(value);
+            return true;
+        }
+        if (map->len == map->cap) {
+            size_t newCap =
+                map->cap < _minEntryCap ? _minEntryCap : map->cap * 2;
+            if (!growEntries(vm, map, newCap)) {
+                return false;
+            }
+        }
+        SlShape *transition = cache->transition;
+        slNewRef(shapeObj(transition));
+        setShape(map, transition);
+        map->entries[map->len++] = (SlMapEntry){
+            .key = slNewRef(cache->key),
+            .value = slNewRef(value),
+            .hash = slStrHash(cache->key)
+        };
+        map->count++;
+        return true;
+    }
+
+    // Keep the previous shape alive, it is the source of the transition
+    SlShape *prevShape = map->shape;
+    if (prevShape != NULL) {
+        slNewRef(shapeObj(prevShape));
+    }
+    bool result = slMapSet(vm, map, cache->key, value);
+    if (result && map->shape != NULL) {
+        if (map->shape != prevShape) {
+            updateCache(cache, prevShape, map->shape, map->len - 1);
+        } else {
+            size_t idx = findEntry(map, cache->key, slStrHash(cache->key));
+            updateCache(cache, map->shape, NULL, idx);
+        }
+    }
+    if (prevShape != NULL) {
+        slDelRef(shapeObj(prevShape));
+    }
+    return result;
+}
+
+bool slMapDropShape(SlVM *vm, SlMap *map) {
+    if (map->shape == NULL) {
+        return true;
+    }
+    // Inline entries are scanned without an index table
+    if (!entriesInline(map) && !growIndex(vm, map, map->count + 1)) {
+        return false;
+    }
+    setShape(map, NULL);
+    return true;
+}
+
+void slFieldCacheClear(SlFieldCache *cache) {
+    slDelRef(cache->key);
+    updateCache(cache, NULL, NULL, 0);
+    cache->key = slNull;
+}
+
+void slShapeDestroy(SlShape *shape) {
+    SlShape *parent = shape->parent;
+    if (parent != NULL) {
+        for (uint32_t i = 0; i < parent->childCount; i++) {
+            if (parent->children[i] == shape) {
+                parent->children[i] = parent->children[--parent->childCount];
+                break;
+            }
+        }
+    }
+    if (shape->rootRef != NULL) {
+        *shape->rootRef = NULL;
+    }
+    slDelRef(shape->key);
+    memFree(shape->children);
+    memFree(shape);
+    if (parent != NULL) {
+        slDelRef(shapeObj(parent));
+    }
+}
+
+static uint32_t mixInt(uint64_t n) {
+    n ^= n >> 33;
+    n *= 0xff51afd7ed558ccdull;
+    n ^= n >> 33;
+    return (uint32_t)n;
+}
+
+bool slMapKeyHash(SlVM *vm, SlObj key, uint32_t *outHash) {
+    switch (key.type) {
+    case SlObj_Null:
+        *outHash = 0x9e3779b9u;
+        return true;
+    case SlObj_Bool:
+        *outHash = key.as.boolean ? 0x85ebca6bu : 0xc2b2ae35u;
+        return true;
+    case SlObj_Int:
+        *outHash = mixInt((uint64_t)key.as.numInt);
+        return true;
+    case SlObj_Float: {
+        // -0.0 and 0.0 are equal and must have the same hash
+        SlFloat value = key.as.numFloat == 0.0 ? 0.0 : key.as.numFloat;
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        *outHash = mixInt(bits) ^ 0x27d4eb2fu;
+        return true;
+    }
+    case SlObj_SmallStr:
+    case SlObj_Str:
+    case SlObj_FrozenStr:
+        // Mutable strings are hashed by content, a frozen copy is stored
+        if (!slStrFlatten(vm, key)) {
+            return false;
+        }
+        *outHash = slStrHash(key);
+        return true;
+    case SlObj_List:
+    case SlObj_FrozenList: {
+        // Mutable lists are frozen when stored and hash like their copy
+        uint32_t hash = 0x811c9dc5u ^ (uint32_t)key.as.list->len;
+        for (size_t i = 0; i < key.as.list->len; i++) {
+            SlObj item = slListGet(key.as.list, i);
+            uint32_t itemHash;
+            bool hashable = slMapKeyHash(vm, item, &itemHash);
+            slDelRef(item);
+            if (!hashable) {
+                return false;
+            }
+            hash = (hash ^ itemHash) * 0x01000193u;
+        }
+        *outHash = hash;
+        return true;
+    }
+    default:
+        slSetError(vm, "%s cannot be used as a map key", slTypeName(key));
+        return false;
+    }
+}
+
+static bool listEq(const SlList *a, const SlList *b) {
+    if (a == b) {
+        return true;
+    } else if (a->len != b->len) {
+        return false;
+    }
+    for (size_t i = 0; i < a->len; i++) {
+        SlObj itemA = slListGet(a, i);
+        SlObj itemB = slListGet(b, i);
+        bool eq = slMapKeyEq(itemA, itemB);
+        slDelRef(itemA);
+        slDelRef(itemB);
+        if (!eq) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool slMapKeyEq(SlObj a, SlObj b) {
+    if (slObjIsStr(a) && slObjIsStr(b)) {
+        return slStrEq(a, b);
+    } else if ((a.type & 0xff) == SlObj_List && (b.type & 0xff) == SlObj_List) {
+        return listEq(a.as.list, b.as.list);
+    }
+    if (a.type != b.type) {
+        return false;
+    }
+    switch (a.type) {
+    case SlObj_Null:
+        return true;
+    case SlObj_Bool:
+        return a.as.boolean == b.as.boolean;
+    case SlObj_Int:
+        return a.as.numInt == b.as.numInt;
+    case SlObj_Float:
+        return a.as.numFloat == b.as.numFloat;
+    default:
+        return a.as.gcObj == b.as.gcObj;
+    }
+}
+
+SlObj slMapStoredKey(SlVM *vm, SlObj key) {
+    if (slObjIsStr(key)) {
+        return slStrIntern(vm, key);
+    } else if (key.type == SlObj_List) {
+        return slFreeze(vm, slNewRef(key));
+    }
+    return slNewRef(key);
+}
+
+static uint64_t loadGroup(const uint8_t *ctrl) {
+    uint64_t group = 0;
+    for (int i = slMapGroupSize - 1; i >= 0; i--) {
+        group = (group << 8) | ctrl[i];
+    }
+    return group;
+}
+
+static uint64_t matchByte(uint64_t group, uint8_t h2) {
+    uint64_t x = group ^ (_lsbs * h2);
+    return (x - _lsbs) & ~x & _msbs;
+}
+
+static uint64_t matchEmpty(uint64_t group) {
+    // Empty is 0b10000000 and deleted is 0b11111110, only empty bytes have the
+    // highest bit set and the second lowest bit clear
+    return group & ~(group << 6) & _msbs;
+}
+
+static uint64_t matchEmptyOrDeleted(uint64_t group) {
+    return group & _msbs;
+}
+
+static uint32_t lowestByte(uint64_t mask) {
+    assert(mask != 0);
+#ifdef _MSC_VER
+    unsigned long bit;
+    _BitScanForward64(&bit, mask);
+    return (uint32_t)bit / 8;
+#else
+    return (uint32_t)__builtin_ctzll(mask) / 8;
+#endif // !_MSC_VER
+}
+
+static uint32_t findPos(const SlMap *map, SlObj key, uint32_t hash) {
+    if (map->count == 0) {
+        return map->indexCap;
+    }
+    uint32_t groupMask = map->indexCap / slMapGroupSize - 1;
+    uint32_t group = h1(hash) & groupMask;
+    for (uint32_t step = 1;; step++) {
+        const uint8_t *ctrl = &map->ctrl[group * slMapGroupSize];
+        uint64_t bytes = loadGroup(ctrl);
+        for (uint64_t m = matchByte(bytes, h2(hash)); m != 0; m &= m - 1) {
+            uint32_t pos = group * slMapGroupSize + lowestByte(m);
+            if (ctrl[pos % slMapGroupSize] != h2(hash)) {
+                continue;
+            }
+            const SlMapEntry *entry = &map->entries[map->indices[pos]];
+            if (entry->hash == hash && slMapKeyEq(entry->key, key)) {
+                return pos;
+            }
+        }
+        if (matchEmpty(bytes) != 0) {
+            return map->indexCap;
+        }
+        // Triangular probing visits every group since their count is a power
+        // of two
+        group = (group + step) & groupMask;
+    }
+}
+
+static uint32_t findFreePos(const SlMap *map, uint32_t hash) {
+    uint32_t groupMask = map->indexCap / slMapGroupSize - 1;
+    uint32_t group = h1(hash) & groupMask;
+    for (uint32_t step = 1;; step++) {
+        uint64_t bytes = loadGroup(&map->ctrl[group * slMapGroupSize]);
+        uint64_t freeBytes = matchEmptyOrDeleted(bytes);
+        if (freeBytes != 0) {
+            return group * slMapGroupSize + lowestByte(freeBytes);
+        }
+        group = (group + step) & groupMask;
+    }
+}
+
+static bool rebuildIndex(SlVM *vm, SlMap *map, uint32_t indexCap) {
+    if (indexCap == 0) {
+        return true;
+    }
+    uint8_t *ctrl = memAllocBytes(
+        indexCap * sizeof(*map->ctrl) + indexCap * sizeof(*map->indices)
+    );
+    if (ctrl == NULL) {
+        slSetOutOfMemoryError(vm);
+        return false;
+    }
+    memset(ctrl, slMapCtrlEmpty, indexCap);
+
+    memFree(map->ctrl);
+    map->ctrl = ctrl;
+    map->indices = (uint32_t *)(ctrl + indexCap);
+    map->indexCap = indexCap;
+    map->growthLeft = indexCap - indexCap / 8 - (uint32_t)map->count;
+
+    for (size_t i = 0; i < map->len; i++) {
+        SlMapEntry *entry = &map->entries[i];
+        if (entry->key.type == SlObj_Empty) {
+            continue;
+        }
+        uint32_t pos = findFreePos(map, entry->hash);
+        map->ctrl[pos] = h2(entry->hash);
+        map->indices[pos] = (uint32_t)i;
+    }
+    return true;
+}
+
+static bool growIndex(SlVM *vm, SlMap *map, size_t count) {
+    uint32_t indexCap = slMapGroupSize;
+    // Keep the table at most 7/8 full
+    while (indexCap - indexCap / 8 < count) {
+        if (indexCap > UINT32_MAX / 2) {
+            slSetError(vm, "maximum map size exceeded");
+            return false;
+        }
+        indexCap *= 2;
+    }
+    // Rebuilding drops the deleted control bytes, grow only if they were not
+    // the reason the table was full
+    if (indexCap < map->indexCap) {
+        indexCap = map->indexCap;
+    } else if (indexCap == map->indexCap && map->count >= indexCap / 2) {
+        indexCap *= 2;
+    }
+    return rebuildIndex(vm, map, indexCap);
+}
+
+static bool growEntries(SlVM *vm, SlMap *map, size_t cap) {
+    SlMapEntry *entries = entriesInline(map)
+        ? memAlloc(cap, sizeof(*entries))
+        : memChange(map->entries, cap, sizeof(*entries));
+    if (entries == NULL) {
+        slSetOutOfMemoryError(vm);
+        return false;
+    }
+    if (entriesInline(map)) {
+        memcpy(entries, map->entries, map->len * sizeof(*entries));
+    }
+    map->entries = entries;
+    map->cap = cap;
+    return true;
+}
+
+static void compactEntries(SlMap *map) {
+    size_t newLen = 0;
+    for (size_t i = 0; i < map->len; i++) {
+        if (map->entries[i].key.type != SlObj_Empty) {
+            map->entries[newLen++] = map->entries[i];
+        }
+    }
+    assert(newLen == map->count);
+    map->len = newLen;
+}
+
+static size_t findEntry(const SlMap *map, SlObj key, uint32_t hash) {
+    if (map->ctrl != NULL && map->shape == NULL) {
+        uint32_t pos = findPos(map, key, hash);
+        return pos == map->indexCap ? SIZE_MAX : map->indices[pos];
+    }
+    // Maps in shape mode or with inline entries are small
+    for (size_t i = 0; i < map->len; i++) {
+        const SlMapEntry *entry = &map->entries[i];
+        if (entry->hash == hash
+            && entry->key.type != SlObj_Empty
+            && slMapKeyEq(entry->key, key))
+        {
+            return i;
+        }
+    }
+    return SIZE_MAX;
+}
+
+static bool appendArray(SlVM *vm, SlMap *map, SlObj value) {
+    if (map->arrayLen == map->arrayCap) {
+        size_t newCap =
+            map->arrayCap < _minEntryCap ? _minEntryCap : map->arrayCap * 2;
+        SlObj *array = memChange(map->array, newCap, sizeof(*array));
+        if (array == NULL) {
+            slSetOutOfMemoryError(vm);
+            return false;
+        }
+        map->array = array;
+        map->arrayCap = newCap;
+    }
+    map->array[map->arrayLen++] = slNewRef(value);
+    return true;
+}
+
+static bool spillArray(SlVM *vm, SlMap *map) {
+    size_t arrayLen = map->arrayLen;
+    if (map->len + arrayLen > map->cap
+        && !growEntries(vm, map, map->len + arrayLen))
+    {
+        return false;
+    }
+    // Array keys were added before any entry
+    memmove(
+        map->entries + arrayLen,
+        map->entries,
+        map->len * sizeof(*map->entries)
+    );
+    for (size_t i = 0; i < arrayLen; i++) {
+        map->entries[i] = (SlMapEntry){
+            .key = slObjInt((int64_t)i),
+            .value = map->array[i],
+            .hash = mixInt((uint64_t)i)
+        };
+    }
+    map->len += arrayLen;
+    map->count += arrayLen;
+    memFree(map->array);
+    map->array = NULL;
+    map->arrayLen = 0;
+    map->arrayCap = 0;
+
+    // Int keys cannot be described by a shape
+    setShape(map, NULL);
+    if (entriesInline(map)) {
+        return true;
+    }
+    return growIndex(vm, map, map->count + 1);
+}
+
+static SlShape *newShape(SlVM *vm, SlShape *parent, SlObj key) {
+    SlShape *shape = memAllocZeroed(1, sizeof(*shape));
+    if (shape == NULL) {
+        slSetOutOfMemoryError(vm);
+        return NULL;
+    }
+    slGCObjInit(&shape->asGCObj);
+    shape->key = slNewRef(key);
+    if (parent != NULL) {
+        shape->parent = parent;
+        shape->keyCount = parent->keyCount + 1;
+        slNewRef(shapeObj(parent));
+    }
+    return shape;
+}
+
+static SlShape *rootShape(SlVM *vm) {
+    if (vm->rootShape != NULL) {
+        slNewRef(shapeObj(vm->rootShape));
+        return vm->rootShape;
+    }
+    SlShape *shape = newShape(vm, NULL, slNull);
+    if (shape == NULL) {
+        return NULL;
+    }
+    shape->rootRef = &vm->rootShape;
+    vm->rootShape = shape;
+    return shape;
+}
+
+static SlShape *shapeTransition(SlVM *vm, SlShape *shape, SlObj key) {
+    for (uint32_t i = 0; i < shape->childCount; i++) {
+        SlShape *child = shape->children[i];
+        if (slStrEq(child->key, key)) {
+            slNewRef(shapeObj(child));
+            return child;
+        }
+    }
+
+    if (shape->childCount == shape->childCap) {
+        uint32_t newCap = shape->childCap == 0 ? 2 : shape->childCap * 2;
+        SlShape **children =
+            memChange(shape->children, newCap, sizeof(*children));
+        if (children == NULL) {
+            slSetOutOfMemoryError(vm);
+            return NULL;
+        }
+        shape->children = children;
+        shape->childCap = newCap;
+    }
+    SlShape *child = newShape(vm, shape, key);
+    if (child == NULL) {
+        return NULL;
+    }
+    shape->children[shape->childCount++] = child;
+    return child;
+}
+
+static void setShape(SlMap *map, SlShape *shape) {
+    SlShape *prevShape = map->shape;
+    map->shape = shape;
+    if (prevShape != NULL) {
+        slDelRef(shapeObj(prevShape));
+    }
+}
+
+static void updateCache(
+    SlFieldCache *cache,
+    SlShape *shape,
+    SlShape *transition,
+    size_t idx
+) {
+    if (shape != NULL) {
+        slNewRef(shapeObj(shape));
+    }
+    if (transition != NULL) {
+        slNewRef(shapeObj(transition));
+    }
+    if (cache->shape != NULL) {
+        slDelRef(shapeObj(cache->shape));
+    }
+    if (cache->transition != NULL) {
+        slDelRef(shapeObj(cache->transition));
+    }
+    cache->shape = shape;
+    cache->transition = transition;
+    cache->idx = (uint32_t)idx;
+}
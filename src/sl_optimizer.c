@@ -0,0 +1,407 @@
+#include <stdint.h>
+
+#include "sl_array.h"
+#include "sl_hashmap.h"
+#include "sl_optimizer.h"
+
+/*
+The AST is optimized before variable names are resolved, so that variables
+whose accesses are all replaced never get a register or a shared slot.
+
+Names are looked up the same way the resolver does: a variable declared with
+`var` can be referenced only after its declaration while functions declared
+with `func` and parameters are visible in the whole block.
+
+A variable is constant when it is declared exactly once in its block, since
+the language has no other way to change the value of a variable.
+*/
+
+// What is known about the value of an expression, a kind implies the ones
+// that come before it
+typedef enum ValueKind {
+    Value_Unknown,
+    Value_Numeric, // either an Int or a Float
+    Value_Int
+} ValueKind;
+
+typedef struct VarInfo {
+    uint32_t declCount; // number of declarations in the block
+    bool visible;
+    bool isConst;
+    ValueKind kind; // only set for variables declared once
+    int64_t value; // set if `isConst` is true
+} VarInfo;
+
+slArrayType(VarInfo, VarInfos, varInfos)
+slArrayImpl(VarInfo, VarInfos, varInfos)
+
+typedef struct Scope {
+    struct Scope *parent;
+    SlStrMap names; // value: index in `vars`
+    VarInfos vars;
+} Scope;
+
+typedef struct OptState {
+    SlVM *vm;
+    SlAst *ast;
+    SlOptLevel level;
+    Scope *scope;
+} OptState;
+
+static SlNode *getNode(const OptState *o, SlNodeIdx idx);
+// Find the variable visible with `name` in the current scope.
+// Return NULL if it is not found.
+static VarInfo *findVar(const OptState *o, SlStrIdx name);
+// Get the variable `name` declared in `scope` creating it if needed.
+// If an error occurs return NULL.
+static VarInfo *addVar(const OptState *o, Scope *scope, SlStrIdx name);
+
+// `*outReturns` is set to true if the statement always ends the function
+static bool optStmnt(OptState *o, SlNodeIdx idx, bool *outReturns);
+static bool optBlock(OptState *o, SlNodeIdx idx, bool *outReturns);
+// `*outDrop` is set to true if the declaration is no longer needed
+static bool optVarDeclr(OptState *o, SlNodeIdx idx, bool *outDrop);
+
+static bool optExpr(OptState *o, SlNodeIdx idx, ValueKind *outKind);
+static void optAccess(OptState *o, SlNodeIdx idx, ValueKind *outKind);
+static void optBinOp(
+    OptState *o,
+    SlNodeIdx idx,
+    ValueKind lhsKind,
+    ValueKind rhsKind,
+    ValueKind *outKind
+);
+// Compute `lhs op rhs` for two Ints with the semantics of the VM.
+// Return false if the result overflows or is not an Int.
+static bool foldInts(SlBinOp op, int64_t lhs, int64_t rhs, int64_t *outRes);
+static bool isIntLiteral(const SlNode *node, int64_t value);
+
+bool slOptimizeAst(SlVM *vm, SlAst *ast, SlOptLevel level) {
+    if (level == SlOpt_None) return true;
+
+    OptState o = {
+        .vm = vm,
+        .ast = ast,
+        .level = level,
+        .scope = NULL
+    };
+    ValueKind kind;
+    return optExpr(&o, ast->root, &kind);
+}
+
+static SlNode *getNode(const OptState *o, SlNodeIdx idx) {
+    assert(idx >= 0 && (uint32_t)idx < o->ast->nodeCount);
+    return &o->ast->nodes[idx];
+}
+
+static VarInfo *findVar(const OptState *o, SlStrIdx name) {
+    for (Scope *scope = o->scope; scope != NULL; scope = scope->parent) {
+        uint32_t *idx = slStrMapGet(&scope->names, name);
+        if (idx != NULL && scope->vars.data[*idx].visible) {
+            return &scope->vars.data[*idx];
+        }
+    }
+    return NULL;
+}
+
+static VarInfo *addVar(const OptState *o, Scope *scope, SlStrIdx name) {
+    uint32_t *idx = slStrMapGet(&scope->names, name);
+    if (idx != NULL) return &scope->vars.data[*idx];
+
+    if (!slStrMapSet(o->vm, &scope->names, name, scope->vars.len)) {
+        return NULL;
+    }
+    if (!varInfosPush(o->vm, &scope->vars, (VarInfo){ 0 })) return NULL;
+    return &scope->vars.data[scope->vars.len - 1];
+}
+
+static bool optStmnt(OptState *o, SlNodeIdx idx, bool *outReturns) {
+    SlNode *node = getNode(o, idx);
+    ValueKind kind;
+    *outReturns = false;
+    switch (node->kind) {
+    case SlNode_Block:
+        return optBlock(o, idx, outReturns);
+    case SlNode_Print:
+        return optExpr(o, node->as.print, &kind);
+    case SlNode_RetStmnt:
+        *outReturns = true;
+        return node->as.retStmnt == -1 || optExpr(o, node->as.retStmnt, &kind);
+    case SlNode_Call:
+        return optExpr(o, idx, &kind);
+    case SlNode_VarDeclr:
+    case SlNode_BinOp:
+    case SlNode_NumInt:
+    case SlNode_Access:
+    case SlNode_Lambda:
+    case SlNode_INVALID:
+        assert(false && "unreachable");
+        return false;
+    }
+    return false;
+}
+
+static bool optBlock(OptState *o, SlNodeIdx idx, bool *outReturns) {
+    SlNode *node = getNode(o, idx);
+    Scope scope = {
+        .parent = o->scope,
+        .names = { .userData = o->ast->strs },
+        .vars = { 0 }
+    };
+    bool ok = false;
+    *outReturns = false;
+
+    // Functions and parameters are already in the variables of the block
+    slMapForeach(node->as.block.vars, SlStrMapBucket, var, i) {
+        VarInfo *info = addVar(o, &scope, var->key);
+        if (info == NULL) goto cleanup;
+        info->visible = true;
+    }
+    for (uint32_t i = 0; i < node->as.block.nodeCount; i++) {
+        SlNode *stmnt = getNode(o, node->as.block.nodes[i]);
+        if (stmnt->kind != SlNode_VarDeclr) continue;
+        VarInfo *info = addVar(o, &scope, stmnt->as.varDeclr.name);
+        if (info == NULL) goto cleanup;
+        info->declCount++;
+    }
+
+    o->scope = &scope;
+
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < node->as.block.nodeCount; i++) {
+        SlNodeIdx stmnt = node->as.block.nodes[i];
+        bool drop = false;
+        if (getNode(o, stmnt)->kind == SlNode_VarDeclr) {
+            if (!optVarDeclr(o, stmnt, &drop)) goto cleanup;
+        } else if (!optStmnt(o, stmnt, outReturns)) {
+            goto cleanup;
+        }
+        if (!drop) node->as.block.nodes[kept++] = stmnt;
+        // Anything after a return is unreachable
+        if (*outReturns) break;
+    }
+    node->as.block.nodeCount = kept;
+    ok = true;
+
+cleanup:
+    o->scope = scope.parent;
+    slStrMapClear(&scope.names);
+    varInfosClear(&scope.vars);
+    return ok;
+}
+
+static bool optVarDeclr(OptState *o, SlNodeIdx idx, bool *outDrop) {
+    SlNode *node = getNode(o, idx);
+    ValueKind kind;
+    if (!optExpr(o, node->as.varDeclr.value, &kind)) return false;
+
+    VarInfo *info = addVar(o, o->scope, node->as.varDeclr.name);
+    assert(info != NULL);
+    info->visible = true;
+    *outDrop = false;
+    if (info->declCount != 1) return true;
+
+    info->kind = kind;
+    SlNode *value = getNode(o, node->as.varDeclr.value);
+    if (o->level >= SlOpt_Propagate && value->kind == SlNode_NumInt) {
+        // Every access that follows is replaced with the value
+        info->isConst = true;
+        info->value = value->as.numInt;
+        *outDrop = true;
+    }
+    return true;
+}
+
+static bool optExpr(OptState *o, SlNodeIdx idx, ValueKind *outKind) {
+    SlNode *node = getNode(o, idx);
+    *outKind = Value_Unknown;
+    switch (node->kind) {
+    case SlNode_NumInt:
+        *outKind = Value_Int;
+        return true;
+    case SlNode_Access:
+        optAccess(o, idx, outKind);
+        return true;
+    case SlNode_BinOp: {
+        ValueKind lhsKind, rhsKind;
+        if (!optExpr(o, node->as.binOp.lhs, &lhsKind)) return false;
+        if (!optExpr(o, node->as.binOp.rhs, &rhsKind)) return false;
+        optBinOp(o, idx, lhsKind, rhsKind, outKind);
+        return true;
+    }
+    case SlNode_Lambda: {
+        bool returns;
+        return optStmnt(o, node->as.lambda.body, &returns);
+    }
+    case SlNode_Call: {
+        ValueKind kind;
+        if (!optExpr(o, node->as.call.callee, &kind)) return false;
+        for (uint16_t i = 0; i < node->as.call.argCount; i++) {
+            if (!optExpr(o, node->as.call.args[i], &kind)) return false;
+        }
+        return true;
+    }
+    case SlNode_Block:
+    case SlNode_VarDeclr:
+    case SlNode_Print:
+    case SlNode_RetStmnt:
+    case SlNode_INVALID:
+        assert(false && "unreachable");
+        return false;
+    }
+    return false;
+}
+
+static void optAccess(OptState *o, SlNodeIdx idx, ValueKind *outKind) {
+    SlNode *node = getNode(o, idx);
+    // Unknown names are reported by the resolver
+    VarInfo *info = findVar(o, node->as.access);
+    if (info == NULL) return;
+
+    *outKind = info->kind;
+    if (info->isConst) {
+        node->kind = SlNode_NumInt;
+        node->as.numInt = info->value;
+    }
+}
+
+static void optBinOp(
+    OptState *o,
+    SlNodeIdx idx,
+    ValueKind lhsKind,
+    ValueKind rhsKind,
+    ValueKind *outKind
+) {
+    SlNode *node = getNode(o, idx);
+    SlNode *lhs = getNode(o, node->as.binOp.lhs);
+    SlNode *rhs = getNode(o, node->as.binOp.rhs);
+    SlBinOp op = node->as.binOp.op;
+
+    int64_t res;
+    if (lhs->kind == SlNode_NumInt
+        && rhs->kind == SlNode_NumInt
+        && foldInts(op, lhs->as.numInt, rhs->as.numInt, &res))
+    {
+        node->kind = SlNode_NumInt;
+        node->as.numInt = res;
+        *outKind = Value_Int;
+        return;
+    }
+
+    if (lhsKind == Value_Int
+        && rhsKind == Value_Int
+        && (op == SlBinOp_Add || op == SlBinOp_Sub || op == SlBinOp_Mul))
+    {
+        *outKind = Value_Int;
+    } else if (lhsKind >= Value_Numeric && rhsKind >= Value_Numeric) {
+        *outKind = Value_Numeric;
+    } else {
+        *outKind = Value_Unknown;
+    }
+
+    // Identities are applied only when the type of the other operand is known
+    // to give the same result: `x + 0` gives 0.0 instead of -0.0 for Floats and
+    // `x * 0` gives NaN or -0.0 for some Floats. Operations on other types are
+    // errors that must not be removed.
+    switch (op) {
+    case SlBinOp_Add:
+        if (isIntLiteral(rhs, 0) && lhsKind == Value_Int) {
+            *node = *lhs;
+        } else if (isIntLiteral(lhs, 0) && rhsKind == Value_Int) {
+            *node = *rhs;
+        }
+        break;
+    case SlBinOp_Sub:
+        if (isIntLiteral(rhs, 0) && lhsKind >= Value_Numeric) {
+            *node = *lhs;
+            *outKind = lhsKind;
+        }
+        break;
+    case SlBinOp_Mul:
+        if (isIntLiteral(rhs, 1) && lhsKind >= Value_Numeric) {
+            *node = *lhs;
+            *outKind = lhsKind;
+        } else if (isIntLiteral(lhs, 1) && rhsKind >= Value_Numeric) {
+            *node = *rhs;
+            *outKind = rhsKind;
+        } else if ((isIntLiteral(rhs, 0) && lhsKind == Value_Int)
+                   || (isIntLiteral(lhs, 0) && rhsKind == Value_Int))
+        {
+            node->kind = SlNode_NumInt;
+            node->as.numInt = 0;
+        }
+        break;
+    case SlBinOp_Div:
+    case SlBinOp_Pow:
+        // Dividing a Float by 1 or raising it to 1 gives the same Float
+        if (isIntLiteral(rhs, 1) && lhsKind >= Value_Numeric) {
+            *node = *lhs;
+            *outKind = lhsKind;
+        }
+        break;
+    case SlBinOp_Mod:
+        break;
+    }
+}
+
+static bool foldInts(SlBinOp op, int64_t lhs, int64_t rhs, int64_t *outRes) {
+    switch (op) {
+    case SlBinOp_Add:
+        if ((rhs > 0 && lhs > INT64_MAX - rhs)
+            || (rhs < 0 && lhs < INT64_MIN - rhs))
+        {
+            return false;
+        }
+        *outRes = lhs + rhs;
+        return true;
+    case SlBinOp_Sub:
+        if ((rhs < 0 && lhs > INT64_MAX + rhs)
+            || (rhs > 0 && lhs < INT64_MIN + rhs))
+        {
+            return false;
+        }
+        *outRes = lhs - rhs;
+        return true;
+    case SlBinOp_Mul:
+        if (lhs > 0) {
+            if (rhs > 0 ? lhs > INT64_MAX / rhs : rhs < INT64_MIN / lhs) {
+                return false;
+            }
+        } else if (rhs > 0) {
+            if (lhs < INT64_MIN / rhs) return false;
+        } else if (lhs != 0 && rhs < INT64_MAX / lhs) {
+            return false;
+        }
+        *outRes = lhs * rhs;
+        return true;
+    case SlBinOp_Div:
+        // Inexact quotients are Floats and dividing by zero gives a Float
+        if (rhs == 0 || (rhs == -1 && lhs == INT64_MIN) || lhs % rhs != 0) {
+            return false;
+        }
+        *outRes = lhs / rhs;
+        return true;
+    case SlBinOp_Mod:
+        if (rhs == 0) return false;
+        *outRes = rhs == -1 ? 0 : lhs % rhs;
+        return true;
+    case SlBinOp_Pow: {
+        // Negative exponents give Floats
+        if (rhs < 0) return false;
+        // Powers of 0, 1 and -1 repeat with a period of 2, any other base
+        // overflows after at most 63 products
+        int64_t exp = lhs >= -1 && lhs <= 1 && rhs > 2 ? 2 - rhs % 2 : rhs;
+        int64_t res = 1;
+        for (int64_t i = 0; i < exp; i++) {
+            if (!foldInts(SlBinOp_Mul, res, lhs, &res)) return false;
+        }
+        *outRes = res;
+        return true;
+    }
+    }
+    return false;
+}
+
+static bool isIntLiteral(const SlNode *node, int64_t value) {
+    return node->kind == SlNode_NumInt && node->as.numInt == value;
+}
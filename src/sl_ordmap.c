@@ -0,0 +1,747 @@
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#include "clib_mem.h"
+#include "sl_map.h"
+#include "sl_ordmap.h"
+#include "sl_str.h"
+
+// Nodes other than the root have at least `_minKeys` keys, a node with at
+// least `_t` keys can lose one without becoming too small
+#define _t ((slOrdMapNodeCap + 1) / 2)
+#define _minKeys (_t - 1)
+
+#define ordMapObj(m) ((SlObj){ .type = SlObj_OrdMap, .as.ordMap = (m) })
+
+// Check that `key` can be stored in an ordered map.
+// If it cannot set an error and return false.
+static bool checkKey(SlVM *vm, SlObj key);
+static SlOrdMapNode *newNode(SlVM *vm, bool leaf);
+// Free a node and its children releasing their keys and values.
+static void destroyNode(SlOrdMapNode *node);
+// Get the index of the first key of `node` that is not less than `key`.
+// If an error occurs return false.
+static bool searchNode(
+    SlVM *vm,
+    const SlOrdMapNode *node,
+    SlObj key,
+    uint16_t *outIdx,
+    bool *outFound
+);
+// Split the full child `idx` of `node` moving its middle key into `node`.
+// If an error occurs return false.
+static bool splitChild(SlVM *vm, SlOrdMapNode *node, uint16_t idx);
+// Make sure that the child `idx` of `node` has at least `_t` keys by
+// borrowing a key from a sibling or merging it with one. Return the index of
+// the child that now holds the keys of the previous one.
+static uint16_t fillChild(SlOrdMapNode *node, uint16_t idx);
+// Merge the child `idx + 1` of `node` and the key between them into the
+// child `idx`.
+static void mergeChildren(SlOrdMapNode *node, uint16_t idx);
+// Remove the key at `idx` of a leaf and return its key and value.
+static void takeFromLeaf(
+    SlOrdMapNode *leaf,
+    uint16_t idx,
+    SlObj *outKey,
+    SlObj *outValue
+);
+// Remove the greatest or least entry of a subtree whose root has at least
+// `_t` keys.
+static void takeMax(SlOrdMapNode *node, SlObj *outKey, SlObj *outValue);
+static void takeMin(SlOrdMapNode *node, SlObj *outKey, SlObj *outValue);
+// Push `node` and the leftmost path below it on the stack of `iter`.
+static void pushLeftmost(SlOrdMapIter *iter, SlOrdMapNode *node);
+
+SlObj slOrdMapNew(SlVM *vm) {
+    SlOrdMap *map = memAllocZeroed(1, sizeof(*map));
+    if (map == NULL) {
+        slSetOutOfMemoryError(vm);
+        return slNull;
+    }
+    slGCObjInit(&map->asGCObj);
+    return ordMapObj(map);
+}
+
+SlObj slOrdMapFromSorted(
+    SlVM *vm,
+    const SlObj *keys,
+    const SlObj *values,
+    size_t count
+) {
+    for (size_t i = 0; i < count; i++) {
+        int cmp = -1;
+        if (!checkKey(vm, keys[i])
+            || (i != 0 && !slOrdMapKeyCmp(vm, keys[i - 1], keys[i], &cmp)))
+        {
+            return slNull;
+        }
+        if (cmp >= 0) {
+            slSetError(vm, "keys must be sorted in increasing order");
+            return slNull;
+        }
+    }
+    SlObj map = slOrdMapNew(vm);
+    if (vm->error.occurred || count == 0) {
+        return map;
+    }
+
+    // The number of nodes of each level depends only on `count`, all of them
+    // are allocated before any reference is moved into the tree
+    size_t levelCounts[slOrdMapMaxHeight];
+    uint32_t height = 0;
+    size_t nodeCount = 0;
+    for (size_t n = count;; n = levelCounts[height - 1] - 1) {
+        size_t levelCount = (n + slOrdMapNodeCap + 1) / (slOrdMapNodeCap + 1);
+        levelCounts[height++] = levelCount;
+        nodeCount += levelCount;
+        if (levelCount == 1) {
+            break;
+        }
+    }
+
+    SlOrdMapNode **nodes = memAllocZeroed(nodeCount, sizeof(*nodes));
+    SlObj *items = memAlloc(count * 2, sizeof(*items));
+    size_t stored = 0;
+    for (size_t i = 0; nodes != NULL && i < nodeCount; i++) {
+        nodes[i] = newNode(vm, i < levelCounts[0]);
+        if (nodes[i] == NULL) {
+            goto error;
+        }
+    }
+    if (nodes == NULL || items == NULL) {
+        slSetOutOfMemoryError(vm);
+        goto error;
+    }
+    for (; stored < count; stored++) {
+        SlObj storedKey = slMapStoredKey(vm, keys[stored]);
+        if (vm->error.occurred) {
+            goto error;
+        }
+        items[stored] = storedKey;
+        items[count + stored] = slNewRef(values[stored]);
+    }
+
+    // Each level is spread evenly over its nodes, the keys between two nodes
+    // are moved to the front of `items` and become the keys of the next level
+    SlObj *levelKeys = items;
+    SlObj *levelValues = items + count;
+    SlOrdMapNode **levelNodes = nodes;
+    size_t n = count;
+    for (uint32_t level = 0; level < height; level++) {
+        size_t levelCount = levelCounts[level];
+        size_t perNode = (n - (levelCount - 1)) / levelCount;
+        size_t extra = (n - (levelCount - 1)) % levelCount;
+        SlOrdMapNode **children = level == 0 ? NULL : levelNodes;
+        if (level != 0) {
+            levelNodes += levelCounts[level - 1];
+        }
+        size_t pos = 0;
+        for (size_t i = 0; i < levelCount; i++) {
+            SlOrdMapNode *node = levelNodes[i];
+            uint16_t keyCount = (uint16_t)(perNode + (i < extra ? 1 : 0));
+            memcpy(node->keys, levelKeys + pos, keyCount * sizeof(SlObj));
+            memcpy(node->values, levelValues + pos, keyCount * sizeof(SlObj));
+            if (children != NULL) {
+                memcpy(
+                    node->children,
+                    children,
+                    (keyCount + 1) * sizeof(*children)
+                );
+                children += keyCount + 1;
+            }
+            node->count = keyCount;
+            pos += keyCount;
+            if (i + 1 < levelCount) {
+                levelKeys[i] = levelKeys[pos];
+                levelValues[i] = levelValues[pos];
+                pos++;
+            }
+        }
+        n = levelCount - 1;
+    }
+    map.as.ordMap->root = levelNodes[0];
+    map.as.ordMap->count = count;
+    memFree(nodes);
+    memFree(items);
+    return map;
+
+error:
+    for (size_t i = 0; nodes != NULL && i < nodeCount; i++) {
+        memFree(nodes[i]);
+    }
+    for (size_t i = 0; i < stored; i++) {
+        slDelRef(items[i]);
+        slDelRef(items[count + i]);
+    }
+    memFree(nodes);
+    memFree(items);
+    slDelRef(map);
+    return slNull;
+}
+
+void slOrdMapDestroy(SlOrdMap *map) {
+    if (map->root != NULL) {
+        destroyNode(map->root);
+    }
+    memFree(map);
+}
+
+SlObj *slOrdMapGet(SlVM *vm, SlOrdMap *map, SlObj key) {
+    if (!checkKey(vm, key)) {
+        return NULL;
+    }
+    for (SlOrdMapNode *node = map->root; node != NULL;) {
+        uint16_t idx;
+        bool found;
+        if (!searchNode(vm, node, key, &idx, &found)) {
+            return NULL;
+        }
+        if (found) {
+            return &node->values[idx];
+        }
+        node = node->leaf ? NULL : node->children[idx];
+    }
+    return NULL;
+}
+
+bool slOrdMapSet(SlVM *vm, SlOrdMap *map, SlObj key, SlObj value) {
+    if (!checkKey(vm, key)) {
+        return false;
+    }
+    if (map->root == NULL) {
+        map->root = newNode(vm, true);
+        if (map->root == NULL) {
+            return false;
+        }
+    }
+    // Full nodes are split on the way down so that there is always room for
+    // the key that a split moves up
+    if (map->root->count == slOrdMapNodeCap) {
+        SlOrdMapNode *root = newNode(vm, false);
+        if (root == NULL) {
+            return false;
+        }
+        root->children[0] = map->root;
+        if (!splitChild(vm, root, 0)) {
+            memFree(root);
+            return false;
+        }
+        map->root = root;
+    }
+
+    SlOrdMapNode *node = map->root;
+    while (true) {
+        uint16_t idx;
+        bool found;
+        if (!searchNode(vm, node, key, &idx, &found)) {
+            return false;
+        }
+        if (found) {
+            SlObj prevValue = node->values[idx];
+            node->values[idx] = slNewRef(value);
+            slDelRef(prevValue);
+            return true;
+        }
+        if (node->leaf) {
+            SlObj storedKey = slMapStoredKey(vm, key);
+            if (vm->error.occurred) {
+                return false;
+            }
+            size_t moved = (node->count - idx) * sizeof(SlObj);
+            memmove(&node->keys[idx + 1], &node->keys[idx], moved);
+            memmove(&node->values[idx + 1], &node->values[idx], moved);
+            node->keys[idx] = storedKey;
+            node->values[idx] = slNewRef(value);
+            node->count++;
+            map->count++;
+            return true;
+        }
+        if (node->children[idx]->count == slOrdMapNodeCap) {
+            if (!splitChild(vm, node, idx)) {
+                return false;
+            }
+            int cmp;
+            if (!slOrdMapKeyCmp(vm, key, node->keys[idx], &cmp)) {
+                return false;
+            }
+            if (cmp == 0) {
+                continue;
+            }
+            idx += cmp > 0 ? 1 : 0;
+        }
+        node = node->children[idx];
+    }
+}
+
+bool slOrdMapDel(SlVM *vm, SlOrdMap *map, SlObj key) {
+    if (!checkKey(vm, key) || map->root == NULL) {
+        return false;
+    }
+
+    // Children are filled on the way down so that removing a key from them
+    // never leaves them with less than `_minKeys` keys
+    SlObj removedKey = slNull, removedValue = slNull;
+    bool removed = false;
+    SlOrdMapNode *node = map->root;
+    while (!removed) {
+        uint16_t idx;
+        bool found;
+        if (!searchNode(vm, node, key, &idx, &found)) {
+            break;
+        }
+        if (found && node->leaf) {
+            takeFromLeaf(node, idx, &removedKey, &removedValue);
+            removed = true;
+        } else if (found) {
+            SlOrdMapNode *left = node->children[idx];
+            SlOrdMapNode *right = node->children[idx + 1];
+            SlObj *slotKey = &node->keys[idx];
+            SlObj *slotValue = &node->values[idx];
+            if (left->count >= _t || right->count >= _t) {
+                removedKey = *slotKey;
+                removedValue = *slotValue;
+                if (left->count >= _t) {
+                    takeMax(left, slotKey, slotValue);
+                } else {
+                    takeMin(right, slotKey, slotValue);
+                }
+                removed = true;
+            } else {
+                mergeChildren(node, idx);
+                node = left;
+            }
+        } else if (node->leaf) {
+            break;
+        } else {
+            node = node->children[fillChild(node, idx)];
+        }
+    }
+
+    // Merging the only two children of the root leaves it empty
+    SlOrdMapNode *root = map->root;
+    if (root->count == 0) {
+        map->root = root->leaf ? NULL : root->children[0];
+        memFree(root);
+    }
+    if (!removed) {
+        return false;
+    }
+    map->count--;
+    slDelRef(removedKey);
+    slDelRef(removedValue);
+    return true;
+}
+
+bool slOrdMapFloor(
+    SlVM *vm,
+    SlOrdMap *map,
+    SlObj key,
+    SlObj *outKey,
+    SlObj **outValue
+) {
+    if (!checkKey(vm, key)) {
+        return false;
+    }
+    SlOrdMapNode *best = NULL;
+    uint16_t bestIdx = 0;
+    for (SlOrdMapNode *node = map->root; node != NULL;) {
+        uint16_t idx;
+        bool found;
+        if (!searchNode(vm, node, key, &idx, &found)) {
+            return false;
+        }
+        if (found) {
+            best = node;
+            bestIdx = idx;
+            break;
+        }
+        if (idx > 0) {
+            best = node;
+            bestIdx = idx - 1;
+        }
+        node = node->leaf ? NULL : node->children[idx];
+    }
+    if (best == NULL) {
+        return false;
+    }
+    *outKey = best->keys[bestIdx];
+    *outValue = &best->values[bestIdx];
+    return true;
+}
+
+bool slOrdMapCeil(
+    SlVM *vm,
+    SlOrdMap *map,
+    SlObj key,
+    SlObj *outKey,
+    SlObj **outValue
+) {
+    if (!checkKey(vm, key)) {
+        return false;
+    }
+    SlOrdMapNode *best = NULL;
+    uint16_t bestIdx = 0;
+    for (SlOrdMapNode *node = map->root; node != NULL;) {
+        uint16_t idx;
+        bool found;
+        if (!searchNode(vm, node, key, &idx, &found)) {
+            return false;
+        }
+        if (idx < node->count) {
+            best = node;
+            bestIdx = idx;
+        }
+        if (found) {
+            break;
+        }
+        node = node->leaf ? NULL : node->children[idx];
+    }
+    if (best == NULL) {
+        return false;
+    }
+    *outKey = best->keys[bestIdx];
+    *outValue = &best->values[bestIdx];
+    return true;
+}
+
+bool slOrdMapIterInit(
+    SlVM *vm,
+    SlOrdMap *map,
+    SlObj lo,
+    SlObj hi,
+    SlOrdMapIter *iter
+) {
+    iter->depth = 0;
+    iter->hi = hi;
+    if ((lo.type != SlObj_Empty && !checkKey(vm, lo))
+        || (hi.type != SlObj_Empty && !checkKey(vm, hi)))
+    {
+        return false;
+    }
+    if (map->root == NULL) {
+        return true;
+    }
+    if (lo.type == SlObj_Empty) {
+        pushLeftmost(iter, map->root);
+        return true;
+    }
+
+    // Keys of the nodes on the path are visited after the subtree below them
+    for (SlOrdMapNode *node = map->root; node != NULL;) {
+        uint16_t idx;
+        bool found;
+        if (!searchNode(vm, node, lo, &idx, &found)) {
+            iter->depth = 0;
+            return false;
+        }
+        assert(iter->depth < slOrdMapMaxHeight);
+        iter->nodes[iter->depth] = node;
+        iter->idx[iter->depth++] = idx;
+        node = found || node->leaf ? NULL : node->children[idx];
+    }
+    return true;
+}
+
+bool slOrdMapIterNext(
+    SlVM *vm,
+    SlOrdMapIter *iter,
+    SlObj *outKey,
+    SlObj **outValue
+) {
+    while (iter->depth != 0) {
+        SlOrdMapNode *node = iter->nodes[iter->depth - 1];
+        uint16_t idx = iter->idx[iter->depth - 1];
+        if (idx == node->count) {
+            iter->depth--;
+            continue;
+        }
+
+        int cmp = -1;
+        if (iter->hi.type != SlObj_Empty
+            && !slOrdMapKeyCmp(vm, node->keys[idx], iter->hi, &cmp))
+        {
+            iter->depth = 0;
+            return false;
+        }
+        if (cmp > 0) {
+            iter->depth = 0;
+            return false;
+        }
+        iter->idx[iter->depth - 1]++;
+        if (!node->leaf) {
+            pushLeftmost(iter, node->children[idx + 1]);
+        }
+        *outKey = node->keys[idx];
+        *outValue = &node->values[idx];
+        return true;
+    }
+    return false;
+}
+
+bool slOrdMapKeyCmp(SlVM *vm, SlObj a, SlObj b, int *outCmp) {
+    if (a.type == SlObj_Int && b.type == SlObj_Int) {
+        *outCmp = (a.as.numInt > b.as.numInt) - (a.as.numInt < b.as.numInt);
+        return true;
+    }
+    if (a.type == SlObj_Float && b.type == SlObj_Float) {
+        SlFloat x = a.as.numFloat, y = b.as.numFloat;
+        *outCmp = (x > y) - (x < y);
+        return true;
+    }
+    if (slObjIsStr(a) && slObjIsStr(b)) {
+        if (!slStrFlatten(vm, a) || !slStrFlatten(vm, b)) {
+            return false;
+        }
+        size_t lenA = slStrLen(&a), lenB = slStrLen(&b);
+        int cmp = memcmp(
+            slStrBytes(&a),
+            slStrBytes(&b),
+            lenA < lenB ? lenA : lenB
+        );
+        *outCmp = cmp != 0 ? cmp : (lenA > lenB) - (lenA < lenB);
+        return true;
+    }
+    slSetError(
+        vm,
+        "cannot compare %s and %s",
+        slTypeName(a),
+        slTypeName(b)
+    );
+    return false;
+}
+
+static bool checkKey(SlVM *vm, SlObj key) {
+    if (key.type == SlObj_Int || slObjIsStr(key)) {
+        return true;
+    }
+    if (key.type == SlObj_Float && !isnan(key.as.numFloat)) {
+        return true;
+    }
+    if (key.type == SlObj_Float) {
+        slSetError(vm, "NaN cannot be used as an ordered map key");
+    } else {
+        slSetError(
+            vm,
+            "%s cannot be used as an ordered map key",
+            slTypeName(key)
+        );
+    }
+    return false;
+}
+
+static SlOrdMapNode *newNode(SlVM *vm, bool leaf) {
+    size_t size = sizeof(SlOrdMapNode);
+    if (!leaf) {
+        size += (slOrdMapNodeCap + 1) * sizeof(SlOrdMapNode *);
+    }
+    SlOrdMapNode *node = memAllocBytes(size);
+    if (node == NULL) {
+        slSetOutOfMemoryError(vm);
+        return NULL;
+    }
+    node->count = 0;
+    node->leaf = leaf;
+    return node;
+}
+
+static void destroyNode(SlOrdMapNode *node) {
+    for (uint16_t i = 0; i < node->count; i++) {
+        slDelRef(node->keys[i]);
+        slDelRef(node->values[i]);
+    }
+    for (uint16_t i = 0; !node->leaf && i <= node->count; i++) {
+        destroyNode(node->children[i]);
+    }
+    memFree(node);
+}
+
+static bool searchNode(
+    SlVM *vm,
+    const SlOrdMapNode *node,
+    SlObj key,
+    uint16_t *outIdx,
+    bool *outFound
+) {
+    uint16_t lo = 0, hi = node->count;
+    *outFound = false;
+    while (lo < hi) {
+        uint16_t mid = (lo + hi) / 2;
+        int cmp;
+        if (!slOrdMapKeyCmp(vm, node->keys[mid], key, &cmp)) {
+            return false;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+            *outFound = cmp == 0;
+        }
+    }
+    *outIdx = lo;
+    return true;
+}
+
+static bool splitChild(SlVM *vm, SlOrdMapNode *node, uint16_t idx) {
+    SlOrdMapNode *left = node->children[idx];
+    SlOrdMapNode *right = newNode(vm, left->leaf);
+    if (right == NULL) {
+        return false;
+    }
+    assert(left->count == slOrdMapNodeCap);
+    right->count = _minKeys;
+    memcpy(right->keys, &left->keys[_t], _minKeys * sizeof(SlObj));
+    memcpy(right->values, &left->values[_t], _minKeys * sizeof(SlObj));
+    if (!left->leaf) {
+        memcpy(right->children, &left->children[_t], _t * sizeof(left));
+    }
+    left->count = _minKeys;
+
+    size_t moved = (node->count - idx) * sizeof(SlObj);
+    memmove(&node->keys[idx + 1], &node->keys[idx], moved);
+    memmove(&node->values[idx + 1], &node->values[idx], moved);
+    memmove(
+        &node->children[idx + 2],
+        &node->children[idx + 1],
+        (node->count - idx) * sizeof(right)
+    );
+    node->keys[idx] = left->keys[_minKeys];
+    node->values[idx] = left->values[_minKeys];
+    node->children[idx + 1] = right;
+    node->count++;
+    return true;
+}
+
+static uint16_t fillChild(SlOrdMapNode *node, uint16_t idx) {
+    SlOrdMapNode *child = node->children[idx];
+    if (child->count >= _t) {
+        return idx;
+    }
+
+    SlOrdMapNode *left = idx > 0 ? node->children[idx - 1] : NULL;
+    SlOrdMapNode *right = idx < node->count ? node->children[idx + 1] : NULL;
+    if (left != NULL && left->count >= _t) {
+        size_t moved = child->count * sizeof(SlObj);
+        memmove(&child->keys[1], child->keys, moved);
+        memmove(&child->values[1], child->values, moved);
+        child->keys[0] = node->keys[idx - 1];
+        child->values[0] = node->values[idx - 1];
+        if (!child->leaf) {
+            memmove(
+                &child->children[1],
+                child->children,
+                (child->count + 1) * sizeof(child)
+            );
+            child->children[0] = left->children[left->count];
+        }
+        left->count--;
+        node->keys[idx - 1] = left->keys[left->count];
+        node->values[idx - 1] = left->values[left->count];
+        child->count++;
+        return idx;
+    }
+    if (right != NULL && right->count >= _t) {
+        child->keys[child->count] = node->keys[idx];
+        child->values[child->count] = node->values[idx];
+        node->keys[idx] = right->keys[0];
+        node->values[idx] = right->values[0];
+        size_t moved = (right->count - 1) * sizeof(SlObj);
+        memmove(right->keys, &right->keys[1], moved);
+        memmove(right->values, &right->values[1], moved);
+        if (!child->leaf) {
+            child->children[child->count + 1] = right->children[0];
+            memmove(
+                right->children,
+                &right->children[1],
+                right->count * sizeof(child)
+            );
+        }
+        right->count--;
+        child->count++;
+        return idx;
+    }
+    if (right != NULL) {
+        mergeChildren(node, idx);
+        return idx;
+    }
+    mergeChildren(node, idx - 1);
+    return idx - 1;
+}
+
+static void mergeChildren(SlOrdMapNode *node, uint16_t idx) {
+    SlOrdMapNode *left = node->children[idx];
+    SlOrdMapNode *right = node->children[idx + 1];
+    assert(left->count + right->count < slOrdMapNodeCap);
+
+    left->keys[left->count] = node->keys[idx];
+    left->values[left->count] = node->values[idx];
+    memcpy(
+        &left->keys[left->count + 1],
+        right->keys,
+        right->count * sizeof(SlObj)
+    );
+    memcpy(
+        &left->values[left->count + 1],
+        right->values,
+        right->count * sizeof(SlObj)
+    );
+    if (!left->leaf) {
+        memcpy(
+            &left->children[left->count + 1],
+            right->children,
+            (right->count + 1) * sizeof(right)
+        );
+    }
+    left->count += right->count + 1;
+    memFree(right);
+
+    size_t moved = (node->count - idx - 1) * sizeof(SlObj);
+    memmove(&node->keys[idx], &node->keys[idx + 1], moved);
+    memmove(&node->values[idx], &node->values[idx + 1], moved);
+    memmove(
+        &node->children[idx + 1],
+        &node->children[idx + 2],
+        (node->count - idx - 1) * sizeof(right)
+    );
+    node->count--;
+}
+
+static void takeFromLeaf(
+    SlOrdMapNode *leaf,
+    uint16_t idx,
+    SlObj *outKey,
+    SlObj *outValue
+) {
+    *outKey = leaf->keys[idx];
+    *outValue = leaf->values[idx];
+    size_t moved = (leaf->count - idx - 1) * sizeof(SlObj);
+    memmove(&leaf->keys[idx], &leaf->keys[idx + 1], moved);
+    memmove(&leaf->values[idx], &leaf->values[idx + 1], moved);
+    leaf->count--;
+}
+
+static void takeMax(SlOrdMapNode *node, SlObj *outKey, SlObj *outValue) {
+    while (!node->leaf) {
+        node = node->children[fillChild(node, node->count)];
+    }
+    takeFromLeaf(node, node->count - 1, outKey, outValue);
+}
+
+static void takeMin(SlOrdMapNode *node, SlObj *outKey, SlObj *outValue) {
+    while (!node->leaf) {
+        node = node->children[fillChild(node, 0)];
+    }
+    takeFromLeaf(node, 0, outKey, outValue);
+}
+
+static void pushLeftmost(SlOrdMapIter *iter, SlOrdMapNode *node) {
+    while (true) {
+        assert(iter->depth < slOrdMapMaxHeight);
+        iter->nodes[iter->depth] = node;
+        iter->idx[iter->depth++] = 0;
+        if (node->leaf) {
+            return;
+        }
+        node = node->children[0];
+    }
+}
@@ -30,11 +30,21 @@ than the old one.
 When a block is opened a new frame is added on top of `vars` and when the block
 is closed all variables with a higher funcLevel are added to an array of shared
 variables.
+
+4) Captures
+
+A captured variable that is set only once is captured by value: closures get a
+copy when they are created and it does not need a shared slot. Functions are
+always shared since closures can capture them before they are declared.
 */
 
 typedef struct VarTable {
     struct VarTable *parent;
     SlStrMap *vars;
+    SlI32Arr uses;
+    // number of times each variable is set, functions are set to null when
+    // the block starts
+    SlI32Arr decls;
     uint32_t funcLevel;
     uint16_t sharedCount;
 } VarTable;
@@ -77,10 +87,13 @@ static SlNodeIdx parseStatement(ParserState *p);
 static SlNodeIdx parseVarDeclr(ParserState *p);
 static SlNodeIdx parseFuncDeclr(ParserState *p);
 static SlNodeIdx parsePrint(ParserState *p);
+static SlNodeIdx parseRetStmnt(ParserState *p);
+static SlNodeIdx parseCallStmnt(ParserState *p);
 static SlNodeIdx parseBlock(ParserState *p);
 static SlNodeIdx parseExpr(ParserState *p);
 static SlNodeIdx parseMul(ParserState *p);
 static SlNodeIdx parseValue(ParserState *p);
+static SlNodeIdx parseCall(ParserState *p, SlNodeIdx callee);
 
 static bool resolveVars(ParserState *p, SlNodeIdx idx);
 
@@ -93,6 +106,7 @@ static void printAccess(SlNode node, const SlAst *ast, uint32_t indent);
 static void printPrint(SlNode node, const SlAst *ast, uint32_t indent);
 static void printRetStmnt(SlNode node, const SlAst *ast, uint32_t indent);
 static void printLambda(SlNode node, const SlAst *ast, uint32_t indent);
+static void printCall(SlNode node, const SlAst *ast, uint32_t indent);
 
 void slPrintAst(const SlAst *ast) {
     printNode(ast->root, ast, 0);
@@ -127,6 +141,9 @@ static void printNode(SlNodeIdx idx, const SlAst *ast, uint32_t indent) {
     case SlNode_RetStmnt:
         printRetStmnt(node, ast, indent);
             break;
+    case SlNode_Call:
+        printCall(node, ast, indent);
+        break;
     case SlNode_INVALID:
         assert(false && "invalid node when printing");
     }
@@ -141,10 +158,12 @@ static void printBlock(SlNode node, const SlAst *ast, uint32_t indent) {
     );
     slMapForeach(node.as.block.vars, SlStrMapBucket, var, i) {
         printf(
-            "%*s- "S_Fmt" @ reg=%"PRIu32", shr=%"PRIi32"\n",
+            "%*s- "S_Fmt" @ idx=%"PRIu16", shr=%"PRIi32", uses=%"PRIi32"%s\n",
             indent * INDENT_WIDTH, "",
             S_Arg(var->key, ast->strs),
-            var->value & 0xff, (int32_t)(var->value >> 16) - 1
+            slVarIdx(var->value), slVarShrIdx(var->value),
+            node.as.block.uses ? node.as.block.uses[i] : 0,
+            slVarByValue(var->value) ? ", by value" : ""
         );
     }
     for (uint32_t i = 0; i < node.as.block.nodeCount; i++) {
@@ -207,7 +226,9 @@ static void printPrint(SlNode node, const SlAst *ast, uint32_t indent) {
 
 static void printRetStmnt(SlNode node, const SlAst *ast, uint32_t indent) {
     printf("%*sreturn\n", indent * INDENT_WIDTH, "");
-    printNode(node.as.print, ast, indent + 1);
+    if (node.as.retStmnt != -1) {
+        printNode(node.as.retStmnt, ast, indent + 1);
+    }
 }
 
 static void printLambda(SlNode node, const SlAst *ast, uint32_t indent) {
@@ -215,13 +236,25 @@ static void printLambda(SlNode node, const SlAst *ast, uint32_t indent) {
     printNode(node.as.lambda.body, ast, indent + 1);
 }
 
+static void printCall(SlNode node, const SlAst *ast, uint32_t indent) {
+    printf("%*scall\n", indent * INDENT_WIDTH, "");
+    printNode(node.as.call.callee, ast, indent + 1);
+    for (uint16_t i = 0; i < node.as.call.argCount; i++) {
+        printNode(node.as.call.args[i], ast, indent + 1);
+    }
+}
+
 static void destroyNode(SlNode node) {
     switch (node.kind) {
     case SlNode_Block:
         memFree(node.as.block.nodes);
+        memFree(node.as.block.uses);
         slStrMapClear(node.as.block.vars);
         memFree(node.as.block.vars);
         break;
+    case SlNode_Call:
+        memFree(node.as.call.args);
+        break;
     default:
         // Nothing to free
         break;
@@ -265,27 +298,39 @@ SlAst slParse(SlVM *vm, const SlSource *source) {
         return (SlAst){ .root = -1 };
     }
 
-    p.funcLevel = 0;
-    p.vars = NULL;
-    if (!resolveVars(&p, root)) {
-        // now p.vars is always owned by a node, no need to free here
-        destroyNodes(p.nodes.data, p.nodes.len);
-        return (SlAst){ .root = -1 };
-    }
-
     memFree(p.tokens.tokens);
 
-    SlAst ast = {
+    return (SlAst){
         .strs = p.tokens.strs,
         .nodes = p.nodes.data,
         .nodeCount = p.nodes.len,
         .root = root
     };
+}
+
+bool slResolveAst(SlVM *vm, SlAst *ast, const char *path) {
+    ParserState p = {
+        .vm = vm,
+        .path = path,
+        .tokens = { .strs = ast->strs },
+        .nodes = {
+            .data = ast->nodes,
+            .len = ast->nodeCount,
+            .cap = ast->nodeCount
+        },
+        .funcLevel = 0,
+        .vars = NULL,
+        .vt = NULL
+    };
+    // now all the variable maps are owned by a node and are freed with the
+    // AST if an error occurs
+    if (!resolveVars(&p, ast->root)) return false;
+
     char *printAst = getenv("SL_PRINT_AST");
     if (printAst && strcmp(printAst, "true") == 0) {
-        printNode(ast.root, &ast, 0);
+        printNode(ast->root, ast, 0);
     }
-    return ast;
+    return true;
 }
 
 static void setError(const ParserState *p, const char *fmt, ...) {
@@ -443,8 +488,13 @@ SlNodeIdx parseStatement(ParserState *p) {
         return parsePrint(p);
     case SlToken_KwFunc:
         return parseFuncDeclr(p);
+    case SlToken_KwReturn:
+        return parseRetStmnt(p);
     case SlToken_LeftCurly:
         return parseBlock(p);
+    case SlToken_Ident:
+    case SlToken_LeftParen:
+        return parseCallStmnt(p);
     default:
         setError(
             p,
@@ -600,6 +650,33 @@ static SlNodeIdx parsePrint(ParserState *p) {
     });
 }
 
+static SlNodeIdx parseRetStmnt(ParserState *p) {
+    uint32_t line = next(p).line;
+    SlNodeIdx expr = -1;
+    if (token(p).kind != SlToken_Semicolon) {
+        expr = parseExpr(p);
+        if (expr == -1) return -1;
+    }
+    if (!expectNext(p, SlToken_Semicolon)) return -1;
+    return addNode(p, (SlNode){
+        .kind = SlNode_RetStmnt,
+        .line = line,
+        .as.retStmnt = expr
+    });
+}
+
+static SlNodeIdx parseCallStmnt(ParserState *p) {
+    uint32_t line = token(p).line;
+    SlNodeIdx expr = parseExpr(p);
+    if (expr == -1) return -1;
+    if (p->nodes.data[expr].kind != SlNode_Call) {
+        setErrorWLine(p, line, "only a call can be used as a statement");
+        return -1;
+    }
+    if (!expectNext(p, SlToken_Semicolon)) return -1;
+    return expr;
+}
+
 static SlNodeIdx parseExpr(ParserState *p) {
     SlNodeIdx lhs = parseMul(p);
     if (lhs == -1) {
@@ -684,20 +761,22 @@ static SlNodeIdx parseMul(ParserState *p) {
 }
 
 static SlNodeIdx parseValue(ParserState *p) {
+    SlNodeIdx value;
     switch (token(p).kind) {
     case SlToken_LeftParen: {
-        SlNodeIdx node = parseExpr(p);
-        if (node == -1) {
+        next(p);
+        value = parseExpr(p);
+        if (value == -1) {
             return -1;
         }
         if (!expectNext(p, SlToken_RightParen)) {
             return -1;
         }
-        return node;
+        break;
     }
     case SlToken_NumInt: {
         SlToken tok = next(p);
-        return addNode(
+        value = addNode(
             p,
             (SlNode){
                 .kind = SlNode_NumInt,
@@ -705,14 +784,16 @@ static SlNodeIdx parseValue(ParserState *p) {
                 .as.numInt = tok.as.numInt
             }
         );
+        break;
     }
     case SlToken_Ident: {
         SlToken tok = next(p);
-        return addNode(p, (SlNode){
+        value = addNode(p, (SlNode){
             .kind = SlNode_Access,
             .line = tok.line,
             .as.access = tok.as.ident
         });
+        break;
     }
     default:
         setError(
@@ -722,6 +803,55 @@ static SlNodeIdx parseValue(ParserState *p) {
         );
         return -1;
     }
+
+    while (value != -1 && token(p).kind == SlToken_LeftParen) {
+        value = parseCall(p, value);
+    }
+    return value;
+}
+
+static SlNodeIdx parseCall(ParserState *p, SlNodeIdx callee) {
+    uint32_t line = next(p).line;
+    SlI32Arr args = { 0 };
+
+    while (token(p).kind != SlToken_RightParen) {
+        if (args.len == UINT16_MAX) {
+            setError(p, "too many arguments (max is %d)", UINT16_MAX);
+            goto error;
+        }
+        SlNodeIdx arg = parseExpr(p);
+        if (arg == -1) goto error;
+        if (!slI32Push(p->vm, &args, arg)) goto error;
+
+        if (
+            token(p).kind != SlToken_Comma
+            && token(p).kind != SlToken_RightParen
+        ) {
+            setError(
+                p,
+                "expected ',' or ')' but found %s instead",
+                slTokenKindToStr(token(p).kind)
+            );
+            goto error;
+        }
+        if (token(p).kind == SlToken_Comma) {
+            next(p);
+        }
+    }
+    next(p);
+
+    return addNode(p, (SlNode){
+        .kind = SlNode_Call,
+        .line = line,
+        .as.call = {
+            .callee = callee,
+            .args = args.data,
+            .argCount = (uint16_t)args.len
+        }
+    });
+error:
+    slI32Clear(&args);
+    return -1;
 }
 
 static bool addVar(const ParserState *p, SlStrIdx name) {
@@ -740,6 +870,8 @@ static bool refVar(const ParserState *p, SlStrIdx name) {
             // then add a share index
             if (vt->funcLevel != funcLevel && *var >> 16 == 0) {
                 *var = ++vt->sharedCount << 16 | *var;
+            } else if (vt->funcLevel == funcLevel) {
+                vt->uses.data[*var & 0xffff]++;
             }
             return true;
         }
@@ -755,9 +887,17 @@ static bool resolveVars(ParserState *p, SlNodeIdx idx) {
     switch (node->kind) {
     case SlNode_Block:
         return resolveBlockVars(p, node);
-    case SlNode_VarDeclr:
+    case SlNode_VarDeclr: {
         if (!resolveVars(p, node->as.varDeclr.value)) return false;
-        return addVar(p, node->as.varDeclr.name);
+        if (!addVar(p, node->as.varDeclr.name)) return false;
+        if (p->vt->uses.len < p->vars->len) {
+            if (!slI32Push(p->vm, &p->vt->uses, 0)) return false;
+            if (!slI32Push(p->vm, &p->vt->decls, 0)) return false;
+        }
+        uint32_t *var = slStrMapGet(p->vars, node->as.varDeclr.name);
+        p->vt->decls.data[slVarIdx(*var)]++;
+        return true;
+    }
     case SlNode_BinOp:
         return resolveVars(p, node->as.binOp.lhs)
             && resolveVars(p, node->as.binOp.rhs);
@@ -788,6 +928,12 @@ static bool resolveVars(ParserState *p, SlNodeIdx idx) {
         return node->as.retStmnt == -1
             ? true
             : resolveVars(p, node->as.retStmnt);
+    case SlNode_Call:
+        if (!resolveVars(p, node->as.call.callee)) return false;
+        for (uint16_t i = 0; i < node->as.call.argCount; i++) {
+            if (!resolveVars(p, node->as.call.args[i])) return false;
+        }
+        return true;
     case SlNode_INVALID:
         assert(false && "invalid node found");
     }
@@ -809,22 +955,46 @@ static bool resolveBlockVars(ParserState *p, SlNode *node) {
         .parent = p->vt,
         .funcLevel = p->funcLevel,
         .vars = vars,
+        .uses = { 0 },
+        .decls = { 0 },
         .sharedCount = 0
     };
+    // Functions and parameters are already declared
+    for (uint32_t i = 0; i < vars->len; i++) {
+        if (!slI32Push(p->vm, &vt.uses, 0)) goto error;
+        if (!slI32Push(p->vm, &vt.decls, 1)) goto error;
+    }
 
-    // ReSharper disable once CppDFALocalValueEscapesFunction
     p->vt = &vt; // never used outside nested calls of this function
     p->vars = vars;
 
     node->as.block.funcCount = vars->len;
 
     for (uint32_t i = 0; i < node->as.block.nodeCount; i++) {
-        if (!resolveVars(p, node->as.block.nodes[i])) return false;
+        if (!resolveVars(p, node->as.block.nodes[i])) goto error;
+    }
+
+    // Only the captured variables that are set again keep a shared slot
+    uint16_t sharedCount = 0;
+    slMapForeach(vars, SlStrMapBucket, var, i) {
+        if (var->value >> 16 == 0) continue;
+        uint16_t varIdx = slVarIdx(var->value);
+        if (vt.decls.data[varIdx] == 1) {
+            var->value = 1u << 31 | varIdx;
+        } else {
+            var->value = (uint32_t)++sharedCount << 16 | varIdx;
+        }
     }
-    node->as.block.sharedCount = p->vt->sharedCount;
+    node->as.block.sharedCount = sharedCount;
+    node->as.block.uses = vt.uses.data;
+    slI32Clear(&vt.decls);
 
     p->vt = vt.parent;
     p->vars = vt.parent ? vt.parent->vars : NULL;
 
     return true;
+error:
+    slI32Clear(&vt.uses);
+    slI32Clear(&vt.decls);
+    return false;
 }
@@ -0,0 +1,1117 @@
+#include <assert.h>
+#include <string.h>
+
+#include "clib_mem.h"
+#include "sl_list.h"
+#include "sl_map.h"
+#include "sl_persist.h"
+#include "sl_str.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif // !_MSC_VER
+
+#define _mask (slPNodeWidth - 1)
+
+#define nodeObj(n) ((SlObj){ .type = SlObj_PNode, .as.pnode = (n) })
+#define emptyKey ((SlObj){ .type = SlObj_Empty })
+
+static SlPNode *newNode(SlVM *vm, SlPNodeKind kind, uint32_t count);
+// Write a slot of a node taking new references to what it contains. `slot`
+// points to an SlObj or to an SlMapEntry depending on the kind of the node.
+static void writeSlot(SlPNode *node, uint32_t idx, const void *slot);
+static void releaseSlot(SlPNode *node, uint32_t idx);
+// Copy a node, the copy takes new references to all of the slots.
+static SlPNode *copyNode(SlVM *vm, const SlPNode *node);
+// Copy a node leaving an uninitialized slot at `idx`.
+static SlPNode *insertSlot(SlVM *vm, const SlPNode *node, uint32_t idx);
+// Copy a node without the slot at `idx`.
+static SlPNode *removeSlot(SlVM *vm, const SlPNode *node, uint32_t idx);
+
+// Get the bottom node of a vector trie that contains `idx`.
+static SlPNode *vecLeaf(const SlPNode *root, uint32_t shift, size_t idx);
+// Build a vector trie with `len` slots, with bottom nodes of kind `leafKind`.
+static SlPNode *vecBuild(
+    SlVM *vm,
+    SlPNodeKind leafKind,
+    const void *slots,
+    size_t len,
+    uint32_t *outShift
+);
+// Copy the path to `idx` and write `slot` there.
+static SlPNode *vecUpdate(
+    SlVM *vm,
+    const SlPNode *node,
+    uint32_t shift,
+    size_t idx,
+    const void *slot
+);
+// Copy the path to the end of a vector trie with `len` slots and write
+// `slot` after the last one. The depth of the trie may change.
+static SlPNode *vecPush(
+    SlVM *vm,
+    SlPNode *root,
+    uint32_t *shift,
+    size_t len,
+    SlPNodeKind leafKind,
+    const void *slot
+);
+
+static SlMapEntry *hamtFind(const SlPNode *node, SlObj key, uint32_t hash);
+static SlPNode *hamtSet(
+    SlVM *vm,
+    const SlPNode *node,
+    uint32_t shift,
+    const SlMapEntry *entry,
+    bool *added
+);
+// Remove `key`, which must be in the trie.
+static SlPNode *hamtDel(
+    SlVM *vm,
+    const SlPNode *node,
+    uint32_t shift,
+    SlObj key,
+    uint32_t hash
+);
+
+static SlObj listFromTrie(SlVM *vm, SlPNode *trie, uint32_t shift, size_t len);
+static SlObj mapFromTries(
+    SlVM *vm,
+    SlPNode *hamt,
+    SlPNode *order,
+    uint32_t orderShift,
+    size_t len,
+    size_t count
+);
+// Create a map with room for `count` entries, small maps have their entries
+// inline.
+// If an error occurs return null.
+static SlObj newFlatMap(SlVM *vm, size_t count);
+// Create a mutable copy of a map that is not stored in tries.
+static SlObj copyFlatMap(SlVM *vm, SlMap *map);
+static SlObj freezeList(SlVM *vm, SlObj list);
+static SlObj freezeMap(SlVM *vm, SlObj map);
+
+static uint32_t popCount(uint32_t n) {
+#ifdef _MSC_VER
+    return __popcnt(n);
+#else
+    return (uint32_t)__builtin_popcount(n);
+#endif // !_MSC_VER
+}
+
+void slPNodeDestroy(SlPNode *node) {
+    for (uint32_t i = 0; i < node->count; i++) {
+        releaseSlot(node, i);
+    }
+    memFree(node);
+}
+
+SlObj slFreeze(SlVM *vm, SlObj obj) {
+    switch (obj.type) {
+    case SlObj_Str: {
+        if (slIsUnique(obj)) {
+            obj.type = SlObj_FrozenStr;
+            return obj;
+        }
+        if (!slStrFlatten(vm, obj)) {
+            slDelRef(obj);
+            return slNull;
+        }
+        SlObj copy = slFrozenStrNew(vm, slStrBytes(&obj), slStrLen(&obj));
+        slDelRef(obj);
+        return copy;
+    }
+    case SlObj_List:
+        return freezeList(vm, obj);
+    case SlObj_Map:
+        return freezeMap(vm, obj);
+    default:
+        return obj;
+    }
+}
+
+SlObj slFrozenListNew(SlVM *vm, const SlObj *items, size_t len) {
+    if (len >= slPersistMinLen) {
+        uint32_t shift;
+        SlPNode *trie = vecBuild(vm, SlPNode_Vec, items, len, &shift);
+        if (trie == NULL) {
+            return slNull;
+        }
+        return listFromTrie(vm, trie, shift, len);
+    }
+
+    // Small frozen lists are a single allocation with exactly enough room
+    SlListKind kind = len == 0 || items[0].type == SlObj_Int
+        ? SlList_Ints
+        : items[0].type == SlObj_Float ? SlList_Floats : SlList_Objs;
+    for (size_t i = 1; i < len && kind != SlList_Objs; i++) {
+        if (items[i].type != items[0].type) {
+            kind = SlList_Objs;
+        }
+    }
+    SlObj list = slListNewInline(vm, kind, len);
+    if (vm->error.occurred) {
+        return slNull;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!slListAppend(vm, list.as.list, items[i])) {
+            slDelRef(list);
+            return slNull;
+        }
+    }
+    list.type = SlObj_FrozenList;
+    return list;
+}
+
+const SlObj *slFrozenListItem(const SlList *list, size_t idx) {
+    assert(list->kind == SlList_Trie && idx < list->len);
+    SlPNode *leaf = vecLeaf(list->trie, list->trieShift, idx);
+    return &slPNodeItems(leaf)[idx & _mask];
+}
+
+// Copy the items of a flat list adding `extra` uninitialized items at the end.
+static SlObj *flatItems(SlVM *vm, const SlList *list, size_t extra) {
+    SlObj *items = memAlloc(list->len + extra, sizeof(*items));
+    if (items == NULL) {
+        slSetOutOfMemoryError(vm);
+        return NULL;
+    }
+    for (size_t i = 0; i < list->len; i++) {
+        items[i] = slListGet(list, i);
+    }
+    return items;
+}
+
+static void freeItems(SlObj *items, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        slDelRef(items[i]);
+    }
+    memFree(items);
+}
+
+SlObj slFrozenListSet(SlVM *vm, SlObj list, size_t idx, SlObj value) {
+    SlList *src = list.as.list;
+    assert(idx < src->len);
+    if (src->kind == SlList_Trie) {
+        SlPNode *trie = vecUpdate(vm, src->trie, src->trieShift, idx, &value);
+        if (trie == NULL) {
+            return slNull;
+        }
+        return listFromTrie(vm, trie, src->trieShift, src->len);
+    }
+
+    SlObj *items = flatItems(vm, src, 0);
+    if (items == NULL) {
+        return slNull;
+    }
+    slDelRef(items[idx]);
+    items[idx] = slNewRef(value);
+    SlObj result = slFrozenListNew(vm, items, src->len);
+    freeItems(items, src->len);
+    return result;
+}
+
+SlObj slFrozenListAppend(SlVM *vm, SlObj list, SlObj value) {
+    SlList *src = list.as.list;
+    if (src->kind == SlList_Trie) {
+        uint32_t shift = src->trieShift;
+        SlPNode *trie =
+            vecPush(vm, src->trie, &shift, src->len, SlPNode_Vec, &value);
+        if (trie == NULL) {
+            return slNull;
+        }
+        return listFromTrie(vm, trie, shift, src->len + 1);
+    }
+
+    SlObj *items = flatItems(vm, src, 1);
+    if (items == NULL) {
+        return slNull;
+    }
+    items[src->len] = slNewRef(value);
+    SlObj result = slFrozenListNew(vm, items, src->len + 1);
+    freeItems(items, src->len + 1);
+    return result;
+}
+
+// Build the tries of a frozen map from the entries that are not removed.
+static SlObj buildTrieMap(SlVM *vm, SlMap *src) {
+    SlMapEntry *entries = memAlloc(slMapCount(src), sizeof(*entries));
+    if (entries == NULL) {
+        slSetOutOfMemoryError(vm);
+        return slNull;
+    }
+    size_t count = 0;
+    size_t iter = 0;
+    SlObj key;
+    SlObj *value;
+    while (slMapNext(src, &iter, &key, &value)) {
+        // Keys of the array part have no stored hash
+        uint32_t hash;
+        if (!slMapKeyHash(vm, key, &hash)) {
+            memFree(entries);
+            return slNull;
+        }
+        entries[count++] = (SlMapEntry){
+            .key = key,
+            .value = *value,
+            .hash = hash
+        };
+    }
+
+    uint32_t orderShift;
+    SlPNode *order =
+        vecBuild(vm, SlPNode_Entries, entries, count, &orderShift);
+    SlPNode *hamt = order == NULL ? NULL : newNode(vm, SlPNode_Hamt, 0);
+    for (size_t i = 0; hamt != NULL && i < count; i++) {
+        SlMapEntry posEntry = {
+            .key = entries[i].key,
+            .value = slObjInt((int64_t)i),
+            .hash = entries[i].hash
+        };
+        bool added = false;
+        SlPNode *newHamt = hamtSet(vm, hamt, 0, &posEntry, &added);
+        slDelRef(nodeObj(hamt));
+        hamt = newHamt;
+    }
+    memFree(entries);
+
+    if (hamt == NULL) {
+        if (order != NULL) {
+            slDelRef(nodeObj(order));
+        }
+        return slNull;
+    }
+    return mapFromTries(vm, hamt, order, orderShift, count, count);
+}
+
+SlObj slFrozenMapNew(SlVM *vm, SlMap *map) {
+    if (slMapCount(map) >= slPersistMinLen) {
+        return buildTrieMap(vm, map);
+    }
+    SlObj copy = copyFlatMap(vm, map);
+    if (vm->error.occurred) {
+        return slNull;
+    }
+    copy.type = SlObj_FrozenMap;
+    return copy;
+}
+
+SlMapEntry *slFrozenMapFind(const SlMap *map, SlObj key, uint32_t hash) {
+    SlMapEntry *posEntry = hamtFind(map->hamt, key, hash);
+    if (posEntry == NULL) {
+        return NULL;
+    }
+    size_t pos = (size_t)posEntry->value.as.numInt;
+    SlPNode *leaf = vecLeaf(map->order, map->orderShift, pos);
+    return &slPNodeEntries(leaf)[pos & _mask];
+}
+
+SlMapEntry *slFrozenMapNext(const SlMap *map, size_t *iter) {
+    while (*iter < map->len) {
+        size_t i = (*iter)++;
+        SlPNode *leaf = vecLeaf(map->order, map->orderShift, i);
+        SlMapEntry *entry = &slPNodeEntries(leaf)[i & _mask];
+        if (entry->key.type != SlObj_Empty) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+SlObj slFrozenMapSet(SlVM *vm, SlObj map, SlObj key, SlObj value) {
+    SlMap *src = map.as.map;
+    if (src->hamt == NULL) {
+        SlObj copy = copyFlatMap(vm, src);
+        if (vm->error.occurred) {
+            return slNull;
+        }
+        if (!slMapSet(vm, copy.as.map, key, value)) {
+            slDelRef(copy);
+            return slNull;
+        }
+        if (slMapCount(copy.as.map) < slPersistMinLen) {
+            copy.type = SlObj_FrozenMap;
+            return copy;
+        }
+        SlObj result = buildTrieMap(vm, copy.as.map);
+        slDelRef(copy);
+        return result;
+    }
+
+    uint32_t hash;
+    if (!slMapKeyHash(vm, key, &hash)) {
+        return slNull;
+    }
+    SlObj storedKey = slMapStoredKey(vm, key);
+    if (vm->error.occurred) {
+        return slNull;
+    }
+    SlMapEntry entry = { .key = storedKey, .value = value, .hash = hash };
+
+    SlObj result = slNull;
+    SlMapEntry *found = hamtFind(src->hamt, storedKey, hash);
+    if (found != NULL) {
+        size_t pos = (size_t)found->value.as.numInt;
+        SlPNode *order =
+            vecUpdate(vm, src->order, src->orderShift, pos, &entry);
+        if (order != NULL) {
+            slNewRef(nodeObj(src->hamt));
+            result = mapFromTries(
+                vm,
+                src->hamt,
+                order,
+                src->orderShift,
+                src->len,
+                src->count
+            );
+        }
+        slDelRef(storedKey);
+        return result;
+    }
+
+    SlMapEntry posEntry = {
+        .key = storedKey,
+        .value = slObjInt((int64_t)src->len),
+        .hash = hash
+    };
+    bool added = false;
+    SlPNode *hamt = hamtSet(vm, src->hamt, 0, &posEntry, &added);
+    uint32_t orderShift = src->orderShift;
+    SlPNode *order = hamt == NULL
+        ? NULL
+        : vecPush(
+            vm,
+            src->order,
+            &orderShift,
+            src->len,
+            SlPNode_Entries,
+            &entry
+        );
+    if (order == NULL) {
+        if (hamt != NULL) {
+            slDelRef(nodeObj(hamt));
+        }
+    } else {
+        result = mapFromTries(
+            vm,
+            hamt,
+            order,
+            orderShift,
+            src->len + 1,
+            src->count + 1
+        );
+    }
+    slDelRef(storedKey);
+    return result;
+}
+
+SlObj slFrozenMapDel(SlVM *vm, SlObj map, SlObj key) {
+    SlMap *src = map.as.map;
+    if (src->hamt == NULL) {
+        SlObj copy = copyFlatMap(vm, src);
+        if (vm->error.occurred) {
+            return slNull;
+        }
+        if (!slMapDel(vm, copy.as.map, key) && vm->error.occurred) {
+            slDelRef(copy);
+            return slNull;
+        }
+        copy.type = SlObj_FrozenMap;
+        return copy;
+    }
+
+    uint32_t hash;
+    if (!slMapKeyHash(vm, key, &hash)) {
+        return slNull;
+    }
+    SlMapEntry *posEntry = hamtFind(src->hamt, key, hash);
+    if (posEntry == NULL) {
+        return slNewRef(map);
+    }
+
+    // The entry is left empty, like removed entries of mutable maps
+    size_t pos = (size_t)posEntry->value.as.numInt;
+    SlMapEntry removed = { .key = emptyKey, .value = slNull };
+    SlPNode *order = vecUpdate(vm, src->order, src->orderShift, pos, &removed);
+    if (order == NULL) {
+        return slNull;
+    }
+    SlPNode *hamt = hamtDel(vm, src->hamt, 0, key, hash);
+    if (hamt == NULL) {
+        slDelRef(nodeObj(order));
+        return slNull;
+    }
+    return mapFromTries(
+        vm,
+        hamt,
+        order,
+        src->orderShift,
+        src->len,
+        src->count - 1
+    );
+}
+
+static size_t slotSize(SlPNodeKind kind) {
+    return kind == SlPNode_Vec ? sizeof(SlObj) : sizeof(SlMapEntry);
+}
+
+static SlPNode *newNode(SlVM *vm, SlPNodeKind kind, uint32_t count) {
+    SlPNode *node = memAllocBytes(sizeof(*node) + count * slotSize(kind));
+    if (node == NULL) {
+        slSetOutOfMemoryError(vm);
+        return NULL;
+    }
+    slGCObjInit(&node->asGCObj);
+    node->bitmap = 0;
+    node->count = count;
+    node->kind = (uint8_t)kind;
+    return node;
+}
+
+static void writeSlot(SlPNode *node, uint32_t idx, const void *slot) {
+    if (node->kind == SlPNode_Vec) {
+        slPNodeItems(node)[idx] = slNewRef(*(const SlObj *)slot);
+        return;
+    }
+    const SlMapEntry *entry = slot;
+    slPNodeEntries(node)[idx] = (SlMapEntry){
+        .key = slNewRef(entry->key),
+        .value = slNewRef(entry->value),
+        .hash = entry->hash
+    };
+}
+
+static void releaseSlot(SlPNode *node, uint32_t idx) {
+    if (node->kind == SlPNode_Vec) {
+        slDelRef(slPNodeItems(node)[idx]);
+        return;
+    }
+    slDelRef(slPNodeEntries(node)[idx].key);
+    slDelRef(slPNodeEntries(node)[idx].value);
+}
+
+static const void *slotAt(const SlPNode *node, uint32_t idx) {
+    return (const uint8_t *)(node + 1) + idx * slotSize(node->kind);
+}
+
+static SlPNode *copyNode(SlVM *vm, const SlPNode *node) {
+    SlPNode *copy = newNode(vm, node->kind, node->count);
+    if (copy == NULL) {
+        return NULL;
+    }
+    copy->bitmap = node->bitmap;
+    for (uint32_t i = 0; i < node->count; i++) {
+        writeSlot(copy, i, slotAt(node, i));
+    }
+    return copy;
+}
+
+static SlPNode *insertSlot(SlVM *vm, const SlPNode *node, uint32_t idx) {
+    SlPNode *copy = newNode(vm, node->kind, node->count + 1);
+    if (copy == NULL) {
+        return NULL;
+    }
+    copy->bitmap = node->bitmap;
+    for (uint32_t i = 0; i < node->count; i++) {
+        writeSlot(copy, i < idx ? i : i + 1, slotAt(node, i));
+    }
+    return copy;
+}
+
+static SlPNode *removeSlot(SlVM *vm, const SlPNode *node, uint32_t idx) {
+    SlPNode *copy = newNode(vm, node->kind, node->count - 1);
+    if (copy == NULL) {
+        return NULL;
+    }
+    copy->bitmap = node->bitmap;
+    for (uint32_t i = 0; i < node->count; i++) {
+        if (i != idx) {
+            writeSlot(copy, i < idx ? i : i - 1, slotAt(node, i));
+        }
+    }
+    return copy;
+}
+
+static SlPNode *vecLeaf(const SlPNode *root, uint32_t shift, size_t idx) {
+    const SlPNode *node = root;
+    for (; shift > 0; shift -= slPNodeBits) {
+        node = slPNodeItems(node)[(idx >> shift) & _mask].as.pnode;
+    }
+    return (SlPNode *)node;
+}
+
+static SlPNode *vecBuild(
+    SlVM *vm,
+    SlPNodeKind leafKind,
+    const void *slots,
+    size_t len,
+    uint32_t *outShift
+) {
+    assert(len > 0);
+    size_t nodeCount = (len + _mask) / slPNodeWidth;
+    SlObj *nodes = memAlloc(nodeCount, sizeof(*nodes));
+    if (nodes == NULL) {
+        slSetOutOfMemoryError(vm);
+        return NULL;
+    }
+
+    SlPNodeKind kind = leafKind;
+    size_t slotCount = len;
+    uint32_t shift = 0;
+    size_t built = 0;
+    for (;;) {
+        for (built = 0; built < nodeCount; built++) {
+            size_t first = built * slPNodeWidth;
+            uint32_t count = (uint32_t)(slotCount - first < slPNodeWidth
+                ? slotCount - first
+                : slPNodeWidth);
+            SlPNode *node = newNode(vm, kind, count);
+            if (node == NULL) {
+                goto error;
+            }
+            // The slots of the level above are the nodes just built, the new
+            // node takes them over
+            for (uint32_t i = 0; i < count; i++) {
+                if (kind == SlPNode_Vec && shift != 0) {
+                    slPNodeItems(node)[i] = nodes[first + i];
+                } else {
+                    const uint8_t *src = slots;
+                    writeSlot(node, i, src + (first + i) * slotSize(kind));
+                }
+            }
+            nodes[built] = nodeObj(node);
+        }
+        if (nodeCount == 1) {
+            break;
+        }
+        slotCount = nodeCount;
+        nodeCount = (nodeCount + _mask) / slPNodeWidth;
+        kind = SlPNode_Vec;
+        shift += slPNodeBits;
+    }
+
+    SlPNode *root = nodes[0].as.pnode;
+    memFree(nodes);
+    *outShift = shift;
+    return root;
+
+error:
+    // The nodes of the previous levels are owned by those already built
+    for (size_t i = 0; i < built; i++) {
+        slDelRef(nodes[i]);
+    }
+    if (shift != 0) {
+        for (size_t i = built * slPNodeWidth; i < slotCount; i++) {
+            slDelRef(nodes[i]);
+        }
+    }
+    memFree(nodes);
+    return NULL;
+}
+
+static SlPNode *vecUpdate(
+    SlVM *vm,
+    const SlPNode *node,
+    uint32_t shift,
+    size_t idx,
+    const void *slot
+) {
+    uint32_t sub = (uint32_t)(idx >> shift) & _mask;
+    SlPNode *child = NULL;
+    if (shift != 0) {
+        child = vecUpdate(
+            vm,
+            slPNodeItems(node)[sub].as.pnode,
+            shift - slPNodeBits,
+            idx,
+            slot
+        );
+        if (child == NULL) {
+            return NULL;
+        }
+    }
+
+    SlPNode *copy = copyNode(vm, node);
+    if (copy == NULL) {
+        if (child != NULL) {
+            slDelRef(nodeObj(child));
+        }
+        return NULL;
+    }
+    releaseSlot(copy, sub);
+    if (child != NULL) {
+        slPNodeItems(copy)[sub] = nodeObj(child);
+    } else {
+        writeSlot(copy, sub, slot);
+    }
+    return copy;
+}
+
+// Create a branch with a single slot, from `shift` down to the bottom.
+static SlPNode *newPath(
+    SlVM *vm,
+    uint32_t shift,
+    SlPNodeKind leafKind,
+    const void *slot
+) {
+    SlPNode *node = newNode(vm, leafKind, 1);
+    if (node == NULL) {
+        return NULL;
+    }
+    writeSlot(node, 0, slot);
+    for (uint32_t s = slPNodeBits; s <= shift; s += slPNodeBits) {
+        SlPNode *parent = newNode(vm, SlPNode_Vec, 1);
+        if (parent == NULL) {
+            slDelRef(nodeObj(node));
+            return NULL;
+        }
+        slPNodeItems(parent)[0] = nodeObj(node);
+        node = parent;
+    }
+    return node;
+}
+
+static SlPNode *pushInto(
+    SlVM *vm,
+    const SlPNode *node,
+    uint32_t shift,
+    size_t idx,
+    SlPNodeKind leafKind,
+    const void *slot
+) {
+    uint32_t sub = (uint32_t)(idx >> shift) & _mask;
+    if (shift == 0) {
+        SlPNode *copy = insertSlot(vm, node, sub);
+        if (copy != NULL) {
+            writeSlot(copy, sub, slot);
+        }
+        return copy;
+    }
+
+    SlPNode *child;
+    if (sub < node->count) {
+        child = pushInto(
+            vm,
+            slPNodeItems(node)[sub].as.pnode,
+            shift - slPNodeBits,
+            idx,
+            leafKind,
+            slot
+        );
+    } else {
+        child = newPath(vm, shift - slPNodeBits, leafKind, slot);
+    }
+    if (child == NULL) {
+        return NULL;
+    }
+
+    SlPNode *copy = sub < node->count
+        ? copyNode(vm, node)
+        : insertSlot(vm, node, sub);
+    if (copy == NULL) {
+        slDelRef(nodeObj(child));
+        return NULL;
+    }
+    if (sub < node->count) {
+        releaseSlot(copy, sub);
+    }
+    slPNodeItems(copy)[sub] = nodeObj(child);
+    return copy;
+}
+
+static SlPNode *vecPush(
+    SlVM *vm,
+    SlPNode *root,
+    uint32_t *shift,
+    size_t len,
+    SlPNodeKind leafKind,
+    const void *slot
+) {
+    if (len < (size_t)slPNodeWidth << *shift) {
+        return pushInto(vm, root, *shift, len, leafKind, slot);
+    }
+
+    // The trie is full, a new root is added above the current one
+    SlPNode *path = newPath(vm, *shift, leafKind, slot);
+    if (path == NULL) {
+        return NULL;
+    }
+    SlPNode *newRoot = newNode(vm, SlPNode_Vec, 2);
+    if (newRoot == NULL) {
+        slDelRef(nodeObj(path));
+        return NULL;
+    }
+    slPNodeItems(newRoot)[0] = slNewRef(nodeObj(root));
+    slPNodeItems(newRoot)[1] = nodeObj(path);
+    *shift += slPNodeBits;
+    return newRoot;
+}
+
+static uint32_t fragment(uint32_t hash, uint32_t shift) {
+    return (hash >> shift) & _mask;
+}
+
+static SlMapEntry *hamtFind(const SlPNode *node, SlObj key, uint32_t hash) {
+    for (uint32_t shift = 0;; shift += slPNodeBits) {
+        SlMapEntry *entries = slPNodeEntries(node);
+        if (node->kind == SlPNode_Collision) {
+            for (uint32_t i = 0; i < node->count; i++) {
+                if (entries[i].hash == hash
+                    && slMapKeyEq(entries[i].key, key))
+                {
+                    return &entries[i];
+                }
+            }
+            return NULL;
+        }
+
+        uint32_t bit = 1u << fragment(hash, shift);
+        if ((node->bitmap & bit) == 0) {
+            return NULL;
+        }
+        SlMapEntry *entry = &entries[popCount(node->bitmap & (bit - 1))];
+        if (entry->key.type != SlObj_Empty) {
+            bool found = entry->hash == hash && slMapKeyEq(entry->key, key);
+            return found ? entry : NULL;
+        }
+        node = entry->value.as.pnode;
+    }
+}
+
+// Create the node that replaces a slot containing `a` when `b` is added.
+static SlPNode *mergeEntries(
+    SlVM *vm,
+    const SlMapEntry *a,
+    const SlMapEntry *b,
+    uint32_t shift
+) {
+    // All the bits of the hashes are equal
+    if (shift >= 32) {
+        SlPNode *node = newNode(vm, SlPNode_Collision, 2);
+        if (node != NULL) {
+            writeSlot(node, 0, a);
+            writeSlot(node, 1, b);
+        }
+        return node;
+    }
+
+    uint32_t fragA = fragment(a->hash, shift);
+    uint32_t fragB = fragment(b->hash, shift);
+    if (fragA != fragB) {
+        SlPNode *node = newNode(vm, SlPNode_Hamt, 2);
+        if (node != NULL) {
+            node->bitmap = (1u << fragA) | (1u << fragB);
+            writeSlot(node, fragA < fragB ? 0 : 1, a);
+            writeSlot(node, fragA < fragB ? 1 : 0, b);
+        }
+        return node;
+    }
+
+    SlPNode *child = mergeEntries(vm, a, b, shift + slPNodeBits);
+    if (child == NULL) {
+        return NULL;
+    }
+    SlPNode *node = newNode(vm, SlPNode_Hamt, 1);
+    if (node == NULL) {
+        slDelRef(nodeObj(child));
+        return NULL;
+    }
+    node->bitmap = 1u << fragA;
+    slPNodeEntries(node)[0] = (SlMapEntry){
+        .key = emptyKey,
+        .value = nodeObj(child)
+    };
+    return node;
+}
+
+static SlPNode *hamtSet(
+    SlVM *vm,
+    const SlPNode *node,
+    uint32_t shift,
+    const SlMapEntry *entry,
+    bool *added
+) {
+    const SlMapEntry *entries = slPNodeEntries(node);
+    SlPNode *copy;
+
+    if (node->kind == SlPNode_Collision) {
+        for (uint32_t i = 0; i < node->count; i++) {
+            if (slMapKeyEq(entries[i].key, entry->key)) {
+                copy = copyNode(vm, node);
+                if (copy != NULL) {
+                    releaseSlot(copy, i);
+                    writeSlot(copy, i, entry);
+                }
+                return copy;
+            }
+        }
+        copy = insertSlot(vm, node, node->count);
+        if (copy != NULL) {
+            writeSlot(copy, node->count, entry);
+            *added = true;
+        }
+        return copy;
+    }
+
+    uint32_t bit = 1u << fragment(entry->hash, shift);
+    uint32_t idx = popCount(node->bitmap & (bit - 1));
+    if ((node->bitmap & bit) == 0) {
+        copy = insertSlot(vm, node, idx);
+        if (copy != NULL) {
+            copy->bitmap |= bit;
+            writeSlot(copy, idx, entry);
+            *added = true;
+        }
+        return copy;
+    }
+
+    const SlMapEntry *current = &entries[idx];
+    SlPNode *child;
+    if (current->key.type == SlObj_Empty) {
+        child = hamtSet(
+            vm,
+            current->value.as.pnode,
+            shift + slPNodeBits,
+            entry,
+            added
+        );
+    } else if (current->hash == entry->hash
+               && slMapKeyEq(current->key, entry->key))
+    {
+        copy = copyNode(vm, node);
+        if (copy != NULL) {
+            releaseSlot(copy, idx);
+            writeSlot(copy, idx, entry);
+        }
+        return copy;
+    } else {
+        child = mergeEntries(vm, current, entry, shift + slPNodeBits);
+        *added = true;
+    }
+    if (child == NULL) {
+        return NULL;
+    }
+
+    copy = copyNode(vm, node);
+    if (copy == NULL) {
+        slDelRef(nodeObj(child));
+        return NULL;
+    }
+    releaseSlot(copy, idx);
+    slPNodeEntries(copy)[idx] = (SlMapEntry){
+        .key = emptyKey,
+        .value = nodeObj(child)
+    };
+    return copy;
+}
+
+static SlPNode *hamtDel(
+    SlVM *vm,
+    const SlPNode *node,
+    uint32_t shift,
+    SlObj key,
+    uint32_t hash
+) {
+    const SlMapEntry *entries = slPNodeEntries(node);
+    if (node->kind == SlPNode_Collision) {
+        uint32_t i = 0;
+        while (!slMapKeyEq(entries[i].key, key)) {
+            i++;
+        }
+        return removeSlot(vm, node, i);
+    }
+
+    uint32_t bit = 1u << fragment(hash, shift);
+    uint32_t idx = popCount(node->bitmap & (bit - 1));
+    assert((node->bitmap & bit) != 0);
+    if (entries[idx].key.type != SlObj_Empty) {
+        SlPNode *copy = removeSlot(vm, node, idx);
+        if (copy != NULL) {
+            copy->bitmap &= ~bit;
+        }
+        return copy;
+    }
+
+    SlPNode *child = hamtDel(
+        vm,
+        entries[idx].value.as.pnode,
+        shift + slPNodeBits,
+        key,
+        hash
+    );
+    if (child == NULL) {
+        return NULL;
+    }
+    SlPNode *copy = copyNode(vm, node);
+    if (copy == NULL) {
+        slDelRef(nodeObj(child));
+        return NULL;
+    }
+    releaseSlot(copy, idx);
+    // A child left with a single entry is replaced by the entry so that
+    // lookups do not go through chains of single-entry nodes
+    if (child->count == 1 && slPNodeEntries(child)[0].key.type != SlObj_Empty) {
+        writeSlot(copy, idx, &slPNodeEntries(child)[0]);
+        slDelRef(nodeObj(child));
+    } else {
+        slPNodeEntries(copy)[idx] = (SlMapEntry){
+            .key = emptyKey,
+            .value = nodeObj(child)
+        };
+    }
+    return copy;
+}
+
+static SlObj listFromTrie(SlVM *vm, SlPNode *trie, uint32_t shift, size_t len) {
+    SlList *list = memAllocZeroed(1, sizeof(*list));
+    if (list == NULL) {
+        slDelRef(nodeObj(trie));
+        slSetOutOfMemoryError(vm);
+        return slNull;
+    }
+    slGCObjInit(&list->asGCObj);
+    list->kind = SlList_Trie;
+    list->trie = trie;
+    list->trieShift = shift;
+    list->len = len;
+    return (SlObj){ .type = SlObj_FrozenList, .as.list = list };
+}
+
+static SlObj mapFromTries(
+    SlVM *vm,
+    SlPNode *hamt,
+    SlPNode *order,
+    uint32_t orderShift,
+    size_t len,
+    size_t count
+) {
+    SlMap *map = memAllocZeroed(1, sizeof(*map));
+    if (map == NULL) {
+        slDelRef(nodeObj(hamt));
+        slDelRef(nodeObj(order));
+        slSetOutOfMemoryError(vm);
+        return slNull;
+    }
+    slGCObjInit(&map->asGCObj);
+    map->hamt = hamt;
+    map->order = order;
+    map->orderShift = orderShift;
+    map->len = len;
+    map->count = count;
+    return (SlObj){ .type = SlObj_FrozenMap, .as.map = map };
+}
+
+static SlObj freezeList(SlVM *vm, SlObj list) {
+    SlList *src = list.as.list;
+    if (slIsUnique(list)) {
+        // Frozen lists keep their items at the start of the storage
+        slListLinearize(src);
+        for (size_t i = 0; src->kind == SlList_Objs && i < src->len; i++) {
+            src->objs[i] = slFreeze(vm, src->objs[i]);
+            if (vm->error.occurred) {
+                slDelRef(list);
+                return slNull;
+            }
+        }
+        list.type = SlObj_FrozenList;
+        return list;
+    }
+
+    SlObj *items = flatItems(vm, src, 0);
+    if (items == NULL) {
+        slDelRef(list);
+        return slNull;
+    }
+    SlObj result = slNull;
+    size_t len = src->len;
+    for (size_t i = 0; i < len; i++) {
+        items[i] = slFreeze(vm, items[i]);
+        if (vm->error.occurred) {
+            goto cleanup;
+        }
+    }
+    result = slFrozenListNew(vm, items, len);
+cleanup:
+    freeItems(items, len);
+    slDelRef(list);
+    return result;
+}
+
+static SlObj freezeMap(SlVM *vm, SlObj map) {
+    SlMap *src = map.as.map;
+    size_t iter = 0;
+    SlObj key;
+    SlObj *value;
+    if (slIsUnique(map)) {
+        while (slMapNext(src, &iter, &key, &value)) {
+            *value = slFreeze(vm, *value);
+            if (vm->error.occurred) {
+                slDelRef(map);
+                return slNull;
+            }
+        }
+        map.type = SlObj_FrozenMap;
+        return map;
+    }
+
+    SlObj copy = newFlatMap(vm, slMapCount(src));
+    if (vm->error.occurred) {
+        slDelRef(map);
+        return slNull;
+    }
+    while (slMapNext(src, &iter, &key, &value)) {
+        SlObj frozenValue = slFreeze(vm, slNewRef(*value));
+        if (vm->error.occurred
+            || !slMapSet(vm, copy.as.map, key, frozenValue))
+        {
+            slDelRef(frozenValue);
+            slDelRef(copy);
+            slDelRef(map);
+            return slNull;
+        }
+        slDelRef(frozenValue);
+    }
+    slDelRef(map);
+    if (slMapCount(copy.as.map) < slPersistMinLen) {
+        copy.type = SlObj_FrozenMap;
+        return copy;
+    }
+    // Copies are stored like any other frozen map of the same size
+    SlObj result = buildTrieMap(vm, copy.as.map);
+    slDelRef(copy);
+    return result;
+}
+
+static SlObj newFlatMap(SlVM *vm, size_t count) {
+    if (count <= slPersistMinLen) {
+        return slMapNewInline(vm, count);
+    }
+    SlObj map = slMapNew(vm);
+    if (vm->error.occurred) {
+        return slNull;
+    }
+    if (!slMapReserve(vm, map.as.map, count)) {
+        slDelRef(map);
+        return slNull;
+    }
+    return map;
+}
+
+static SlObj copyFlatMap(SlVM *vm, SlMap *map) {
+    // One more entry so that `slFrozenMapSet` does not move the entries out
+    SlObj copy = newFlatMap(vm, slMapCount(map) + 1);
+    if (vm->error.occurred) {
+        return slNull;
+    }
+    size_t iter = 0;
+    SlObj key;
+    SlObj *value;
+    while (slMapNext(map, &iter, &key, &value)) {
+        if (!slMapSet(vm, copy.as.map, key, *value)) {
+            slDelRef(copy);
+            return slNull;
+        }
+    }
+    return copy;
+}
@@ -0,0 +1,560 @@
+#include <assert.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "sl_str.h"
+#include "sl_hashmap.h"
+
+_Static_assert(
+    offsetof(SlObj, as) == offsetof(SlObj, reserved) + sizeof(uint32_t)
+        && sizeof(SlObj) - offsetof(SlObj, reserved) == slSmallStrCap + 1,
+    "small strings must fit between `reserved` and the end of SlObj"
+);
+
+#define smallBytes(obj) ((uint8_t *)&(obj)->reserved)
+#define ropeParts(str) ((SlObj *)((str) + 1))
+#define tableMinCap 16
+
+// Marks a removed entry in a string table
+static SlStr tombstoneStr;
+#define tombstone (&tombstoneStr)
+
+static uint32_t heapStrHash(SlStr *str);
+// Check if `str` is a rope that is not referenced anywhere else
+static bool isUniqueRope(SlObj str);
+// Get a new reference to `str` if it is frozen or to a frozen copy of it.
+// If an error occurs return null.
+static SlObj frozenRef(SlVM *vm, SlObj str);
+static SlStrTable *vmStrTable(SlVM *vm);
+// Find a string with the given contents, return NULL if it is not found.
+static SlStr *tableFind(
+    const SlStrTable *table,
+    const uint8_t *bytes,
+    size_t len,
+    uint32_t hash
+);
+static bool tableInsert(SlVM *vm, SlStrTable *table, SlStr *str);
+
+SlObj slSmallStrNew(const uint8_t *bytes, size_t len) {
+    assert(len <= slSmallStrCap);
+    SlObj str = { .type = SlObj_SmallStr };
+    uint8_t *dst = smallBytes(&str);
+    memcpy(dst, bytes, len);
+    memset(dst + len, 0, slSmallStrCap - len);
+    dst[slSmallStrCap] = (uint8_t)(slSmallStrCap - len);
+    return str;
+}
+
+SlStr *slStrAlloc(SlVM *vm, size_t len) {
+    SlStr *str = memAllocBytes(sizeof(*str) + len);
+    if (str == NULL) {
+        slSetOutOfMemoryError(vm);
+        return NULL;
+    }
+    slGCObjInit(&str->asGCObj);
+    str->bytes = (uint8_t *)(str + 1);
+    str->len = len;
+    str->cap = 0;
+    str->hash = 0;
+    str->rope = false;
+    str->internedIn = NULL;
+    str->parent = NULL;
+    return str;
+}
+
+void slStrDestroy(SlStr *str) {
+    while (str != NULL) {
+        SlStr *next = NULL;
+        if (str->internedIn != NULL) {
+            slStrTableRemove(str->internedIn, str);
+        }
+        if (str->cap != 0) {
+            memFree(str->bytes);
+        }
+        if (str->parent != NULL) {
+            slDelRef((SlObj){ .type = SlObj_FrozenStr, .as.str = str->parent });
+        }
+        if (str->rope) {
+            SlObj *parts = ropeParts(str);
+            slDelRef(parts[1]);
+            // Ropes built by appending in a loop are deep on the left, that
+            // side is released without recursion
+            if (isUniqueRope(parts[0])) {
+                next = parts[0].as.str;
+            } else {
+                slDelRef(parts[0]);
+            }
+        }
+        memFree(str);
+        str = next;
+    }
+}
+
+size_t slStrLen(const SlObj *str) {
+    assert(slObjIsStr(*str));
+    if (str->type == SlObj_SmallStr) {
+        return slSmallStrCap - smallBytes(str)[slSmallStrCap];
+    }
+    return str->as.str->len;
+}
+
+const uint8_t *slStrBytes(const SlObj *str) {
+    assert(slObjIsStr(*str));
+    if (str->type == SlObj_SmallStr) {
+        return smallBytes(str);
+    }
+    assert(str->as.str->bytes != NULL && "rope must be flattened");
+    return str->as.str->bytes;
+}
+
+bool slStrFlatten(SlVM *vm, SlObj str) {
+    if (str.type == SlObj_SmallStr || str.as.str->bytes != NULL) {
+        return true;
+    }
+
+    SlStr *root = str.as.str;
+    uint8_t *bytes = memAllocBytes(root->len);
+    if (bytes == NULL) {
+        slSetOutOfMemoryError(vm);
+        return false;
+    }
+
+    // The rope is written from the end so that walking left-deep ropes needs
+    // no stack, only ropes on the right side of a node are saved for later
+    SlStr **pending = NULL;
+    size_t pendingLen = 0, pendingCap = 0;
+    size_t end = root->len;
+    SlObj node = str;
+
+    while (true) {
+        if (node.type == SlObj_SmallStr || node.as.str->bytes != NULL) {
+            size_t len = slStrLen(&node);
+            end -= len;
+            memcpy(bytes + end, slStrBytes(&node), len);
+            if (pendingLen == 0) {
+                break;
+            }
+            node = ropeParts(pending[--pendingLen])[0];
+            continue;
+        }
+
+        SlObj rhs = ropeParts(node.as.str)[1];
+        if (rhs.type == SlObj_SmallStr || rhs.as.str->bytes != NULL) {
+            size_t len = slStrLen(&rhs);
+            end -= len;
+            memcpy(bytes + end, slStrBytes(&rhs), len);
+            node = ropeParts(node.as.str)[0];
+            continue;
+        }
+
+        if (pendingLen == pendingCap) {
+            size_t newCap = pendingCap == 0 ? 8 : pendingCap * 2;
+            SlStr **newPending = memExpand(pending, newCap, sizeof(*pending));
+            if (newPending == NULL) {
+                slSetOutOfMemoryError(vm);
+                memFree(pending);
+                memFree(bytes);
+                return false;
+            }
+            pending = newPending;
+            pendingCap = newCap;
+        }
+        pending[pendingLen++] = node.as.str;
+        node = rhs;
+    }
+    assert(end == 0);
+    memFree(pending);
+
+    SlObj *parts = ropeParts(root);
+    SlObj lhs = parts[0], rhs = parts[1];
+    parts[0] = parts[1] = slNull;
+    root->bytes = bytes;
+    root->cap = root->len;
+    slDelRef(lhs);
+    slDelRef(rhs);
+    return true;
+}
+
+bool slStrEq(SlObj a, SlObj b) {
+    if (a.type == SlObj_SmallStr && b.type == SlObj_SmallStr) {
+        return a.reserved == b.reserved && a.as.numInt == b.as.numInt;
+    }
+    if (a.type != SlObj_SmallStr && b.type != SlObj_SmallStr) {
+        SlStr *strA = a.as.str;
+        SlStr *strB = b.as.str;
+        if (strA == strB) {
+            return true;
+        }
+        if (strA->internedIn != NULL && strA->internedIn == strB->internedIn) {
+            return false;
+        }
+        if (strA->hash != 0 && strB->hash != 0 && strA->hash != strB->hash) {
+            return false;
+        }
+    }
+    size_t len = slStrLen(&a);
+    if (len != slStrLen(&b)) {
+        return false;
+    }
+    return memcmp(slStrBytes(&a), slStrBytes(&b), len) == 0;
+}
+
+uint32_t slStrHash(SlObj str) {
+    if (str.type == SlObj_SmallStr) {
+        return slMemHash(smallBytes(&str), slStrLen(&str));
+    }
+    return heapStrHash(str.as.str);
+}
+
+SlObj slStrConcat(SlVM *vm, SlObj a, SlObj b) {
+    size_t lenA = slStrLen(&a);
+    size_t lenB = slStrLen(&b);
+    // The result is frozen, it cannot be a mutable operand or a rope that
+    // references one
+    if (lenA == 0) {
+        return frozenRef(vm, b);
+    } else if (lenB == 0) {
+        return frozenRef(vm, a);
+    }
+
+    if (lenA + lenB >= slRopeMinLen) {
+        a = frozenRef(vm, a);
+        if (a.type == SlObj_Null) {
+            return slNull;
+        }
+        b = frozenRef(vm, b);
+        if (b.type == SlObj_Null) {
+            slDelRef(a);
+            return slNull;
+        }
+        SlStr *str = memAllocBytes(sizeof(*str) + 2 * sizeof(SlObj));
+        if (str == NULL) {
+            slSetOutOfMemoryError(vm);
+            slDelRef(a);
+            slDelRef(b);
+            return slNull;
+        }
+        slGCObjInit(&str->asGCObj);
+        str->bytes = NULL;
+        str->len = lenA + lenB;
+        str->cap = 0;
+        str->hash = 0;
+        str->rope = true;
+        str->internedIn = NULL;
+        str->parent = NULL;
+        ropeParts(str)[0] = a;
+        ropeParts(str)[1] = b;
+        return (SlObj){ .type = SlObj_FrozenStr, .as.str = str };
+    }
+
+    if (!slStrFlatten(vm, a) || !slStrFlatten(vm, b)) {
+        return slNull;
+    }
+    SlObj parts[2] = { a, b };
+    return slStrJoin(vm, parts, 2);
+}
+
+SlObj slStrAppend(SlVM *vm, SlObj str, SlObj tail) {
+    // Interned strings are shared through the table and ropes still reference
+    // their parts, both are left untouched
+    bool inPlace = str.type != SlObj_SmallStr
+        && slIsUnique(str)
+        && str.as.str->internedIn == NULL
+        && !str.as.str->rope
+        && !(tail.type != SlObj_SmallStr && tail.as.str == str.as.str);
+    if (!inPlace) {
+        SlObj result = slStrConcat(vm, str, tail);
+        slDelRef(str);
+        return result;
+    }
+    if (!slStrFlatten(vm, tail)) {
+        slDelRef(str);
+        return slNull;
+    }
+
+    SlStr *heapStr = str.as.str;
+    size_t tailLen = slStrLen(&tail);
+    size_t newLen = heapStr->len + tailLen;
+    if (newLen > heapStr->cap) {
+        size_t newCap = newLen < slRopeMinLen ? slRopeMinLen : newLen * 2;
+        uint8_t *bytes = heapStr->cap == 0
+            ? memAllocBytes(newCap)
+            : memChangeBytes(heapStr->bytes, newCap);
+        if (bytes == NULL) {
+            slSetOutOfMemoryError(vm);
+            slDelRef(str);
+            return slNull;
+        }
+        if (heapStr->cap == 0) {
+            memcpy(bytes, heapStr->bytes, heapStr->len);
+        }
+        heapStr->bytes = bytes;
+        heapStr->cap = newCap;
+        // A view owns its bytes from now on
+        if (heapStr->parent != NULL) {
+            SlStr *parent = heapStr->parent;
+            heapStr->parent = NULL;
+            slDelRef((SlObj){ .type = SlObj_FrozenStr, .as.str = parent });
+        }
+    }
+    memcpy(heapStr->bytes + heapStr->len, slStrBytes(&tail), tailLen);
+    heapStr->len = newLen;
+    heapStr->hash = 0;
+    return str;
+}
+
+SlObj slStrSlice(SlVM *vm, SlObj str, size_t start, size_t len) {
+    assert(start + len <= slStrLen(&str));
+    if (!slStrFlatten(vm, str)) {
+        return slNull;
+    }
+    if (str.type == SlObj_FrozenStr && start == 0 && len == str.as.str->len) {
+        return slNewRef(str);
+    }
+    // The bytes of a mutable string may change or move, it is always copied
+    const uint8_t *bytes = slStrBytes(&str) + start;
+    if (str.type != SlObj_FrozenStr || len < slStrViewMinLen) {
+        return slFrozenStrNew(vm, bytes, len);
+    }
+
+    SlStr *parent = str.as.str;
+    if (parent->parent != NULL) {
+        parent = parent->parent;
+    }
+    if (len * slStrViewMaxRatio < parent->len) {
+        return slFrozenStrNew(vm, bytes, len);
+    }
+    SlStr *view = memAllocBytes(sizeof(*view));
+    if (view == NULL) {
+        slSetOutOfMemoryError(vm);
+        return slNull;
+    }
+    slGCObjInit(&view->asGCObj);
+    // Views are frozen and the bytes are never written through them
+    view->bytes = (uint8_t *)bytes;
+    view->len = len;
+    view->cap = 0;
+    view->hash = 0;
+    view->rope = false;
+    view->internedIn = NULL;
+    view->parent = parent;
+    slNewRef((SlObj){ .type = SlObj_FrozenStr, .as.str = parent });
+    return (SlObj){ .type = SlObj_FrozenStr, .as.str = view };
+}
+
+SlObj slStrJoin(SlVM *vm, const SlObj *strs, size_t count) {
+    size_t len = 0;
+    for (size_t i = 0; i < count; i++) {
+        len += slStrLen(&strs[i]);
+    }
+
+    uint8_t smallBuf[slSmallStrCap];
+    SlStr *str = NULL;
+    uint8_t *bytes = smallBuf;
+    if (len > slSmallStrCap) {
+        str = slStrAlloc(vm, len);
+        if (str == NULL) {
+            return slNull;
+        }
+        bytes = str->bytes;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        size_t partLen = slStrLen(&strs[i]);
+        memcpy(bytes, slStrBytes(&strs[i]), partLen);
+        bytes += partLen;
+    }
+
+    if (str == NULL) {
+        return slSmallStrNew(smallBuf, len);
+    }
+    return (SlObj){ .type = SlObj_FrozenStr, .as.str = str };
+}
+
+SlObj slStrInternBytes(SlVM *vm, const uint8_t *bytes, size_t len) {
+    if (len <= slSmallStrCap) {
+        return slSmallStrNew(bytes, len);
+    }
+
+    SlStrTable *table = vmStrTable(vm);
+    uint32_t hash = slMemHash(bytes, len);
+    SlStr *found = tableFind(table, bytes, len, hash);
+    if (found != NULL) {
+        return slNewRef((SlObj){ .type = SlObj_FrozenStr, .as.str = found });
+    }
+
+    SlObj str = slFrozenStrNew(vm, bytes, len);
+    if (str.type == SlObj_Null) {
+        return slNull;
+    }
+    str.as.str->hash = hash;
+    if (!tableInsert(vm, table, str.as.str)) {
+        slDelRef(str);
+        return slNull;
+    }
+    return str;
+}
+
+SlObj slStrIntern(SlVM *vm, SlObj str) {
+    if (str.type == SlObj_SmallStr || str.as.str->internedIn != NULL) {
+        return slNewRef(str);
+    }
+    if (!slStrFlatten(vm, str)) {
+        return slNull;
+    }
+    // A mutable string could change while it is in the table and a string
+    // shared with other threads must not reach it, their copy is interned
+    if (str.type != SlObj_FrozenStr || slIsShared(str)) {
+        return slStrInternBytes(vm, str.as.str->bytes, str.as.str->len);
+    }
+
+    SlStrTable *table = vmStrTable(vm);
+    SlStr *found = tableFind(
+        table,
+        str.as.str->bytes,
+        str.as.str->len,
+        heapStrHash(str.as.str)
+    );
+    if (found != NULL) {
+        return slNewRef((SlObj){ .type = SlObj_FrozenStr, .as.str = found });
+    }
+    if (!tableInsert(vm, table, str.as.str)) {
+        return slNull;
+    }
+    return slNewRef(str);
+}
+
+void slStrTableRemove(SlStrTable *table, SlStr *str) {
+    assert(str->internedIn == table);
+    uint32_t mask = table->cap - 1;
+    for (uint32_t idx = heapStrHash(str) & mask;; idx = (idx + 1) & mask) {
+        assert(table->strs[idx] != NULL);
+        if (table->strs[idx] != str) {
+            continue;
+        }
+        table->strs[idx] = tombstone;
+        table->tombstones++;
+        table->len--;
+        break;
+    }
+    str->internedIn = NULL;
+
+    if (table->len == 0) {
+        memFree(table->strs);
+        table->strs = NULL;
+        table->cap = 0;
+        table->tombstones = 0;
+    }
+}
+
+static uint32_t heapStrHash(SlStr *str) {
+    if (str->hash != 0) {
+        return str->hash;
+    }
+    assert(str->bytes != NULL && "rope must be flattened");
+    uint32_t hash = slMemHash(str->bytes, str->len);
+    // A hash of zero is not cached and is recomputed each time, neither is
+    // the hash of a shared string: other threads read it
+    if (!slIsShared((SlObj){ .type = SlObj_FrozenStr, .as.str = str })) {
+        str->hash = hash;
+    }
+    return hash;
+}
+
+static bool isUniqueRope(SlObj str) {
+    return str.type == SlObj_FrozenStr
+        && str.as.str->rope
+        && !slIsShared(str)
+        && str.as.str->asGCObj.refCount == 1;
+}
+
+static SlObj frozenRef(SlVM *vm, SlObj str) {
+    if (str.type != SlObj_Str) {
+        return slNewRef(str);
+    }
+    if (!slStrFlatten(vm, str)) {
+        return slNull;
+    }
+    return slFrozenStrNew(vm, str.as.str->bytes, str.as.str->len);
+}
+
+static SlStrTable *vmStrTable(SlVM *vm) {
+    return vm->strTable != NULL ? vm->strTable : &vm->ownStrTable;
+}
+
+static SlStr *tableFind(
+    const SlStrTable *table,
+    const uint8_t *bytes,
+    size_t len,
+    uint32_t hash
+) {
+    if (table->cap == 0) {
+        return NULL;
+    }
+    uint32_t mask = table->cap - 1;
+    for (uint32_t idx = hash & mask;; idx = (idx + 1) & mask) {
+        SlStr *entry = table->strs[idx];
+        if (entry == NULL) {
+            return NULL;
+        }
+        if (
+            entry != tombstone
+            && entry->len == len
+            && heapStrHash(entry) == hash
+            && memcmp(entry->bytes, bytes, len) == 0
+        ) {
+            return entry;
+        }
+    }
+}
+
+static bool tableGrow(SlStrTable *table) {
+    uint32_t newCap = tableMinCap;
+    while (newCap / 2 < table->len + 1) {
+        newCap *= 2;
+    }
+    SlStr **newStrs = memAllocZeroed(newCap, sizeof(*newStrs));
+    if (newStrs == NULL) {
+        return false;
+    }
+
+    uint32_t mask = newCap - 1;
+    for (uint32_t i = 0; i < table->cap; i++) {
+        SlStr *entry = table->strs[i];
+        if (entry == NULL || entry == tombstone) {
+            continue;
+        }
+        uint32_t idx = heapStrHash(entry) & mask;
+        while (newStrs[idx] != NULL) {
+            idx = (idx + 1) & mask;
+        }
+        newStrs[idx] = entry;
+    }
+    memFree(table->strs);
+    table->strs = newStrs;
+    table->cap = newCap;
+    table->tombstones = 0;
+    return true;
+}
+
+static bool tableInsert(SlVM *vm, SlStrTable *table, SlStr *str) {
+    if (table->cap / 2 + table->cap / 4 < table->len + table->tombstones + 1) {
+        if (!tableGrow(table)) {
+            slSetOutOfMemoryError(vm);
+            return false;
+        }
+    }
+
+    uint32_t mask = table->cap - 1;
+    uint32_t idx = heapStrHash(str) & mask;
+    while (table->strs[idx] != NULL && table->strs[idx] != tombstone) {
+        idx = (idx + 1) & mask;
+    }
+    if (table->strs[idx] == tombstone) {
+        table->tombstones--;
+    }
+    table->strs[idx] = str;
+    table->len++;
+    str->internedIn = table;
+    return true;
+}
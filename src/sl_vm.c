@@ -1,4 +1,9 @@
 #include "sl_vm.h"
+#include "sl_list.h"
+#include "sl_map.h"
+#include "sl_ordmap.h"
+#include "sl_persist.h"
+#include "sl_str.h"
 #include "clib_mem.h"
 
 #include <string.h>
@@ -7,7 +12,33 @@
 #include <assert.h>
 #include <errno.h>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#define threadLocal __declspec(thread)
+#else
+#define threadLocal _Thread_local
+#endif // !_MSC_VER
+
 static void destroyObj(SlObj o);
+// Share the keys and values of a node of an ordered map and its children.
+// If an error occurs return false.
+static bool shareOrdMapNode(SlVM *vm, SlOrdMapNode *node);
+// Find the link to the first open slot of the running frame whose location is
+// not above `location`, or to the first slot of another frame.
+static SlSharedSlot **findOpenSlot(SlVM *vm, SlObj *location);
+
+// The address of this variable is unique to each thread and is used to tell
+// the owner of an object apart from the other threads.
+static threadLocal uint8_t threadTag;
+// Owner of objects whose biased count has been merged, never equal to the
+// tag of a thread.
+static const uint8_t mergedOwner;
+
+static const void *currentThread(void);
+static const void *loadOwner(const SlGCObj *obj);
+static void storeOwner(SlGCObj *obj, const void *owner);
+// Atomically add `value` to `*counter` and return the new value.
+static int64_t atomicAdd(volatile int64_t *counter, int64_t value);
 
 SlSource slSourceFromCStr(const char *str) {
     size_t len = strlen(str);
@@ -45,7 +76,10 @@ SlSource *slSourceFromFile(SlVM *vm, const char *path) {
         slSetError(vm, "file too big %.1024s, maximum size is 4GiB", path);
         goto exit;
     }
-    assert(fseek(f, 0, SEEK_SET) == 0);
+    if (fseek(f, 0, SEEK_SET) != 0) {
+        slSetError(vm, "failed to seek %.1024s: %s", path, strerror(errno));
+        goto exit;
+    }
 
     ret = memAllocBytes(sizeof(*ret) + fileSize);
     if (ret == NULL) {
@@ -87,7 +121,7 @@ SlObj slObjInt(int64_t value) {
 
 SlObj slObjFloat(double value) {
     return (SlObj) {
-        .type = SlObj_Int,
+        .type = SlObj_Float,
         .as.numFloat = value
     };
 }
@@ -97,16 +131,14 @@ SlObj slFrozenStrNew(
     const uint8_t *bytes,
     size_t len
 ) {
-    SlStr *str = memAllocBytes(sizeof(*str) + len * sizeof(*bytes));
+    if (len <= slSmallStrCap) {
+        return slSmallStrNew(bytes, len);
+    }
+
+    SlStr *str = slStrAlloc(vm, len);
     if (str == NULL) {
-        slSetOutOfMemoryError(vm);
         return slNull;
     }
-
-    str->asGCObj.refCount = 1;
-    str->bytes = (uint8_t *)(str + 1);
-    str->len = len;
-    str->cap = 0;
     memcpy(str->bytes, bytes, len * sizeof(*bytes));
 
     return (SlObj){ .type = SlObj_FrozenStr, .as.str = str };
@@ -115,21 +147,27 @@ SlObj slFrozenStrNew(
 SlObj slFrozenStrFmt(SlVM *vm, const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
-    size_t len = (size_t)vsnprintf(NULL, 0, fmt, args) + 1;
+    va_list argsCopy;
+    va_copy(argsCopy, args);
+    size_t len = (size_t)vsnprintf(NULL, 0, fmt, argsCopy);
+    va_end(argsCopy);
+
+    if (len <= slSmallStrCap) {
+        char bytes[slSmallStrCap + 1];
+        (void)vsnprintf(bytes, sizeof(bytes), fmt, args);
+        va_end(args);
+        return slSmallStrNew((uint8_t *)bytes, len);
+    }
 
-    SlStr *str = memAllocBytes(sizeof(*str) + len * sizeof(str->bytes));
+    // Room for the NUL terminator written by vsnprintf
+    SlStr *str = slStrAlloc(vm, len + 1);
     if (str == NULL) {
-        slSetOutOfMemoryError(vm);
         va_end(args);
         return slNull;
     }
+    str->len = len;
 
-    str->asGCObj.refCount = 1;
-    str->bytes = (uint8_t *)(str + 1);
-    str->len = len - 1;
-    str->cap = 0;
-
-    (void)vsnprintf((char *)str->bytes, len, fmt, args);
+    (void)vsnprintf((char *)str->bytes, len + 1, fmt, args);
     va_end(args);
 
     return (SlObj){ .type = SlObj_FrozenStr, .as.str = str };
@@ -144,6 +182,7 @@ SlObj slPrototypeNew(
     SlSharedInfo *sharedInfo,
     uint16_t sharedCount,
     uint16_t frameSize,
+    uint16_t paramCount,
     SlDebugInfo *debugInfo
 ) {
     SlPrototype *proto = memAllocBytes(sizeof(*proto));
@@ -159,7 +198,7 @@ SlObj slPrototypeNew(
         return slNull;
     }
 
-    proto->asGCObj.refCount = 1;
+    slGCObjInit(&proto->asGCObj);
     proto->bytes = bytes;
     proto->size = size;
     proto->constants = constants;
@@ -167,27 +206,310 @@ SlObj slPrototypeNew(
     proto->sharedInfo = sharedInfo;
     proto->sharedCount = sharedCount;
     proto->frameSize = frameSize;
+    proto->paramCount = paramCount;
     proto->debugInfo = debugInfo;
 
     return (SlObj){ .type = SlObj_Prototype, .as.proto = proto };
 }
 
+SlObj slFuncNew(SlVM *vm, SlObj proto) {
+    assert(proto.type == SlObj_Prototype);
+    uint16_t sharedCount = proto.as.proto->sharedCount;
+    SlFunc *func = memAllocZeroedBytes(
+        sizeof(*func) + sharedCount * sizeof(*func->sharedSlots)
+    );
+    if (func == NULL) {
+        slSetOutOfMemoryError(vm);
+        return slNull;
+    }
+    slGCObjInit(&func->asGCObj);
+    func->proto = slNewRef(proto).as.proto;
+    return (SlObj){ .type = SlObj_Func, .as.func = func };
+}
+
+SlSharedSlot *slOpenSharedSlot(SlVM *vm, uint16_t reg) {
+    assert(reg < vm->bytecode->frameSize);
+    SlObj *location = &vm->stackPtr[reg];
+    SlSharedSlot **link = findOpenSlot(vm, location);
+    if (*link != NULL && (*link)->location == location) {
+        slNewRef((SlObj){ .type = SlObj_SharedSlot, .as.sharedSlot = *link });
+        return *link;
+    }
+
+    SlSharedSlot *slot = memAllocBytes(sizeof(*slot));
+    if (slot == NULL) {
+        slSetOutOfMemoryError(vm);
+        return NULL;
+    }
+    // One reference for the list of open slots and one for the caller
+    slGCObjInit(&slot->asGCObj);
+    slot->asGCObj.refCount++;
+    slot->location = location;
+    slot->value = slNull;
+    slot->nextOpen = *link;
+    *link = slot;
+    return slot;
+}
+
+void slCloseSharedSlots(SlVM *vm, uint16_t from, uint16_t to) {
+    assert(from <= to && to < vm->bytecode->frameSize);
+    SlSharedSlot **link = findOpenSlot(vm, &vm->stackPtr[to]);
+    while (*link != NULL
+           && (*link)->location >= &vm->stackPtr[from]
+           && (*link)->location <= &vm->stackPtr[to])
+    {
+        SlSharedSlot *slot = *link;
+        *link = slot->nextOpen;
+        slot->nextOpen = NULL;
+        slot->value = slNewRef(*slot->location);
+        slot->location = &slot->value;
+        slDelRef((SlObj){ .type = SlObj_SharedSlot, .as.sharedSlot = slot });
+    }
+}
+
+static SlSharedSlot **findOpenSlot(SlVM *vm, SlObj *location) {
+    // The frames are in different stack blocks, only the addresses of the
+    // running one can be compared
+    SlObj *frameEnd = &vm->stackPtr[vm->bytecode->frameSize];
+    SlSharedSlot **link = &vm->openSlots;
+    while (*link != NULL
+           && (*link)->location > location
+           && (*link)->location < frameEnd)
+    {
+        link = &(*link)->nextOpen;
+    }
+    return link;
+}
+
+void slGCObjInit(SlGCObj *obj) {
+    obj->refCount = 1;
+    obj->sharedRefCount = 0;
+    obj->owner = NULL;
+}
+
 SlObj slNewRef(SlObj obj) {
-    if (!slObjIsSmall(obj)) {
-        obj.as.gcObj->refCount++;
+    if (slObjIsSmall(obj)) {
+        return obj;
+    }
+    SlGCObj *gcObj = obj.as.gcObj;
+    const void *owner = loadOwner(gcObj);
+    if (owner == NULL || owner == currentThread()) {
+        gcObj->refCount++;
+    } else {
+        atomicAdd(&gcObj->sharedRefCount, 2);
     }
     return obj;
 }
 
 void slDelRef(SlObj obj) {
-    if (!slObjIsSmall(obj)) {
-        obj.as.gcObj->refCount--;
-        if (obj.as.gcObj->refCount == 0) {
+    if (slObjIsSmall(obj)) {
+        return;
+    }
+    SlGCObj *gcObj = obj.as.gcObj;
+    const void *owner = loadOwner(gcObj);
+    if (owner == NULL) {
+        gcObj->refCount--;
+        if (gcObj->refCount == 0) {
             destroyObj(obj);
         }
+    } else if (owner == currentThread()) {
+        gcObj->refCount--;
+        if (gcObj->refCount != 0) {
+            return;
+        }
+        // From now on every thread, including this one, uses the shared count
+        storeOwner(gcObj, &mergedOwner);
+        if (atomicAdd(&gcObj->sharedRefCount, 1) == 1) {
+            destroyObj(obj);
+        }
+    } else if (atomicAdd(&gcObj->sharedRefCount, -2) == 1) {
+        // The count of the owner was already merged and this was the last
+        // reference
+        destroyObj(obj);
     }
 }
 
+bool slShare(SlVM *vm, SlObj o) {
+    if (slObjIsSmall(o) || loadOwner(o.as.gcObj) != NULL) {
+        return true;
+    }
+    // Other threads read the bytes and the cached hash, a rope is flattened
+    // and hashed before it is shared since neither is done afterwards
+    if ((o.type & 0xff) == SlObj_Str) {
+        if (!slStrFlatten(vm, o)) {
+            return false;
+        }
+        slStrHash(o);
+    }
+    // Other threads would update the transitions of a shape and their
+    // references to it, maps are switched to dictionary mode instead
+    if ((o.type & 0xff) == SlObj_Map && !slMapDropShape(vm, o.as.map)) {
+        return false;
+    }
+    storeOwner(o.as.gcObj, currentThread());
+
+    switch ((SlObjType)(o.type & 0xff)) {
+    case SlObj_Prototype:
+        for (uint32_t i = 0; i < o.as.proto->constCount; i++) {
+            if (!slShare(vm, o.as.proto->constants[i])) {
+                return false;
+            }
+        }
+        break;
+    case SlObj_Str:
+        // The intern table belongs to the thread of the VM, other threads
+        // must not update it when they release the string
+        if (o.as.str->internedIn != NULL) {
+            slStrTableRemove(o.as.str->internedIn, o.as.str);
+        }
+        if (o.as.str->parent != NULL) {
+            SlObj parent = {
+                .type = SlObj_FrozenStr,
+                .as.str = o.as.str->parent
+            };
+            if (!slShare(vm, parent)) {
+                return false;
+            }
+        }
+        break;
+    case SlObj_List:
+        if (o.as.list->parent != NULL) {
+            SlObj parent = {
+                .type = SlObj_FrozenList,
+                .as.list = o.as.list->parent
+            };
+            if (!slShare(vm, parent)) {
+                return false;
+            }
+        }
+        if (o.as.list->kind == SlList_Trie) {
+            SlObj trie = { .type = SlObj_PNode, .as.pnode = o.as.list->trie };
+            if (!slShare(vm, trie)) {
+                return false;
+            }
+        }
+        if (o.as.list->kind != SlList_Objs) {
+            break;
+        }
+        for (size_t i = 0; i < o.as.list->len; i++) {
+            SlObj item = o.as.list->objs[slListPos(o.as.list, i)];
+            if (!slShare(vm, item)) {
+                return false;
+            }
+        }
+        break;
+    case SlObj_Map:
+        for (size_t i = 0; i < o.as.map->arrayLen; i++) {
+            if (!slShare(vm, o.as.map->array[i])) {
+                return false;
+            }
+        }
+        for (size_t i = 0; i < o.as.map->len; i++) {
+            if (!slShare(vm, o.as.map->entries[i].key)) {
+                return false;
+            }
+            if (!slShare(vm, o.as.map->entries[i].value)) {
+                return false;
+            }
+        }
+        if (o.as.map->hamt != NULL) {
+            SlObj hamt = { .type = SlObj_PNode, .as.pnode = o.as.map->hamt };
+            SlObj order = { .type = SlObj_PNode, .as.pnode = o.as.map->order };
+            if (!slShare(vm, hamt) || !slShare(vm, order)) {
+                return false;
+            }
+        }
+        break;
+    case SlObj_OrdMap:
+        if (o.as.ordMap->root != NULL
+            && !shareOrdMapNode(vm, o.as.ordMap->root))
+        {
+            return false;
+        }
+        break;
+    case SlObj_PNode:
+        for (uint32_t i = 0; i < o.as.pnode->count; i++) {
+            if (o.as.pnode->kind == SlPNode_Vec) {
+                if (!slShare(vm, slPNodeItems(o.as.pnode)[i])) {
+                    return false;
+                }
+                continue;
+            }
+            SlMapEntry *entry = &slPNodeEntries(o.as.pnode)[i];
+            if (!slShare(vm, entry->key) || !slShare(vm, entry->value)) {
+                return false;
+            }
+        }
+        break;
+    case SlObj_Func: {
+        for (uint16_t i = 0; i < o.as.func->proto->sharedCount; i++) {
+            SlObj slot = {
+                .type = SlObj_SharedSlot,
+                .as.sharedSlot = o.as.func->sharedSlots[i]
+            };
+            if (!slShare(vm, slot)) {
+                return false;
+            }
+        }
+        SlObj proto = {
+            .type = SlObj_Prototype,
+            .as.proto = o.as.func->proto
+        };
+        if (!slShare(vm, proto)) {
+            return false;
+        }
+        break;
+    }
+    case SlObj_SharedSlot:
+        if (!slShare(vm, *o.as.sharedSlot->location)) {
+            return false;
+        }
+        break;
+    default:
+        break;
+    }
+    return true;
+}
+
+bool slIsShared(SlObj o) {
+    return !slObjIsSmall(o) && loadOwner(o.as.gcObj) != NULL;
+}
+
+bool slIsUnique(SlObj o) {
+    return !slObjIsSmall(o)
+        && loadOwner(o.as.gcObj) == NULL
+        && o.as.gcObj->refCount == 1;
+}
+
+static const void *currentThread(void) {
+    return &threadTag;
+}
+
+static const void *loadOwner(const SlGCObj *obj) {
+#ifdef _MSC_VER
+    // Aligned pointer-sized loads and stores are atomic on all targets of MSVC
+    return *(const void *const volatile *)&obj->owner;
+#else
+    return __atomic_load_n(&obj->owner, __ATOMIC_ACQUIRE);
+#endif // !_MSC_VER
+}
+
+static void storeOwner(SlGCObj *obj, const void *owner) {
+#ifdef _MSC_VER
+    *(const void *volatile *)&obj->owner = owner;
+#else
+    __atomic_store_n(&obj->owner, owner, __ATOMIC_RELEASE);
+#endif // !_MSC_VER
+}
+
+static int64_t atomicAdd(volatile int64_t *counter, int64_t value) {
+#ifdef _MSC_VER
+    return _InterlockedExchangeAdd64(counter, value) + value;
+#else
+    return __atomic_add_fetch(counter, value, __ATOMIC_ACQ_REL);
+#endif // !_MSC_VER
+}
+
 const char *slTypeName(SlObj o) {
     switch ((SlObjType)o.type) {
     case SlObj_Null:
@@ -202,28 +524,36 @@ const char *slTypeName(SlObj o) {
         return "Int";
     case SlObj_Float:
         return "Float";
+    // Strings are always frozen, the representation is not visible
+    case SlObj_SmallStr:
     case SlObj_Str:
+    case SlObj_FrozenStr:
         return "Str";
     case SlObj_Prototype:
         return "<internal:Prototype>";
+    case SlObj_Shape:
+        return "<internal:Shape>";
     case SlObj_List:
         return "List";
     case SlObj_Map:
         return "Map";
+    case SlObj_OrdMap:
+        return "OrdMap";
     case SlObj_Func:
         return "Func";
     case SlObj_Struct:
         return "Struct";
     case SlObj_SharedSlot:
         return "<internal:SharedSlot>";
-    case SlObj_FrozenStr:
-        return "Str*";
+    case SlObj_PNode:
+        return "<internal:PNode>";
     case SlObj_FrozenList:
         return "List*";
     case SlObj_FrozenMap:
         return "Map*";
     }
     assert(false && "unreachable");
+    return NULL;
 }
 
 void slSetOutOfMemoryError(SlVM *vm) {
@@ -256,13 +586,11 @@ static void destroyObj(SlObj o) {
     case SlObj_Bool:
     case SlObj_Int:
     case SlObj_Float:
+    case SlObj_SmallStr:
     case SlObj_StackIdx:
         break;
     case SlObj_Str:
-        if (o.as.str->cap != 0) {
-            memFree(o.as.str->bytes);
-        }
-        memFree(o.as.str);
+        slStrDestroy(o.as.str);
         break;
     case SlObj_Prototype:
         o.as.gcObj->refCount = SIZE_MAX;
@@ -281,33 +609,35 @@ static void destroyObj(SlObj o) {
         memFree(o.as.proto->sharedInfo);
         memFree(o.as.proto);
         break;
+    case SlObj_Shape:
+        slShapeDestroy(o.as.shape);
+        break;
     case SlObj_List:
         o.as.gcObj->refCount = SIZE_MAX;
-        for (size_t i = 0; i < o.as.list->len; i++) {
-            slDelRef(o.as.list->objs[i]);
-        }
-        if (o.as.list->cap != 0) {
-            memFree(o.as.list->objs);
-        }
-        memFree(o.as.list);
+        slListDestroy(o.as.list);
         break;
     case SlObj_Map:
         o.as.gcObj->refCount = SIZE_MAX;
-        for (size_t i = 0; i < o.as.map->cap; i++) {
-            slDelRef(o.as.map->entries[i].key);
-            slDelRef(o.as.map->entries[i].value);
-        }
-        memFree(o.as.map->entries);
-        memFree(o.as.map);
+        slMapDestroy(o.as.map);
+        break;
+    case SlObj_OrdMap:
+        o.as.gcObj->refCount = SIZE_MAX;
+        slOrdMapDestroy(o.as.ordMap);
         break;
     case SlObj_Func:
         o.as.gcObj->refCount = SIZE_MAX;
         for (uint16_t i = 0; i < o.as.func->proto->sharedCount; i++) {
+            // Slots are NULL if the function was destroyed before they
+            // were all set
+            if (o.as.func->sharedSlots[i] == NULL) {
+                break;
+            }
             delPtrRef(
                 SlObj_SharedSlot,
                 &o.as.func->sharedSlots[i]->asGCObj
             );
         }
+        delPtrRef(SlObj_Prototype, &o.as.func->proto->asGCObj);
         memFree(o.as.func);
         break;
     case SlObj_Struct:
@@ -324,6 +654,10 @@ static void destroyObj(SlObj o) {
         slDelRef(o.as.sharedSlot->value);
         memFree(o.as.sharedSlot);
         break;
+    case SlObj_PNode:
+        o.as.gcObj->refCount = SIZE_MAX;
+        slPNodeDestroy(o.as.pnode);
+        break;
 
     case SlObj_FrozenStr:
     case SlObj_FrozenList:
@@ -331,3 +665,17 @@ static void destroyObj(SlObj o) {
         assert(false && "unreachable");
     }
 }
+
+static bool shareOrdMapNode(SlVM *vm, SlOrdMapNode *node) {
+    for (uint16_t i = 0; i < node->count; i++) {
+        if (!slShare(vm, node->keys[i]) || !slShare(vm, node->values[i])) {
+            return false;
+        }
+    }
+    for (uint16_t i = 0; !node->leaf && i <= node->count; i++) {
+        if (!shareOrdMapNode(vm, node->children[i])) {
+            return false;
+        }
+    }
+    return true;
+}
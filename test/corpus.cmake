@@ -0,0 +1,50 @@
+# Run a script of the corpus at every optimization level and compare what it
+# prints with the expected output.
+# Usage: cmake -DTEST_EXE=<test> -DSCRIPT=<file.sl> -P corpus.cmake
+# The expected output is in the file with the same name and extension `.out`.
+# The optional file with extension `.ops` lists instructions the bytecode must
+# use, one per line and followed by the levels it applies to if not all of
+# them. A line starting with `-` lists an instruction that must not be used.
+
+get_filename_component(dir ${SCRIPT} DIRECTORY)
+get_filename_component(name ${SCRIPT} NAME_WE)
+file(READ ${dir}/${name}.out expected)
+set(ops "")
+if(EXISTS ${dir}/${name}.ops)
+    file(STRINGS ${dir}/${name}.ops ops)
+endif()
+
+foreach(level 0 1 2 3)
+    execute_process(
+        COMMAND ${TEST_EXE} ${SCRIPT} ${level}
+        OUTPUT_VARIABLE output
+        ERROR_VARIABLE output
+    )
+    foreach(line ${ops})
+        string(REGEX MATCH "^(-?)([a-z0-9]+)(.*)$" match "${line}")
+        set(used "${CMAKE_MATCH_1}")
+        set(op ${CMAKE_MATCH_2})
+        string(REGEX MATCHALL "[0-9]+" levels "${CMAKE_MATCH_3}")
+        list(FIND levels ${level} found)
+        if(NOT levels STREQUAL "" AND found EQUAL -1)
+            continue()
+        endif()
+        if(output MATCHES "\n\t${op}[\t\n]")
+            if(used STREQUAL "-")
+                message(FATAL_ERROR "${name} at level ${level} uses ${op}")
+            endif()
+        elseif(NOT used STREQUAL "-")
+            message(FATAL_ERROR "${name} at level ${level} does not use ${op}")
+        endif()
+    endforeach()
+
+    # The compiler prints the bytecode of each function before it runs
+    string(REGEX REPLACE "(^|\n)(<0x|\t|----)[^\n]*" "" output "${output}")
+    string(REGEX REPLACE "^\n+" "" output "${output}")
+    if(NOT output STREQUAL expected)
+        message(FATAL_ERROR
+            "${name} at level ${level} printed:\n${output}\n"
+            "expected:\n${expected}"
+        )
+    endif()
+endforeach()
@@ -9,18 +9,19 @@ void checkError(SlVM *vm);
 
 int main(int argc, char **argv) {
     if (argc < 2) {
-        printf("USAGE: test <file.sl>\n");
+        printf("USAGE: test <file.sl> [opt-level]\n");
         return 1;
     }
+    SlOptLevel optLevel = argc > 2 ? atoi(argv[2]) : SlOpt_Propagate;
     SlVM vm = { 0 };
     SlSource *src = slSourceFromFile(&vm, argv[1]);
     checkError(&vm);
-    SlObj mainFunc = slGenCode(&vm, src);
+    SlObj mainFunc = slGenCode(&vm, src, optLevel);
     checkError(&vm);
-    /*
     SlObj result = slRun(&vm, mainFunc);
     checkError(&vm);
-    */
+    slDelRef(result);
+    slDelRef(mainFunc);
 
     return 0;
 }
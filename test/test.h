@@ -0,0 +1,46 @@
+#ifndef SL_TEST_H_
+#define SL_TEST_H_
+
+#include <stdio.h>
+#include <string.h>
+
+#include "seal.h"
+
+// Unit tests of the runtime. Each test program defines test functions taking a
+// VM and calls them with `runTest` from `main`, it returns `testResult()`.
+
+static int g_failedChecks = 0;
+
+#define check(cond) do {                                                       \
+        if (!(cond)) {                                                         \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);    \
+            g_failedChecks++;                                                  \
+        }                                                                      \
+    } while (0)
+
+// Check that a string object holds the C string `cStr`
+#define checkStr(obj, cStr) do {                                               \
+        SlObj checkStr_ = (obj);                                               \
+        check(slObjIsStr(checkStr_)                                            \
+            && slStrLen(&checkStr_) == strlen(cStr)                            \
+            && memcmp(slStrBytes(&checkStr_), cStr, strlen(cStr)) == 0);       \
+    } while (0)
+
+#define runTest(func) do {                                                     \
+        SlVM vm_ = { 0 };                                                      \
+        int failedBefore_ = g_failedChecks;                                    \
+        func(&vm_);                                                            \
+        if (vm_.error.occurred) {                                              \
+            printf("%s: unexpected error: %s\n", #func, vm_.error.msg);        \
+            g_failedChecks++;                                                  \
+        }                                                                      \
+        printf(                                                                \
+            "%s %s\n",                                                         \
+            g_failedChecks == failedBefore_ ? "ok  " : "FAIL",                 \
+            #func                                                              \
+        );                                                                     \
+    } while (0)
+
+#define testResult() (g_failedChecks == 0 ? 0 : 1)
+
+#endif // !SL_TEST_H_
@@ -0,0 +1,195 @@
+#include "sl_codegen.h"
+#include "sl_exec.h"
+#include "test.h"
+
+// Compile `text` at `level` and run it twice, the results are stored in
+// `results`. Returns the prototype of the main function.
+static SlObj runTwice(
+    SlVM *vm,
+    const char *text,
+    SlOptLevel level,
+    SlObj results[2]
+) {
+    SlSource src = slSourceFromCStr(text);
+    src.path = "<test>";
+    SlObj main = slGenCode(vm, &src, level);
+    check(main.type == SlObj_Prototype);
+    if (main.type != SlObj_Prototype) {
+        return main;
+    }
+    results[0] = slRun(vm, main);
+    results[1] = slRun(vm, main);
+    return main;
+}
+
+static void testCodegenStaticFuncs(SlVM *vm) {
+    for (SlOptLevel level = SlOpt_None; level <= SlOpt_Ssa; level++) {
+        // A function that captures nothing is a constant of its parent
+        SlObj results[2];
+        SlObj main = runTwice(
+            vm,
+            "func f() { return 1; }\n"
+            "return f;\n",
+            level,
+            results
+        );
+        check(results[0].type == SlObj_Func);
+        check(results[0].as.func == results[1].as.func);
+        check(main.as.proto->constCount == 1);
+        check(main.as.proto->constants[0].as.func == results[0].as.func);
+        slDelRef(results[0]);
+        slDelRef(results[1]);
+        slDelRef(main);
+
+        // A closure is made each time
+        main = runTwice(
+            vm,
+            "func make(x) {\n"
+            "    func g() { return x; }\n"
+            "    return g;\n"
+            "}\n"
+            "return make(1);\n",
+            level,
+            results
+        );
+        check(results[0].type == SlObj_Func);
+        check(results[0].as.func != results[1].as.func);
+        check(results[0].as.func->proto->sharedCount == 1);
+        slDelRef(results[0]);
+        slDelRef(results[1]);
+        slDelRef(main);
+    }
+}
+
+// Run the peephole optimizer on `len` bytes of `code` and check that the
+// result is `expected`
+static void checkPeephole(
+    SlVM *vm,
+    const uint8_t *code,
+    uint32_t len,
+    const uint8_t *expected,
+    uint32_t expectedLen,
+    SlLineInfo *lineInfo,
+    uint32_t lineInfoCount
+) {
+    SlU8Arr bytecode = { 0 };
+    for (uint32_t i = 0; i < len; i++) {
+        check(slU8Push(vm, &bytecode, code[i]));
+    }
+    check(slOptimizeBytecode(vm, &bytecode, lineInfo, lineInfoCount));
+    check(bytecode.len == expectedLen);
+    if (bytecode.len == expectedLen) {
+        check(memcmp(bytecode.data, expected, expectedLen) == 0);
+    }
+    slU8Clear(&bytecode);
+}
+
+static void testCodegenPeephole(SlVM *vm) {
+    // Jumps are threaded, nops removed and ranges of nulls merged
+    const uint8_t code[] = {
+        SlOp_ln, 0, 1,
+        SlOp_ln, 2, 4,
+        SlOp_jmp, 0, 0, 1, // to the jmp after the nop
+        SlOp_nop,
+        SlOp_jmp, 0, 0, 2, // to the ret
+        SlOp_print, 0,
+        SlOp_ret, 0
+    };
+    const uint8_t expected[] = {
+        SlOp_ln, 0, 4,
+        SlOp_jmp, 0, 0, 6,
+        SlOp_jmp, 0, 0, 2,
+        SlOp_print, 0,
+        SlOp_ret, 0
+    };
+    SlLineInfo lineInfo[] = {
+        { .start = 0, .len = 6, .line = 1 },
+        { .start = 6, .len = 5, .line = 2 },
+        { .start = 11, .len = 8, .line = 3 }
+    };
+    checkPeephole(
+        vm,
+        code,
+        sizeof(code),
+        expected,
+        sizeof(expected),
+        lineInfo,
+        3
+    );
+    check(lineInfo[0].start == 0 && lineInfo[0].len == 3);
+    check(lineInfo[1].start == 3 && lineInfo[1].len == 4);
+    check(lineInfo[2].start == 7 && lineInfo[2].len == 8);
+
+    // A backward jump over a removed copy, register 130 takes two bytes
+    const uint8_t loop[] = {
+        SlOp_print, 0x80, 0x02,
+        SlOp_cpy, 5, 5,
+        SlOp_jfl, 1, 0xff, 0xff, 0xf5, // to the print
+        SlOp_ret, 1
+    };
+    const uint8_t loopExpected[] = {
+        SlOp_print, 0x80, 0x02,
+        SlOp_jfl, 1, 0xff, 0xff, 0xf8,
+        SlOp_ret, 1
+    };
+    checkPeephole(
+        vm,
+        loop,
+        sizeof(loop),
+        loopExpected,
+        sizeof(loopExpected),
+        NULL,
+        0
+    );
+
+    // A null or a copy that is overwritten before it is read is removed
+    const uint8_t dead[] = {
+        SlOp_ln, 3, 3,
+        SlOp_li8, 3, 7,
+        SlOp_cpy, 4, 3,
+        SlOp_add, 4, 3, 3,
+        SlOp_ret, 4
+    };
+    const uint8_t deadExpected[] = {
+        SlOp_li8, 3, 7,
+        SlOp_add, 4, 3, 3,
+        SlOp_ret, 4
+    };
+    checkPeephole(
+        vm,
+        dead,
+        sizeof(dead),
+        deadExpected,
+        sizeof(deadExpected),
+        NULL,
+        0
+    );
+
+    // Ranges of nulls are not merged into one that a jump goes to
+    const uint8_t target[] = {
+        SlOp_ln, 0, 1,
+        SlOp_jmp, 0, 0, 0,
+        SlOp_ln, 2, 3,
+        SlOp_jmp, 0xff, 0xff, 0xf9 // to the second ln
+    };
+    const uint8_t targetExpected[] = {
+        SlOp_ln, 0, 1,
+        SlOp_ln, 2, 3,
+        SlOp_jmp, 0xff, 0xff, 0xf9
+    };
+    checkPeephole(
+        vm,
+        target,
+        sizeof(target),
+        targetExpected,
+        sizeof(targetExpected),
+        NULL,
+        0
+    );
+}
+
+int main(void) {
+    runTest(testCodegenStaticFuncs);
+    runTest(testCodegenPeephole);
+    return testResult();
+}
@@ -0,0 +1,233 @@
+#include <stdlib.h>
+
+#include "sl_builtin.h"
+#include "sl_list.h"
+#include "sl_map.h"
+#include "sl_persist.h"
+#include "sl_str.h"
+#include "test.h"
+
+#define cStr(s) (const uint8_t *)(s), strlen(s)
+
+static SlObj newMutableStr(SlVM *vm, const char *s) {
+    SlObj str = slFrozenStrNew(vm, cStr(s));
+    str.type = SlObj_Str;
+    return str;
+}
+
+static SlObj newListRange(SlVM *vm, int64_t len) {
+    SlObj list = slListNew(vm, 0);
+    for (int64_t i = 0; i < len; i++) {
+        check(slListAppend(vm, list.as.list, slObjInt(i)));
+    }
+    return list;
+}
+
+static SlObj newMapRange(SlVM *vm, int64_t len) {
+    SlObj map = slMapNew(vm);
+    for (int64_t i = 0; i < len; i++) {
+        check(slMapSet(vm, map.as.map, slObjInt(i), slObjInt(-i)));
+    }
+    return map;
+}
+
+static void testIsUnique(SlVM *vm) {
+    SlObj list = slListNew(vm, 0);
+    check(slIsUnique(list));
+    SlObj other = slNewRef(list);
+    check(!slIsUnique(list));
+    slDelRef(other);
+    check(slIsUnique(list));
+    check(slShare(vm, list));
+    check(!slIsUnique(list));
+    slDelRef(list);
+    check(!slIsUnique(slObjInt(1)));
+}
+
+static void testFreezeInPlace(SlVM *vm) {
+    // Unique objects keep their memory, including the nested ones
+    SlObj str = newMutableStr(vm, "a string that is not small");
+    SlStr *heapStr = str.as.str;
+    SlObj list = slListNew(vm, 0);
+    check(slListAppend(vm, list.as.list, str));
+    slDelRef(str);
+    SlList *heapList = list.as.list;
+
+    SlObj frozen = slFreeze(vm, list);
+    check(frozen.type == SlObj_FrozenList && frozen.as.list == heapList);
+    check(heapList->objs[0].type == SlObj_FrozenStr);
+    check(heapList->objs[0].as.str == heapStr);
+    slDelRef(frozen);
+
+    SlObj map = newMapRange(vm, 3);
+    SlMap *heapMap = map.as.map;
+    SlObj value = slListNew(vm, 0);
+    check(slMapSet(vm, heapMap, slObjInt(3), value));
+    slDelRef(value);
+    frozen = slFreeze(vm, map);
+    check(frozen.type == SlObj_FrozenMap && frozen.as.map == heapMap);
+    check(slMapGet(vm, heapMap, slObjInt(3))->type == SlObj_FrozenList);
+    slDelRef(frozen);
+}
+
+static void testFreezeCopy(SlVM *vm) {
+    // Referenced objects are copied and the copies are frozen deeply
+    SlObj inner = slListNew(vm, 0);
+    check(slListAppend(vm, inner.as.list, slObjInt(7)));
+    SlObj outer = slListNew(vm, 0);
+    check(slListAppend(vm, outer.as.list, inner));
+
+    SlObj frozen = slFreeze(vm, slNewRef(outer));
+    check(frozen.type == SlObj_FrozenList);
+    check(frozen.as.list != outer.as.list);
+    check(outer.type == SlObj_List && inner.type == SlObj_List);
+    SlObj copy = slListGet(frozen.as.list, 0);
+    check(copy.type == SlObj_FrozenList && copy.as.list != inner.as.list);
+    check(slListGet(copy.as.list, 0).as.numInt == 7);
+    // Changing the original does not change the copy
+    check(slListAppend(vm, inner.as.list, slObjInt(8)));
+    check(copy.as.list->len == 1);
+
+    slDelRef(frozen);
+    slDelRef(outer);
+    slDelRef(inner);
+
+    SlObj str = newMutableStr(vm, "a string that is not small");
+    frozen = slFreeze(vm, slNewRef(str));
+    check(frozen.type == SlObj_FrozenStr && frozen.as.str != str.as.str);
+    checkStr(frozen, "a string that is not small");
+    slDelRef(frozen);
+    slDelRef(str);
+}
+
+static void testFreezeCopyLarge(SlVM *vm) {
+    // Large copies are stored like any other frozen container of their size
+    SlObj list = newListRange(vm, slPersistMinLen);
+    SlObj frozen = slFreeze(vm, slNewRef(list));
+    check(frozen.as.list->kind == SlList_Trie);
+    check(slListGet(frozen.as.list, slPersistMinLen - 1).as.numInt
+        == slPersistMinLen - 1);
+    slDelRef(frozen);
+    slDelRef(list);
+
+    SlObj map = newMapRange(vm, slPersistMinLen);
+    check(slMapDel(vm, map.as.map, slObjInt(0)));
+    check(slMapSet(vm, map.as.map, slObjInt(-1), slNull));
+    frozen = slFreeze(vm, slNewRef(map));
+    check(frozen.type == SlObj_FrozenMap && frozen.as.map->hamt != NULL);
+    check(frozen.as.map->count == slPersistMinLen);
+    check(slMapGet(vm, frozen.as.map, slObjInt(0)) == NULL);
+    check(slMapGet(vm, frozen.as.map, slObjInt(5))->as.numInt == -5);
+    check(slMapGet(vm, frozen.as.map, slObjInt(-1)) != NULL);
+    slDelRef(frozen);
+
+    // Smaller copies stay flat
+    check(slMapDel(vm, map.as.map, slObjInt(1)));
+    frozen = slFreeze(vm, slNewRef(map));
+    check(frozen.type == SlObj_FrozenMap && frozen.as.map->hamt == NULL);
+    check(frozen.as.map->count == slPersistMinLen - 1);
+    slDelRef(frozen);
+    slDelRef(map);
+}
+
+static void testStrAppend(SlVM *vm) {
+    SlObj str = newMutableStr(vm, "a string that is not small");
+    SlStr *heapStr = str.as.str;
+    SlObj tail = slFrozenStrNew(vm, cStr(" and a tail"));
+
+    // Unique strings grow in place with spare capacity
+    str = slStrAppend(vm, str, tail);
+    check(str.as.str == heapStr);
+    checkStr(str, "a string that is not small and a tail");
+    size_t cap = heapStr->cap;
+    check(cap >= slRopeMinLen);
+    str = slStrAppend(vm, str, slSmallStrNew(cStr("!")));
+    check(str.as.str == heapStr && heapStr->cap == cap);
+    checkStr(str, "a string that is not small and a tail!");
+    for (int i = 0; i < 10; i++) {
+        str = slStrAppend(vm, str, tail);
+    }
+    check(str.as.str == heapStr && heapStr->cap > cap);
+    check(slStrLen(&str) == 38 + 10 * 11);
+
+    // Appending a string to itself copies it
+    str = slStrAppend(vm, str, str);
+    check(str.as.str != heapStr);
+    check(slStrLen(&str) == 2 * (38 + 10 * 11));
+    slDelRef(str);
+
+    // Interned strings are left untouched
+    SlObj interned = slStrIntern(vm, newMutableStr(vm, "interned string"));
+    SlObj other = slStrAppend(vm, slNewRef(interned), tail);
+    check(other.as.str != interned.as.str);
+    checkStr(interned, "interned string");
+    checkStr(other, "interned string and a tail");
+    slDelRef(other);
+    slDelRef(interned);
+    slDelRef(tail);
+}
+
+static void testSetFrozenItem(SlVM *vm) {
+    // A unique flat frozen list is changed in place with a frozen value
+    SlObj list = slFreeze(vm, newListRange(vm, 3));
+    SlList *heapList = list.as.list;
+    SlObj value = slListNew(vm, 0);
+    check(slSetItem(vm, &list, slObjInt(1), value));
+    check(list.as.list == heapList);
+    check(slListGet(heapList, 1).type == SlObj_FrozenList);
+    check(slListGet(heapList, 1).as.list != value.as.list);
+
+    // A referenced one is replaced, the other version is unchanged
+    SlObj old = slNewRef(list);
+    check(slSetItem(vm, &list, slObjInt(0), slObjInt(9)));
+    check(list.as.list != heapList && list.type == SlObj_FrozenList);
+    check(slListGet(list.as.list, 0).as.numInt == 9);
+    check(slListGet(old.as.list, 0).as.numInt == 0);
+    slDelRef(old);
+    slDelRef(list);
+
+    // Trie-backed maps always produce a new version
+    SlObj map = newMapRange(vm, slPersistMinLen);
+    SlObj frozen = slFreeze(vm, slNewRef(map));
+    slDelRef(map);
+    check(frozen.as.map->hamt != NULL);
+    SlMap *heapMap = frozen.as.map;
+    check(slSetItem(vm, &frozen, slObjInt(0), value));
+    check(frozen.as.map != heapMap);
+    check(slMapGet(vm, frozen.as.map, slObjInt(0))->type == SlObj_FrozenList);
+    slDelRef(frozen);
+    slDelRef(value);
+}
+
+static void testListKeys(SlVM *vm) {
+    // Mutable list keys are stored frozen and compared by content
+    SlObj key = newListRange(vm, 3);
+    SlObj map = slMapNew(vm);
+    check(slMapSet(vm, map.as.map, key, slObjInt(1)));
+    check(slListAppend(vm, key.as.list, slObjInt(3)));
+
+    SlObj lookup = newListRange(vm, 3);
+    check(slMapGet(vm, map.as.map, lookup)->as.numInt == 1);
+    check(slMapGet(vm, map.as.map, key) == NULL);
+    size_t iter = 0;
+    SlObj storedKey;
+    SlObj *value;
+    check(slMapNext(map.as.map, &iter, &storedKey, &value));
+    check(storedKey.type == SlObj_FrozenList);
+    check(storedKey.as.list != key.as.list);
+
+    slDelRef(lookup);
+    slDelRef(key);
+    slDelRef(map);
+}
+
+int main(void) {
+    runTest(testIsUnique);
+    runTest(testFreezeInPlace);
+    runTest(testFreezeCopy);
+    runTest(testFreezeCopyLarge);
+    runTest(testStrAppend);
+    runTest(testSetFrozenItem);
+    runTest(testListKeys);
+    return testResult();
+}
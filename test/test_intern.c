@@ -0,0 +1,100 @@
+#include "test.h"
+
+#define cStr(s) (const uint8_t *)(s), strlen(s)
+
+static void testInternPointerEq(SlVM *vm) {
+    SlObj a = slStrInternBytes(vm, cStr("an interned string"));
+    SlObj b = slStrInternBytes(vm, cStr("an interned string"));
+    SlObj c = slStrInternBytes(vm, cStr("another interned string"));
+    check(a.type == SlObj_FrozenStr && a.as.str == b.as.str);
+    check(a.as.str != c.as.str);
+    check(a.as.str->asGCObj.refCount == 2);
+    check(vm->ownStrTable.len == 2);
+
+    // Short strings are stored inline and never reach the table
+    SlObj small = slStrInternBytes(vm, cStr("short"));
+    check(small.type == SlObj_SmallStr);
+    check(vm->ownStrTable.len == 2);
+
+    slDelRef(a);
+    slDelRef(b);
+    slDelRef(c);
+}
+
+static void testInternExisting(SlVM *vm) {
+    SlObj first = slFrozenStrNew(vm, cStr("a string to intern"));
+    SlObj second = slFrozenStrNew(vm, cStr("a string to intern"));
+
+    SlObj interned = slStrIntern(vm, first);
+    check(interned.as.str == first.as.str);
+    check(first.as.str->internedIn == &vm->ownStrTable);
+    slDelRef(interned);
+
+    // An equal string resolves to the one already in the table
+    interned = slStrIntern(vm, second);
+    check(interned.as.str == first.as.str);
+    check(second.as.str->internedIn == NULL);
+    slDelRef(interned);
+
+    slDelRef(first);
+    slDelRef(second);
+}
+
+static void testInternWeakEntries(SlVM *vm) {
+    SlObj a = slStrInternBytes(vm, cStr("a weak table entry"));
+    SlObj b = slStrInternBytes(vm, cStr("another weak entry"));
+    check(vm->ownStrTable.len == 2);
+
+    slDelRef(a);
+    check(vm->ownStrTable.len == 1);
+    // A destroyed string is not found again
+    SlObj again = slStrInternBytes(vm, cStr("a weak table entry"));
+    check(vm->ownStrTable.len == 2);
+    slDelRef(again);
+
+    // The table releases its memory once empty
+    slDelRef(b);
+    check(vm->ownStrTable.len == 0);
+    check(vm->ownStrTable.strs == NULL);
+}
+
+static void testInternShared(SlVM *vm) {
+    SlObj str = slStrInternBytes(vm, cStr("interned, then shared"));
+    check(str.as.str->internedIn != NULL);
+
+    // Sharing removes the string from the table of the thread
+    check(slShare(vm, str));
+    check(str.as.str->internedIn == NULL);
+    check(vm->ownStrTable.len == 0);
+
+    // A shared string is never added, a copy of it is
+    SlObj interned = slStrIntern(vm, str);
+    check(interned.as.str != str.as.str);
+    check(slStrEq(interned, str));
+    check(str.as.str->internedIn == NULL);
+    check(vm->ownStrTable.len == 1);
+
+    slDelRef(interned);
+    slDelRef(str);
+}
+
+static void testSharedHash(SlVM *vm) {
+    SlObj str = slFrozenStrNew(vm, cStr("hashed when shared"));
+    check(str.as.str->hash == 0);
+
+    // Other threads only read the hash, it is computed before sharing
+    check(slShare(vm, str));
+    check(slIsShared(str));
+    check(str.as.str->hash != 0);
+    check(str.as.str->hash == slStrHash(str));
+    slDelRef(str);
+}
+
+int main(void) {
+    runTest(testInternPointerEq);
+    runTest(testInternExisting);
+    runTest(testInternWeakEntries);
+    runTest(testInternShared);
+    runTest(testSharedHash);
+    return testResult();
+}
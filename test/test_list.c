@@ -0,0 +1,280 @@
+#include "sl_builtin.h"
+#include "sl_list.h"
+#include "sl_map.h"
+#include "sl_persist.h"
+#include "test.h"
+
+#define cStr(s) (const uint8_t *)(s), strlen(s)
+
+static void testListInts(SlVM *vm) {
+    SlObj obj = slListNew(vm, 0);
+    SlList *list = obj.as.list;
+    for (int64_t i = 0; i < 100; i++) {
+        check(slListAppend(vm, list, slObjInt(i * i)));
+    }
+    check(list->kind == SlList_Ints);
+    check(list->len == 100);
+    check(list->ints[7] == 49);
+    SlObj item = slListGet(list, 99);
+    check(item.type == SlObj_Int && item.as.numInt == 99 * 99);
+    check(slListSet(vm, list, 0, slObjInt(-1)));
+    check(list->kind == SlList_Ints && list->ints[0] == -1);
+    slDelRef(obj);
+}
+
+static void testListFloats(SlVM *vm) {
+    // An empty list takes the kind of its first item
+    SlObj obj = slListNew(vm, 8);
+    SlList *list = obj.as.list;
+    check(slListAppend(vm, list, slObjFloat(0.5)));
+    check(slListAppend(vm, list, slObjFloat(-2.0)));
+    check(list->kind == SlList_Floats);
+    SlObj item = slListGet(list, 1);
+    check(item.type == SlObj_Float && item.as.numFloat == -2.0);
+    slDelRef(obj);
+}
+
+static void testListPromotion(SlVM *vm) {
+    // Ints and floats are not mixed, the items keep their type
+    SlObj obj = slListNew(vm, 0);
+    SlList *list = obj.as.list;
+    for (int64_t i = 0; i < 10; i++) {
+        check(slListAppend(vm, list, slObjInt(i)));
+    }
+    check(slListAppend(vm, list, slObjFloat(1.5)));
+    check(list->kind == SlList_Objs);
+    check(list->len == 11);
+    for (int64_t i = 0; i < 10; i++) {
+        SlObj item = slListGet(list, (size_t)i);
+        check(item.type == SlObj_Int && item.as.numInt == i);
+    }
+    check(list->objs[10].type == SlObj_Float);
+    slDelRef(obj);
+
+    // Setting an item of another type boxes the list as well
+    obj = slListNew(vm, 0);
+    list = obj.as.list;
+    for (int i = 0; i < 5; i++) {
+        check(slListAppend(vm, list, slObjFloat(i / 2.0)));
+    }
+    SlObj str = slFrozenStrNew(vm, cStr("a string that is not small"));
+    check(slListSet(vm, list, 2, str));
+    check(list->kind == SlList_Objs);
+    check(list->objs[2].as.str == str.as.str);
+    check(list->objs[4].type == SlObj_Float && list->objs[4].as.numFloat == 2);
+    // The list holds its own reference
+    slDelRef(str);
+    checkStr(list->objs[2], "a string that is not small");
+    slDelRef(obj);
+}
+
+static void testListIndex(SlVM *vm) {
+    SlObj obj = slListNew(vm, 0);
+    SlList *list = obj.as.list;
+    for (int64_t i = 0; i < 3; i++) {
+        check(slListAppend(vm, list, slObjInt(i)));
+    }
+    size_t idx;
+    check(slListIndex(vm, list, slObjInt(-1), &idx) && idx == 2);
+    check(slListIndex(vm, list, slObjInt(-3), &idx) && idx == 0);
+    check(!slListIndex(vm, list, slObjInt(3), &idx));
+    check(vm->error.occurred);
+    vm->error.occurred = false;
+    check(!slListIndex(vm, list, slObjInt(-4), &idx));
+    check(vm->error.occurred);
+    vm->error.occurred = false;
+    check(!slListIndex(vm, list, slObjFloat(0.0), &idx));
+    check(vm->error.occurred);
+    vm->error.occurred = false;
+    slDelRef(obj);
+}
+
+static void testGetSetItem(SlVM *vm) {
+    SlObj list = slListNew(vm, 0);
+    check(slListAppend(vm, list.as.list, slObjInt(1)));
+    check(slSetItem(vm, &list, slObjInt(-1), slObjInt(5)));
+    SlObj item = slGetItem(vm, list, slObjInt(0));
+    check(item.type == SlObj_Int && item.as.numInt == 5);
+
+    SlObj map = slMapNew(vm);
+    check(slSetItem(vm, &map, slObjInt(3), list));
+    item = slGetItem(vm, map, slObjInt(3));
+    check(item.type == SlObj_List && item.as.list == list.as.list);
+    slDelRef(item);
+
+    item = slGetItem(vm, map, slObjInt(4));
+    check(item.type == SlObj_Null && vm->error.occurred);
+    vm->error.occurred = false;
+    item = slGetItem(vm, slObjInt(1), slObjInt(0));
+    check(item.type == SlObj_Null && vm->error.occurred);
+    vm->error.occurred = false;
+
+    slDelRef(map);
+    slDelRef(list);
+}
+
+static void testListInline(SlVM *vm) {
+    SlObj obj = slListNew(vm, 0);
+    SlList *list = obj.as.list;
+    // The inline room holds twice as many unboxed items as boxed ones
+    check((void *)list->objs == (void *)(list + 1));
+    check(list->cap == 2 * slListInlineCap);
+    for (int64_t i = 0; i < slListInlineCap; i++) {
+        check(slListAppend(vm, list, slObjInt(i)));
+    }
+    // Boxing a full inline list of ints keeps the items in place
+    check(slListAppend(vm, list, slNull));
+    check(list->kind == SlList_Objs);
+    check((void *)list->objs != (void *)(list + 1));
+    for (int64_t i = 0; i < slListInlineCap; i++) {
+        check(slListGet(list, (size_t)i).as.numInt == i);
+    }
+    slDelRef(obj);
+
+    obj = slListNew(vm, 0);
+    list = obj.as.list;
+    for (int64_t i = 0; i < 3; i++) {
+        check(slListAppend(vm, list, slObjInt(i)));
+    }
+    check(slListAppend(vm, list, slNull));
+    check((void *)list->objs == (void *)(list + 1));
+    check(list->cap == slListInlineCap);
+    check(slListGet(list, 2).as.numInt == 2);
+
+    // Growing past the inline room moves the items to their own buffer
+    for (int64_t i = 4; i < 20; i++) {
+        check(slListAppend(vm, list, slObjInt(i)));
+    }
+    check((void *)list->objs != (void *)(list + 1));
+    check(list->len == 20 && slListGet(list, 19).as.numInt == 19);
+    slDelRef(obj);
+
+    // Lists created larger never use inline storage
+    obj = slListNew(vm, slListInlineCap + 1);
+    check((void *)obj.as.list->objs != (void *)(obj.as.list + 1));
+    slDelRef(obj);
+}
+
+// Check that the items of `list` are the Ints `from` to `to - 1`.
+static bool isRange(const SlList *list, int64_t from, int64_t to) {
+    if (list->len != (size_t)(to - from)) {
+        return false;
+    }
+    for (size_t i = 0; i < list->len; i++) {
+        SlObj item = slListGet(list, i);
+        if (item.type != SlObj_Int || item.as.numInt != from + (int64_t)i) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void testListRing(SlVM *vm) {
+    SlObj obj = slListNew(vm, 0);
+    SlList *list = obj.as.list;
+    for (int64_t i = 5; i < 10; i++) {
+        check(slListAppend(vm, list, slObjInt(i)));
+    }
+    for (int64_t i = 4; i >= 0; i--) {
+        check(slListPrepend(vm, list, slObjInt(i)));
+    }
+    check(isRange(list, 0, 10));
+    // The front wrapped around the end of the inline storage
+    check(list->head != 0 && list->head + list->len > list->cap);
+
+    // Using the list as a queue keeps the storage size
+    size_t cap = list->cap;
+    for (int64_t i = 10; i < 1000; i++) {
+        check(slListAppend(vm, list, slObjInt(i)));
+        SlObj item = slListPopFront(list);
+        check(item.as.numInt == i - 10);
+    }
+    check(list->cap == cap);
+    check(isRange(list, 990, 1000));
+
+    // Growing a wrapped list keeps the order
+    check(list->head + list->len > list->cap);
+    for (int64_t i = 1000; i < 1100; i++) {
+        check(slListAppend(vm, list, slObjInt(i)));
+    }
+    check(isRange(list, 990, 1100));
+    check(slListPop(list).as.numInt == 1099);
+    check(slListPopFront(list).as.numInt == 990);
+    check(isRange(list, 991, 1099));
+    slDelRef(obj);
+}
+
+static void testListRingKinds(SlVM *vm) {
+    // Boxing a wrapped list rotates the items first
+    SlObj obj = slListNew(vm, 0);
+    SlList *list = obj.as.list;
+    for (int64_t i = 0; i < 6; i++) {
+        check(slListAppend(vm, list, slObjInt(i)));
+    }
+    for (int64_t i = 0; i < 4; i++) {
+        check(slListPopFront(list).as.numInt == i);
+        check(slListAppend(vm, list, slObjInt(i + 6)));
+    }
+    check(list->head != 0);
+    SlObj str = slFrozenStrNew(vm, (const uint8_t *)"a long string", 13);
+    check(slListPrepend(vm, list, str));
+    slDelRef(str);
+    check(list->kind == SlList_Objs && list->len == 7);
+    checkStr(slListGet(list, 0), "a long string");
+    slDelRef(slListGet(list, 0));
+    for (int64_t i = 1; i < 7; i++) {
+        check(slListGet(list, (size_t)i).as.numInt == i + 3);
+    }
+    SlObj item = slListPopFront(list);
+    checkStr(item, "a long string");
+    slDelRef(item);
+
+    // Freezing a wrapped list in place moves its items to the front
+    for (int64_t i = 0; i < 3; i++) {
+        check(slListPopFront(list).as.numInt == i + 4);
+        check(slListAppend(vm, list, slObjInt(i + 10)));
+    }
+    check(list->head != 0);
+    SlObj frozen = slFreeze(vm, obj);
+    check(frozen.as.list == list && list->head == 0);
+    check(isRange(list, 7, 13));
+    check(list->objs[0].as.numInt == 7);
+    slDelRef(frozen);
+}
+
+static void testDequeBuiltins(SlVM *vm) {
+    SlObj list = slListNew(vm, 0);
+    check(slPushBack(vm, list, slObjInt(2)));
+    check(slPushFront(vm, list, slObjInt(1)));
+    check(slPushBack(vm, list, slObjInt(3)));
+    check(isRange(list.as.list, 1, 4));
+    check(slPopFront(vm, list).as.numInt == 1);
+    check(slPopBack(vm, list).as.numInt == 3);
+    check(slPopBack(vm, list).as.numInt == 2);
+
+    SlObj item = slPopFront(vm, list);
+    check(item.type == SlObj_Null && vm->error.occurred);
+    vm->error.occurred = false;
+
+    // Frozen lists cannot be used as queues
+    SlObj frozen = slFreeze(vm, slNewRef(list));
+    check(!slPushBack(vm, frozen, slObjInt(1)) && vm->error.occurred);
+    vm->error.occurred = false;
+    check(!slPushFront(vm, slNull, slObjInt(1)) && vm->error.occurred);
+    vm->error.occurred = false;
+    slDelRef(frozen);
+    slDelRef(list);
+}
+
+int main(void) {
+    runTest(testListInts);
+    runTest(testListFloats);
+    runTest(testListPromotion);
+    runTest(testListIndex);
+    runTest(testGetSetItem);
+    runTest(testListInline);
+    runTest(testListRing);
+    runTest(testListRingKinds);
+    runTest(testDequeBuiltins);
+    return testResult();
+}
@@ -0,0 +1,282 @@
+#include "sl_map.h"
+#include "sl_str.h"
+#include "test.h"
+
+#define cStr(s) (const uint8_t *)(s), strlen(s)
+
+// Check that `map` holds exactly the integer keys `from..to` with `step`,
+// each mapped to its negation.
+static bool hasIntKeys(
+    SlVM *vm,
+    SlMap *map,
+    int64_t from,
+    int64_t to,
+    int step
+) {
+    size_t expected = 0;
+    for (int64_t i = from; i < to; i += step) {
+        SlObj *value = slMapGet(vm, map, slObjInt(i));
+        if (value == NULL || value->as.numInt != -i) {
+            return false;
+        }
+        expected++;
+    }
+    return slMapCount(map) == expected;
+}
+
+static void testMapProbing(SlVM *vm) {
+    SlObj obj = slMapNew(vm);
+    SlMap *map = obj.as.map;
+    check(slMapGet(vm, map, slObjInt(1)) == NULL);
+
+    // Enough keys to fill many groups and make probe sequences collide, they
+    // start from 1 so that they are not stored in the array part
+    for (int64_t i = 1; i <= 10000; i++) {
+        check(slMapSet(vm, map, slObjInt(i), slObjInt(-i)));
+    }
+    check(map->arrayLen == 0);
+    check(hasIntKeys(vm, map, 1, 10001, 1));
+    for (int64_t i = 10001; i < 20000; i++) {
+        check(slMapGet(vm, map, slObjInt(i)) == NULL);
+    }
+    // At most 7/8 of the index is used
+    check(map->count <= map->indexCap - map->indexCap / 8);
+
+    // Updating a key keeps its position
+    check(slMapSet(vm, map, slObjInt(5), slObjInt(50)));
+    check(map->count == 10000);
+    check(slMapGet(vm, map, slObjInt(5))->as.numInt == 50);
+    slDelRef(obj);
+}
+
+static void testMapDelete(SlVM *vm) {
+    SlObj obj = slMapNew(vm);
+    SlMap *map = obj.as.map;
+    for (int64_t i = 1; i <= 1000; i++) {
+        check(slMapSet(vm, map, slObjInt(i), slObjInt(-i)));
+    }
+    for (int64_t i = 2; i <= 1000; i += 2) {
+        check(slMapDel(vm, map, slObjInt(i)));
+    }
+    check(!slMapDel(vm, map, slObjInt(2)));
+    check(hasIntKeys(vm, map, 1, 1001, 2));
+    for (int64_t i = 2; i <= 1000; i += 2) {
+        check(slMapGet(vm, map, slObjInt(i)) == NULL);
+    }
+
+    // Removed keys can be added again
+    for (int64_t i = 2; i <= 1000; i += 2) {
+        check(slMapSet(vm, map, slObjInt(i), slObjInt(-i)));
+    }
+    check(hasIntKeys(vm, map, 1, 1001, 1));
+    slDelRef(obj);
+}
+
+static void testMapTombstoneReuse(SlVM *vm) {
+    SlObj obj = slMapNew(vm);
+    SlMap *map = obj.as.map;
+    for (int64_t i = 1; i <= 50; i++) {
+        check(slMapSet(vm, map, slObjInt(i), slObjInt(-i)));
+    }
+    uint32_t indexCap = map->indexCap;
+
+    // Deleting and adding keys at a constant count reuses the deleted control
+    // bytes, the table grows at most once since it is more than half full
+    for (int64_t i = 51; i <= 50000; i++) {
+        check(slMapDel(vm, map, slObjInt(i - 50)));
+        check(slMapSet(vm, map, slObjInt(i), slObjInt(-i)));
+    }
+    check(map->indexCap <= 2 * indexCap);
+    check(hasIntKeys(vm, map, 49951, 50001, 1));
+    slDelRef(obj);
+}
+
+static void testMapCompaction(SlVM *vm) {
+    SlObj obj = slMapNew(vm);
+    SlMap *map = obj.as.map;
+    for (int64_t i = 1; i <= 100; i++) {
+        check(slMapSet(vm, map, slObjInt(i), slObjInt(-i)));
+    }
+    // Once most entries are removed the array is compacted
+    for (int64_t i = 1; i <= 90; i++) {
+        check(slMapDel(vm, map, slObjInt(i)));
+    }
+    check(map->len - map->count <= map->len / 2);
+    check(hasIntKeys(vm, map, 91, 101, 1));
+
+    // Insertion order survives compaction
+    size_t iter = 0;
+    int64_t expected = 91;
+    SlObj key;
+    SlObj *value;
+    while (slMapNext(map, &iter, &key, &value)) {
+        check(key.as.numInt == expected++);
+    }
+    check(expected == 101);
+    slDelRef(obj);
+}
+
+static void testMapReserve(SlVM *vm) {
+    SlObj obj = slMapNew(vm);
+    SlMap *map = obj.as.map;
+    check(slMapReserve(vm, map, 1000));
+    SlMapEntry *entries = map->entries;
+    uint8_t *ctrl = map->ctrl;
+    for (int64_t i = 1; i <= 1000; i++) {
+        check(slMapSet(vm, map, slObjInt(i), slObjInt(-i)));
+    }
+    check(map->entries == entries && map->ctrl == ctrl);
+    slDelRef(obj);
+}
+
+static void testMapKeys(SlVM *vm) {
+    SlObj obj = slMapNew(vm);
+    SlMap *map = obj.as.map;
+
+    check(slMapSet(vm, map, slNull, slObjInt(1)));
+    SlObj boolKey = { .type = SlObj_Bool, .as.boolean = false };
+    check(slMapSet(vm, map, boolKey, slObjInt(2)));
+    check(slMapSet(vm, map, slObjFloat(-0.0), slObjInt(3)));
+    check(slMapGet(vm, map, slObjFloat(0.0))->as.numInt == 3);
+    // Ints and floats are different keys
+    check(slMapGet(vm, map, slObjInt(0)) == NULL);
+
+    SlObj key = slFrozenStrNew(vm, cStr("a long string used as a key"));
+    check(slMapSet(vm, map, key, slObjInt(4)));
+    SlObj same = slFrozenStrNew(vm, cStr("a long string used as a key"));
+    check(slMapGet(vm, map, same)->as.numInt == 4);
+    // String keys are interned
+    check(key.as.str->internedIn != NULL);
+
+    // A mutable string is hashed by its content and a frozen copy is stored
+    SlObj mutableKey = slFrozenStrNew(vm, cStr("a mutable string key"));
+    mutableKey.type = SlObj_Str;
+    check(slMapSet(vm, map, mutableKey, slObjInt(5)));
+    SlObj frozenKey = slFrozenStrNew(vm, cStr("a mutable string key"));
+    check(slMapGet(vm, map, frozenKey)->as.numInt == 5);
+    size_t iter = 0;
+    SlObj lastKey = slNull;
+    SlObj *value;
+    while (slMapNext(map, &iter, &lastKey, &value)) {
+    }
+    check(lastKey.type == SlObj_FrozenStr);
+    check(lastKey.as.str != mutableKey.as.str);
+
+    // Maps are not hashable
+    check(!slMapSet(vm, map, obj, slNull));
+    check(vm->error.occurred);
+    vm->error.occurred = false;
+
+    slDelRef(frozenKey);
+    slDelRef(mutableKey);
+    slDelRef(same);
+    slDelRef(key);
+    slDelRef(obj);
+}
+
+static void testMapInline(SlVM *vm) {
+    SlObj obj = slMapNew(vm);
+    SlMap *map = obj.as.map;
+    // Small maps have their entries in the same allocation and no index
+    check((void *)map->entries == (void *)(map + 1));
+    check(map->cap == slMapInlineCap);
+    for (int64_t i = 1; i <= slMapInlineCap; i++) {
+        check(slMapSet(vm, map, slObjInt(i), slObjInt(-i)));
+    }
+    check(map->shape == NULL && map->ctrl == NULL);
+    check(hasIntKeys(vm, map, 1, slMapInlineCap + 1, 1));
+
+    // Removed entries are skipped by the scan
+    check(slMapDel(vm, map, slObjInt(2)));
+    check(!slMapDel(vm, map, slObjInt(2)));
+    check(slMapGet(vm, map, slObjInt(2)) == NULL);
+    check(slMapGet(vm, map, slObjInt(3))->as.numInt == -3);
+    // Removing the last entry makes room for another one
+    check(slMapDel(vm, map, slObjInt(slMapInlineCap)));
+    check(slMapSet(vm, map, slObjInt(slMapInlineCap), slNull));
+    check(map->ctrl == NULL);
+
+    // Moving the entries out of the header builds the index table
+    check(slMapSet(vm, map, slObjInt(2), slObjInt(-2)));
+    check((void *)map->entries != (void *)(map + 1));
+    check(map->ctrl != NULL);
+    check(slMapGet(vm, map, slObjInt(2))->as.numInt == -2);
+    check(slMapGet(vm, map, slObjInt(slMapInlineCap))->type == SlObj_Null);
+    check(map->count == slMapInlineCap);
+    slDelRef(obj);
+}
+
+// Check that iterating `map` gives the Int keys in `expected`, in order.
+static bool hasKeyOrder(SlMap *map, const int64_t *expected, size_t count) {
+    size_t iter = 0;
+    size_t i = 0;
+    SlObj key;
+    SlObj *value;
+    while (slMapNext(map, &iter, &key, &value)) {
+        if (i == count || key.as.numInt != expected[i++]) {
+            return false;
+        }
+    }
+    return i == count;
+}
+
+static void testMapArrayPart(SlVM *vm) {
+    SlObj obj = slMapNew(vm);
+    SlMap *map = obj.as.map;
+    for (int64_t i = 0; i < 6; i++) {
+        check(slMapSet(vm, map, slObjInt(i), slObjInt(-i)));
+    }
+    check(map->arrayLen == 6 && map->count == 0 && map->len == 0);
+    check(hasIntKeys(vm, map, 0, 6, 1));
+    check(slMapSet(vm, map, slObjInt(3), slObjInt(30)));
+    check(slMapGet(vm, map, slObjInt(3))->as.numInt == 30);
+    check(slMapCount(map) == 6);
+
+    // Once another key exists Int keys are stored in entries
+    check(slMapSet(vm, map, slObjInt(-1), slObjInt(1)));
+    check(slMapSet(vm, map, slObjInt(6), slObjInt(-6)));
+    check(map->arrayLen == 6 && map->count == 2);
+    int64_t order[] = { 0, 1, 2, 3, 4, 5, -1, 6 };
+    check(hasKeyOrder(map, order, 8));
+
+    // Removing the last key of the array part shrinks it
+    check(slMapDel(vm, map, slObjInt(5)));
+    check(map->arrayLen == 5 && slMapGet(vm, map, slObjInt(5)) == NULL);
+    check(slMapSet(vm, map, slObjInt(5), slObjInt(-5)));
+    check(map->arrayLen == 5);
+    int64_t order2[] = { 0, 1, 2, 3, 4, -1, 6, 5 };
+    check(hasKeyOrder(map, order2, 8));
+
+    // Removing any other key moves the array part to the entries
+    check(slMapDel(vm, map, slObjInt(1)));
+    check(map->arrayLen == 0 && map->count == 7);
+    check(slMapGet(vm, map, slObjInt(1)) == NULL);
+    check(slMapGet(vm, map, slObjInt(3))->as.numInt == 30);
+    int64_t order3[] = { 0, 2, 3, 4, -1, 6, 5 };
+    check(hasKeyOrder(map, order3, 7));
+    slDelRef(obj);
+
+    // A large array part moves to entries stored outside of the header
+    obj = slMapNew(vm);
+    map = obj.as.map;
+    for (int64_t i = 0; i < 100; i++) {
+        check(slMapSet(vm, map, slObjInt(i), slObjInt(-i)));
+    }
+    check(map->arrayLen == 100);
+    check(slMapDel(vm, map, slObjInt(0)));
+    check(map->arrayLen == 0 && map->ctrl != NULL);
+    check(hasIntKeys(vm, map, 1, 100, 1));
+    slDelRef(obj);
+}
+
+int main(void) {
+    runTest(testMapProbing);
+    runTest(testMapDelete);
+    runTest(testMapTombstoneReuse);
+    runTest(testMapCompaction);
+    runTest(testMapReserve);
+    runTest(testMapKeys);
+    runTest(testMapInline);
+    runTest(testMapArrayPart);
+    return testResult();
+}
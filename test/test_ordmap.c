@@ -0,0 +1,284 @@
+#include <math.h>
+
+#include "sl_builtin.h"
+#include "sl_list.h"
+#include "sl_map.h"
+#include "sl_ordmap.h"
+#include "sl_str.h"
+#include "test.h"
+
+#define cStr(s) (const uint8_t *)(s), strlen(s)
+
+// Nodes other than the root have at least this many keys
+#define minKeys ((slOrdMapNodeCap + 1) / 2 - 1)
+
+// Check the B-tree invariants below `node` and count its keys. All the leaves
+// must be at depth `*leafDepth`, which is set by the first leaf reached.
+static bool isValidNode(
+    SlVM *vm,
+    const SlOrdMapNode *node,
+    bool root,
+    int depth,
+    int *leafDepth,
+    size_t *count
+) {
+    if (node->count > slOrdMapNodeCap || (!root && node->count < minKeys)) {
+        return false;
+    }
+    for (uint16_t i = 1; i < node->count; i++) {
+        int cmp;
+        if (!slOrdMapKeyCmp(vm, node->keys[i - 1], node->keys[i], &cmp)
+            || cmp >= 0)
+        {
+            return false;
+        }
+    }
+    *count += node->count;
+    if (node->leaf) {
+        if (*leafDepth < 0) {
+            *leafDepth = depth;
+        }
+        return *leafDepth == depth;
+    }
+    for (uint16_t i = 0; i <= node->count; i++) {
+        const SlOrdMapNode *child = node->children[i];
+        int cmp;
+        // The keys of a child are between the keys around it
+        if (i > 0 && (!slOrdMapKeyCmp(
+            vm, node->keys[i - 1], child->keys[0], &cmp) || cmp >= 0))
+        {
+            return false;
+        }
+        if (i < node->count && (!slOrdMapKeyCmp(
+            vm, child->keys[child->count - 1], node->keys[i], &cmp)
+            || cmp >= 0))
+        {
+            return false;
+        }
+        if (!isValidNode(vm, child, false, depth + 1, leafDepth, count)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool isValid(SlVM *vm, SlOrdMap *map) {
+    if (map->root == NULL) {
+        return map->count == 0;
+    }
+    int leafDepth = -1;
+    size_t count = 0;
+    return isValidNode(vm, map->root, true, 0, &leafDepth, &count)
+        && count == map->count;
+}
+
+// Keys `0` to `n - 1` in a scrambled order, `n` must not be a multiple of 7.
+static int64_t scrambled(int64_t i, int64_t n) {
+    return i * 7 % n;
+}
+
+static void testOrdMapInsert(SlVM *vm) {
+    SlObj obj = slOrdMapNew(vm);
+    SlOrdMap *map = obj.as.ordMap;
+    for (int64_t i = 0; i < 1000; i++) {
+        int64_t key = scrambled(i, 1000);
+        check(slOrdMapSet(vm, map, slObjInt(key), slObjInt(-key)));
+    }
+    check(map->count == 1000);
+    check(isValid(vm, map));
+    // Splitting nodes made the tree grow a few levels
+    check(!map->root->leaf && !map->root->children[0]->leaf);
+    for (int64_t i = 0; i < 1000; i++) {
+        check(slOrdMapGet(vm, map, slObjInt(i))->as.numInt == -i);
+    }
+    check(slOrdMapGet(vm, map, slObjInt(1000)) == NULL);
+
+    // Setting an existing key replaces its value
+    check(slOrdMapSet(vm, map, slObjInt(500), slNull));
+    check(map->count == 1000);
+    check(slOrdMapGet(vm, map, slObjInt(500))->type == SlObj_Null);
+    slDelRef(obj);
+}
+
+static void testOrdMapDelete(SlVM *vm) {
+    SlObj obj = slOrdMapNew(vm);
+    SlOrdMap *map = obj.as.ordMap;
+    for (int64_t i = 0; i < 999; i++) {
+        check(slOrdMapSet(vm, map, slObjInt(i), slObjInt(-i)));
+    }
+    // Removing keys borrows from siblings and merges nodes
+    for (int64_t i = 0; i < 999; i += 2) {
+        check(slOrdMapDel(vm, map, slObjInt(scrambled(i, 999))));
+    }
+    check(map->count == 499);
+    check(isValid(vm, map));
+    check(!slOrdMapDel(vm, map, slObjInt(scrambled(0, 999))));
+    for (int64_t i = 1; i < 999; i += 2) {
+        int64_t key = scrambled(i, 999);
+        check(slOrdMapGet(vm, map, slObjInt(key))->as.numInt == -key);
+    }
+
+    for (int64_t i = 1; i < 999; i += 2) {
+        check(slOrdMapDel(vm, map, slObjInt(scrambled(i, 999))));
+        if (i % 100 == 1) {
+            check(isValid(vm, map));
+        }
+    }
+    check(map->count == 0 && isValid(vm, map));
+    slDelRef(obj);
+}
+
+static void testOrdMapFromSorted(SlVM *vm) {
+    SlObj keys[500];
+    SlObj values[500];
+    for (int64_t i = 0; i < 500; i++) {
+        keys[i] = slObjInt(i * 2);
+        values[i] = slObjFloat((SlFloat)i);
+    }
+    SlObj obj = slOrdMapFromSorted(vm, keys, values, 500);
+    SlOrdMap *map = obj.as.ordMap;
+    check(map->count == 500 && isValid(vm, map));
+    check(slOrdMapGet(vm, map, slObjInt(998))->as.numFloat == 499);
+    check(slOrdMapGet(vm, map, slObjInt(997)) == NULL);
+    // The tree can be changed afterwards
+    check(slOrdMapSet(vm, map, slObjInt(997), slNull));
+    check(slOrdMapDel(vm, map, slObjInt(0)));
+    check(isValid(vm, map));
+    slDelRef(obj);
+
+    keys[10] = slObjInt(0);
+    obj = slOrdMapFromSorted(vm, keys, values, 500);
+    check(obj.type == SlObj_Null && vm->error.occurred);
+    vm->error.occurred = false;
+}
+
+static void testOrdMapLookups(SlVM *vm) {
+    SlObj obj = slOrdMapNew(vm);
+    SlOrdMap *map = obj.as.ordMap;
+    for (int64_t i = 0; i < 200; i += 10) {
+        check(slOrdMapSet(vm, map, slObjInt(i), slObjInt(i)));
+    }
+    SlObj key;
+    SlObj *value;
+    check(slOrdMapFloor(vm, map, slObjInt(55), &key, &value));
+    check(key.as.numInt == 50);
+    check(slOrdMapFloor(vm, map, slObjInt(60), &key, &value));
+    check(key.as.numInt == 60);
+    check(!slOrdMapFloor(vm, map, slObjInt(-1), &key, &value));
+    check(slOrdMapCeil(vm, map, slObjInt(55), &key, &value));
+    check(key.as.numInt == 60);
+    check(!slOrdMapCeil(vm, map, slObjInt(191), &key, &value));
+    check(!vm->error.occurred);
+
+    // Ranges include both bounds, an empty bound is open
+    SlOrdMapIter iter;
+    check(slOrdMapIterInit(vm, map, slObjInt(35), slObjInt(70), &iter));
+    int64_t expected = 40;
+    while (slOrdMapIterNext(vm, &iter, &key, &value)) {
+        check(key.as.numInt == expected);
+        expected += 10;
+    }
+    check(expected == 80);
+    SlObj open = { .type = SlObj_Empty };
+    check(slOrdMapIterInit(vm, map, slObjInt(150), open, &iter));
+    expected = 150;
+    while (slOrdMapIterNext(vm, &iter, &key, &value)) {
+        check(key.as.numInt == expected);
+        expected += 10;
+    }
+    check(expected == 200);
+
+    // All the keys must have the same type
+    check(!slOrdMapSet(vm, map, slObjFloat(1.5), slNull));
+    check(vm->error.occurred);
+    vm->error.occurred = false;
+    check(!slOrdMapSet(vm, map, slObjFloat(NAN), slNull));
+    check(vm->error.occurred);
+    vm->error.occurred = false;
+    slDelRef(obj);
+}
+
+static void testOrdMapStrKeys(SlVM *vm) {
+    SlObj obj = slOrdMapNew(vm);
+    SlOrdMap *map = obj.as.ordMap;
+    const char *words[] = { "pear", "apple", "a longer key than the others",
+        "fig", "apples" };
+    for (int i = 0; i < 5; i++) {
+        SlObj key = slFrozenStrNew(vm, cStr(words[i]));
+        check(slOrdMapSet(vm, map, key, slObjInt(i)));
+        slDelRef(key);
+    }
+    SlOrdMapIter iter;
+    SlObj open = { .type = SlObj_Empty };
+    check(slOrdMapIterInit(vm, map, open, open, &iter));
+    const char *sorted[] = { "a longer key than the others", "apple",
+        "apples", "fig", "pear" };
+    SlObj key;
+    SlObj *value;
+    for (int i = 0; slOrdMapIterNext(vm, &iter, &key, &value); i++) {
+        checkStr(key, sorted[i]);
+    }
+    // String keys are stored interned
+    check(map->root->keys[0].as.str->internedIn != NULL);
+    slDelRef(obj);
+}
+
+static void testOrdMapBuiltins(SlVM *vm) {
+    // Keys in increasing order are loaded in bulk, others one by one
+    SlObj src = slMapNew(vm);
+    for (int64_t i = 1; i <= 100; i++) {
+        check(slMapSet(vm, src.as.map, slObjInt(i * 3), slObjInt(i)));
+    }
+    SlObj obj = slToOrdMap(vm, src);
+    check(obj.type == SlObj_OrdMap && obj.as.ordMap->count == 100);
+    check(isValid(vm, obj.as.ordMap));
+    check(slMapSet(vm, src.as.map, slObjInt(1), slObjInt(0)));
+    SlObj unsorted = slToOrdMap(vm, src);
+    check(unsorted.as.ordMap->count == 101);
+    check(isValid(vm, unsorted.as.ordMap));
+    slDelRef(unsorted);
+    check(slMapSet(vm, src.as.map, slNull, slNull));
+    check(slToOrdMap(vm, src).type == SlObj_Null && vm->error.occurred);
+    vm->error.occurred = false;
+    slDelRef(src);
+
+    SlObj keys = slRange(vm, obj, slObjInt(10), slObjInt(20));
+    check(keys.type == SlObj_FrozenList && keys.as.list->len == 3);
+    check(slListGet(keys.as.list, 0).as.numInt == 12);
+    check(slListGet(keys.as.list, 2).as.numInt == 18);
+    slDelRef(keys);
+    keys = slRange(vm, obj, slNull, slObjInt(6));
+    check(keys.as.list->len == 2);
+    slDelRef(keys);
+
+    check(slFloor(vm, obj, slObjInt(10)).as.numInt == 9);
+    check(slCeil(vm, obj, slObjInt(10)).as.numInt == 12);
+    check(slCeil(vm, obj, slObjInt(301)).type == SlObj_Null);
+    check(!vm->error.occurred);
+    check(slFloor(vm, src, slObjInt(1)).type == SlObj_Null);
+    check(vm->error.occurred);
+    vm->error.occurred = false;
+
+    SlObj item = slGetItem(vm, obj, slObjInt(30));
+    check(item.as.numInt == 10);
+    check(slSetItem(vm, &obj, slObjInt(31), slObjInt(-1)));
+    check(slGetItem(vm, obj, slObjInt(31)).as.numInt == -1);
+
+    // Sharing an ordered map shares its keys and values
+    SlObj str = slFrozenStrNew(vm, cStr("a value that is not small"));
+    check(slSetItem(vm, &obj, slObjInt(0), str));
+    check(slShare(vm, obj));
+    check(slIsShared(str));
+    slDelRef(str);
+    slDelRef(obj);
+}
+
+int main(void) {
+    runTest(testOrdMapInsert);
+    runTest(testOrdMapDelete);
+    runTest(testOrdMapFromSorted);
+    runTest(testOrdMapLookups);
+    runTest(testOrdMapStrKeys);
+    runTest(testOrdMapBuiltins);
+    return testResult();
+}
@@ -0,0 +1,220 @@
+#include <stdlib.h>
+
+#include "sl_list.h"
+#include "sl_map.h"
+#include "sl_persist.h"
+#include "test.h"
+
+static SlObj newFrozenRange(SlVM *vm, size_t len) {
+    SlObj *items = malloc(len * sizeof(*items));
+    for (size_t i = 0; i < len; i++) {
+        items[i] = slObjInt((int64_t)i);
+    }
+    SlObj list = slFrozenListNew(vm, items, len);
+    free(items);
+    return list;
+}
+
+static bool isRange(SlObj list, size_t len) {
+    if (list.as.list->len != len) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        SlObj item = slListGet(list.as.list, i);
+        if (item.type != SlObj_Int || item.as.numInt != (int64_t)i) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static SlObj newMapRange(SlVM *vm, int64_t len) {
+    SlObj map = slMapNew(vm);
+    for (int64_t i = 0; i < len; i++) {
+        check(slMapSet(vm, map.as.map, slObjInt(i), slObjInt(-i)));
+    }
+    return map;
+}
+
+static void testListTrieThreshold(SlVM *vm) {
+    SlObj flat = newFrozenRange(vm, slPersistMinLen - 1);
+    check(flat.type == SlObj_FrozenList);
+    check(flat.as.list->kind == SlList_Ints);
+    check((void *)flat.as.list->ints == (void *)(flat.as.list + 1));
+    check(flat.as.list->cap == slPersistMinLen - 1);
+    SlObj trie = slFrozenListAppend(vm, flat, slObjInt(slPersistMinLen - 1));
+    check(trie.as.list->kind == SlList_Trie);
+    check(isRange(trie, slPersistMinLen));
+    // The original version is unchanged
+    check(isRange(flat, slPersistMinLen - 1));
+    slDelRef(trie);
+    slDelRef(flat);
+}
+
+static void testListPathCopy(SlVM *vm) {
+    // Three levels: 32 * 32 items per child of the root
+    SlObj list = newFrozenRange(vm, 3000);
+    check(list.as.list->trieShift == 2 * slPNodeBits);
+    SlObj changed = slFrozenListSet(vm, list, 1500, slObjInt(-1));
+    check(isRange(list, 3000));
+    check(slListGet(changed.as.list, 1500).as.numInt == -1);
+    check(slListGet(changed.as.list, 1499).as.numInt == 1499);
+
+    // Only the nodes on the path to the change are copied
+    SlObj *oldChildren = slPNodeItems(list.as.list->trie);
+    SlObj *newChildren = slPNodeItems(changed.as.list->trie);
+    check(oldChildren != newChildren);
+    check(oldChildren[0].as.pnode == newChildren[0].as.pnode);
+    check(oldChildren[1].as.pnode != newChildren[1].as.pnode);
+    check(oldChildren[2].as.pnode == newChildren[2].as.pnode);
+    check(oldChildren[0].as.gcObj->refCount == 2);
+
+    slDelRef(list);
+    check(slListGet(changed.as.list, 2999).as.numInt == 2999);
+    slDelRef(changed);
+}
+
+static void testListAppendGrowth(SlVM *vm) {
+    // Appending past 32 and 32 * 32 items adds a level above the root
+    SlObj list = newFrozenRange(vm, slPersistMinLen);
+    check(list.as.list->trieShift == 0);
+    for (size_t len = slPersistMinLen; len < 1100; len++) {
+        SlObj next = slFrozenListAppend(vm, list, slObjInt((int64_t)len));
+        slDelRef(list);
+        list = next;
+        if (len == slPNodeWidth) {
+            check(list.as.list->trieShift == slPNodeBits);
+        }
+    }
+    check(list.as.list->trieShift == 2 * slPNodeBits);
+    check(isRange(list, 1100));
+    slDelRef(list);
+}
+
+static void testMapHamt(SlVM *vm) {
+    SlObj src = newMapRange(vm, 100);
+    SlObj map = slFrozenMapNew(vm, src.as.map);
+    slDelRef(src);
+    check(map.type == SlObj_FrozenMap && map.as.map->hamt != NULL);
+    check(map.as.map->count == 100);
+    for (int64_t i = 0; i < 100; i++) {
+        check(slMapGet(vm, map.as.map, slObjInt(i))->as.numInt == -i);
+    }
+    check(slMapGet(vm, map.as.map, slObjInt(100)) == NULL);
+
+    SlObj added = slFrozenMapSet(vm, map, slObjInt(100), slObjInt(1));
+    SlObj updated = slFrozenMapSet(vm, added, slObjInt(5), slObjInt(5));
+    SlObj removed = slFrozenMapDel(vm, updated, slObjInt(0));
+    check(added.as.map->count == 101);
+    check(removed.as.map->count == 100);
+    // Every version keeps its own contents
+    check(slMapGet(vm, map.as.map, slObjInt(100)) == NULL);
+    check(slMapGet(vm, added.as.map, slObjInt(100))->as.numInt == 1);
+    check(slMapGet(vm, added.as.map, slObjInt(5))->as.numInt == -5);
+    check(slMapGet(vm, updated.as.map, slObjInt(5))->as.numInt == 5);
+    check(slMapGet(vm, updated.as.map, slObjInt(0)) != NULL);
+    check(slMapGet(vm, removed.as.map, slObjInt(0)) == NULL);
+    // Updating a key shares the HAMT, only the order trie changes
+    check(updated.as.map->hamt == added.as.map->hamt);
+
+    // Iteration keeps insertion order and skips removed entries
+    size_t iter = 0;
+    int64_t expected = 1;
+    SlObj key;
+    SlObj *value;
+    while (slMapNext(removed.as.map, &iter, &key, &value)) {
+        check(key.as.numInt == expected++);
+    }
+    check(expected == 101);
+
+    SlObj same = slFrozenMapDel(vm, removed, slObjInt(0));
+    check(same.as.map == removed.as.map);
+
+    slDelRef(same);
+    slDelRef(removed);
+    slDelRef(updated);
+    slDelRef(added);
+    slDelRef(map);
+}
+
+typedef struct HashedKey {
+    uint32_t hash;
+    int64_t key;
+} HashedKey;
+
+static int compareHashes(const void *a, const void *b) {
+    uint32_t hashA = ((const HashedKey *)a)->hash;
+    uint32_t hashB = ((const HashedKey *)b)->hash;
+    return hashA < hashB ? -1 : hashA > hashB;
+}
+
+static void testMapHamtCollision(SlVM *vm) {
+    // Find two Int keys with the same 32-bit hash
+    size_t count = 300000;
+    HashedKey *keys = malloc(count * sizeof(*keys));
+    for (size_t i = 0; i < count; i++) {
+        keys[i].key = (int64_t)i;
+        check(slMapKeyHash(vm, slObjInt((int64_t)i), &keys[i].hash));
+    }
+    qsort(keys, count, sizeof(*keys), compareHashes);
+    int64_t a = -1, b = -1;
+    for (size_t i = 1; i < count && a < 0; i++) {
+        if (keys[i].hash == keys[i - 1].hash) {
+            a = keys[i - 1].key;
+            b = keys[i].key;
+        }
+    }
+    free(keys);
+    check(a >= 0);
+    if (a < 0) {
+        return;
+    }
+
+    SlObj src = newMapRange(vm, 40);
+    SlObj map = slFrozenMapNew(vm, src.as.map);
+    slDelRef(src);
+    SlObj withA = slFrozenMapSet(vm, map, slObjInt(a), slObjInt(1));
+    SlObj withBoth = slFrozenMapSet(vm, withA, slObjInt(b), slObjInt(2));
+    check(withBoth.as.map->count == 42);
+    check(slMapGet(vm, withBoth.as.map, slObjInt(a))->as.numInt == 1);
+    check(slMapGet(vm, withBoth.as.map, slObjInt(b))->as.numInt == 2);
+    check(slMapGet(vm, withA.as.map, slObjInt(b)) == NULL);
+
+    SlObj withB = slFrozenMapDel(vm, withBoth, slObjInt(a));
+    check(slMapGet(vm, withB.as.map, slObjInt(a)) == NULL);
+    check(slMapGet(vm, withB.as.map, slObjInt(b))->as.numInt == 2);
+    check(slMapGet(vm, withBoth.as.map, slObjInt(a))->as.numInt == 1);
+
+    slDelRef(withB);
+    slDelRef(withBoth);
+    slDelRef(withA);
+    slDelRef(map);
+}
+
+static void testMapSmallFrozen(SlVM *vm) {
+    // Small frozen maps stay flat, growing one past the threshold builds
+    // the tries
+    SlObj src = newMapRange(vm, slPersistMinLen - 1);
+    SlObj map = slFrozenMapNew(vm, src.as.map);
+    slDelRef(src);
+    check(map.type == SlObj_FrozenMap && map.as.map->hamt == NULL);
+    // They are a single allocation with room for one more entry
+    check((void *)map.as.map->entries == (void *)(map.as.map + 1));
+    check(map.as.map->cap == slPersistMinLen);
+    SlObj grown = slFrozenMapSet(vm, map, slObjInt(-1), slNull);
+    check(grown.as.map->hamt != NULL);
+    check(slMapCount(grown.as.map) == slPersistMinLen);
+    check(slMapCount(map.as.map) == slPersistMinLen - 1);
+    slDelRef(grown);
+    slDelRef(map);
+}
+
+int main(void) {
+    runTest(testListTrieThreshold);
+    runTest(testListPathCopy);
+    runTest(testListAppendGrowth);
+    runTest(testMapHamt);
+    runTest(testMapHamtCollision);
+    runTest(testMapSmallFrozen);
+    return testResult();
+}
@@ -0,0 +1,162 @@
+#include "sl_builtin.h"
+#include "test.h"
+
+#define cStr(s) (const uint8_t *)(s), strlen(s)
+
+static bool isRope(SlObj str) {
+    return str.type == SlObj_FrozenStr && str.as.str->bytes == NULL;
+}
+
+static void testRopeThreshold(SlVM *vm) {
+    // 31 + 32 bytes are copied, 32 + 32 bytes produce a rope
+    SlObj a = slFrozenStrNew(vm, cStr("0123456789abcdef0123456789abcde"));
+    SlObj b = slFrozenStrNew(vm, cStr("0123456789abcdef0123456789abcdef"));
+
+    SlObj flat = slStrConcat(vm, a, b);
+    check(!isRope(flat));
+    check(slStrLen(&flat) == slRopeMinLen - 1);
+
+    SlObj rope = slStrConcat(vm, b, b);
+    check(isRope(rope));
+    check(slStrLen(&rope) == slRopeMinLen);
+    check(slStrFlatten(vm, rope));
+    check(!isRope(rope));
+    checkStr(
+        rope,
+        "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"
+    );
+
+    slDelRef(flat);
+    slDelRef(rope);
+    slDelRef(a);
+    slDelRef(b);
+}
+
+static void testRopeFlattenOrder(SlVM *vm) {
+    SlObj parts[4] = {
+        slFrozenStrNew(vm, cStr("first part with 32 bytes........")),
+        slFrozenStrNew(vm, cStr("second part with 32 bytes.......")),
+        slFrozenStrNew(vm, cStr("third part with 32 bytes........")),
+        slFrozenStrNew(vm, cStr("fourth part with 32 bytes.......")),
+    };
+    // ((0 + 1) + (2 + 3)): the right side is a rope too and is walked using
+    // the pending stack
+    SlObj left = slStrConcat(vm, parts[0], parts[1]);
+    SlObj right = slStrConcat(vm, parts[2], parts[3]);
+    SlObj root = slStrConcat(vm, left, right);
+    check(isRope(left) && isRope(right) && isRope(root));
+
+    check(slStrFlatten(vm, root));
+    checkStr(
+        root,
+        "first part with 32 bytes........second part with 32 bytes......."
+        "third part with 32 bytes........fourth part with 32 bytes......."
+    );
+    // The parts are still usable by their other owners
+    check(isRope(left));
+    check(slStrFlatten(vm, left));
+    checkStr(
+        left,
+        "first part with 32 bytes........second part with 32 bytes......."
+    );
+
+    slDelRef(root);
+    slDelRef(left);
+    slDelRef(right);
+    for (int i = 0; i < 4; i++) {
+        slDelRef(parts[i]);
+    }
+}
+
+static void testRopeLeftDeep(SlVM *vm) {
+    // A string built by appending in a loop, flattening and destroying it
+    // must not recurse on its depth
+    SlObj piece = slFrozenStrNew(vm, cStr("0123456789"));
+    SlObj str = slFrozenStrNew(vm, cStr("start-of-a-long-string-"));
+    for (int i = 0; i < 100000; i++) {
+        SlObj next = slStrConcat(vm, str, piece);
+        slDelRef(str);
+        str = next;
+    }
+    check(slStrLen(&str) == 23 + 100000 * 10);
+    check(slStrFlatten(vm, str));
+    const uint8_t *bytes = slStrBytes(&str);
+    check(memcmp(bytes, "start-of-a-long-string-0123456789", 33) == 0);
+    check(memcmp(bytes + slStrLen(&str) - 10, "0123456789", 10) == 0);
+    slDelRef(str);
+
+    // Destroyed without being flattened
+    str = slFrozenStrNew(vm, cStr("start-of-a-long-string-"));
+    for (int i = 0; i < 100000; i++) {
+        SlObj next = slStrConcat(vm, str, piece);
+        slDelRef(str);
+        str = next;
+    }
+    check(isRope(str));
+    slDelRef(str);
+    slDelRef(piece);
+}
+
+static void testRopeShare(SlVM *vm) {
+    SlObj a = slFrozenStrNew(vm, cStr("a string with 32 bytes in it...."));
+    SlObj rope = slStrConcat(vm, a, a);
+    check(isRope(rope));
+
+    // Other threads cannot flatten or hash the string, both happen before
+    check(slShare(vm, rope));
+    check(slIsShared(rope));
+    check(!isRope(rope));
+    check(rope.as.str->hash != 0);
+    check(!slIsShared(a));
+    checkStr(
+        rope,
+        "a string with 32 bytes in it....a string with 32 bytes in it...."
+    );
+
+    slDelRef(rope);
+    slDelRef(a);
+}
+
+static void testRopeIntern(SlVM *vm) {
+    SlObj a = slFrozenStrNew(vm, cStr("a string with 32 bytes in it...."));
+    SlObj rope = slStrConcat(vm, a, a);
+    SlObj interned = slStrIntern(vm, rope);
+    check(interned.as.str == rope.as.str);
+    check(!isRope(rope));
+
+    SlObj again = slStrInternBytes(
+        vm,
+        cStr("a string with 32 bytes in it....a string with 32 bytes in it....")
+    );
+    check(again.as.str == rope.as.str);
+
+    slDelRef(again);
+    slDelRef(interned);
+    slDelRef(rope);
+    slDelRef(a);
+}
+
+static void testInterpolate(SlVM *vm) {
+    SlObj parts[20];
+    for (int i = 0; i < 20; i++) {
+        parts[i] = slObjInt(i);
+    }
+    SlObj str = slInterpolate(vm, parts, 3);
+    checkStr(str, "012");
+    slDelRef(str);
+
+    // More parts than the buffer on the stack
+    str = slInterpolate(vm, parts, 20);
+    checkStr(str, "012345678910111213141516171819");
+    slDelRef(str);
+}
+
+int main(void) {
+    runTest(testRopeThreshold);
+    runTest(testRopeFlattenOrder);
+    runTest(testRopeLeftDeep);
+    runTest(testRopeShare);
+    runTest(testRopeIntern);
+    runTest(testInterpolate);
+    return testResult();
+}
@@ -0,0 +1,150 @@
+#include "sl_map.h"
+#include "sl_str.h"
+#include "test.h"
+
+#define cStr(s) (const uint8_t *)(s), strlen(s)
+
+static SlObj newRecord(SlVM *vm, const char **keys, size_t count) {
+    SlObj map = slMapNew(vm);
+    for (size_t i = 0; i < count; i++) {
+        SlObj key = slFrozenStrNew(vm, cStr(keys[i]));
+        check(slMapSet(vm, map.as.map, key, slObjInt((int64_t)i)));
+        slDelRef(key);
+    }
+    return map;
+}
+
+static void testShapeTransitions(SlVM *vm) {
+    const char *keys[] = { "x", "y", "a longer field name" };
+    const char *otherOrder[] = { "y", "x", "a longer field name" };
+    SlObj a = newRecord(vm, keys, 3);
+    SlObj b = newRecord(vm, keys, 3);
+    SlObj c = newRecord(vm, otherOrder, 3);
+
+    // The same keys in the same order lead to the same shape
+    check(a.as.map->shape != NULL);
+    check(a.as.map->shape == b.as.map->shape);
+    check(a.as.map->shape != c.as.map->shape);
+    check(a.as.map->shape->keyCount == 3);
+    check(a.as.map->ctrl == NULL);
+    // Both orders start from the root, which has one child for each key
+    check(vm->rootShape != NULL && vm->rootShape->childCount == 2);
+
+    SlObj key = slFrozenStrNew(vm, cStr("a longer field name"));
+    check(slMapGet(vm, c.as.map, key)->as.numInt == 2);
+    slDelRef(key);
+
+    slDelRef(a);
+    slDelRef(b);
+    slDelRef(c);
+    // Shapes are released with the last map using them
+    check(vm->rootShape == NULL);
+}
+
+static void testShapeToDict(SlVM *vm) {
+    const char *keys[] = { "x", "y" };
+
+    // A key that is not a string
+    SlObj map = newRecord(vm, keys, 2);
+    check(slMapSet(vm, map.as.map, slObjInt(1), slNull));
+    check(map.as.map->shape == NULL);
+    SlObj x = slFrozenStrNew(vm, cStr("x"));
+    check(slMapGet(vm, map.as.map, x)->as.numInt == 0);
+    slDelRef(map);
+
+    // A removed key
+    map = newRecord(vm, keys, 2);
+    check(slMapDel(vm, map.as.map, x));
+    check(map.as.map->shape == NULL);
+    check(slMapGet(vm, map.as.map, x) == NULL);
+    slDelRef(map);
+
+    // Too many keys
+    map = slMapNew(vm);
+    for (int i = 0; i <= slShapeMaxKeys; i++) {
+        SlObj key = slFrozenStrFmt(vm, "key%d", i);
+        check(slMapSet(vm, map.as.map, key, slObjInt(i)));
+        check((map.as.map->shape != NULL) == (i < slShapeMaxKeys));
+        slDelRef(key);
+    }
+    check(map.as.map->count == slShapeMaxKeys + 1);
+    check(slMapGet(vm, map.as.map, x) == NULL);
+    slDelRef(map);
+    slDelRef(x);
+}
+
+static void testFieldCacheGet(SlVM *vm) {
+    const char *keys[] = { "x", "y" };
+    SlObj a = newRecord(vm, keys, 2);
+    SlObj b = newRecord(vm, keys, 2);
+    SlFieldCache cache = { .key = slFrozenStrNew(vm, cStr("y")) };
+
+    // A miss fills the cache, a map with the same shape hits it
+    check(slMapGetField(vm, a.as.map, &cache)->as.numInt == 1);
+    check(cache.shape == a.as.map->shape);
+    check(cache.transition == NULL && cache.idx == 1);
+    check(slMapGetField(vm, b.as.map, &cache)->as.numInt == 1);
+
+    // Dictionary mode maps are looked up without the cache
+    check(slMapSet(vm, b.as.map, slObjInt(0), slNull));
+    check(slMapGetField(vm, b.as.map, &cache)->as.numInt == 1);
+    check(cache.shape == a.as.map->shape);
+
+    SlFieldCache missing = { .key = slFrozenStrNew(vm, cStr("z")) };
+    check(slMapGetField(vm, a.as.map, &missing) == NULL);
+
+    slFieldCacheClear(&cache);
+    slFieldCacheClear(&missing);
+    slDelRef(a);
+    slDelRef(b);
+}
+
+static void testFieldCacheSet(SlVM *vm) {
+    SlObj a = slMapNew(vm);
+    SlObj b = slMapNew(vm);
+    SlFieldCache cache = { .key = slFrozenStrNew(vm, cStr("x")) };
+
+    // Adding a field caches the transition, the next map reuses it
+    check(slMapSetField(vm, a.as.map, &cache, slObjInt(1)));
+    check(cache.transition == a.as.map->shape);
+    check(slMapSetField(vm, b.as.map, &cache, slObjInt(2)));
+    check(b.as.map->shape == a.as.map->shape);
+    check(b.as.map->count == 1);
+    check(slMapGet(vm, b.as.map, cache.key)->as.numInt == 2);
+
+    // Updating an existing field caches its position
+    check(slMapSetField(vm, a.as.map, &cache, slObjInt(3)));
+    check(cache.transition == NULL && cache.shape == a.as.map->shape);
+    check(slMapSetField(vm, b.as.map, &cache, slObjInt(4)));
+    check(b.as.map->count == 1);
+    check(slMapGetField(vm, a.as.map, &cache)->as.numInt == 3);
+    check(slMapGetField(vm, b.as.map, &cache)->as.numInt == 4);
+
+    slFieldCacheClear(&cache);
+    slDelRef(a);
+    slDelRef(b);
+    check(vm->rootShape == NULL);
+}
+
+static void testShapeShare(SlVM *vm) {
+    const char *keys[] = { "x", "y" };
+    SlObj map = newRecord(vm, keys, 2);
+
+    // Shapes are not shared between threads, the map becomes a dictionary
+    check(slShare(vm, map));
+    check(map.as.map->shape == NULL);
+    check(vm->rootShape == NULL);
+    SlObj y = slFrozenStrNew(vm, cStr("y"));
+    check(slMapGet(vm, map.as.map, y)->as.numInt == 1);
+    slDelRef(y);
+    slDelRef(map);
+}
+
+int main(void) {
+    runTest(testShapeTransitions);
+    runTest(testShapeToDict);
+    runTest(testFieldCacheGet);
+    runTest(testFieldCacheSet);
+    runTest(testShapeShare);
+    return testResult();
+}
@@ -0,0 +1,90 @@
+#include "test.h"
+
+#define cStr(s) (const uint8_t *)(s), strlen(s)
+
+static void testSmallStrBoundary(SlVM *vm) {
+    SlObj empty = slFrozenStrNew(vm, cStr(""));
+    check(empty.type == SlObj_SmallStr);
+    checkStr(empty, "");
+
+    // slSmallStrCap bytes are stored inline, one more needs an allocation
+    SlObj full = slFrozenStrNew(vm, cStr("abcdefghijk"));
+    check(full.type == SlObj_SmallStr);
+    checkStr(full, "abcdefghijk");
+    // The unused capacity is zero and doubles as the terminator
+    check(slStrBytes(&full)[slSmallStrCap] == '\0');
+
+    SlObj heap = slFrozenStrNew(vm, cStr("abcdefghijkl"));
+    check(heap.type == SlObj_FrozenStr);
+    checkStr(heap, "abcdefghijkl");
+    slDelRef(heap);
+}
+
+static void testSmallStrEmbeddedNul(SlVM *vm) {
+    SlObj str = slFrozenStrNew(vm, (const uint8_t *)"a\0b", 3);
+    check(str.type == SlObj_SmallStr);
+    check(slStrLen(&str) == 3);
+    check(memcmp(slStrBytes(&str), "a\0b", 3) == 0);
+    check(!slStrEq(str, slFrozenStrNew(vm, cStr("a"))));
+}
+
+static void testStrEqAcrossForms(SlVM *vm) {
+    SlObj small = slFrozenStrNew(vm, cStr("key"));
+    SlObj same = slFrozenStrNew(vm, cStr("key"));
+    SlObj other = slFrozenStrNew(vm, cStr("kez"));
+    check(slStrEq(small, same));
+    check(!slStrEq(small, other));
+    check(slStrHash(small) == slStrHash(same));
+
+    SlObj longA = slFrozenStrNew(vm, cStr("a long string key"));
+    SlObj longB = slFrozenStrNew(vm, cStr("a long string key"));
+    check(longA.as.str != longB.as.str);
+    check(slStrEq(longA, longB));
+    check(!slStrEq(longA, small));
+    check(slStrHash(longA) == slStrHash(longB));
+    slDelRef(longA);
+    slDelRef(longB);
+}
+
+static void testStrConcatBoundary(SlVM *vm) {
+    SlObj a = slFrozenStrNew(vm, cStr("abcde"));
+    SlObj b = slFrozenStrNew(vm, cStr("fghijk"));
+    SlObj c = slFrozenStrNew(vm, cStr("fghijkl"));
+
+    SlObj fits = slStrConcat(vm, a, b);
+    check(fits.type == SlObj_SmallStr);
+    checkStr(fits, "abcdefghijk");
+
+    SlObj spills = slStrConcat(vm, a, c);
+    check(spills.type == SlObj_FrozenStr);
+    checkStr(spills, "abcdefghijkl");
+    slDelRef(spills);
+}
+
+static void testStrFmt(SlVM *vm) {
+    SlObj small = slFrozenStrFmt(vm, "%d", 12345);
+    check(small.type == SlObj_SmallStr);
+    checkStr(small, "12345");
+
+    SlObj heap = slFrozenStrFmt(vm, "%s-%d", "a longer string", 7);
+    check(heap.type == SlObj_FrozenStr);
+    checkStr(heap, "a longer string-7");
+    slDelRef(heap);
+}
+
+static void testStrTypeName(SlVM *vm) {
+    SlObj small = slFrozenStrNew(vm, cStr("x"));
+    SlObj heap = slFrozenStrNew(vm, cStr("not a small string"));
+    check(strcmp(slTypeName(small), slTypeName(heap)) == 0);
+    slDelRef(heap);
+}
+
+int main(void) {
+    runTest(testSmallStrBoundary);
+    runTest(testSmallStrEmbeddedNul);
+    runTest(testStrEqAcrossForms);
+    runTest(testStrConcatBoundary);
+    runTest(testStrFmt);
+    runTest(testStrTypeName);
+    return testResult();
+}
@@ -0,0 +1,258 @@
+#include "sl_builtin.h"
+#include "sl_list.h"
+#include "sl_persist.h"
+#include "sl_str.h"
+#include "test.h"
+
+#define cStr(s) (const uint8_t *)(s), strlen(s)
+
+// Create a frozen string of `len` bytes cycling through the alphabet.
+static SlObj newAlphabet(SlVM *vm, size_t len) {
+    uint8_t bytes[1024];
+    for (size_t i = 0; i < len; i++) {
+        bytes[i] = (uint8_t)('a' + i % 26);
+    }
+    return slFrozenStrNew(vm, bytes, len);
+}
+
+// Create a flat frozen list of the Ints `0` to `len - 1`.
+static SlObj newFlatRange(SlVM *vm, int64_t len) {
+    SlObj list = slListNew(vm, 0);
+    for (int64_t i = 0; i < len; i++) {
+        check(slListAppend(vm, list.as.list, slObjInt(i)));
+    }
+    return slFreeze(vm, list);
+}
+
+static void testStrView(SlVM *vm) {
+    SlObj parent = newAlphabet(vm, 200);
+    SlObj view = slStrSlice(vm, parent, 10, 100);
+    check(view.type == SlObj_FrozenStr);
+    check(view.as.str->parent == parent.as.str);
+    check(slStrBytes(&view) == slStrBytes(&parent) + 10);
+    check(slStrLen(&view) == 100);
+    check(parent.as.str->asGCObj.refCount == 2);
+
+    // A view of a view references the string that owns the bytes
+    SlObj inner = slStrSlice(vm, view, 26, 64);
+    check(inner.as.str->parent == parent.as.str);
+    check(slStrBytes(&inner) == slStrBytes(&parent) + 36);
+
+    // The whole string is the string itself
+    SlObj whole = slStrSlice(vm, parent, 0, 200);
+    check(whole.as.str == parent.as.str);
+    slDelRef(whole);
+
+    // Views keep the bytes alive
+    slDelRef(parent);
+    check(slStrBytes(&inner)[0] == 'k');
+    slDelRef(inner);
+    slDelRef(view);
+}
+
+static void testStrViewCopies(SlVM *vm) {
+    SlObj parent = newAlphabet(vm, 1000);
+
+    // Short slices and slices much shorter than the string are copied
+    SlObj shortSlice = slStrSlice(vm, parent, 0, slStrViewMinLen - 1);
+    check(shortSlice.as.str->parent == NULL);
+    SlObj smallSlice = slStrSlice(vm, parent, 3, 5);
+    check(smallSlice.type == SlObj_SmallStr);
+    checkStr(smallSlice, "defgh");
+    SlObj ratioSlice = slStrSlice(vm, parent, 0, 1000 / slStrViewMaxRatio - 1);
+    check(ratioSlice.as.str->parent == NULL);
+    check(parent.as.str->asGCObj.refCount == 1);
+    slDelRef(ratioSlice);
+    slDelRef(shortSlice);
+
+    // The bytes of a mutable string may change, slices are always copied
+    SlObj mutableStr = newAlphabet(vm, 200);
+    mutableStr.type = SlObj_Str;
+    SlObj copy = slStrSlice(vm, mutableStr, 0, 100);
+    check(copy.type == SlObj_FrozenStr && copy.as.str->parent == NULL);
+    check(slStrBytes(&copy) != slStrBytes(&mutableStr));
+    mutableStr = slStrAppend(vm, mutableStr, parent);
+    check(slStrLen(&copy) == 100 && slStrBytes(&copy)[0] == 'a');
+    slDelRef(mutableStr);
+    slDelRef(copy);
+
+    // Appending to a unique view copies its bytes and releases the parent
+    SlObj view = slStrSlice(vm, parent, 100, 200);
+    check(parent.as.str->asGCObj.refCount == 2);
+    view = slStrAppend(vm, view, slSmallStrNew(cStr("!")));
+    check(view.as.str->parent == NULL);
+    check(parent.as.str->asGCObj.refCount == 1);
+    check(slStrLen(&view) == 201 && slStrBytes(&view)[200] == '!');
+    slDelRef(view);
+    slDelRef(parent);
+}
+
+static void testListView(SlVM *vm) {
+    SlObj parent = newFlatRange(vm, 100);
+    check(parent.type == SlObj_FrozenList);
+    SlObj view = slListSlice(vm, parent, 20, 50);
+    check(view.type == SlObj_FrozenList);
+    check(view.as.list->parent == parent.as.list);
+    check(view.as.list->ints == parent.as.list->ints + 20);
+    check(slListGet(view.as.list, 0).as.numInt == 20);
+
+    SlObj inner = slListSlice(vm, view, 10, 20);
+    check(inner.as.list->parent == parent.as.list);
+    check(slListGet(inner.as.list, 19).as.numInt == 49);
+
+    // Setting an item of a unique view does not change the parent
+    check(slSetItem(vm, &inner, slObjInt(0), slObjInt(-1)));
+    check(slListGet(inner.as.list, 0).as.numInt == -1);
+    check(inner.as.list->parent == NULL);
+    check(slListGet(parent.as.list, 30).as.numInt == 30);
+
+    // Short slices are copied
+    SlObj copy = slListSlice(vm, parent, 0, slListViewMinLen - 1);
+    check(copy.as.list->parent == NULL);
+    slDelRef(copy);
+
+    slDelRef(parent);
+    check(slListGet(view.as.list, 49).as.numInt == 69);
+    slDelRef(inner);
+    slDelRef(view);
+}
+
+static void testListSliceCopies(SlVM *vm) {
+    // Mutable lists give mutable copies
+    SlObj list = slListNew(vm, 0);
+    for (int64_t i = 0; i < 100; i++) {
+        check(slListAppend(vm, list.as.list, slObjInt(i)));
+    }
+    SlObj copy = slListSlice(vm, list, 10, 50);
+    check(copy.type == SlObj_List && copy.as.list->parent == NULL);
+    check(slListSet(vm, list.as.list, 10, slNull));
+    check(slListGet(copy.as.list, 0).as.numInt == 10);
+    slDelRef(copy);
+
+    // Lists stored in tries are copied as well
+    SlObj frozen = slFreeze(vm, slNewRef(list));
+    check(frozen.as.list->kind == SlList_Trie);
+    copy = slListSlice(vm, frozen, 10, 50);
+    check(copy.type == SlObj_FrozenList && copy.as.list->parent == NULL);
+    check(slListGet(copy.as.list, 49).as.numInt == 59);
+    slDelRef(copy);
+    slDelRef(frozen);
+    slDelRef(list);
+}
+
+static void testSlice(SlVM *vm) {
+    SlObj str = slFrozenStrNew(vm, cStr("hello, world"));
+    SlObj part = slSlice(vm, str, slObjInt(-5), slObjInt(100));
+    checkStr(part, "world");
+    slDelRef(part);
+    part = slSlice(vm, str, slObjInt(5), slObjInt(2));
+    checkStr(part, "");
+    slDelRef(part);
+
+    SlObj list = newFlatRange(vm, 10);
+    part = slSlice(vm, list, slObjInt(2), slObjInt(-2));
+    check(part.as.list->len == 6);
+    check(slListGet(part.as.list, 0).as.numInt == 2);
+    slDelRef(part);
+
+    part = slSlice(vm, list, slObjFloat(0.0), slObjInt(1));
+    check(part.type == SlObj_Null && vm->error.occurred);
+    vm->error.occurred = false;
+    part = slSlice(vm, slObjInt(1), slObjInt(0), slObjInt(1));
+    check(part.type == SlObj_Null && vm->error.occurred);
+    vm->error.occurred = false;
+
+    slDelRef(list);
+    slDelRef(str);
+}
+
+static void testSplit(SlVM *vm) {
+    SlObj str = slFrozenStrNew(vm, cStr("a, b,, c, "));
+    SlObj sep = slFrozenStrNew(vm, cStr(", "));
+    SlObj parts = slSplit(vm, str, sep);
+    check(parts.type == SlObj_FrozenList && parts.as.list->len == 4);
+    checkStr(slListGet(parts.as.list, 0), "a");
+    checkStr(slListGet(parts.as.list, 1), "b,");
+    checkStr(slListGet(parts.as.list, 2), "c");
+    checkStr(slListGet(parts.as.list, 3), "");
+    slDelRef(parts);
+    slDelRef(str);
+
+    // Long parts are views of the string
+    SlObj line = newAlphabet(vm, 100);
+    SlObj text = slStrJoin(vm, (SlObj[]){ line, sep, line }, 3);
+    parts = slSplit(vm, text, sep);
+    check(parts.as.list->len == 2);
+    SlObj first = slListGet(parts.as.list, 0);
+    check(first.as.str->parent == text.as.str);
+    check(slStrEq(first, line));
+    slDelRef(first);
+    slDelRef(parts);
+
+    // A mutable string is copied once and the parts are views of the copy
+    text.type = SlObj_Str;
+    parts = slSplit(vm, text, sep);
+    SlObj last = slListGet(parts.as.list, 1);
+    check(last.as.str->parent != NULL);
+    check(last.as.str->parent != text.as.str);
+    check(slStrEq(last, line));
+    slDelRef(last);
+    slDelRef(parts);
+    slDelRef(text);
+    slDelRef(line);
+
+    SlObj empty = slSmallStrNew(cStr(""));
+    parts = slSplit(vm, sep, empty);
+    check(parts.type == SlObj_Null && vm->error.occurred);
+    vm->error.occurred = false;
+    slDelRef(sep);
+}
+
+static void testLines(SlVM *vm) {
+    SlObj str = slFrozenStrNew(vm, cStr("first\r\nsecond\n\nlast\n"));
+    SlObj lines = slLines(vm, str);
+    check(lines.type == SlObj_FrozenList && lines.as.list->len == 4);
+    checkStr(slListGet(lines.as.list, 0), "first");
+    checkStr(slListGet(lines.as.list, 1), "second");
+    checkStr(slListGet(lines.as.list, 2), "");
+    checkStr(slListGet(lines.as.list, 3), "last");
+    slDelRef(lines);
+    slDelRef(str);
+
+    lines = slLines(vm, slSmallStrNew(cStr("")));
+    check(lines.as.list->len == 0);
+    slDelRef(lines);
+    lines = slLines(vm, slSmallStrNew(cStr("no newline")));
+    check(lines.as.list->len == 1);
+    checkStr(slListGet(lines.as.list, 0), "no newline");
+    slDelRef(lines);
+}
+
+static void testShareView(SlVM *vm) {
+    // Sharing a view shares the object that owns its storage
+    SlObj parent = newAlphabet(vm, 100);
+    SlObj view = slStrSlice(vm, parent, 0, 99);
+    check(slShare(vm, view));
+    check(slIsShared(parent));
+    slDelRef(view);
+    slDelRef(parent);
+
+    SlObj list = newFlatRange(vm, 100);
+    view = slListSlice(vm, list, 0, 99);
+    check(slShare(vm, view));
+    check(slIsShared(list));
+    slDelRef(view);
+    slDelRef(list);
+}
+
+int main(void) {
+    runTest(testStrView);
+    runTest(testStrViewCopies);
+    runTest(testListView);
+    runTest(testListSliceCopies);
+    runTest(testSlice);
+    runTest(testSplit);
+    runTest(testLines);
+    runTest(testShareView);
+    return testResult();
+}